@@ -0,0 +1,65 @@
+#!/bin/bash
+
+# Compare the compile time and the number of BPF instructions generated for
+# the shipped tools with each --opt profile
+#
+# The programs are only generated (--emit-elf), not loaded. The instructions
+# processed by the verifier need a kernel, see --probe-stats.
+#
+
+set -o pipefail
+set -e
+set -u
+
+if [[ "$#" -ne 3 ]]; then
+  echo "Compare --opt profiles on the shipped tools"
+  echo ""
+  echo "USAGE:"
+  echo "$(basename $0) <bpftrace> <objdump> <tooldir>"
+  echo ""
+  echo "EXAMPLE:"
+  echo "$(basename $0) bpftrace llvm-objdump-18 ./tools"
+  echo ""
+  exit 1
+fi
+
+BPF=$(command -v "$1") || ( echo "ERROR: $1 not found"; exit 1 )
+OBJDUMP=$(command -v "$2") || (echo "ERROR: $2 not found"; exit 1 )
+TOOLDIR=$3
+[[ -d "$TOOLDIR" ]] || (echo "tooldir does not appear to be a directory: ${TOOLDIR}"; exit 1)
+
+TMPDIR=$(mktemp -d)
+[[ $? -ne 0 || -z $TMPDIR ]] && (echo "Failed to create tmp dir"; exit 10)
+
+cd $TMPDIR
+set +e
+
+PROFILES="fast default size"
+TIME="/usr/bin/time -f%e --"
+
+# Number of BPF instructions in the programs of an ELF file, a load of a
+# 64-bit immediate counts once
+function insn_count() {
+    "$OBJDUMP" -d "$1" | grep -cE '^ *[0-9]+:'
+}
+
+echo "Using version $($BPF -V)"
+printf "%-24s" "script"
+for p in $PROFILES; do printf "%18s" "$p (s / insns)"; done
+echo
+
+for script in ${TOOLDIR}/*.bt; do
+    s=$(basename ${script/.bt/})
+    printf "%-24s" "$s"
+    for p in $PROFILES; do
+        t=$($TIME $BPF --no-warnings --opt "$p" --emit-elf "${s}_${p}" "$script" 3>&1 1>/dev/null 2>&3 3>&- | tail -n 1)
+        if [ $? -ne 0 ] || [ ! -f "${s}_${p}" ]; then
+            printf "%18s" "failed"
+            continue
+        fi
+        printf "%18s" "$t / $(insn_count "${s}_${p}")"
+    done
+    echo
+done
+
+[[ -n ${TMPDIR} ]] && rm -rf "${TMPDIR}"
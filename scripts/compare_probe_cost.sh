@@ -0,0 +1,84 @@
+#!/bin/bash
+
+# Compare the average run time of the BPF programs generated for a script
+# between two bpftrace builds
+#
+# The kernel accounts the run time of every BPF program while
+# kernel.bpf_stats_enabled is set, which is what this reports. The default
+# script captures a kernel stack on every write() syscall, driven by dd.
+#
+
+set -o pipefail
+set -e
+set -u
+
+if [[ "$#" -lt 2 ]]; then
+  echo "Compare the per-event cost of a script's probes between two bpftrace builds"
+  echo ""
+  echo "USAGE:"
+  echo "$(basename $0) <bpftrace_A> <bpftrace_B> [<script>] [<events>]"
+  echo ""
+  echo "EXAMPLE:"
+  echo "$(basename $0) bpftrace_master bpftrace 'tracepoint:syscalls:sys_enter_write { @[kstack] = count(); }'"
+  echo ""
+  echo "NOTE: needs root, bpftool and dd, and writes to the kernel.bpf_stats_enabled sysctl"
+  exit 1
+fi
+
+BPF_A=$(command -v "$1") || ( echo "ERROR: $1 not found"; exit 1 )
+BPF_B=$(command -v "$2") || ( echo "ERROR: $2 not found"; exit 1 )
+SCRIPT=${3:-'tracepoint:syscalls:sys_enter_write /comm == "dd"/ { @[kstack] = count(); }'}
+EVENTS=${4:-1000000}
+command -v bpftool > /dev/null || ( echo "ERROR: bpftool not found"; exit 1 )
+
+STATS_ENABLED=$(sysctl -n kernel.bpf_stats_enabled)
+trap 'sysctl -q -w kernel.bpf_stats_enabled=$STATS_ENABLED' EXIT
+sysctl -q -w kernel.bpf_stats_enabled=1
+
+# Prints "<run_time_ns> <run_cnt>" summed over the programs loaded by a pid
+function prog_stats {
+    bpftool prog show | awk -v pid="$1" '
+        /^[0-9]+:/ {
+            time = 0; cnt = 0
+            for (i = 1; i < NF; i++) {
+                if ($i == "run_time_ns") time = $(i + 1)
+                if ($i == "run_cnt") cnt = $(i + 1)
+            }
+        }
+        index($0, "bpftrace(" pid ")") { total_time += time; total_cnt += cnt }
+        END { print total_time + 0, total_cnt + 0 }'
+}
+
+# Prints the average run time in ns of the programs bpftrace $1 loads
+function measure {
+    local out
+    out=$(mktemp)
+    "$1" --no-warnings -e "$SCRIPT" > "$out" 2>&1 &
+    local pid=$!
+    # Wait for the probes to be attached
+    for i in $(seq 1 100); do
+        grep -q "^Attaching" "$out" && break
+        sleep 0.1
+    done
+    sleep 1
+
+    dd if=/dev/zero of=/dev/null bs=1 count="$EVENTS" status=none
+    read -r time cnt <<< "$(prog_stats $pid)"
+
+    kill -INT $pid
+    wait $pid || true
+    rm -f "$out"
+
+    if [[ "$cnt" -eq 0 ]]; then
+        echo "ERROR: no events were counted" >&2
+        exit 1
+    fi
+    echo "$((time / cnt))"
+}
+
+echo "Using version $($BPF_A -V) and $($BPF_B -V)"
+echo "Script: $SCRIPT"
+
+a=$(measure "$BPF_A")
+b=$(measure "$BPF_B")
+echo "A ${a}ns/event  B ${b}ns/event  diff $((b - a))ns"
@@ -38,9 +38,9 @@ struct Header {
   uint16_t unused;     // For future use
   uint32_t header_len; // Length of this struct
   uint64_t version;    // Hash of version string
-  uint64_t rr_off;     // RequiredResources offset from start of file
+  uint64_t rr_off;     // RequiredResources offset from start of section
   uint64_t rr_len;     // RequiredResources length
-  uint64_t elf_off;    // ELF offset from start of file
+  uint64_t elf_off;    // ELF offset from start of section
   uint64_t elf_len;    // ELF length
 };
 
@@ -241,6 +241,7 @@ int load(BPFtrace &bpftrace, const std::string &in)
   char *secname = nullptr;
   Elf_Data *data = nullptr;
   uint8_t *btaot_section = nullptr;
+  size_t btaot_section_size = 0;
   const Header *hdr;
 
   if (elf_version(EV_CURRENT) == EV_NONE) {
@@ -293,6 +294,7 @@ int load(BPFtrace &bpftrace, const std::string &in)
       }
 
       btaot_section = static_cast<uint8_t *>(data->d_buf);
+      btaot_section_size = data->d_size;
       break;
     }
   }
@@ -304,6 +306,11 @@ int load(BPFtrace &bpftrace, const std::string &in)
     err = 1;
     goto out;
   }
+  if (btaot_section_size < sizeof(Header)) {
+    LOG(ERROR) << "Corrupted AOT bpftrace file: incomplete header";
+    err = 1;
+    goto out;
+  }
   if (hdr->magic != AOT_MAGIC) {
     LOG(ERROR) << "Invalid magic in " << in << ": " << hdr->magic;
     err = 1;
@@ -325,14 +332,20 @@ int load(BPFtrace &bpftrace, const std::string &in)
     err = 1;
     goto out;
   }
-  if ((hdr->rr_off + hdr->rr_len) > static_cast<uint64_t>(in_file_size) ||
-      (hdr->elf_off + hdr->elf_len) > static_cast<uint64_t>(in_file_size)) {
+  // Payload offsets are relative to the start of the section
+  if (hdr->rr_off > btaot_section_size ||
+      hdr->rr_len > btaot_section_size - hdr->rr_off ||
+      hdr->elf_off > btaot_section_size ||
+      hdr->elf_len > btaot_section_size - hdr->elf_off) {
     LOG(ERROR) << "Corrupted AOT bpftrace file: incomplete payload";
     err = 1;
     goto out;
   }
 
-  // Load payloads
+  // Load payloads. RequiredResources is deserialized and the ELF is copied
+  // into the BpfBytecode. Using either in place would need a fixed-layout
+  // payload that the runtime can read without deserializing it, which
+  // doesn't exist.
   err = load_required_resources(bpftrace,
                                 btaot_section + hdr->rr_off,
                                 hdr->rr_len);
@@ -341,8 +354,6 @@ int load(BPFtrace &bpftrace, const std::string &in)
 
   bpftrace.bytecode_ = BpfBytecode{ std::span<uint8_t>{
       btaot_section + hdr->elf_off, hdr->elf_len } };
-  if (err)
-    goto out;
 
 out:
   if (elf)
@@ -1,6 +1,7 @@
 #include "ast/ast.h"
 
 #include <algorithm>
+#include <utility>
 
 #include "ast/visitor.h"
 #include "log.h"
@@ -9,6 +10,11 @@ namespace bpftrace::ast {
 
 static constexpr std::string_view ENUM = "enum ";
 
+// Chunks start small so that short-lived contexts stay cheap and grow up to
+// the maximum for large programs
+static constexpr size_t MIN_CHUNK_SIZE = 4096;
+static constexpr size_t MAX_CHUNK_SIZE = 1024 * 1024;
+
 Integer::Integer(int64_t n, location loc, bool is_negative)
     : Expression(loc), n(n), is_negative(is_negative)
 {
@@ -250,14 +256,29 @@ Subprog::Subprog(std::string name,
 {
 }
 
+MapDecl::MapDecl(const std::string &ident,
+                 const std::string &bpf_type,
+                 int64_t max_entries,
+                 const std::string &flag,
+                 location loc)
+    : Node(loc),
+      ident(ident),
+      bpf_type(bpf_type),
+      max_entries(max_entries),
+      flag(flag)
+{
+}
+
 Program::Program(const std::string &c_definitions,
                  Config *config,
+                 MapDeclList &&map_decls,
                  SubprogList &&functions,
                  ProbeList &&probes,
                  location loc)
     : Node(loc),
       c_definitions(c_definitions),
       config(config),
+      map_decls(std::move(map_decls)),
       functions(std::move(functions)),
       probes(std::move(probes))
 {
@@ -370,6 +391,7 @@ AttachPoint &AttachPoint::create_expansion_copy(ASTContext &ctx,
   ap.len = len;
   ap.mode = mode;
   ap.async = async;
+  ap.timer_slot = timer_slot;
   ap.expansion = expansion;
   ap.address = address;
   ap.func_offset = func_offset;
@@ -520,4 +542,69 @@ SizedType ident_to_sized_type(const std::string &ident)
   return ident_to_record(ident);
 }
 
+ASTContext::~ASTContext()
+{
+  clear();
+}
+
+ASTContext::ASTContext(ASTContext &&other) noexcept
+    : root(std::exchange(other.root, nullptr)),
+      chunks_(std::move(other.chunks_)),
+      chunk_size_(std::exchange(other.chunk_size_, 0)),
+      cur_(std::exchange(other.cur_, nullptr)),
+      end_(std::exchange(other.end_, nullptr)),
+      nodes_(std::move(other.nodes_))
+{
+  other.chunks_.clear();
+  other.nodes_.clear();
+}
+
+ASTContext &ASTContext::operator=(ASTContext &&other) noexcept
+{
+  if (this == &other)
+    return *this;
+
+  clear();
+  root = std::exchange(other.root, nullptr);
+  chunks_ = std::move(other.chunks_);
+  chunk_size_ = std::exchange(other.chunk_size_, 0);
+  cur_ = std::exchange(other.cur_, nullptr);
+  end_ = std::exchange(other.end_, nullptr);
+  nodes_ = std::move(other.nodes_);
+  other.chunks_.clear();
+  other.nodes_.clear();
+  return *this;
+}
+
+void *ASTContext::allocate(size_t size)
+{
+  constexpr size_t align = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+  size = (size + align - 1) & ~(align - 1);
+
+  if (static_cast<size_t>(end_ - cur_) < size) {
+    chunk_size_ = std::clamp(chunk_size_ * 2, MIN_CHUNK_SIZE, MAX_CHUNK_SIZE);
+    size_t chunk_size = std::max(chunk_size_, size);
+    chunks_.push_back(
+        std::make_unique_for_overwrite<std::byte[]>(chunk_size));
+    cur_ = chunks_.back().get();
+    end_ = cur_ + chunk_size;
+  }
+
+  void *mem = cur_;
+  cur_ += size;
+  return mem;
+}
+
+void ASTContext::clear()
+{
+  for (auto it = nodes_.rbegin(); it != nodes_.rend(); ++it)
+    (*it)->~Node();
+  nodes_.clear();
+  chunks_.clear();
+  chunk_size_ = 0;
+  cur_ = nullptr;
+  end_ = nullptr;
+  root = nullptr;
+}
+
 } // namespace bpftrace::ast
@@ -1,7 +1,11 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 #include <map>
+#include <memory>
+#include <new>
+#include <optional>
 #include <string>
 #include <vector>
 
@@ -413,6 +417,9 @@ public:
   uint64_t len = 0;   // for watchpoint probes, the width of watched addr
   std::string mode;   // for watchpoint probes, the watch mode
   bool async = false; // for watchpoint probes, if it's an async watchpoint
+  // for interval and profile probes driven by a BPF timer, the first slot of
+  // the timers map used by the probe
+  std::optional<uint32_t> timer_slot;
 
   ExpansionType expansion = ExpansionType::NONE;
 
@@ -491,16 +498,38 @@ private:
 };
 using SubprogList = std::vector<Subprog *>;
 
+// Top-level declaration selecting the BPF map type backing a map, e.g.
+//
+//   let @x = lru_hash(1024);
+//
+// Validated by the semantic analyser and recorded in the map's MapInfo.
+class MapDecl : public Node {
+public:
+  MapDecl(const std::string &ident,
+          const std::string &bpf_type,
+          int64_t max_entries,
+          const std::string &flag,
+          location loc);
+
+  std::string ident;
+  std::string bpf_type;
+  int64_t max_entries;
+  std::string flag;
+};
+using MapDeclList = std::vector<MapDecl *>;
+
 class Program : public Node {
 public:
   Program(const std::string &c_definitions,
           Config *config,
+          MapDeclList &&map_decls,
           SubprogList &&functions,
           ProbeList &&probes,
           location loc);
 
   std::string c_definitions;
   Config *config = nullptr;
+  MapDeclList map_decls;
   SubprogList functions;
   ProbeList probes;
 };
@@ -518,19 +547,30 @@ concept NodeType = std::derived_from<T, Node>;
 // Manages the lifetime of AST nodes.
 //
 // Nodes allocated by an ASTContext will be kept alive for the duration of the
-// owning ASTContext object.
+// owning ASTContext object. Nodes are bump allocated from large chunks of
+// memory, which avoids a heap allocation per node and keeps nodes created
+// together (e.g. a probe and its body) close to each other in memory.
 class ASTContext {
 public:
   Program *root = nullptr;
 
+  ASTContext() = default;
+  ~ASTContext();
+
+  ASTContext(ASTContext &&other) noexcept;
+  ASTContext &operator=(ASTContext &&other) noexcept;
+  ASTContext(const ASTContext &) = delete;
+  ASTContext &operator=(const ASTContext &) = delete;
+
   // Creates and returns a pointer to an AST node.
   template <NodeType T, typename... Args>
   T *make_node(Args &&...args)
   {
-    auto uniq_ptr = std::make_unique<T>(std::forward<Args>(args)...);
-    auto *raw_ptr = uniq_ptr.get();
-    nodes_.push_back(std::move(uniq_ptr));
-    return raw_ptr;
+    static_assert(alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+    void *mem = allocate(sizeof(T));
+    auto *node = new (mem) T(std::forward<Args>(args)...);
+    nodes_.push_back(node);
+    return node;
   }
 
   unsigned int node_count()
@@ -539,7 +579,15 @@ public:
   }
 
 private:
-  std::vector<std::unique_ptr<Node>> nodes_;
+  void *allocate(size_t size);
+  void clear();
+
+  std::vector<std::unique_ptr<std::byte[]>> chunks_;
+  size_t chunk_size_ = 0;
+  std::byte *cur_ = nullptr;
+  std::byte *end_ = nullptr;
+  // Nodes in order of creation, destroyed in reverse order
+  std::vector<Node *> nodes_;
 };
 
 } // namespace ast
@@ -219,6 +219,41 @@ DIType *DIBuilderBPF::CreateByteArrayType(uint64_t num_bytes)
       num_bytes * 8, 0, getInt8Ty(), getOrCreateArray({ subrange }));
 }
 
+// Value type of the timers map: struct { struct bpf_timer timer; }
+//
+// The kernel finds timers in map values by the name of their BTF type, so the
+// value needs the type even though BPF programs only ever take its address.
+DIType *DIBuilderBPF::CreateTimerValueType()
+{
+  // struct bpf_timer { __u64 __opaque[2]; } __attribute__((aligned(8)));
+  auto subrange = getOrCreateSubrange(0, 2);
+  DIType *opaque = createArrayType(
+      128, 0, getInt64Ty(), getOrCreateArray({ subrange }));
+  DIType *bpf_timer = createStructType(
+      file,
+      "bpf_timer",
+      file,
+      0,
+      128,
+      64,
+      DINode::FlagZero,
+      nullptr,
+      getOrCreateArray({ createMemberType(
+          file, "__opaque", file, 0, 128, 0, 0, DINode::FlagZero, opaque) }));
+
+  return createStructType(
+      file,
+      "",
+      file,
+      0,
+      128,
+      64,
+      DINode::FlagZero,
+      nullptr,
+      getOrCreateArray({ createMemberType(
+          file, "timer", file, 0, 128, 0, 0, DINode::FlagZero, bpf_timer) }));
+}
+
 /// Convert internal SizedType to a corresponding DIType type.
 ///
 /// In codegen, some types are not converted into a directly corresponding
@@ -256,7 +291,8 @@ DIType *DIBuilderBPF::GetType(const SizedType &stype, bool emit_codegen_types)
                             getOrCreateArray({}));
   }
 
-  if (stype.IsByteArray() || stype.IsRecordTy() || stype.IsStack()) {
+  if (stype.IsByteArray() || stype.IsRecordTy() || stype.IsStack() ||
+      stype.IsCountDistinctTy()) {
     auto subrange = getOrCreateSubrange(0, stype.GetSize());
     return createArrayType(
         stype.GetSize() * 8, 0, getInt8Ty(), getOrCreateArray({ subrange }));
@@ -315,7 +351,8 @@ DIType *DIBuilderBPF::GetMapKeyType(const SizedType &key_type,
                : getInt64Ty();
 
   // Some map types need an extra 8-byte key.
-  if (value_type.IsHistTy() || value_type.IsLhistTy()) {
+  if (value_type.IsHistTy() || value_type.IsLhistTy() ||
+      value_type.IsQuantilesTy()) {
     uint64_t size = key_type.GetSize() + 8;
     return CreateByteArrayType(size);
   }
@@ -346,21 +383,45 @@ DIGlobalVariableExpression *DIBuilderBPF::createMapEntry(
     libbpf::bpf_map_type map_type,
     uint64_t max_entries,
     DIType *key_type,
-    const SizedType &value_type)
+    const SizedType &value_type,
+    uint32_t map_flags)
 {
-  SmallVector<Metadata *, 4> fields = {
+  return createMapEntry(name,
+                        map_type,
+                        max_entries,
+                        key_type,
+                        value_type.IsNoneTy() ? nullptr : GetType(value_type),
+                        map_flags);
+}
+
+// A value of `value_type` nullptr creates a map without key and value, e.g. a
+// ring buffer
+DIGlobalVariableExpression *DIBuilderBPF::createMapEntry(
+    const std::string &name,
+    libbpf::bpf_map_type map_type,
+    uint64_t max_entries,
+    DIType *key_type,
+    DIType *value_type,
+    uint32_t map_flags)
+{
+  SmallVector<Metadata *, 5> fields = {
     createPointerMemberType("type", 0, GetMapFieldInt(map_type)),
     createPointerMemberType("max_entries", 64, GetMapFieldInt(max_entries)),
   };
 
   uint64_t size = 128;
-  if (!value_type.IsNoneTy()) {
+  if (value_type) {
     fields.push_back(
         createPointerMemberType("key", size, createPointerType(key_type, 64)));
     fields.push_back(createPointerMemberType(
-        "value", size + 64, createPointerType(GetType(value_type), 64)));
+        "value", size + 64, createPointerType(value_type, 64)));
     size += 128;
   }
+  if (map_flags != 0) {
+    fields.push_back(
+        createPointerMemberType("map_flags", size, GetMapFieldInt(map_flags)));
+    size += 64;
+  }
 
   DIType *map_entry_type = createStructType(file,
                                             "",
@@ -40,6 +40,7 @@ public:
   DIType *CreateTupleType(const SizedType &stype);
   DIType *CreateMapStructType(const SizedType &stype);
   DIType *CreateByteArrayType(uint64_t num_bytes);
+  DIType *CreateTimerValueType();
   DIType *createPointerMemberType(const std::string &name,
                                   uint64_t offset,
                                   DIType *type);
@@ -51,7 +52,14 @@ public:
                                              libbpf::bpf_map_type map_type,
                                              uint64_t max_entries,
                                              DIType *key_type,
-                                             const SizedType &value_type);
+                                             const SizedType &value_type,
+                                             uint32_t map_flags = 0);
+  DIGlobalVariableExpression *createMapEntry(const std::string &name,
+                                             libbpf::bpf_map_type map_type,
+                                             uint64_t max_entries,
+                                             DIType *key_type,
+                                             DIType *value_type,
+                                             uint32_t map_flags = 0);
   DIGlobalVariableExpression *createGlobalVariable(std::string_view name,
                                                    const SizedType &stype);
 
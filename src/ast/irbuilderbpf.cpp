@@ -1,5 +1,6 @@
 #include "ast/irbuilderbpf.h"
 
+#include <ctime>
 #include <iostream>
 #include <sstream>
 #include <thread>
@@ -435,6 +436,9 @@ llvm::Type *IRBuilderBPF::GetMapValueType(const SizedType &stype)
     // The second is the count value
     std::vector<llvm::Type *> llvm_elems = { getInt64Ty(), getInt64Ty() };
     ty = GetStructType("avg_stas_val", llvm_elems, false);
+  } else if (stype.IsCountDistinctTy()) {
+    // One byte per HyperLogLog register
+    ty = ArrayType::get(getInt8Ty(), stype.GetSize());
   } else {
     ty = GetType(stype);
   }
@@ -483,6 +487,13 @@ CallInst *IRBuilderBPF::CreateMapLookup(Map &map,
   return createMapLookup(map.ident, key, name);
 }
 
+CallInst *IRBuilderBPF::CreateMapLookup(const std::string &map_name,
+                                        Value *key,
+                                        const std::string &name)
+{
+  return createMapLookup(map_name, key, name);
+}
+
 CallInst *IRBuilderBPF::createMapLookup(const std::string &map_name,
                                         Value *key,
                                         const std::string &name)
@@ -529,6 +540,17 @@ CallInst *IRBuilderBPF::CreateGetJoinMap(BasicBlock *failure_callback,
       to_string(MapType::Join), "join", loc, failure_callback);
 }
 
+CallInst *IRBuilderBPF::CreateGetTopkSketch(uint32_t sketch_idx,
+                                            BasicBlock *failure_callback,
+                                            const location &loc)
+{
+  return createGetScratchMap(to_string(MapType::TopkSketch),
+                             "topk_sketch",
+                             loc,
+                             failure_callback,
+                             sketch_idx);
+}
+
 CallInst *IRBuilderBPF::CreateGetStackScratchMap(StackType stack_type,
                                                  BasicBlock *failure_callback,
                                                  const location &loc)
@@ -552,6 +574,15 @@ Value *IRBuilderBPF::CreateGetStrAllocation(const std::string &name,
                           [](AsyncIds &async_ids) { return async_ids.str(); });
 }
 
+// Returns a pointer to this CPU's {value, is_set} pair of a keyless
+// aggregation kept in the scalar aggregation buffer
+Value *IRBuilderBPF::CreateGetScalarAggSlot(uint32_t slot, const location &loc)
+{
+  return createScratchBuffer(bpftrace::globalvars::GlobalVar::SCALAR_AGG_BUFFER,
+                             loc,
+                             slot);
+}
+
 Value *IRBuilderBPF::CreateGetFmtStringArgsAllocation(StructType *struct_type,
                                                       const std::string &name,
                                                       const location &loc)
@@ -1187,6 +1218,58 @@ Value *IRBuilderBPF::CreateForEachMapElem(Value *ctx,
   return call;
 }
 
+CallInst *IRBuilderBPF::CreateTimerInit(Value *timer,
+                                        const std::string &map_name,
+                                        const location &loc)
+{
+  Value *map_ptr = GetMapVar(map_name);
+
+  // long bpf_timer_init(struct bpf_timer *timer, struct bpf_map *map,
+  // u64 flags)
+  // Return: 0 on success or negative error
+  FunctionType *timer_init_func_type = FunctionType::get(
+      getInt64Ty(), { getPtrTy(), map_ptr->getType(), getInt64Ty() }, false);
+  return CreateHelperCall(libbpf::BPF_FUNC_timer_init,
+                          timer_init_func_type,
+                          { timer, map_ptr, getInt64(CLOCK_MONOTONIC) },
+                          "timer_init",
+                          &loc);
+}
+
+CallInst *IRBuilderBPF::CreateTimerSetCallback(Value *timer,
+                                               Value *callback,
+                                               const location &loc)
+{
+  // long bpf_timer_set_callback(struct bpf_timer *timer, void *callback_fn)
+  // Return: 0 on success or negative error
+  //
+  // callback is long (*callback_fn)(struct bpf_map *map, const void *key,
+  // void *value);
+  FunctionType *timer_set_callback_func_type = FunctionType::get(
+      getInt64Ty(), { getPtrTy(), callback->getType() }, false);
+  return CreateHelperCall(libbpf::BPF_FUNC_timer_set_callback,
+                          timer_set_callback_func_type,
+                          { timer, callback },
+                          "timer_set_callback",
+                          &loc);
+}
+
+CallInst *IRBuilderBPF::CreateTimerStart(Value *timer,
+                                         Value *nsecs,
+                                         uint64_t flags,
+                                         const location &loc)
+{
+  // long bpf_timer_start(struct bpf_timer *timer, u64 nsecs, u64 flags)
+  // Return: 0 on success or negative error
+  FunctionType *timer_start_func_type = FunctionType::get(
+      getInt64Ty(), { getPtrTy(), getInt64Ty(), getInt64Ty() }, false);
+  return CreateHelperCall(libbpf::BPF_FUNC_timer_start,
+                          timer_start_func_type,
+                          { timer, nsecs, getInt64(flags) },
+                          "timer_start",
+                          &loc);
+}
+
 void IRBuilderBPF::CreateCheckSetRecursion(const location &loc,
                                            int early_exit_ret)
 {
@@ -1243,8 +1326,7 @@ void IRBuilderBPF::CreateCheckSetRecursion(const location &loc,
   // Most of the time this will happen for the functions that can lead
   // to a crash e.g. "queued_spin_lock_slowpath" but it can also happen
   // for nested probes e.g. "page_fault_user" -> "print".
-  CreateAtomicIncCounter(to_string(MapType::EventLossCounter),
-                         bpftrace_.event_loss_cnt_key_);
+  CreateIncEventLossCounter();
   CreateRet(getInt64(early_exit_ret));
 
   SetInsertPoint(lookup_failure_block);
@@ -2135,9 +2217,18 @@ void IRBuilderBPF::CreateOutput(Value *ctx,
                                 Value *data,
                                 size_t size,
                                 const location *loc)
+{
+  CreateOutput(ctx, data, getInt64(size), loc);
+}
+
+void IRBuilderBPF::CreateOutput(Value *ctx,
+                                Value *data,
+                                Value *size,
+                                const location *loc)
 {
   assert(ctx && ctx->getType() == getPtrTy());
   assert(data && data->getType()->isPointerTy());
+  assert(size && size->getType() == getInt64Ty());
 
   if (bpftrace_.feature_->has_map_ringbuf()) {
     CreateRingbufOutput(data, size, loc);
@@ -2147,7 +2238,7 @@ void IRBuilderBPF::CreateOutput(Value *ctx,
 }
 
 void IRBuilderBPF::CreateRingbufOutput(Value *data,
-                                       size_t size,
+                                       Value *size,
                                        const location *loc)
 {
   Value *map_ptr = GetMapVar(to_string(MapType::Ringbuf));
@@ -2160,7 +2251,7 @@ void IRBuilderBPF::CreateRingbufOutput(Value *data,
 
   Value *ret = CreateHelperCall(libbpf::BPF_FUNC_ringbuf_output,
                                 ringbuf_output_func_type,
-                                { map_ptr, data, getInt64(size), getInt64(0) },
+                                { map_ptr, data, size, getInt64(0) },
                                 "ringbuf_output",
                                 loc);
 
@@ -2175,20 +2266,143 @@ void IRBuilderBPF::CreateRingbufOutput(Value *data,
   CreateCondBr(condition, loss_block, merge_block);
 
   SetInsertPoint(loss_block);
-  CreateAtomicIncCounter(to_string(MapType::EventLossCounter),
-                         bpftrace_.event_loss_cnt_key_);
+  CreateIncEventLossCounter();
   CreateBr(merge_block);
 
   SetInsertPoint(merge_block);
 }
 
-void IRBuilderBPF::CreateAtomicIncCounter(const std::string &map_name,
-                                          uint32_t idx)
+Value *IRBuilderBPF::CreateRingbufReserve(size_t size, const location *loc)
 {
+  Value *map_ptr = GetMapVar(to_string(MapType::Ringbuf));
+
+  // void *bpf_ringbuf_reserve(void *ringbuf, u64 size, u64 flags)
+  FunctionType *ringbuf_reserve_func_type = FunctionType::get(
+      getPtrTy(), { map_ptr->getType(), getInt64Ty(), getInt64Ty() }, false);
+
+  return CreateHelperCall(libbpf::BPF_FUNC_ringbuf_reserve,
+                          ringbuf_reserve_func_type,
+                          { map_ptr, getInt64(size), getInt64(0) },
+                          "ringbuf_reserve",
+                          loc);
+}
+
+void IRBuilderBPF::CreateRingbufSubmit(Value *data, const location *loc)
+{
+  // void bpf_ringbuf_submit(void *data, u64 flags)
+  FunctionType *ringbuf_submit_func_type = FunctionType::get(
+      getVoidTy(), { getPtrTy(), getInt64Ty() }, false);
+
+  CreateHelperCall(libbpf::BPF_FUNC_ringbuf_submit,
+                   ringbuf_submit_func_type,
+                   { data, getInt64(0) },
+                   "",
+                   loc);
+}
+
+IRBuilderBPF::OutputEvent IRBuilderBPF::CreateOutputReserve(
+    StructType *struct_type,
+    const std::string &name,
+    const location &loc)
+{
+  OutputEvent event;
+  if (!bpftrace_.feature_->has_map_ringbuf()) {
+    event.data = CreateGetFmtStringArgsAllocation(struct_type, name, loc);
+    return event;
+  }
+
+  size_t size = module_.getDataLayout().getTypeAllocSize(struct_type);
+  event.data = CreateRingbufReserve(size, &loc);
+
+  // A failed reservation skips building the event altogether. Nothing was
+  // reserved so there is nothing to discard either.
+  llvm::Function *parent = GetInsertBlock()->getParent();
+  BasicBlock *reserved_block = BasicBlock::Create(module_.getContext(),
+                                                  "ringbuf_reserved",
+                                                  parent);
+  BasicBlock *loss_block = BasicBlock::Create(module_.getContext(),
+                                              "event_loss_counter",
+                                              parent);
+  event.done = BasicBlock::Create(module_.getContext(),
+                                  "ringbuf_done",
+                                  parent);
+  CreateCondBr(CreateIsNotNull(event.data, "ringbuf_reserve_ok"),
+               reserved_block,
+               loss_block);
+
+  SetInsertPoint(loss_block);
+  CreateIncEventLossCounter();
+  CreateBr(event.done);
+
+  SetInsertPoint(reserved_block);
+  return event;
+}
+
+void IRBuilderBPF::CreateOutputCommit(Value *ctx,
+                                      const OutputEvent &event,
+                                      size_t size,
+                                      const location *loc)
+{
+  if (!event.done) {
+    CreateOutput(ctx, event.data, size, loc);
+    if (dyn_cast<AllocaInst>(event.data))
+      CreateLifetimeEnd(event.data);
+    return;
+  }
+
+  CreateRingbufSubmit(event.data, loc);
+  CreateBr(event.done);
+  SetInsertPoint(event.done);
+}
+
+void IRBuilderBPF::CreateCheckSampled(int early_exit_ret)
+{
+  // The sample rate map holds a { mask, count } pair per CPU. An event is
+  // kept if the count of events seen on the CPU so far has none of the mask
+  // bits set, i.e. one in every mask + 1 events is kept.
+  AllocaInst *key = CreateAllocaBPF(getInt32Ty(), "sample_key");
+  CreateStore(getInt32(0), key);
+  CallInst *call = createMapLookup(to_string(MapType::SampleRate), key);
+  CreateLifetimeEnd(key);
+
+  llvm::Function *parent = GetInsertBlock()->getParent();
+  BasicBlock *lookup_success_block = BasicBlock::Create(module_.getContext(),
+                                                        "sample_lookup_success",
+                                                        parent);
+  BasicBlock *drop_block = BasicBlock::Create(module_.getContext(),
+                                              "sample_drop",
+                                              parent);
+  BasicBlock *merge_block = BasicBlock::Create(module_.getContext(),
+                                               "sample_keep",
+                                               parent);
+  CreateCondBr(CreateIsNotNull(call, "sample_lookup_cond"),
+               lookup_success_block,
+               merge_block);
+
+  SetInsertPoint(lookup_success_block);
+  Value *mask = CreateLoad(getInt64Ty(), call, "sample_mask");
+  Value *count_ptr = CreateGEP(getInt64Ty(), call, getInt64(1));
+  Value *count = CreateLoad(getInt64Ty(), count_ptr, "sample_count");
+  CreateStore(CreateAdd(count, getInt64(1)), count_ptr);
+  Value *drop = CreateICmpNE(CreateAnd(count, mask),
+                             getInt64(0),
+                             "sample_drop_cond");
+  CreateCondBr(drop, drop_block, merge_block);
+
+  SetInsertPoint(drop_block);
+  CreateRet(getInt64(early_exit_ret));
+
+  SetInsertPoint(merge_block);
+}
+
+void IRBuilderBPF::CreateIncEventLossCounter()
+{
+  // The counter is per-CPU so that CPUs losing events at the same time, which
+  // is exactly when the system is overloaded, don't contend on it.
   AllocaInst *key = CreateAllocaBPF(getInt32Ty(), "key");
-  CreateStore(getInt32(idx), key);
+  CreateStore(getInt32(event_loss_cnt_key_), key);
 
-  CallInst *call = createMapLookup(map_name, key);
+  CallInst *call = createMapLookup(to_string(MapType::EventLossCounter), key);
   llvm::Function *parent = GetInsertBlock()->getParent();
   BasicBlock *lookup_success_block = BasicBlock::Create(module_.getContext(),
                                                         "lookup_success",
@@ -2206,11 +2420,8 @@ void IRBuilderBPF::CreateAtomicIncCounter(const std::string &map_name,
   CreateCondBr(condition, lookup_success_block, lookup_failure_block);
 
   SetInsertPoint(lookup_success_block);
-  CREATE_ATOMIC_RMW(AtomicRMWInst::BinOp::Add,
-                    call,
-                    getInt64(1),
-                    8,
-                    AtomicOrdering::SequentiallyConsistent);
+  Value *count = CreateLoad(getInt64Ty(), call);
+  CreateStore(CreateAdd(count, getInt64(1)), call);
   CreateBr(lookup_merge_block);
 
   SetInsertPoint(lookup_failure_block);
@@ -2281,13 +2492,12 @@ void IRBuilderBPF::CreateMapElemAdd(Value *ctx,
 
 void IRBuilderBPF::CreatePerfEventOutput(Value *ctx,
                                          Value *data,
-                                         size_t size,
+                                         Value *size,
                                          const location *loc)
 {
   Value *map_ptr = GetMapVar(to_string(MapType::PerfEvent));
 
   Value *flags_val = getInt64(BPF_F_CURRENT_CPU);
-  Value *size_val = getInt64(size);
 
   // long bpf_perf_event_output(struct pt_regs *ctx, struct bpf_map *map,
   //                            u64 flags, void *data, u64 size)
@@ -2300,7 +2510,7 @@ void IRBuilderBPF::CreatePerfEventOutput(Value *ctx,
                                                          false);
   CreateHelperCall(libbpf::BPF_FUNC_perf_event_output,
                    perfoutput_func_type,
-                   { ctx, map_ptr, flags_val, data, size_val },
+                   { ctx, map_ptr, flags_val, data, size },
                    "perf_event_output",
                    loc);
 }
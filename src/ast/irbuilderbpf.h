@@ -44,6 +44,9 @@ public:
   CallInst *CreateMapLookup(Map &map,
                             Value *key,
                             const std::string &name = "lookup_elem");
+  CallInst *CreateMapLookup(const std::string &map_name,
+                            Value *key,
+                            const std::string &name = "lookup_elem");
   Value *CreateMapLookupElem(Value *ctx,
                              Map &map,
                              Value *key,
@@ -73,6 +76,17 @@ public:
                               Value *callback,
                               Value *callback_ctx,
                               const location &loc);
+  // `timer` points to a struct bpf_timer stored in the map `map_name`
+  CallInst *CreateTimerInit(Value *timer,
+                            const std::string &map_name,
+                            const location &loc);
+  CallInst *CreateTimerSetCallback(Value *timer,
+                                   Value *callback,
+                                   const location &loc);
+  CallInst *CreateTimerStart(Value *timer,
+                             Value *nsecs,
+                             uint64_t flags,
+                             const location &loc);
   void CreateProbeRead(Value *ctx,
                        Value *dst,
                        llvm::Value *size,
@@ -149,10 +163,14 @@ public:
   CallInst *CreatePerCpuPtr(Value *var, Value *cpu, const location &loc);
   CallInst *CreateThisCpuPtr(Value *var, const location &loc);
   CallInst *CreateGetJoinMap(BasicBlock *failure_callback, const location &loc);
+  CallInst *CreateGetTopkSketch(uint32_t sketch_idx,
+                                BasicBlock *failure_callback,
+                                const location &loc);
   CallInst *CreateGetStackScratchMap(StackType stack_type,
                                      BasicBlock *failure_callback,
                                      const location &loc);
   Value *CreateGetStrAllocation(const std::string &name, const location &loc);
+  Value *CreateGetScalarAggSlot(uint32_t slot, const location &loc);
   Value *CreateGetFmtStringArgsAllocation(StructType *struct_type,
                                           const std::string &name,
                                           const location &loc);
@@ -187,7 +205,36 @@ public:
                     Value *data,
                     size_t size,
                     const location *loc = nullptr);
-  void CreateAtomicIncCounter(const std::string &map_name, uint32_t idx);
+  void CreateOutput(Value *ctx,
+                    Value *data,
+                    Value *size,
+                    const location *loc = nullptr);
+  // An output event under construction, see CreateOutputReserve()
+  struct OutputEvent {
+    Value *data = nullptr;
+    // Set if `data` points into ring buffer memory
+    BasicBlock *done = nullptr;
+  };
+  // Allocates a fixed size output event. If the ring buffer is available the
+  // event is reserved in ring memory and the code generated until the matching
+  // CreateOutputCommit() only runs if the reservation succeeded. Otherwise
+  // the event is built in the format string args allocation and copied out.
+  OutputEvent CreateOutputReserve(StructType *struct_type,
+                                  const std::string &name,
+                                  const location &loc);
+  void CreateOutputCommit(Value *ctx,
+                          const OutputEvent &event,
+                          size_t size,
+                          const location *loc = nullptr);
+  // Counts a lost event for the probe being generated
+  void CreateIncEventLossCounter();
+  // Returns early from the probe with `early_exit_ret` for events dropped by
+  // adaptive sampling, see BPFtrace::update_sample_rates
+  void CreateCheckSampled(int early_exit_ret);
+  void SetEventLossCounterKey(uint32_t key)
+  {
+    event_loss_cnt_key_ = key;
+  }
   void CreateMapElemInit(Value *ctx,
                          Map &map,
                          Value *key,
@@ -288,6 +335,7 @@ private:
   Module &module_;
   BPFtrace &bpftrace_;
   AsyncIds &async_ids_;
+  uint32_t event_loss_cnt_key_ = 0;
 
   CallInst *CreateGetPidTgid(const location &loc);
   void CreateGetNsPidTgid(Value *ctx,
@@ -338,11 +386,13 @@ private:
   llvm::Type *getKernelPointerStorageTy();
   llvm::Type *getUserPointerStorageTy();
   void CreateRingbufOutput(Value *data,
-                           size_t size,
+                           Value *size,
                            const location *loc = nullptr);
+  Value *CreateRingbufReserve(size_t size, const location *loc = nullptr);
+  void CreateRingbufSubmit(Value *data, const location *loc = nullptr);
   void CreatePerfEventOutput(Value *ctx,
                              Value *data,
-                             size_t size,
+                             Value *size,
                              const location *loc = nullptr);
 
   void createPerCpuSum(AllocaInst *ret, CallInst *call, const SizedType &type);
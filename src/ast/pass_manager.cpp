@@ -4,6 +4,7 @@
 
 #include "ast/passes/printer.h"
 #include "bpftrace.h"
+#include "timing_trace.h"
 
 namespace bpftrace::ast {
 
@@ -28,6 +29,7 @@ PassResult PassManager::Run(PassContext &ctx)
   if (bt_debug.find(DebugStage::Ast) != bt_debug.end())
     print(ctx, "parser", std::cout);
   for (auto &pass : passes_) {
+    timing::Phase phase(pass.name, "compile");
     auto result = pass.Run(ctx);
     if (bt_debug.find(DebugStage::Ast) != bt_debug.end())
       print(ctx, pass.name, std::cout);
@@ -2,6 +2,7 @@
 
 #include <algorithm>
 #include <arpa/inet.h>
+#include <atomic>
 #include <cerrno>
 #include <csignal>
 #include <cstdio>
@@ -10,10 +11,13 @@
 #include <fstream>
 #include <limits>
 #include <llvm/IR/GlobalValue.h>
+#include <thread>
 
 #if LLVM_VERSION_MAJOR <= 16
 #include <llvm-c/Transforms/IPO.h>
 #endif
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
 #include <llvm/CodeGen/UnreachableBlockElim.h>
 #include <llvm/IR/Constants.h>
 #include <llvm/IR/GlobalVariable.h>
@@ -21,8 +25,11 @@
 #include <llvm/IR/LegacyPassManager.h>
 #include <llvm/IR/Metadata.h>
 #include <llvm/IR/Verifier.h>
+#include <llvm/Linker/Linker.h>
 #include <llvm/Passes/PassBuilder.h>
 #include <llvm/Transforms/IPO.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/FunctionComparator.h>
 #if LLVM_VERSION_MAJOR <= 16
 #include <llvm/Transforms/IPO/PassManagerBuilder.h>
 #endif
@@ -39,6 +46,7 @@
 #include "collect_nodes.h"
 #include "globalvars.h"
 #include "log.h"
+#include "timing_trace.h"
 #include "tracepoint_format_parser.h"
 #include "types.h"
 #include "usdt.h"
@@ -50,6 +58,34 @@ CodegenLLVM::CodegenLLVM(ASTContext &ctx, BPFtrace &bpftrace)
 {
 }
 
+static std::unique_ptr<TargetMachine> create_target_machine(
+    const std::string &triple,
+    OptProfile profile)
+{
+  std::string error_str;
+  auto target = llvm::TargetRegistry::lookupTarget(triple, error_str);
+  if (!target)
+    throw FatalUserException(
+        "Could not find bpf llvm target, does your llvm support it?");
+
+  std::unique_ptr<TargetMachine> target_machine(
+      target->createTargetMachine(triple,
+                                  "generic",
+                                  "",
+                                  TargetOptions(),
+                                  std::optional<Reloc::Model>()));
+#if LLVM_VERSION_MAJOR >= 18
+  target_machine->setOptLevel(profile == OptProfile::fast
+                                  ? llvm::CodeGenOptLevel::Less
+                                  : llvm::CodeGenOptLevel::Aggressive);
+#else
+  target_machine->setOptLevel(profile == OptProfile::fast
+                                  ? llvm::CodeGenOpt::Less
+                                  : llvm::CodeGenOpt::Aggressive);
+#endif
+  return target_machine;
+}
+
 CodegenLLVM::CodegenLLVM(ASTContext &ctx,
                          BPFtrace &bpftrace,
                          std::unique_ptr<USDTHelper> usdt_helper)
@@ -66,23 +102,8 @@ CodegenLLVM::CodegenLLVM(ASTContext &ctx,
   LLVMInitializeBPFTarget();
   LLVMInitializeBPFTargetMC();
   LLVMInitializeBPFAsmPrinter();
-  std::string error_str;
-  auto target = llvm::TargetRegistry::lookupTarget(LLVMTargetTriple, error_str);
-  if (!target)
-    throw FatalUserException(
-        "Could not find bpf llvm target, does your llvm support it?");
-
-  target_machine_.reset(
-      target->createTargetMachine(LLVMTargetTriple,
-                                  "generic",
-                                  "",
-                                  TargetOptions(),
-                                  std::optional<Reloc::Model>()));
-#if LLVM_VERSION_MAJOR >= 18
-  target_machine_->setOptLevel(llvm::CodeGenOptLevel::Aggressive);
-#else
-  target_machine_->setOptLevel(llvm::CodeGenOpt::Aggressive);
-#endif
+  target_machine_ = create_target_machine(LLVMTargetTriple,
+                                          bpftrace_.opt_profile_);
 
   module_->setTargetTriple(LLVMTargetTriple);
   module_->setDataLayout(target_machine_->createDataLayout());
@@ -187,12 +208,11 @@ ScopedExpr CodegenLLVM::kstack_ustack(const std::string &ident,
                                                "merge_block",
                                                parent);
 
+  // The scratch buffer is not zeroed: only the frames written by
+  // bpf_get_stack() are hashed here and read back by userspace
   Value *stack_trace = b_.CreateGetStackScratchMap(stack_type,
                                                    stack_scratch_failure,
                                                    loc);
-  b_.CreateMemsetBPF(stack_trace,
-                     b_.getInt8(0),
-                     uint64_size * stack_type.limit);
 
   BasicBlock *get_stack_success = BasicBlock::Create(module_->getContext(),
                                                      "get_stack_success",
@@ -241,7 +261,36 @@ ScopedExpr CodegenLLVM::kstack_ustack(const std::string &ident,
                  b_.CreateGEP(stack_key_struct,
                               stack_key,
                               { b_.getInt64(0), b_.getInt32(0) }));
-  // Add the stack and id to the stack map
+  // Only add the stack to the stack map if it's not there yet. Hot stacks
+  // are seen over and over again and the lookup is much cheaper than an
+  // update, which would also allocate a new element for LRU maps.
+  BasicBlock *stack_missing = BasicBlock::Create(module_->getContext(),
+                                                 "stack_missing",
+                                                 parent);
+  BasicBlock *stack_found = BasicBlock::Create(module_->getContext(),
+                                               "stack_found",
+                                               parent);
+  Value *existing = b_.CreateMapLookup(stack_type.name(),
+                                       stack_key,
+                                       "stack_lookup");
+  Value *missing = b_.CreateICmpEQ(existing,
+                                   b_.GetNull(),
+                                   "stack_missing_cond");
+  b_.CreateCondBr(missing, stack_missing, stack_found);
+
+  // The key already holds nr_stack_frames, so a hit has the same number of
+  // frames. A different stack with the same hash and depth would otherwise
+  // be reported as the first one stored: check the leaf frame too and
+  // overwrite the stored stack if it differs, as an unconditional update
+  // used to.
+  b_.SetInsertPoint(stack_found);
+  Value *stored_leaf = b_.CreateLoad(b_.getInt64Ty(), existing, "stored_leaf");
+  Value *leaf = b_.CreateLoad(b_.getInt64Ty(), stack_trace, "leaf");
+  b_.CreateCondBr(b_.CreateICmpNE(stored_leaf, leaf, "stack_collision_cond"),
+                  stack_missing,
+                  merge_block);
+
+  b_.SetInsertPoint(stack_missing);
   b_.CreateMapUpdateElem(
       ctx_, stack_type.name(), stack_key, stack_trace, loc, BPF_ANY);
   b_.CreateBr(merge_block);
@@ -284,6 +333,10 @@ int CodegenLLVM::get_probe_id()
 
 ScopedExpr CodegenLLVM::visit(Builtin &builtin)
 {
+  if (auto cached = cached_builtins_.find(builtin.ident);
+      cached != cached_builtins_.end())
+    return ScopedExpr(cached->second);
+
   if (builtin.ident == "nsecs") {
     return ScopedExpr(b_.CreateGetNs(TimestampMode::boot, builtin.loc));
   } else if (builtin.ident == "elapsed") {
@@ -454,6 +507,10 @@ ScopedExpr CodegenLLVM::visit(Call &call)
 {
   if (call.func == "count") {
     Map &map = *call.map;
+    if (auto slot = scalarAggSlot(map)) {
+      scalarAggAdd(*slot, b_.getInt64(1), call.loc);
+      return ScopedExpr();
+    }
     auto scoped_key = getMapKey(map);
     b_.CreateMapElemAdd(
         ctx_, map, scoped_key.value(), b_.getInt64(1), call.loc);
@@ -461,19 +518,32 @@ ScopedExpr CodegenLLVM::visit(Call &call)
 
   } else if (call.func == "sum") {
     Map &map = *call.map;
-    ScopedExpr scoped_key = getMapKey(map);
+    auto slot = scalarAggSlot(map);
+    ScopedExpr scoped_key = slot ? ScopedExpr() : getMapKey(map);
     ScopedExpr scoped_expr = visit(*call.vargs.front());
     // promote int to 64-bit
     Value *cast = b_.CreateIntCast(scoped_expr.value(),
                                    b_.getInt64Ty(),
                                    call.vargs.front()->type.IsSigned());
-    b_.CreateMapElemAdd(ctx_, map, scoped_key.value(), cast, call.loc);
+    if (slot)
+      scalarAggAdd(*slot, cast, call.loc);
+    else
+      b_.CreateMapElemAdd(ctx_, map, scoped_key.value(), cast, call.loc);
     return ScopedExpr();
 
   } else if (call.func == "max" || call.func == "min") {
     bool is_max = call.func == "max";
     Map &map = *call.map;
 
+    if (auto slot = scalarAggSlot(map)) {
+      ScopedExpr scoped_expr = visit(*call.vargs.front());
+      Value *expr = b_.CreateIntCast(scoped_expr.value(),
+                                     b_.getInt64Ty(),
+                                     call.vargs.front()->type.IsSigned());
+      scalarAggMinMax(*slot, expr, is_max, map.type.IsSigned(), call.loc);
+      return ScopedExpr();
+    }
+
     ScopedExpr scoped_key = getMapKey(map);
     CallInst *lookup = b_.CreateMapLookup(map, scoped_key.value());
     ScopedExpr scoped_expr = visit(*call.vargs.front());
@@ -657,7 +727,7 @@ ScopedExpr CodegenLLVM::visit(Call &call)
 
     return ScopedExpr();
 
-  } else if (call.func == "hist") {
+  } else if (call.func == "hist" || call.func == "quantiles") {
     if (!log2_func_)
       log2_func_ = createLog2Function();
 
@@ -681,6 +751,200 @@ ScopedExpr CodegenLLVM::visit(Call &call)
 
     return ScopedExpr();
 
+  } else if (call.func == "count_distinct") {
+    Map &map = *call.map;
+    auto &arg = *call.vargs.front();
+    const auto precision = static_cast<Integer *>(call.vargs.at(1))->n;
+
+    ScopedExpr scoped_key = getMapKey(map);
+    ScopedExpr scoped_arg = visit(arg);
+
+    Value *hash;
+    if (arg.type.IsIntTy()) {
+      // Integers are hashed as 64-bit
+      AllocaInst *val = b_.CreateAllocaBPF(b_.getInt64Ty(),
+                                           "count_distinct_val");
+      b_.CreateStore(b_.CreateIntCast(scoped_arg.value(),
+                                      b_.getInt64Ty(),
+                                      arg.type.IsSigned()),
+                     val);
+      hash = createMurmurHash(val, 8, 0);
+      b_.CreateLifetimeEnd(val);
+    } else {
+      hash = createMurmurHash(scoped_arg.value(), arg.type.GetSize(), 0);
+    }
+
+    // HyperLogLog: the top `precision` bits of the hash select a register,
+    // which records the highest rank (position of the leftmost 1, counting
+    // from 1) seen in the remaining bits. A guard bit below them caps the
+    // rank at 64 - precision + 1.
+    Value *idx = b_.CreateLShr(hash, 64 - precision);
+    Value *rest = b_.CreateOr(b_.CreateShl(hash, precision),
+                              b_.getInt64(1ul << (precision - 1)));
+    // Same binary search for the leftmost 1 as in createLog2Function()
+    Value *l = b_.getInt64(0);
+    for (int i = 5; i >= 0; i--) {
+      Value *threshold = b_.getInt64(1ul << (1ul << i));
+      Value *is_ge = b_.CreateIntCast(b_.CreateICmpUGE(rest, threshold),
+                                      b_.getInt64Ty(),
+                                      false);
+      Value *shift = b_.CreateShl(is_ge, i);
+      rest = b_.CreateLShr(rest, shift);
+      l = b_.CreateAdd(l, shift);
+    }
+    Value *rank = b_.CreateTrunc(b_.CreateSub(b_.getInt64(64), l),
+                                 b_.getInt8Ty());
+
+    llvm::Type *registers_ty = b_.GetMapValueType(map.type);
+    llvm::Function *parent = b_.GetInsertBlock()->getParent();
+    BasicBlock *lookup_failure_block = BasicBlock::Create(module_->getContext(),
+                                                          "lookup_failure",
+                                                          parent);
+    BasicBlock *lookup_success_block = BasicBlock::Create(module_->getContext(),
+                                                          "lookup_success",
+                                                          parent);
+    BasicBlock *update_register_block = BasicBlock::Create(
+        module_->getContext(), "update_register", parent);
+    BasicBlock *lookup_merge_block = BasicBlock::Create(module_->getContext(),
+                                                        "lookup_merge",
+                                                        parent);
+
+    CallInst *lookup = b_.CreateMapLookup(map, scoped_key.value());
+    BasicBlock *lookup_block = b_.GetInsertBlock();
+    b_.CreateCondBr(b_.CreateICmpNE(lookup, b_.GetNull(), "lookup_cond"),
+                    lookup_success_block,
+                    lookup_failure_block);
+
+    // First value for this key: insert empty registers and look them up
+    // again, the registers are too large to build the whole value here.
+    b_.SetInsertPoint(lookup_failure_block);
+    Value *empty = b_.CreateWriteMapValueAllocation(map.type,
+                                                    map.ident + "_val",
+                                                    call.loc);
+    b_.CreateMemsetBPF(empty, b_.getInt8(0), map.type.GetSize());
+    b_.CreateMapUpdateElem(ctx_, map.ident, scoped_key.value(), empty, call.loc);
+    if (dyn_cast<AllocaInst>(empty))
+      b_.CreateLifetimeEnd(empty);
+    CallInst *init_lookup = b_.CreateMapLookup(map, scoped_key.value());
+    BasicBlock *init_lookup_block = b_.GetInsertBlock();
+    b_.CreateCondBr(b_.CreateICmpNE(init_lookup, b_.GetNull(), "lookup_cond"),
+                    lookup_success_block,
+                    lookup_merge_block);
+
+    b_.SetInsertPoint(lookup_success_block);
+    auto *registers = b_.CreatePHI(b_.getPtrTy(), 2, "registers");
+    registers->addIncoming(lookup, lookup_block);
+    registers->addIncoming(init_lookup, init_lookup_block);
+    Value *reg = b_.CreateGEP(registers_ty, registers, { b_.getInt64(0), idx });
+    b_.CreateCondBr(b_.CreateICmpUGT(rank, b_.CreateLoad(b_.getInt8Ty(), reg)),
+                    update_register_block,
+                    lookup_merge_block);
+
+    // Registers are per-CPU, so this doesn't need to be atomic
+    b_.SetInsertPoint(update_register_block);
+    b_.CreateStore(rank, reg);
+    b_.CreateBr(lookup_merge_block);
+
+    b_.SetInsertPoint(lookup_merge_block);
+    return ScopedExpr();
+
+  } else if (call.func == "topk") {
+    Map &map = *call.map;
+    const auto &topk_args = bpftrace_.resources.maps_info.at(map.ident)
+                                .topk_args;
+    if (!topk_args.has_value())
+      LOG(BUG) << "call to topk with missing arguments";
+
+    ScopedExpr scoped_key = getMapKey(map);
+    Value *hash = createMurmurHash(scoped_key.value(),
+                                   map.key_type.GetSize(),
+                                   0);
+
+    llvm::Function *parent = b_.GetInsertBlock()->getParent();
+    BasicBlock *topk_done = BasicBlock::Create(module_->getContext(),
+                                               "topk_done",
+                                               parent);
+    Value *sketch = b_.CreateGetTopkSketch(topk_args->sketch_idx,
+                                           topk_done,
+                                           call.loc);
+
+    // Count the key in every row of the count-min sketch. The columns are
+    // derived from the two halves of the hash (Kirsch-Mitzenmacher), so the
+    // key is hashed only once. The smallest of the counters is the estimate:
+    // it is never below the real count, and is only above it by the keys
+    // colliding in every row.
+    llvm::Type *sketch_ty = ArrayType::get(b_.getInt64Ty(), TOPK_SKETCH_SIZE);
+    Value *h1 = b_.CreateAnd(hash, b_.getInt64(0xffffffff));
+    Value *h2 = b_.CreateOr(b_.CreateLShr(hash, 32), b_.getInt64(1));
+    Value *estimate = nullptr;
+    for (int row = 0; row < TOPK_SKETCH_DEPTH; row++) {
+      Value *col = b_.CreateAnd(b_.CreateAdd(h1,
+                                             b_.CreateMul(h2,
+                                                          b_.getInt64(row))),
+                                b_.getInt64(TOPK_SKETCH_WIDTH - 1));
+      Value *slot = b_.CreateAdd(col, b_.getInt64(row * TOPK_SKETCH_WIDTH));
+      Value *counter = b_.CreateGEP(sketch_ty,
+                                    sketch,
+                                    { b_.getInt64(0), slot });
+      // The sketch is per-CPU, so this doesn't need to be atomic
+      Value *count = b_.CreateAdd(b_.CreateLoad(b_.getInt64Ty(), counter),
+                                  b_.getInt64(1));
+      b_.CreateStore(count, counter);
+      estimate = estimate ? b_.CreateSelect(b_.CreateICmpULT(count, estimate),
+                                            count,
+                                            estimate)
+                          : count;
+    }
+    Value *total_counter = b_.CreateGEP(
+        sketch_ty,
+        sketch,
+        { b_.getInt64(0), b_.getInt64(TOPK_SKETCH_SIZE - 1) });
+    Value *total = b_.CreateAdd(b_.CreateLoad(b_.getInt64Ty(), total_counter),
+                                b_.getInt64(1));
+    b_.CreateStore(total, total_counter);
+
+    // Keys already in the map get their new estimate in place, which also
+    // marks them as recently used.
+    BasicBlock *lookup_success_block = BasicBlock::Create(module_->getContext(),
+                                                          "lookup_success",
+                                                          parent);
+    BasicBlock *lookup_failure_block = BasicBlock::Create(module_->getContext(),
+                                                          "lookup_failure",
+                                                          parent);
+    BasicBlock *admit_block = BasicBlock::Create(module_->getContext(),
+                                                 "topk_admit",
+                                                 parent);
+    CallInst *lookup = b_.CreateMapLookup(map, scoped_key.value());
+    b_.CreateCondBr(b_.CreateICmpNE(lookup, b_.GetNull(), "lookup_cond"),
+                    lookup_success_block,
+                    lookup_failure_block);
+
+    b_.SetInsertPoint(lookup_success_block);
+    b_.CreateStore(estimate, lookup);
+    b_.CreateBr(topk_done);
+
+    // New keys are only admitted if they may be heavy hitters, i.e. seen in
+    // at least 1 / (2 * k) of the events. At most 2 * k keys can be, so a
+    // stream of light keys can't evict the heavy ones from the LRU map.
+    // Their counts stay in the sketch, so a key becoming heavy later is
+    // admitted with its full estimate.
+    b_.SetInsertPoint(lookup_failure_block);
+    b_.CreateCondBr(
+        b_.CreateICmpUGE(b_.CreateMul(estimate, b_.getInt64(2 * topk_args->k)),
+                         total),
+        admit_block,
+        topk_done);
+
+    b_.SetInsertPoint(admit_block);
+    AllocaInst *val = b_.CreateAllocaBPF(b_.getInt64Ty(), map.ident + "_val");
+    b_.CreateStore(estimate, val);
+    b_.CreateMapUpdateElem(ctx_, map.ident, scoped_key.value(), val, call.loc);
+    b_.CreateLifetimeEnd(val);
+    b_.CreateBr(topk_done);
+
+    b_.SetInsertPoint(topk_done);
+    return ScopedExpr();
+
   } else if (call.func == "lhist") {
     if (!linear_func_)
       linear_func_ = createLinearFunction();
@@ -1285,11 +1549,12 @@ ScopedExpr CodegenLLVM::visit(Call &call)
       // element so we can return 1 straight away.
       // For the rest, use bpf_map_sum_elem_count if available and map supports
       // it, otherwise fall back to bpf_for_each_map_elem with a custom callback
-      if (map_has_single_elem(map.type, map.key_type)) {
+      const auto &map_info = bpftrace_.resources.maps_info.at(map.ident);
+      if (map_has_single_elem(map_info)) {
         return ScopedExpr(b_.getInt64(1));
       } else if (bpftrace_.feature_->has_kernel_func(
                      Kfunc::bpf_map_sum_elem_count) &&
-                 !is_array_map(map.type, map.key_type)) {
+                 !is_array_map(map_info)) {
         return ScopedExpr(CreateKernelFuncCall(Kfunc::bpf_map_sum_elem_count,
                                                { b_.GetMapVar(map.ident) },
                                                "len"));
@@ -1520,6 +1785,15 @@ ScopedExpr CodegenLLVM::visit(Offsetof &offof)
 
 ScopedExpr CodegenLLVM::visit(Map &map)
 {
+  bool key_uses_vars = false;
+  auto cache_key = mapLookupCacheKey(map, key_uses_vars);
+  if (cache_key) {
+    auto cached = map_lookup_cache_.find(*cache_key);
+    if (cached != map_lookup_cache_.end() &&
+        cached->second.block == b_.GetInsertBlock())
+      return ScopedExpr(cached->second.value);
+  }
+
   auto scoped_key = getMapKey(map);
 
   auto map_info = bpftrace_.resources.maps_info.find(map.ident);
@@ -1529,13 +1803,21 @@ ScopedExpr CodegenLLVM::visit(Map &map)
 
   const auto &val_type = map_info->second.value_type;
   Value *value;
-  if (canAggPerCpuMapElems(val_type, map_info->second.key_type)) {
+  if (canAggPerCpuMapElems(map_info->second)) {
     value = b_.CreatePerCpuMapAggElems(
         ctx_, map, scoped_key.value(), val_type, map.loc);
   } else {
     value = b_.CreateMapLookupElem(ctx_, map, scoped_key.value(), map.loc);
   }
 
+  if (cache_key && value->getType()->isIntegerTy()) {
+    map_lookup_cache_[*cache_key] = CachedMapLookup{
+      .block = b_.GetInsertBlock(),
+      .value = value,
+      .uses_vars = key_uses_vars,
+    };
+  }
+
   return ScopedExpr(value, [this, value] {
     if (dyn_cast<AllocaInst>(value))
       b_.CreateLifetimeEnd(value);
@@ -2105,6 +2387,10 @@ ScopedExpr CodegenLLVM::visit(FieldAccess &acc)
         value = b_.CreateSafeGEP(b_.getInt32Ty(), ctx_, value);
         return ScopedExpr(value);
       }
+    } else if (auto fused = fused_reads_.read_idx.find(&acc);
+               fused != fused_reads_.read_idx.end()) {
+      return readFusedField(
+          std::move(scoped_arg), fused->second, type, field, acc.loc);
     } else {
       return probereadDatastructElem(std::move(scoped_arg),
                                      b_.getInt64(field.offset),
@@ -2695,7 +2981,7 @@ ScopedExpr CodegenLLVM::visit(Block &block)
 {
   scope_stack_.push_back(&block);
   for (Statement *stmt : block.stmts)
-    visit(*stmt);
+    visitStatement(*stmt);
   scope_stack_.pop_back();
 
   return ScopedExpr();
@@ -2723,29 +3009,58 @@ void CodegenLLVM::generateProbe(Probe &probe,
   func->setSection(get_section_name(func_name));
   debug_.createProbeDebugInfo(*func);
 
-  BasicBlock *entry = BasicBlock::Create(module_->getContext(), "entry", func);
-  b_.SetInsertPoint(entry);
+  auto timer_slot = current_attach_point_->timer_slot;
+  llvm::Function *body_func = func;
+  if (timer_slot) {
+    body_func = createTimerCallback(func_name);
+  } else {
+    BasicBlock *entry = BasicBlock::Create(module_->getContext(),
+                                           "entry",
+                                           func);
+    b_.SetInsertPoint(entry);
+  }
 
   // check: do the following 8 lines need to be in the wildcard loop?
-  ctx_ = func->arg_begin();
+  //
+  // Timer callbacks have no probe context, the map they are called for is
+  // passed in its place. The probe body doesn't use the context then (see
+  // ResourceAnalyser::assign_timer_slots), apart from being passed to output
+  // helpers which ignore it when using the ring buffer.
+  ctx_ = body_func->arg_begin();
+
+  // Drop events before doing anything else so that dropped events cost as
+  // little as possible
+  if (is_sampled(probe_type))
+    b_.CreateCheckSampled(getReturnValueForProbe(probe_type));
 
   if (bpftrace_.need_recursion_check_) {
     b_.CreateCheckSetRecursion(current_attach_point_->loc,
                                getReturnValueForProbe(probe_type));
   }
 
+  auto cse = cse_.builtins.find(&probe);
+  if (cse != cse_.builtins.end())
+    cacheBuiltins(cse->second.before_pred);
   if (probe.pred)
     visit(*probe.pred);
   variables_.clear();
+  if (cse != cse_.builtins.end())
+    cacheBuiltins(cse->second.before_body);
   auto scoped_block = visit(*probe.block);
+  clearCSECaches();
 
   createRet();
 
   if (dummy) {
+    if (body_func != func)
+      body_func->eraseFromParent();
     func->eraseFromParent();
     return;
   }
 
+  if (timer_slot)
+    generateTimerStart(*func, *body_func, *timer_slot);
+
   auto pt = probetype(current_attach_point_->provider);
   if ((pt == ProbeType::watchpoint || pt == ProbeType::asyncwatchpoint) &&
       current_attach_point_->func.size())
@@ -2753,6 +3068,131 @@ void CodegenLLVM::generateProbe(Probe &probe,
         func_type, name, current_attach_point_->address, index);
 }
 
+namespace {
+
+// Period of a timer driven probe in nanoseconds
+uint64_t timer_period_ns(const AttachPoint &ap)
+{
+  if (ap.target == "s")
+    return ap.freq * 1000000000ULL;
+  if (ap.target == "ms")
+    return ap.freq * 1000000ULL;
+  if (ap.target == "us")
+    return ap.freq * 1000ULL;
+  // hz
+  return 1000000000ULL / ap.freq;
+}
+
+// Start the timer on the CPU it is armed on, BPF_F_TIMER_CPU_PIN
+constexpr uint64_t TIMER_CPU_PIN_FLAG = 1ULL << 1;
+
+uint64_t timer_flags(const AttachPoint &ap)
+{
+  return probetype(ap.provider) == ProbeType::profile ? TIMER_CPU_PIN_FLAG : 0;
+}
+
+} // namespace
+
+llvm::Function *CodegenLLVM::createTimerCallback(
+    const std::string &probe_func_name)
+{
+  // Create a callback function suitable for passing to
+  // bpf_timer_set_callback, of the form:
+  //
+  //   static int cb(struct map *map, int *key, struct timer_val *value)
+  //   {
+  //     bpf_timer_start(&value->timer, period, flags);
+  //     [probe body...]
+  //   }
+  //
+  // The timer is re-armed first so that the period doesn't drift by the time
+  // the probe body takes.
+  std::array<llvm::Type *, 3> args = { b_.getPtrTy(),
+                                       b_.getPtrTy(),
+                                       b_.getPtrTy() };
+
+  FunctionType *callback_type = FunctionType::get(b_.getInt64Ty(), args, false);
+  auto *callback = llvm::Function::Create(
+      callback_type,
+      llvm::Function::LinkageTypes::InternalLinkage,
+      probe_func_name + "_timer_cb",
+      module_.get());
+  callback->setDSOLocal(true);
+  callback->setVisibility(llvm::GlobalValue::DefaultVisibility);
+  callback->setSection(".text");
+
+  Struct debug_args;
+  debug_args.AddField("map", CreatePointer(CreateInt8()));
+  debug_args.AddField("key", CreatePointer(CreateInt8()));
+  debug_args.AddField("value", CreatePointer(CreateInt8()));
+  debug_.createFunctionDebugInfo(*callback, CreateInt64(), debug_args);
+
+  auto *entry = BasicBlock::Create(module_->getContext(), "entry", callback);
+  b_.SetInsertPoint(entry);
+
+  const auto &ap = *current_attach_point_;
+  b_.CreateTimerStart(callback->getArg(2),
+                      b_.getInt64(timer_period_ns(ap)),
+                      timer_flags(ap),
+                      ap.loc);
+  return callback;
+}
+
+void CodegenLLVM::generateTimerStart(llvm::Function &func,
+                                     llvm::Function &callback,
+                                     uint32_t timer_slot)
+{
+  // Generate the probe program, of the form:
+  //
+  //   int probe(void *ctx)
+  //   {
+  //     int key = slot [+ cpu];
+  //     struct timer_val *value = bpf_map_lookup_elem(&timers, &key);
+  //     if (!value)
+  //       return 1;
+  //     bpf_timer_init(&value->timer, &timers, CLOCK_MONOTONIC);
+  //     bpf_timer_set_callback(&value->timer, cb);
+  //     return bpf_timer_start(&value->timer, period, flags);
+  //   }
+  //
+  // Profile probes have a timer per CPU, each started on its own CPU.
+  // bpf_timer_init fails if the timer is already initialized, e.g. when the
+  // probe is attached again, which is fine as the callback is set anyway.
+  const auto &ap = *current_attach_point_;
+  auto *entry = BasicBlock::Create(module_->getContext(), "entry", &func);
+  b_.SetInsertPoint(entry);
+
+  Value *slot = b_.getInt32(timer_slot);
+  if (probetype(ap.provider) == ProbeType::profile) {
+    Value *cpu = b_.CreateTrunc(b_.CreateGetCpuId(ap.loc), b_.getInt32Ty());
+    slot = b_.CreateAdd(slot, cpu);
+  }
+  AllocaInst *key = b_.CreateAllocaBPF(b_.getInt32Ty(), "timer_key");
+  b_.CreateStore(slot, key);
+  auto map_name = to_string(MapType::Timers);
+  Value *timer = b_.CreateMapLookup(map_name, key, "timer");
+  b_.CreateLifetimeEnd(key);
+
+  BasicBlock *found = BasicBlock::Create(module_->getContext(),
+                                         "timer_found",
+                                         &func);
+  BasicBlock *missing = BasicBlock::Create(module_->getContext(),
+                                           "timer_missing",
+                                           &func);
+  Value *is_missing = b_.CreateICmpEQ(timer, b_.GetNull(), "timer_is_null");
+  b_.CreateCondBr(is_missing, missing, found);
+
+  b_.SetInsertPoint(missing);
+  b_.CreateRet(b_.getInt64(1));
+
+  b_.SetInsertPoint(found);
+  b_.CreateTimerInit(timer, map_name, ap.loc);
+  b_.CreateTimerSetCallback(timer, &callback, ap.loc);
+  Value *ret = b_.CreateTimerStart(
+      timer, b_.getInt64(timer_period_ns(ap)), timer_flags(ap), ap.loc);
+  b_.CreateRet(ret);
+}
+
 void CodegenLLVM::add_probe(AttachPoint &ap,
                             Probe &probe,
                             const std::string &name,
@@ -2800,6 +3240,7 @@ void CodegenLLVM::add_probe(AttachPoint &ap,
 ScopedExpr CodegenLLVM::visit(Subprog &subprog)
 {
   scope_stack_.push_back(&subprog);
+  b_.SetEventLossCounterKey(0);
   std::vector<llvm::Type *> arg_types;
   // First argument is for passing ctx pointer for output, rest are proper
   // arguments to the function
@@ -2834,7 +3275,7 @@ ScopedExpr CodegenLLVM::visit(Subprog &subprog)
   }
 
   for (Statement *stmt : subprog.stmts)
-    visit(*stmt);
+    visitStatement(*stmt);
   if (subprog.return_type.IsVoidTy())
     createRet();
 
@@ -2869,6 +3310,16 @@ void CodegenLLVM::createRet(Value *value)
   b_.CreateRet(b_.getInt64(ret_val));
 }
 
+// Adaptive sampling applies to probes fired by events. BEGIN/END, interval
+// and iterator probes always run.
+bool CodegenLLVM::is_sampled(ProbeType probe_type)
+{
+  if (!bpftrace_.config_.get(ConfigKeyBool::adaptive_sampling))
+    return false;
+  return probe_type != ProbeType::special &&
+         probe_type != ProbeType::interval && probe_type != ProbeType::iter;
+}
+
 int CodegenLLVM::getReturnValueForProbe(ProbeType probe_type)
 {
   // Fall back to default return value
@@ -2914,6 +3365,15 @@ ScopedExpr CodegenLLVM::visit(Probe &probe)
   // can restore it for the next pass (printf_id_, time_id_).
   auto reset_ids = async_ids_.create_reset_ids();
   bool generated = false;
+
+  const auto &loss_probes = bpftrace_.resources.event_loss_probes;
+  auto loss_probe = std::find(loss_probes.begin(),
+                              loss_probes.end(),
+                              probe.name());
+  b_.SetEventLossCounterKey(
+      loss_probe == loss_probes.end()
+          ? 0
+          : std::distance(loss_probes.begin(), loss_probe) + 1);
   for (auto *attach_point : probe.attach_points) {
     reset_ids();
     current_attach_point_ = attach_point;
@@ -2975,6 +3435,72 @@ int CodegenLLVM::getNextIndexForProbe()
   return next_probe_index_++;
 }
 
+std::optional<uint32_t> CodegenLLVM::scalarAggSlot(const Map &map)
+{
+  return bpftrace_.resources.maps_info.at(map.ident).scalar_agg_slot;
+}
+
+// The slot belongs to the current CPU so plain loads and stores suffice, the
+// same as for the value of a per-CPU map.
+void CodegenLLVM::scalarAggAdd(uint32_t slot, Value *val, const location &loc)
+{
+  Value *slot_ptr = b_.CreateGetScalarAggSlot(slot, loc);
+  Value *is_set_ptr = b_.CreateGEP(b_.getInt64Ty(),
+                                   slot_ptr,
+                                   b_.getInt64(1));
+  Value *old_val = b_.CreateLoad(b_.getInt64Ty(), slot_ptr);
+  b_.CreateStore(b_.CreateAdd(old_val, val), slot_ptr);
+  b_.CreateStore(b_.getInt64(1), is_set_ptr);
+}
+
+void CodegenLLVM::scalarAggMinMax(uint32_t slot,
+                                  Value *val,
+                                  bool is_max,
+                                  bool is_signed,
+                                  const location &loc)
+{
+  Value *slot_ptr = b_.CreateGetScalarAggSlot(slot, loc);
+  Value *is_set_ptr = b_.CreateGEP(b_.getInt64Ty(),
+                                   slot_ptr,
+                                   b_.getInt64(1));
+
+  llvm::Function *parent = b_.GetInsertBlock()->getParent();
+  BasicBlock *is_set_block = BasicBlock::Create(module_->getContext(),
+                                                "is_set",
+                                                parent);
+  BasicBlock *min_max_block = BasicBlock::Create(module_->getContext(),
+                                                 "min_max",
+                                                 parent);
+  BasicBlock *merge_block = BasicBlock::Create(module_->getContext(),
+                                               "min_max_merge",
+                                               parent);
+
+  Value *is_set_val = b_.CreateLoad(b_.getInt64Ty(), is_set_ptr);
+  Value *is_set_condition = b_.CreateICmpEQ(is_set_val,
+                                            b_.getInt64(1),
+                                            "is_set_cond");
+  b_.CreateCondBr(is_set_condition, is_set_block, min_max_block);
+
+  b_.SetInsertPoint(is_set_block);
+  Value *mm_val = b_.CreateLoad(b_.getInt64Ty(), slot_ptr);
+  Value *min_max_condition;
+  if (is_max) {
+    min_max_condition = is_signed ? b_.CreateICmpSGE(val, mm_val)
+                                  : b_.CreateICmpUGE(val, mm_val);
+  } else {
+    min_max_condition = is_signed ? b_.CreateICmpSGE(mm_val, val)
+                                  : b_.CreateICmpUGE(mm_val, val);
+  }
+  b_.CreateCondBr(min_max_condition, min_max_block, merge_block);
+
+  b_.SetInsertPoint(min_max_block);
+  b_.CreateStore(val, slot_ptr);
+  b_.CreateStore(b_.getInt64(1), is_set_ptr);
+  b_.CreateBr(merge_block);
+
+  b_.SetInsertPoint(merge_block);
+}
+
 ScopedExpr CodegenLLVM::getMapKey(Map &map)
 {
   return getMapKey(map, map.key_expr);
@@ -3013,9 +3539,10 @@ ScopedExpr CodegenLLVM::getMapKey(Map &map, Expression *key_expr)
         // Call-ee freed
       }
     } else if (map.key_type.IsIntTy()) {
-      // Integers are always stored as 64-bit in map keys
+      // Integers are stored as 64-bit in map keys, except for array maps
+      // which are indexed by 32-bit integers
       b_.CreateStore(b_.CreateIntCast(scoped_key_expr.value(),
-                                      b_.getInt64Ty(),
+                                      b_.GetType(map.key_type),
                                       key_expr->type.IsSigned()),
                      key);
     } else {
@@ -3500,12 +4027,22 @@ void CodegenLLVM::createFormatStringCall(Call &call,
   // The id maps to bpftrace_.*_args_, and is a way to define the
   // types and offsets of each of the arguments, and share that between BPF and
   // user-space for printing.
+  //
+  // Arguments marked as data_loc by the resource analyser only have their
+  // location stored in the struct. Their data follows the struct and is sent at
+  // its actual length.
   std::vector<llvm::Type *> elements = { b_.getInt64Ty() }; // ID
 
   const auto &args = std::get<1>(call_args.at(id));
+  size_t var_size = 0;
   for (const Field &arg : args) {
-    llvm::Type *ty = b_.GetType(arg.type);
-    elements.push_back(ty);
+    if (arg.is_data_loc) {
+      elements.push_back(b_.getInt32Ty());
+      var_size += arg.type.GetSize();
+    } else {
+      llvm::Type *ty = b_.GetType(arg.type);
+      elements.push_back(ty);
+    }
   }
   StructType *fmt_struct = StructType::create(elements,
                                               call_name + "_t",
@@ -3524,9 +4061,29 @@ void CodegenLLVM::createFormatStringCall(Call &call,
                << " does not match LLVM offset=" << expected_offset;
   }
 
-  Value *fmt_args = b_.CreateGetFmtStringArgsAllocation(fmt_struct,
-                                                        call_name + "_args",
-                                                        call.loc);
+  // Evaluate the arguments up front. Reserving ring buffer space may fail,
+  // which skips the code up to the commit, and side effects of the arguments
+  // (e.g. `@x++`) must happen regardless.
+  std::vector<ScopedExpr> scoped_args;
+  for (size_t i = 1; i < call.vargs.size(); i++)
+    scoped_args.push_back(visit(*call.vargs.at(i)));
+
+  // Fixed size events are written directly into the ring buffer. Variable
+  // length ones are built separately so that only their actual length is
+  // output.
+  IRBuilderBPF::OutputEvent event;
+  if (var_size > 0) {
+    StructType *alloc_struct = StructType::create(
+        { fmt_struct, ArrayType::get(b_.getInt8Ty(), var_size) },
+        call_name + "_buf_t",
+        false);
+    event.data = b_.CreateGetFmtStringArgsAllocation(alloc_struct,
+                                                     call_name + "_args",
+                                                     call.loc);
+  } else {
+    event = b_.CreateOutputReserve(fmt_struct, call_name + "_args", call.loc);
+  }
+  Value *fmt_args = event.data;
   // The struct is not packed so we need to memset it
   b_.CreateMemsetBPF(fmt_args, b_.getInt8(0), struct_size);
 
@@ -3535,13 +4092,24 @@ void CodegenLLVM::createFormatStringCall(Call &call,
                                   { b_.getInt32(0), b_.getInt32(0) });
   b_.CreateStore(b_.getInt64(id + asyncactionint(async_action)), id_offset);
 
+  Value *data_size = b_.getInt64(struct_size);
   for (size_t i = 1; i < call.vargs.size(); i++) {
     Expression &arg = *call.vargs.at(i);
-    auto scoped_arg = visit(arg);
+    auto &scoped_arg = scoped_args.at(i - 1);
     Value *offset = b_.CreateGEP(fmt_struct,
                                  fmt_args,
                                  { b_.getInt32(0), b_.getInt32(i) });
-    if (needMemcpy(arg.type))
+    if (args.at(i - 1).is_data_loc) {
+      Value *length = createVarLengthArg(
+          b_.CreateGEP(b_.getInt8Ty(), fmt_args, data_size),
+          scoped_arg.value(),
+          args.at(i - 1).type,
+          call.loc);
+      Value *data_loc = b_.CreateOr(b_.CreateShl(length, 16), data_size);
+      b_.CreateStore(b_.CreateIntCast(data_loc, b_.getInt32Ty(), false),
+                     offset);
+      data_size = b_.CreateAdd(data_size, length);
+    } else if (needMemcpy(arg.type))
       b_.CreateMemcpyBPF(offset, scoped_arg.value(), arg.type.GetSize());
     else if (arg.type.IsIntegerTy() && arg.type.GetSize() < 8)
       b_.CreateStore(b_.CreateIntCast(scoped_arg.value(),
@@ -3552,9 +4120,50 @@ void CodegenLLVM::createFormatStringCall(Call &call,
       b_.CreateStore(scoped_arg.value(), offset);
   }
 
-  b_.CreateOutput(ctx_, fmt_args, struct_size, &call.loc);
-  if (dyn_cast<AllocaInst>(fmt_args))
-    b_.CreateLifetimeEnd(fmt_args);
+  if (var_size > 0) {
+    b_.CreateOutput(ctx_, fmt_args, data_size, &call.loc);
+    if (dyn_cast<AllocaInst>(fmt_args))
+      b_.CreateLifetimeEnd(fmt_args);
+  } else {
+    b_.CreateOutputCommit(ctx_, event, struct_size, &call.loc);
+  }
+}
+
+// Copies a string or a buffer to `dst` at its actual length and returns the
+// number of bytes copied (as i64). The length is clamped to the size of the
+// type so that the verifier can bound the accesses which follow.
+Value *CodegenLLVM::createVarLengthArg(Value *dst,
+                                       Value *src,
+                                       const SizedType &type,
+                                       const location &loc)
+{
+  Value *max_length = b_.getInt64(type.GetSize());
+  Value *length;
+  if (type.IsStringTy()) {
+    // The helper returns the length including the NUL terminator
+    Value *ret = b_.CreateProbeReadStr(
+        ctx_, dst, type.GetSize(), src, AddrSpace::kernel, loc);
+    length = b_.CreateSelect(b_.CreateICmpSGT(ret, b_.getInt64(0)),
+                             ret,
+                             b_.getInt64(0));
+  } else {
+    // Buffers start with their 32 bit length
+    Value *content_length = b_.CreateIntCast(
+        b_.CreateLoad(b_.getInt32Ty(), src), b_.getInt64Ty(), false);
+    length = b_.CreateAdd(content_length,
+                          b_.getInt64(sizeof(AsyncEvent::Buf)));
+  }
+  length = b_.CreateSelect(b_.CreateICmpULE(length, max_length),
+                           length,
+                           max_length);
+  if (type.IsBufferTy())
+    b_.CreateProbeRead(ctx_,
+                       dst,
+                       b_.CreateIntCast(length, b_.getInt32Ty(), false),
+                       src,
+                       AddrSpace::kernel,
+                       loc);
+  return length;
 }
 
 void CodegenLLVM::generateWatchpointSetupProbe(
@@ -3671,9 +4280,10 @@ void CodegenLLVM::createPrintNonMapCall(Call &call, int id)
   StructType *print_struct = b_.GetStructType(struct_name.str(),
                                               elements,
                                               true);
-  Value *buf = b_.CreateGetFmtStringArgsAllocation(print_struct,
-                                                   struct_name.str(),
-                                                   call.loc);
+  auto event = b_.CreateOutputReserve(print_struct,
+                                      struct_name.str(),
+                                      call.loc);
+  Value *buf = event.data;
   size_t struct_size = datalayout().getTypeAllocSize(print_struct);
 
   // Store asyncactionid:
@@ -3700,9 +4310,7 @@ void CodegenLLVM::createPrintNonMapCall(Call &call, int id)
     b_.CreateStore(value, content_offset);
   }
 
-  b_.CreateOutput(ctx_, buf, struct_size, &call.loc);
-  if (dyn_cast<AllocaInst>(buf))
-    b_.CreateLifetimeEnd(buf);
+  b_.CreateOutputCommit(ctx_, event, struct_size, &call.loc);
 }
 
 void CodegenLLVM::generate_ir()
@@ -3711,6 +4319,8 @@ void CodegenLLVM::generate_ir()
 
   auto analyser = CodegenResourceAnalyser(Visitor::ctx_, bpftrace_.config_);
   auto codegen_resources = analyser.analyse();
+  cse_ = CSEAnalyser(Visitor::ctx_).analyse();
+  fused_reads_ = FusedReadAnalyser(Visitor::ctx_, bpftrace_).analyse();
 
   generate_maps(bpftrace_.resources, codegen_resources);
   generate_global_vars(bpftrace_.resources, bpftrace_.config_);
@@ -3724,21 +4334,37 @@ void CodegenLLVM::createMapDefinition(const std::string &name,
                                       libbpf::bpf_map_type map_type,
                                       uint64_t max_entries,
                                       const SizedType &key_type,
-                                      const SizedType &value_type)
+                                      const SizedType &value_type,
+                                      uint32_t map_flags)
 {
   DIType *di_key_type = debug_.GetMapKeyType(key_type, value_type, map_type);
+  DIType *di_value_type = value_type.IsNoneTy() ? nullptr
+                                                : debug_.GetType(value_type);
+  createMapDefinition(
+      name, map_type, max_entries, di_key_type, di_value_type, map_flags);
+}
+
+void CodegenLLVM::createMapDefinition(const std::string &name,
+                                      libbpf::bpf_map_type map_type,
+                                      uint64_t max_entries,
+                                      DIType *key_type,
+                                      DIType *value_type,
+                                      uint32_t map_flags)
+{
   map_types_.emplace(name, map_type);
   auto var_name = bpf_map_name(name);
   auto debuginfo = debug_.createMapEntry(
-      var_name, map_type, max_entries, di_key_type, value_type);
+      var_name, map_type, max_entries, key_type, value_type, map_flags);
 
   // It's sufficient that the global variable has the correct size (struct with
   // one pointer per field). The actual inner types are defined in debug info.
-  SmallVector<llvm::Type *, 4> elems = { b_.getPtrTy(), b_.getPtrTy() };
-  if (!value_type.IsNoneTy()) {
+  SmallVector<llvm::Type *, 5> elems = { b_.getPtrTy(), b_.getPtrTy() };
+  if (value_type) {
     elems.push_back(b_.getPtrTy());
     elems.push_back(b_.getPtrTy());
   }
+  if (map_flags != 0)
+    elems.push_back(b_.getPtrTy());
   auto type = StructType::create(elems, "struct map_t", false);
 
   auto var = llvm::dyn_cast<GlobalVariable>(
@@ -3749,11 +4375,16 @@ void CodegenLLVM::createMapDefinition(const std::string &name,
   var->addDebugInfo(debuginfo);
 }
 
-libbpf::bpf_map_type CodegenLLVM::get_map_type(const SizedType &val_type,
-                                               const SizedType &key_type)
+libbpf::bpf_map_type CodegenLLVM::get_map_type(const MapInfo &map_info)
 {
-  if (val_type.IsCountTy() && key_type.IsNoneTy()) {
+  const auto &val_type = map_info.value_type;
+  const auto &key_type = map_info.key_type;
+  if (map_info.decl_args.has_value()) {
+    return map_info.decl_args->bpf_type;
+  } else if (val_type.IsCountTy() && key_type.IsNoneTy()) {
     return libbpf::BPF_MAP_TYPE_PERCPU_ARRAY;
+  } else if (val_type.IsTopkTy()) {
+    return libbpf::BPF_MAP_TYPE_LRU_PERCPU_HASH;
   } else if (val_type.NeedsPercpuMap()) {
     return libbpf::BPF_MAP_TYPE_PERCPU_HASH;
   } else {
@@ -3761,20 +4392,16 @@ libbpf::bpf_map_type CodegenLLVM::get_map_type(const SizedType &val_type,
   }
 }
 
-bool CodegenLLVM::is_array_map(const SizedType &val_type,
-                               const SizedType &key_type)
+bool CodegenLLVM::is_array_map(const MapInfo &map_info)
 {
-  auto map_type = get_map_type(val_type, key_type);
-  return map_type == libbpf::BPF_MAP_TYPE_ARRAY ||
-         map_type == libbpf::BPF_MAP_TYPE_PERCPU_ARRAY;
+  return is_array_map_type(get_map_type(map_info));
 }
 
 // Check if we can special-case the map to have a single element. This is done
 // for keyless maps BPF_MAP_TYPE_(PERCPU_)ARRAY type.
-bool CodegenLLVM::map_has_single_elem(const SizedType &val_type,
-                                      const SizedType &key_type)
+bool CodegenLLVM::map_has_single_elem(const MapInfo &map_info)
 {
-  return is_array_map(val_type, key_type) && key_type.IsNoneTy();
+  return is_array_map(map_info) && map_info.key_type.IsNoneTy();
 }
 
 // Emit maps in libbpf format so that Clang can create BTF info for them which
@@ -3786,9 +4413,11 @@ bool CodegenLLVM::map_has_single_elem(const SizedType &val_type,
 // - "max_entries" maximum number of entries
 // - "key"         key type
 // - "value"       value type
+// - "map_flags"   map creation flags (only emitted when non-zero)
 //
-// "type" and "max_entries" are integers but they must be represented as
-// pointers to an array of ints whose dimension defines the specified value.
+// "type", "max_entries" and "map_flags" are integers but they must be
+// represented as pointers to an array of ints whose dimension defines the
+// specified value.
 //
 // "key" and "value" are pointers to the corresponding types. Note that these
 // are not used for the BPF_MAP_TYPE_RINGBUF map type.
@@ -3810,26 +4439,46 @@ void CodegenLLVM::generate_maps(const RequiredResources &required_resources,
     const auto &val_type = info.value_type;
     const auto &key_type = info.key_type;
 
+    // Kept in the scalar aggregation buffer instead
+    if (info.scalar_agg_slot.has_value())
+      continue;
+
     auto max_entries = bpftrace_.config_.get(ConfigKeyInt::max_map_keys);
-    auto map_type = get_map_type(val_type, key_type);
+    auto map_type = get_map_type(info);
+    uint32_t map_flags = 0;
+    if (info.decl_args.has_value()) {
+      max_entries = info.decl_args->max_entries;
+      map_flags = info.decl_args->flags;
+    }
 
-    // hist() and lhist() transparently create additional elements in whatever
-    // map they are assigned to. So even if the map looks like it has no keys,
-    // multiple keys are necessary.
-    if (key_type.IsNoneTy() && !val_type.IsHistTy() && !val_type.IsLhistTy()) {
+    // hist(), lhist() and quantiles() transparently create additional
+    // elements in whatever map they are assigned to. So even if the map looks
+    // like it has no keys, multiple keys are necessary.
+    if (key_type.IsNoneTy() && !val_type.IsHistTy() && !val_type.IsLhistTy() &&
+        !val_type.IsQuantilesTy()) {
       max_entries = 1;
     }
+    // topk() keeps some spare room so that new keys only evict the least
+    // recently updated keys outside of the top k.
+    if (info.topk_args.has_value())
+      max_entries = 2 * info.topk_args->k;
 
-    createMapDefinition(name, map_type, max_entries, key_type, val_type);
+    createMapDefinition(
+        name, map_type, max_entries, key_type, val_type, map_flags);
   }
 
   // bpftrace internal maps
 
   uint16_t max_stack_limit = 0;
+  auto stack_map_type = libbpf::BPF_MAP_TYPE_LRU_HASH;
+  if (bpftrace_.config_.get(ConfigKeyStackMapType::default_) ==
+      ConfigStackMapType::hash)
+    stack_map_type = libbpf::BPF_MAP_TYPE_HASH;
+  auto max_stack_ids = bpftrace_.config_.get(ConfigKeyInt::max_stack_ids);
   for (const StackType &stack_type : codegen_resources.stackid_maps) {
     createMapDefinition(stack_type.name(),
-                        libbpf::BPF_MAP_TYPE_LRU_HASH,
-                        128 << 10,
+                        stack_map_type,
+                        max_stack_ids,
                         CreateArray(12, CreateInt8()),
                         CreateArray(stack_type.limit, CreateUInt64()));
     max_stack_limit = std::max(stack_type.limit, max_stack_limit);
@@ -3887,13 +4536,36 @@ void CodegenLLVM::generate_maps(const RequiredResources &required_resources,
                         CreateNone());
   }
 
-  int loss_cnt_key_size = sizeof(bpftrace_.event_loss_cnt_key_) * 8;
-  int loss_cnt_val_size = sizeof(bpftrace_.event_loss_cnt_val_) * 8;
+  if (required_resources.topk_sketches > 0) {
+    createMapDefinition(to_string(MapType::TopkSketch),
+                        libbpf::BPF_MAP_TYPE_PERCPU_ARRAY,
+                        required_resources.topk_sketches,
+                        CreateInt32(),
+                        CreateArray(TOPK_SKETCH_SIZE, CreateUInt64()));
+  }
+
+  if (bpftrace_.config_.get(ConfigKeyBool::adaptive_sampling)) {
+    // { mask, count }, see IRBuilderBPF::CreateCheckSampled
+    createMapDefinition(to_string(MapType::SampleRate),
+                        libbpf::BPF_MAP_TYPE_PERCPU_ARRAY,
+                        1,
+                        CreateInt32(),
+                        CreateArray(2, CreateUInt64()));
+  }
+
+  if (required_resources.timer_slots > 0) {
+    createMapDefinition(to_string(MapType::Timers),
+                        libbpf::BPF_MAP_TYPE_ARRAY,
+                        required_resources.timer_slots,
+                        debug_.getInt32Ty(),
+                        debug_.CreateTimerValueType());
+  }
+
   createMapDefinition(to_string(MapType::EventLossCounter),
-                      libbpf::BPF_MAP_TYPE_ARRAY,
-                      1,
-                      CreateInt(loss_cnt_key_size),
-                      CreateInt(loss_cnt_val_size));
+                      libbpf::BPF_MAP_TYPE_PERCPU_ARRAY,
+                      1 + required_resources.event_loss_probes.size(),
+                      CreateUInt32(),
+                      CreateUInt64());
 }
 
 void CodegenLLVM::generate_global_vars(
@@ -3933,17 +4605,17 @@ void CodegenLLVM::emit_elf(const std::string &filename)
   return;
 }
 
-void CodegenLLVM::optimize()
+static void optimize_module(Module &module,
+                            TargetMachine *target_machine,
+                            OptProfile profile)
 {
-  assert(state_ == State::IR);
-
   PipelineTuningOptions pto;
   pto.LoopUnrolling = false;
   pto.LoopInterleaving = false;
   pto.LoopVectorization = false;
   pto.SLPVectorization = false;
 
-  llvm::PassBuilder pb(target_machine_.get(), pto);
+  llvm::PassBuilder pb(target_machine, pto);
 
   // ModuleAnalysisManager must be destroyed first.
   llvm::LoopAnalysisManager lam;
@@ -3958,13 +4630,241 @@ void CodegenLLVM::optimize()
   pb.registerLoopAnalyses(lam);
   pb.crossRegisterProxies(lam, fam, cgam, mam);
 
-  ModulePassManager mpm = pb.buildPerModuleDefaultPipeline(
-      llvm::OptimizationLevel::O3);
-  mpm.run(*module_, mam);
+  // O1 still runs SROA, inlining and simplification, without which many
+  // programs would not pass the verifier, but skips the expensive
+  // interprocedural and loop passes of O3
+  llvm::OptimizationLevel level = llvm::OptimizationLevel::O3;
+  if (profile == OptProfile::fast)
+    level = llvm::OptimizationLevel::O1;
+  else if (profile == OptProfile::size)
+    level = llvm::OptimizationLevel::Oz;
+
+  ModulePassManager mpm = pb.buildPerModuleDefaultPipeline(level);
+  mpm.run(module, mam);
+}
+
+void CodegenLLVM::optimize()
+{
+  assert(state_ == State::IR);
+
+  size_t n_threads = bpftrace_.config_.get(ConfigKeyInt::codegen_threads);
+  if (n_threads == 0)
+    n_threads = std::max(1u, std::thread::hardware_concurrency());
+
+  if (n_threads > 1) {
+    // Each part gets its own copies of helper functions, so identical
+    // programs from different parts would no longer compare equal after
+    // linking. Deduplicate them up front instead.
+    deduplicate_progs();
+    optimize_parallel(n_threads);
+  } else {
+    optimize_module(*module_, target_machine_.get(), bpftrace_.opt_profile_);
+    deduplicate_progs();
+  }
 
   state_ = State::OPT;
 }
 
+void CodegenLLVM::optimize_parallel(size_t n_parts)
+{
+  // Every BPF program is an externally visible function, everything else
+  // (subprogs, loop callbacks, helpers) is internal
+  std::unordered_map<const llvm::Function *, size_t> part_of;
+  for (auto &func : *module_) {
+    if (!func.isDeclaration() && func.hasExternalLinkage())
+      part_of.emplace(&func, part_of.size());
+  }
+  n_parts = std::min(n_parts, part_of.size());
+  if (n_parts < 2) {
+    optimize_module(*module_, target_machine_.get(), bpftrace_.opt_profile_);
+    return;
+  }
+
+  // Programs are assigned round robin in module order, so the result only
+  // depends on the number of parts. Each part also gets a copy of all the
+  // internal functions and globals, and declarations of the maps and global
+  // variables whose definitions stay in module_. Parts are handed to the
+  // threads as bitcode as each thread needs its own LLVMContext.
+  std::vector<SmallVector<char, 0>> parts(n_parts);
+  for (size_t i = 0; i < n_parts; i++) {
+    ValueToValueMapTy vmap;
+    auto part = CloneModule(*module_, vmap, [&](const GlobalValue *gv) {
+      if (auto *func = dyn_cast<Function>(gv)) {
+        auto prog = part_of.find(func);
+        return prog == part_of.end() || prog->second % n_parts == i;
+      }
+      return gv->hasLocalLinkage();
+    });
+    raw_svector_ostream os(parts[i]);
+    WriteBitcodeToFile(*part, os);
+  }
+
+  std::atomic<size_t> next = 0;
+  auto worker = [&]() {
+    for (size_t i = next++; i < n_parts; i = next++) {
+      timing::Phase phase("optimize part " + std::to_string(i), "codegen");
+      LLVMContext context;
+      auto part = parseBitcodeFile(
+          MemoryBufferRef(StringRef(parts[i].data(), parts[i].size()), ""),
+          context);
+      if (!part)
+        LOG(BUG) << "Failed to read BPF programs: "
+                 << toString(part.takeError());
+
+      auto target_machine = create_target_machine(LLVMTargetTriple,
+                                                  bpftrace_.opt_profile_);
+      optimize_module(**part, target_machine.get(), bpftrace_.opt_profile_);
+
+      parts[i].clear();
+      raw_svector_ostream os(parts[i]);
+      WriteBitcodeToFile(**part, os);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < n_parts; i++)
+    threads.emplace_back(worker);
+  worker();
+  for (auto &thread : threads)
+    thread.join();
+
+  // Drop all the function bodies, the optimized ones are linked back in. This
+  // keeps the programs in their original order.
+  std::vector<llvm::Function *> internal;
+  for (auto &func : *module_) {
+    if (func.isDeclaration())
+      continue;
+    if (func.hasLocalLinkage())
+      internal.push_back(&func);
+    func.deleteBody();
+  }
+  for (auto *func : internal)
+    func->eraseFromParent();
+  for (auto &var : make_early_inc_range(module_->globals())) {
+    if (var.hasLocalLinkage() && var.use_empty())
+      var.eraseFromParent();
+  }
+
+  for (auto &bitcode : parts) {
+    auto part = parseBitcodeFile(
+        MemoryBufferRef(StringRef(bitcode.data(), bitcode.size()), ""),
+        *context_);
+    if (!part)
+      LOG(BUG) << "Failed to read optimized BPF programs: "
+               << toString(part.takeError());
+    if (Linker::linkModules(*module_, std::move(*part)))
+      LOG(BUG) << "Failed to link optimized BPF programs";
+  }
+}
+
+// Programs of these probe types do not depend on the attach point at load
+// time, so a single loaded program can be attached to multiple places.
+static bool can_share_prog(const Probe &probe)
+{
+  // (k|u)probe_multi programs have an expected attach type that depends on
+  // the probe, they already cover all the matched functions anyway.
+  if (!probe.funcs.empty())
+    return false;
+  // Timer driven programs hard code their slot of the timers map
+  if (probe.timer_slot)
+    return false;
+
+  switch (probe.type) {
+    case ProbeType::kprobe:
+    case ProbeType::kretprobe:
+    case ProbeType::uprobe:
+    case ProbeType::uretprobe:
+    case ProbeType::usdt:
+    case ProbeType::tracepoint:
+    case ProbeType::rawtracepoint:
+    case ProbeType::profile:
+    case ProbeType::interval:
+    case ProbeType::software:
+    case ProbeType::hardware:
+      return true;
+    case ProbeType::invalid:
+    case ProbeType::special:
+    case ProbeType::watchpoint:
+    case ProbeType::asyncwatchpoint:
+    case ProbeType::fentry:
+    case ProbeType::fexit:
+    case ProbeType::iter:
+      return false;
+  }
+  return false;
+}
+
+void CodegenLLVM::deduplicate_progs()
+{
+  std::vector<std::pair<llvm::Function *, ProbeType>> candidates;
+  std::unordered_set<llvm::Function *> seen;
+  for (const auto &probe : bpftrace_.resources.probes) {
+    if (!can_share_prog(probe))
+      continue;
+
+    auto usdt_location_idx = (probe.type == ProbeType::usdt)
+                                 ? std::make_optional<int>(
+                                       probe.usdt_location_idx)
+                                 : std::nullopt;
+    for (const auto *name : { &probe.name, &probe.orig_name }) {
+      auto *func = module_->getFunction(
+          get_function_name_for_probe(*name, probe.index, usdt_location_idx));
+      if (func) {
+        // Multiple probes can already share a function (e.g. kprobes attached
+        // to all inlined locations of a function).
+        if (seen.insert(func).second)
+          candidates.emplace_back(func, probe.type);
+        break;
+      }
+    }
+  }
+
+  if (candidates.size() < 2)
+    return;
+
+  // Every probe function is placed in its own section which FunctionComparator
+  // takes into account. Drop the sections while comparing and restore them on
+  // the functions which are kept.
+  std::unordered_map<llvm::Function *, std::string> sections;
+  for (auto &[func, _] : candidates) {
+    sections.emplace(func, func->getSection().str());
+    func->setSection("");
+  }
+
+  GlobalNumberState global_numbers;
+  std::map<std::pair<ProbeType, FunctionComparator::FunctionHash>,
+           std::vector<llvm::Function *>>
+      buckets;
+  size_t removed = 0;
+  for (auto &[func, type] : candidates) {
+    auto &bucket = buckets[{ type, FunctionComparator::functionHash(*func) }];
+    auto same = std::find_if(bucket.begin(),
+                             bucket.end(),
+                             [&](llvm::Function *kept) {
+                               return FunctionComparator(kept,
+                                                         func,
+                                                         &global_numbers)
+                                          .compare() == 0;
+                             });
+    if (same == bucket.end()) {
+      bucket.push_back(func);
+      continue;
+    }
+
+    bpftrace_.resources.program_aliases[func->getName().str()] =
+        (*same)->getName().str();
+    sections.erase(func);
+    func->eraseFromParent();
+    removed++;
+  }
+
+  for (auto &[func, section] : sections)
+    func->setSection(section);
+
+  if (removed > 0)
+    LOG(V1) << "Removed " << removed << " duplicate BPF program(s)";
+}
+
 bool CodegenLLVM::verify()
 {
   bool ret = llvm::verifyModule(*module_, &errs());
@@ -4180,6 +5080,104 @@ ScopedExpr CodegenLLVM::probereadDatastructElem(ScopedExpr &&scoped_src,
   }
 }
 
+void CodegenLLVM::visitStatement(Statement &stmt)
+{
+  auto effects = cse_.effects.find(&stmt);
+  if (effects == cse_.effects.end()) {
+    // Not expected, but without knowing what the statement modifies nothing
+    // cached can be trusted afterwards
+    visit(stmt);
+    releaseFusedReads();
+    map_lookup_cache_.clear();
+    return;
+  }
+
+  stmt_effects_.push_back(&effects->second);
+  visit(stmt);
+  stmt_effects_.pop_back();
+  releaseFusedReads();
+
+  const auto &modified = effects->second;
+  std::erase_if(map_lookup_cache_, [&](const auto &entry) {
+    return modified.writes_map(entry.first.first) ||
+           (modified.assigns_vars && entry.second.uses_vars);
+  });
+}
+
+void CodegenLLVM::cacheBuiltins(const std::vector<Builtin *> &builtins)
+{
+  for (auto *builtin : builtins) {
+    auto scoped = visit(*builtin);
+    cached_builtins_[builtin->ident] = scoped.value();
+    cached_builtin_scopes_.push_back(std::move(scoped));
+  }
+}
+
+void CodegenLLVM::clearCSECaches()
+{
+  cached_builtins_.clear();
+  cached_builtin_scopes_.clear();
+  map_lookup_cache_.clear();
+}
+
+// Returns std::nullopt if reads of the map can't be cached right now, either
+// because of the key or because the statements being generated modify it
+std::optional<std::pair<std::string, std::string>> CodegenLLVM::
+    mapLookupCacheKey(Map &map, bool &uses_vars)
+{
+  auto key = map_key_cse_str(map.key_expr, uses_vars);
+  if (!key)
+    return std::nullopt;
+  for (const auto *effects : stmt_effects_) {
+    if (effects->writes_map(map.ident) ||
+        (uses_vars && effects->assigns_vars))
+      return std::nullopt;
+  }
+  return std::make_pair(map.ident, *key);
+}
+
+ScopedExpr CodegenLLVM::readFusedField(ScopedExpr &&scoped_src,
+                                       size_t read_idx,
+                                       const SizedType &data_type,
+                                       const Field &field,
+                                       const location &loc)
+{
+  const auto &read = fused_reads_.reads.at(read_idx);
+  AllocaInst *buf;
+  auto existing = fused_read_bufs_.find(read_idx);
+  if (existing != fused_read_bufs_.end()) {
+    buf = existing->second;
+  } else {
+    // First of the fused accesses generated in this statement, it dominates
+    // the others so do the read for all of them here
+    buf = b_.CreateAllocaBPF(CreateArray(read.size, CreateInt8()),
+                             "fused_read");
+    Value *src = b_.CreateSafeGEP(b_.getInt8Ty(),
+                                  scoped_src.value(),
+                                  b_.getInt64(read.offset));
+    b_.CreateProbeRead(ctx_,
+                       buf,
+                       b_.getInt32(read.size),
+                       src,
+                       data_type.GetAS(),
+                       loc);
+    fused_read_bufs_.emplace(read_idx, buf);
+  }
+
+  Value *elem = b_.CreateGEP(b_.getInt8Ty(),
+                             buf,
+                             b_.getInt64(field.offset - read.offset));
+  return ScopedExpr(b_.CreateDatastructElemLoad(
+      field.type, elem, false, data_type.GetAS()));
+}
+
+void CodegenLLVM::releaseFusedReads()
+{
+  for (auto &[idx, buf] : fused_read_bufs_)
+    b_.CreateLifetimeEnd(buf);
+  fused_read_bufs_.clear();
+}
+
 ScopedExpr CodegenLLVM::createIncDec(Unop &unop)
 {
   bool is_increment = unop.op == Operator::INCREMENT;
@@ -4229,6 +5227,31 @@ ScopedExpr CodegenLLVM::createIncDec(Unop &unop)
   }
 }
 
+Value *CodegenLLVM::createMurmurHash(Value *data, size_t size, uint64_t seed)
+{
+  if (!murmur_hash_2_func_)
+    murmur_hash_2_func_ = createMurmurHash2Func();
+
+  // murmur_hash_2 consumes 8-byte words, so zero-pad the data if needed
+  const uint64_t nr_words = (size + 7) / 8;
+  if (nr_words > std::numeric_limits<uint8_t>::max())
+    LOG(BUG) << "Value of " << size << " bytes is too large to hash";
+  AllocaInst *words = nullptr;
+  if (size % 8 != 0) {
+    words = b_.CreateAllocaBPF(ArrayType::get(b_.getInt64Ty(), nr_words),
+                               "hash_words");
+    b_.CreateMemsetBPF(words, b_.getInt8(0), nr_words * 8);
+    b_.CreateMemcpyBPF(words, data, size);
+    data = words;
+  }
+  Value *hash = b_.CreateCall(murmur_hash_2_func_,
+                              { data, b_.getInt8(nr_words), b_.getInt64(seed) },
+                              "murmur_hash_2");
+  if (words)
+    b_.CreateLifetimeEnd(words);
+  return hash;
+}
+
 llvm::Function *CodegenLLVM::createMurmurHash2Func()
 {
   // The goal is to produce the following code:
@@ -4486,7 +5509,7 @@ llvm::Function *CodegenLLVM::createForEachMapCallback(For &f, llvm::Type *ctx_t)
   Value *val = callback->getArg(2);
 
   const auto &map_val_type = map_info->second.value_type;
-  if (canAggPerCpuMapElems(map_val_type, map_info->second.key_type)) {
+  if (canAggPerCpuMapElems(map_info->second)) {
     val = b_.CreatePerCpuMapAggElems(
         ctx_, map, callback->getArg(1), map_val_type, map.loc);
   } else if (!inBpfMemory(val_type)) {
@@ -4519,8 +5542,16 @@ llvm::Function *CodegenLLVM::createForEachMapCallback(For &f, llvm::Type *ctx_t)
                                                   field.name);
   }
 
-  // Generate code for the loop body
-  visit(f.stmts);
+  // Generate code for the loop body. It is a separate function, so values
+  // cached in the probe can't be used.
+  auto saved_builtins = std::move(cached_builtins_);
+  auto saved_lookups = std::move(map_lookup_cache_);
+  cached_builtins_.clear();
+  map_lookup_cache_.clear();
+  for (Statement *stmt : f.stmts)
+    visitStatement(*stmt);
+  map_lookup_cache_ = std::move(saved_lookups);
+  cached_builtins_ = std::move(saved_builtins);
   b_.CreateRet(b_.getInt64(0));
 
   // Restore original non-context variables
@@ -4535,13 +5566,10 @@ llvm::Function *CodegenLLVM::createForEachMapCallback(For &f, llvm::Type *ctx_t)
   return callback;
 }
 
-bool CodegenLLVM::canAggPerCpuMapElems(const SizedType &val_type,
-                                       const SizedType &key_type)
+bool CodegenLLVM::canAggPerCpuMapElems(const MapInfo &map_info)
 {
-  auto map_type = get_map_type(val_type, key_type);
-  return val_type.IsCastableMapTy() &&
-         (map_type == libbpf::BPF_MAP_TYPE_PERCPU_ARRAY ||
-          map_type == libbpf::BPF_MAP_TYPE_PERCPU_HASH);
+  return map_info.value_type.IsCastableMapTy() &&
+         is_per_cpu_map_type(get_map_type(map_info));
 }
 
 // BPF helpers that use fmt strings (bpf_trace_printk, bpf_seq_printf) expect
@@ -19,6 +19,8 @@
 #include "ast/visitor.h"
 #include "bpftrace.h"
 #include "codegen_resources.h"
+#include "cse.h"
+#include "fused_reads.h"
 #include "format_string.h"
 #include "kfuncs.h"
 #include "location.hh"
@@ -164,6 +166,10 @@ public:
                               const CallArgs &call_args,
                               const std::string &call_name,
                               AsyncAction async_action);
+  Value *createVarLengthArg(Value *dst,
+                            Value *src,
+                            const SizedType &type,
+                            const location &loc);
 
   void createPrintMapCall(Call &call);
   void createPrintNonMapCall(Call &call, int id);
@@ -172,7 +178,14 @@ public:
                            libbpf::bpf_map_type map_type,
                            uint64_t max_entries,
                            const SizedType &key_type,
-                           const SizedType &value_type);
+                           const SizedType &value_type,
+                           uint32_t map_flags = 0);
+  void createMapDefinition(const std::string &name,
+                           libbpf::bpf_map_type map_type,
+                           uint64_t max_entries,
+                           DIType *key_type,
+                           DIType *value_type,
+                           uint32_t map_flags = 0);
   Value *createTuple(
       const SizedType &tuple_type,
       const std::vector<std::pair<llvm::Value *, const location *>> &vals,
@@ -184,11 +197,9 @@ public:
                        Value *src_val);
 
   void generate_ir(void);
-  libbpf::bpf_map_type get_map_type(const SizedType &val_type,
-                                    const SizedType &key_type);
-  bool is_array_map(const SizedType &val_type, const SizedType &key_type);
-  bool map_has_single_elem(const SizedType &val_type,
-                           const SizedType &key_type);
+  libbpf::bpf_map_type get_map_type(const MapInfo &map_info);
+  bool is_array_map(const MapInfo &map_info);
+  bool map_has_single_elem(const MapInfo &map_info);
   void generate_maps(const RequiredResources &rr, const CodegenResources &cr);
   void generate_global_vars(const RequiredResources &resources,
                             const ::bpftrace::Config &bpftrace_config);
@@ -228,6 +239,34 @@ private:
       const std::vector<Value *> &extra_keys,
       const location &loc);
 
+  // Keyless aggregations kept in the scalar aggregation buffer, see
+  // MapInfo::scalar_agg_slot
+  std::optional<uint32_t> scalarAggSlot(const Map &map);
+  void scalarAggAdd(uint32_t slot, Value *val, const location &loc);
+  void scalarAggMinMax(uint32_t slot,
+                       Value *val,
+                       bool is_max,
+                       bool is_signed,
+                       const location &loc);
+
+  // Load a field covered by a fused read, see FusedReadAnalyser
+  ScopedExpr readFusedField(ScopedExpr &&scoped_src,
+                            size_t read_idx,
+                            const SizedType &data_type,
+                            const Field &field,
+                            const location &loc);
+  // Ends the fused reads of the statement just generated
+  void releaseFusedReads();
+
+  // Generates a statement of a block and invalidates what it modified
+  void visitStatement(Statement &stmt);
+  // Evaluates builtins used repeatedly in the probe once, see CSEAnalyser
+  void cacheBuiltins(const std::vector<Builtin *> &builtins);
+  void clearCSECaches();
+  std::optional<std::pair<std::string, std::string>> mapLookupCacheKey(
+      Map &map,
+      bool &uses_vars);
+
   void compareStructure(SizedType &our_type, llvm::Type *llvm_type);
 
   llvm::Function *createLog2Function();
@@ -256,6 +295,7 @@ private:
   // If null, return value will depend on current attach point (void in subprog)
   void createRet(Value *value = nullptr);
   int getReturnValueForProbe(ProbeType probe_type);
+  bool is_sampled(ProbeType probe_type);
 
   // Every time we see a watchpoint that specifies a function + arg pair, we
   // generate a special "setup" probe that:
@@ -272,6 +312,26 @@ private:
                                     int arg_num,
                                     int index);
 
+  // Interval and profile probes which have a timer slot run their body in a
+  // BPF timer callback. The probe program itself only starts the timer and is
+  // run once from userspace (once on each CPU for profile probes) when the
+  // probe is attached.
+  llvm::Function *createTimerCallback(const std::string &probe_func_name);
+  void generateTimerStart(llvm::Function &func,
+                          llvm::Function &callback,
+                          uint32_t timer_slot);
+
+  // Expanded probes (wildcarded tracepoints, USDT locations, ...) get a
+  // separate function each, even if the bodies end up identical. Remove the
+  // duplicates after optimization and record them in
+  // `RequiredResources::program_aliases` so that all the attach points share
+  // a single loaded program.
+  void deduplicate_progs();
+
+  // Splits the BPF programs into `n_parts` modules which are optimized in
+  // parallel and then linked back into module_
+  void optimize_parallel(size_t n_parts);
+
   ScopedExpr readDatastructElemFromStack(ScopedExpr &&scoped_src,
                                          Value *index,
                                          const SizedType &data_type,
@@ -292,11 +352,12 @@ private:
   llvm::Function *createMapLenCallback();
   llvm::Function *createForEachMapCallback(For &f, llvm::Type *ctx_t);
   llvm::Function *createMurmurHash2Func();
+  // Hash `size` bytes at `data` with murmur_hash_2
+  Value *createMurmurHash(Value *data, size_t size, uint64_t seed);
 
   Value *createFmtString(int print_id);
 
-  bool canAggPerCpuMapElems(const SizedType &val_type,
-                            const SizedType &key_type);
+  bool canAggPerCpuMapElems(const MapInfo &map_info);
 
   void maybeAllocVariable(const std::string &var_ident,
                           const SizedType &var_type,
@@ -344,6 +405,25 @@ private:
 
   std::unordered_map<std::string, libbpf::bpf_map_type> map_types_;
 
+  CSEInfo cse_;
+  // Effects of the statements being generated, innermost last
+  std::vector<const StatementEffects *> stmt_effects_;
+  std::unordered_map<std::string, Value *> cached_builtins_;
+  std::vector<ScopedExpr> cached_builtin_scopes_;
+  // Integer map values read in the current probe, by map and key. An entry is
+  // only reused in the basic block it was read in, which it dominates.
+  struct CachedMapLookup {
+    BasicBlock *block;
+    Value *value;
+    bool uses_vars;
+  };
+  std::map<std::pair<std::string, std::string>, CachedMapLookup>
+      map_lookup_cache_;
+
+  FusedReads fused_reads_;
+  // Buffers of the fused reads done so far in the current statement
+  std::unordered_map<size_t, AllocaInst *> fused_read_bufs_;
+
   llvm::Function *linear_func_ = nullptr;
   llvm::Function *log2_func_ = nullptr;
   llvm::Function *murmur_hash_2_func_ = nullptr;
@@ -52,7 +52,7 @@ void ConfigAnalyser::set_config(AssignConfigVarStatement &assignment,
 }
 
 void ConfigAnalyser::set_config(AssignConfigVarStatement &assignment,
-                                [[maybe_unused]] ConfigKeyString key)
+                                ConfigKeyString key)
 {
   auto &assignTy = assignment.expr->type;
   if (!assignTy.IsStringTy()) {
@@ -60,7 +60,14 @@ void ConfigAnalyser::set_config(AssignConfigVarStatement &assignment,
     return;
   }
 
-  config_setter_.set(key, dynamic_cast<String *>(assignment.expr)->str);
+  auto val = dynamic_cast<String *>(assignment.expr)->str;
+  if (key == ConfigKeyString::quantiles) {
+    if (!config_setter_.set_quantiles(val))
+      LOG(ERROR, assignment.expr->loc, err_);
+    return;
+  }
+
+  config_setter_.set(key, val);
 }
 
 void ConfigAnalyser::set_config(AssignConfigVarStatement &assignment,
@@ -118,6 +125,20 @@ void ConfigAnalyser::set_config(AssignConfigVarStatement &assignment,
     LOG(ERROR, assignment.expr->loc, err_);
 }
 
+void ConfigAnalyser::set_config(AssignConfigVarStatement &assignment,
+                                [[maybe_unused]] ConfigKeyStackMapType key)
+{
+  auto &assignTy = assignment.expr->type;
+  if (!assignTy.IsStringTy()) {
+    log_type_error(assignTy, Type::string, assignment);
+    return;
+  }
+
+  auto val = dynamic_cast<String *>(assignment.expr)->str;
+  if (!config_setter_.set_stack_map_type_config(val))
+    LOG(ERROR, assignment.expr->loc, err_);
+}
+
 void ConfigAnalyser::visit(Integer &integer)
 {
   integer.type = CreateInt64();
@@ -50,6 +50,8 @@ private:
   void set_config(AssignConfigVarStatement &assignment, ConfigKeyStackMode key);
   void set_config(AssignConfigVarStatement &assignment,
                   ConfigKeyMissingProbes key);
+  void set_config(AssignConfigVarStatement &assignment,
+                  ConfigKeyStackMapType key);
 
   void log_type_error(SizedType &type,
                       Type expected_type,
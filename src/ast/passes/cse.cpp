@@ -0,0 +1,213 @@
+#include "cse.h"
+
+#include <type_traits>
+
+namespace bpftrace::ast {
+
+namespace {
+
+// Invariant builtins which cost a helper call to evaluate
+const std::unordered_set<std::string> HOISTABLE_BUILTINS = {
+  "pid", "tid", "uid", "gid", "username", "cgroup", "comm", "curtask", "cpu",
+  "numaid"
+};
+
+} // namespace
+
+bool is_invariant_builtin(const std::string &ident)
+{
+  if (HOISTABLE_BUILTINS.contains(ident) || ident == "retval")
+    return true;
+  return ident.size() == 4 && ident.starts_with("arg") && ident[3] >= '0' &&
+         ident[3] <= '9';
+}
+
+std::optional<std::string> map_key_cse_str(const Expression *key_expr,
+                                           bool &uses_vars)
+{
+  if (!key_expr)
+    return "";
+  if (auto *integer = dynamic_cast<const Integer *>(key_expr))
+    return std::to_string(integer->n);
+  if (auto *str = dynamic_cast<const String *>(key_expr))
+    return "\"" + str->str + "\"";
+  if (auto *var = dynamic_cast<const Variable *>(key_expr)) {
+    uses_vars = true;
+    return var->ident;
+  }
+  if (auto *builtin = dynamic_cast<const Builtin *>(key_expr)) {
+    if (is_invariant_builtin(builtin->ident))
+      return builtin->ident;
+    return std::nullopt;
+  }
+  if (auto *tuple = dynamic_cast<const Tuple *>(key_expr)) {
+    std::string str = "(";
+    for (const auto *elem : tuple->elems) {
+      auto elem_str = map_key_cse_str(elem, uses_vars);
+      if (!elem_str)
+        return std::nullopt;
+      str += *elem_str + ",";
+    }
+    return str + ")";
+  }
+  return std::nullopt;
+}
+
+CSEAnalyser::CSEAnalyser(ASTContext &ctx) : Visitor<CSEAnalyser>(ctx)
+{
+}
+
+CSEInfo CSEAnalyser::analyse()
+{
+  for (auto *subprog : ctx_.root->functions)
+    subprogs_.insert(subprog->name());
+  visit(ctx_.root);
+  return std::move(result_);
+}
+
+void CSEAnalyser::visit(Probe &probe)
+{
+  pred_uses_.clear();
+  body_uses_.clear();
+  in_probe_ = true;
+
+  if (probe.pred) {
+    in_pred_ = true;
+    visit(*probe.pred);
+    in_pred_ = false;
+  }
+  visit(*probe.block);
+  in_probe_ = false;
+
+  auto &cse = result_.builtins[&probe];
+  for (auto &[ident, uses] : pred_uses_) {
+    auto body = body_uses_.find(ident);
+    if (uses.size() > 1 || body != body_uses_.end())
+      cse.before_pred.push_back(uses.front());
+  }
+  for (auto &[ident, uses] : body_uses_) {
+    if (uses.size() > 1 && !pred_uses_.contains(ident))
+      cse.before_body.push_back(uses.front());
+  }
+}
+
+void CSEAnalyser::visit(Builtin &builtin)
+{
+  if (!in_probe_ || loop_body_depth_ > 0 ||
+      !HOISTABLE_BUILTINS.contains(builtin.ident))
+    return;
+  if (in_pred_)
+    pred_uses_[builtin.ident].push_back(&builtin);
+  else
+    body_uses_[builtin.ident].push_back(&builtin);
+}
+
+void CSEAnalyser::visit(Call &call)
+{
+  Visitor<CSEAnalyser>::visit(call);
+
+  if (call.map) {
+    // Aggregation functions, e.g. `@x = count()`
+    map_written(call.map->ident);
+  } else if (call.func == "delete" || call.func == "clear" ||
+             call.func == "zero") {
+    if (!call.vargs.empty() && call.vargs.at(0)->is_map)
+      map_written(static_cast<Map *>(call.vargs.at(0))->ident);
+  } else if (subprogs_.contains(call.func)) {
+    if (auto *effects = current_effects())
+      effects->writes_any_map = true;
+  }
+}
+
+void CSEAnalyser::visit(Unop &unop)
+{
+  Visitor<CSEAnalyser>::visit(unop);
+
+  if (unop.op != Operator::INCREMENT && unop.op != Operator::DECREMENT)
+    return;
+  if (unop.expr->is_map) {
+    map_written(static_cast<Map *>(unop.expr)->ident);
+  } else if (unop.expr->is_variable) {
+    if (auto *effects = current_effects())
+      effects->assigns_vars = true;
+  }
+}
+
+void CSEAnalyser::visit(ExprStatement &expr)
+{
+  visit_statement(expr);
+}
+
+void CSEAnalyser::visit(AssignMapStatement &assignment)
+{
+  visit_statement(assignment);
+}
+
+void CSEAnalyser::visit(AssignVarStatement &assignment)
+{
+  visit_statement(assignment);
+}
+
+void CSEAnalyser::visit(VarDeclStatement &decl)
+{
+  visit_statement(decl);
+}
+
+void CSEAnalyser::visit(If &if_node)
+{
+  visit_statement(if_node);
+}
+
+void CSEAnalyser::visit(Jump &jump)
+{
+  visit_statement(jump);
+}
+
+void CSEAnalyser::visit(Unroll &unroll)
+{
+  visit_statement(unroll);
+}
+
+void CSEAnalyser::visit(While &while_block)
+{
+  visit_statement(while_block);
+}
+
+void CSEAnalyser::visit(For &for_loop)
+{
+  loop_body_depth_++;
+  visit_statement(for_loop);
+  loop_body_depth_--;
+}
+
+template <typename T>
+void CSEAnalyser::visit_statement(T &stmt)
+{
+  auto &effects = result_.effects[&stmt];
+  if constexpr (std::is_same_v<T, AssignMapStatement>) {
+    effects.maps_written.insert(stmt.map->ident);
+  } else if constexpr (std::is_same_v<T, AssignVarStatement> ||
+                       std::is_same_v<T, VarDeclStatement>) {
+    effects.assigns_vars = true;
+  }
+
+  effects_stack_.push_back(&effects);
+  Visitor<CSEAnalyser>::visit(stmt);
+  effects_stack_.pop_back();
+
+  // Nested statements affect their parents as well
+  if (!effects_stack_.empty()) {
+    auto *parent = effects_stack_.back();
+    parent->maps_written.insert(effects.maps_written.begin(),
+                                effects.maps_written.end());
+    parent->assigns_vars |= effects.assigns_vars;
+    parent->writes_any_map |= effects.writes_any_map;
+  }
+}
+
+StatementEffects *CSEAnalyser::current_effects()
+{
+  return effects_stack_.empty() ? nullptr : effects_stack_.back();
+}
+
+} // namespace bpftrace::ast
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "ast/visitor.h"
+
+namespace bpftrace::ast {
+
+// Builtins of a probe which are evaluated once up front instead of at every
+// use
+struct ProbeBuiltinCSE {
+  // Used in the predicate and at least once more
+  std::vector<Builtin *> before_pred;
+  // Used at least twice in the probe body
+  std::vector<Builtin *> before_body;
+};
+
+// What a statement, including any statements nested in it, may modify
+struct StatementEffects {
+  std::unordered_set<std::string> maps_written;
+  bool assigns_vars = false;
+  // Calls a subprogram, which may write to any map
+  bool writes_any_map = false;
+
+  bool writes_map(const std::string &ident) const
+  {
+    return writes_any_map || maps_written.contains(ident);
+  }
+};
+
+struct CSEInfo {
+  std::unordered_map<const Probe *, ProbeBuiltinCSE> builtins;
+  std::unordered_map<const Statement *, StatementEffects> effects;
+};
+
+// Returns true for builtins which evaluate to the same value every time
+// within a single run of a probe
+bool is_invariant_builtin(const std::string &ident);
+
+// Returns a string which is equal for two map key expressions only if they
+// evaluate to the same key within a probe, as long as no variable is
+// assigned in between. `uses_vars` is set if the key depends on variables.
+std::optional<std::string> map_key_cse_str(const Expression *key_expr,
+                                           bool &uses_vars);
+
+// Common subexpression elimination analysis pass
+//
+// BPF helper calls are opaque to LLVM, so repeated uses of e.g. `pid` or
+// `comm` in a probe, or repeated reads of `@map[key]`, each result in a
+// helper call. This pass collects what codegen needs to evaluate them once:
+// the builtins which are used repeatedly in each probe and what each
+// statement modifies so that cached map lookups can be invalidated.
+class CSEAnalyser : public Visitor<CSEAnalyser> {
+public:
+  explicit CSEAnalyser(ASTContext &ctx);
+  CSEInfo analyse();
+
+  using Visitor<CSEAnalyser>::visit;
+  void visit(Probe &probe);
+  void visit(Builtin &builtin);
+  void visit(Call &call);
+  void visit(Unop &unop);
+  void visit(ExprStatement &expr);
+  void visit(AssignMapStatement &assignment);
+  void visit(AssignVarStatement &assignment);
+  void visit(VarDeclStatement &decl);
+  void visit(If &if_node);
+  void visit(Jump &jump);
+  void visit(Unroll &unroll);
+  void visit(While &while_block);
+  void visit(For &for_loop);
+
+private:
+  template <typename T>
+  void visit_statement(T &stmt);
+  void map_written(const std::string &ident);
+  StatementEffects *current_effects();
+
+  CSEInfo result_;
+  std::unordered_set<std::string> subprogs_;
+  // Effects of the statement being visited and all statements it is nested in
+  std::vector<StatementEffects *> effects_stack_;
+
+  bool in_probe_ = false;
+  bool in_pred_ = false;
+  // For loop bodies are generated as separate functions and don't share the
+  // builtins evaluated in the probe
+  int loop_body_depth_ = 0;
+  std::unordered_map<std::string, std::vector<Builtin *>> pred_uses_;
+  std::unordered_map<std::string, std::vector<Builtin *>> body_uses_;
+};
+
+} // namespace bpftrace::ast
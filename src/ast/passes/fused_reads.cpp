@@ -0,0 +1,193 @@
+#include "fused_reads.h"
+
+#include <algorithm>
+#include <cctype>
+
+#include "ast/codegen_helper.h"
+#include "bpftrace.h"
+#include "struct.h"
+#include "types.h"
+
+namespace bpftrace::ast {
+
+namespace {
+
+// Builtins which evaluate to the same value every time within a probe
+bool is_stable_builtin(const std::string &ident)
+{
+  if (ident == "curtask" || ident == "retval" || ident == "ctx")
+    return true;
+  return ident.size() > 3 && ident.starts_with("arg") &&
+         std::all_of(ident.begin() + 3, ident.end(), [](char c) {
+           return std::isdigit(c);
+         });
+}
+
+} // namespace
+
+FusedReadAnalyser::FusedReadAnalyser(ASTContext &ctx, BPFtrace &bpftrace)
+    : Visitor<FusedReadAnalyser>(ctx), bpftrace_(bpftrace)
+{
+}
+
+FusedReads FusedReadAnalyser::analyse()
+{
+  visit(ctx_.root);
+  return std::move(result_);
+}
+
+void FusedReadAnalyser::visit(ExprStatement &expr)
+{
+  begin_statement();
+  Visitor<FusedReadAnalyser>::visit(expr);
+  end_statement();
+}
+
+void FusedReadAnalyser::visit(AssignMapStatement &assignment)
+{
+  begin_statement();
+  Visitor<FusedReadAnalyser>::visit(assignment);
+  end_statement();
+}
+
+void FusedReadAnalyser::visit(AssignVarStatement &assignment)
+{
+  // The variable is only assigned after its value has been computed, so
+  // reads through it on the right hand side can still be fused
+  begin_statement();
+  Visitor<FusedReadAnalyser>::visit(assignment);
+  end_statement();
+}
+
+void FusedReadAnalyser::visit(FieldAccess &acc)
+{
+  Visitor<FusedReadAnalyser>::visit(acc);
+
+  if (!in_statement_ || conditional_depth_ > 0)
+    return;
+
+  // Only plain probe reads through a pointer, i.e. `ptr->field`
+  const SizedType &type = acc.expr->type;
+  if (!type.IsRecordTy() || type.IsCtxAccess() || type.is_tparg ||
+      type.is_funcarg || type.is_btftype || inBpfMemory(type))
+    return;
+  auto *deref = dynamic_cast<Unop *>(acc.expr);
+  if (!deref || deref->op != Operator::MUL)
+    return;
+
+  auto key = base_key(*deref->expr);
+  if (!key)
+    return;
+
+  auto record = bpftrace_.structs.Lookup(type.GetName()).lock();
+  if (!record || !record->HasField(acc.field))
+    return;
+  const auto &field = record->GetField(acc.field);
+  if (field.bitfield.has_value() || field.is_data_loc ||
+      !(field.type.IsIntTy() || field.type.IsPtrTy()) || field.offset < 0)
+    return;
+
+  *key += "/" + std::to_string(static_cast<int>(type.GetAS()));
+  candidates_[*key].push_back(Candidate{
+      .acc = &acc,
+      .offset = static_cast<size_t>(field.offset),
+      .size = field.type.GetSize(),
+  });
+}
+
+void FusedReadAnalyser::visit(Binop &binop)
+{
+  // The right hand side of && and || is evaluated conditionally
+  bool conditional = binop.op == Operator::LAND || binop.op == Operator::LOR;
+  if (conditional)
+    conditional_depth_++;
+  Visitor<FusedReadAnalyser>::visit(binop);
+  if (conditional)
+    conditional_depth_--;
+}
+
+void FusedReadAnalyser::visit(Unop &unop)
+{
+  if ((unop.op == Operator::INCREMENT || unop.op == Operator::DECREMENT) &&
+      unop.expr->is_variable)
+    statement_modifies_vars_ = true;
+  Visitor<FusedReadAnalyser>::visit(unop);
+}
+
+void FusedReadAnalyser::visit(Ternary &ternary)
+{
+  conditional_depth_++;
+  Visitor<FusedReadAnalyser>::visit(ternary);
+  conditional_depth_--;
+}
+
+// Identifies a pointer expression which has the same value wherever it
+// appears within a statement
+std::optional<std::string> FusedReadAnalyser::base_key(Expression &expr)
+{
+  if (expr.is_variable)
+    return static_cast<Variable &>(expr).ident;
+  if (auto *builtin = dynamic_cast<Builtin *>(&expr)) {
+    if (is_stable_builtin(builtin->ident))
+      return builtin->ident;
+    return std::nullopt;
+  }
+  if (auto *cast = dynamic_cast<Cast *>(&expr)) {
+    if (auto inner = base_key(*cast->expr))
+      return "(" + typestr(cast->type) + ")" + *inner;
+  }
+  return std::nullopt;
+}
+
+void FusedReadAnalyser::begin_statement()
+{
+  in_statement_ = true;
+  statement_modifies_vars_ = false;
+  conditional_depth_ = 0;
+  candidates_.clear();
+}
+
+void FusedReadAnalyser::end_statement()
+{
+  in_statement_ = false;
+  if (statement_modifies_vars_)
+    return;
+
+  for (auto &[key, accesses] : candidates_) {
+    if (accesses.size() < 2)
+      continue;
+
+    std::sort(accesses.begin(),
+              accesses.end(),
+              [](const Candidate &a, const Candidate &b) {
+                return a.offset < b.offset;
+              });
+
+    // Greedily cover the accesses with reads of up to MAX_FUSED_READ_SIZE
+    // bytes, only keeping the reads which cover more than one access
+    size_t first = 0;
+    while (first < accesses.size()) {
+      size_t start = accesses[first].offset;
+      size_t end = start + accesses[first].size;
+      size_t last = first + 1;
+      while (last < accesses.size() &&
+             accesses[last].offset + accesses[last].size - start <=
+                 MAX_FUSED_READ_SIZE) {
+        end = std::max(end, accesses[last].offset + accesses[last].size);
+        last++;
+      }
+
+      if (last - first > 1) {
+        size_t idx = result_.reads.size();
+        result_.reads.push_back(FusedRead{ .offset = start,
+                                           .size = end - start });
+        for (size_t i = first; i < last; i++)
+          result_.read_idx[accesses[i].acc] = idx;
+      }
+      first = last;
+    }
+  }
+  candidates_.clear();
+}
+
+} // namespace bpftrace::ast
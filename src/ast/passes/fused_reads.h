@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ast/visitor.h"
+
+namespace bpftrace {
+
+class BPFtrace;
+
+namespace ast {
+
+// Fields read through the same pointer within a statement are probe read at
+// once if they are no more than this many bytes apart
+constexpr size_t MAX_FUSED_READ_SIZE = 64;
+
+// A single probe read covering several field accesses. `offset` is relative
+// to the pointer the fields are accessed through.
+struct FusedRead {
+  size_t offset = 0;
+  size_t size = 0;
+};
+
+struct FusedReads {
+  std::vector<FusedRead> reads;
+  // Field accesses which load from one of `reads`, by index
+  std::unordered_map<const FieldAccess *, size_t> read_idx;
+};
+
+// Fused read analysis pass
+//
+// Every access to a field of a struct outside of BPF memory costs a probe
+// read helper call. This pass finds accesses to nearby scalar fields through
+// the same pointer within a statement, e.g.
+//
+//   printf("%d %d\n", $task->pid, $task->tgid);
+//
+// so that codegen can do a single probe read for all of them and load the
+// individual fields from the copy.
+//
+// Only accesses which are unconditionally evaluated by the statement are
+// fused so that whichever is generated first dominates the others.
+class FusedReadAnalyser : public Visitor<FusedReadAnalyser> {
+public:
+  FusedReadAnalyser(ASTContext &ctx, BPFtrace &bpftrace);
+  FusedReads analyse();
+
+  using Visitor<FusedReadAnalyser>::visit;
+  void visit(ExprStatement &expr);
+  void visit(AssignMapStatement &assignment);
+  void visit(AssignVarStatement &assignment);
+  void visit(FieldAccess &acc);
+  void visit(Binop &binop);
+  void visit(Unop &unop);
+  void visit(Ternary &ternary);
+
+private:
+  struct Candidate {
+    const FieldAccess *acc;
+    size_t offset;
+    size_t size;
+  };
+
+  std::optional<std::string> base_key(Expression &expr);
+  void begin_statement();
+  void end_statement();
+
+  BPFtrace &bpftrace_;
+  FusedReads result_;
+
+  bool in_statement_ = false;
+  bool statement_modifies_vars_ = false;
+  int conditional_depth_ = 0;
+  // Candidate accesses of the current statement, by base pointer
+  std::map<std::string, std::vector<Candidate>> candidates_;
+};
+
+} // namespace ast
+} // namespace bpftrace
@@ -442,6 +442,16 @@ void Printer::visit(Subprog &subprog)
   --depth_;
 }
 
+void Printer::visit(MapDecl &decl)
+{
+  std::string indent(depth_, ' ');
+  out_ << indent << "map decl: " << decl.ident << " = " << decl.bpf_type
+       << "(" << decl.max_entries;
+  if (!decl.flag.empty())
+    out_ << ", " << decl.flag;
+  out_ << ")" << std::endl;
+}
+
 void Printer::visit(Program &program)
 {
   if (program.c_definitions.size() > 0)
@@ -455,6 +465,7 @@ void Printer::visit(Program &program)
   --depth_;
 
   ++depth_;
+  visit(program.map_decls);
   visit(program.functions);
   visit(program.probes);
   --depth_;
@@ -50,6 +50,7 @@ public:
   void visit(AttachPoint &ap);
   void visit(Probe &probe);
   void visit(Subprog &subprog);
+  void visit(MapDecl &decl);
   void visit(Program &program);
 
   int depth_ = -1;
@@ -1,18 +1,25 @@
 #include "resource_analyser.h"
 
 #include <algorithm>
+#include <cstdint>
 
 #include "ast/async_event_types.h"
 #include "ast/codegen_helper.h"
+#include "bpffeature.h"
 #include "bpftrace.h"
 #include "globalvars.h"
 #include "log.h"
 #include "struct.h"
+#include "utils.h"
 
 namespace bpftrace::ast {
 
 namespace {
 
+// Strings and buffers up to this size are always sent inline in format string
+// events
+constexpr size_t MIN_VAR_LENGTH_ARG_SIZE = 64;
+
 // This helper differs from SemanticAnalyser::single_provider_type() in that
 // for situations where a single probetype is required we assume the AST is
 // well formed.
@@ -25,6 +32,18 @@ ProbeType single_provider_type_postsema(Probe *probe)
   return ProbeType::invalid;
 }
 
+// Builtins and functions which need the context of the event which triggered
+// the probe or helpers which only tracing programs may call. Timer callbacks
+// have neither.
+bool needs_probe_ctx(const std::string &ident)
+{
+  static const std::unordered_set<std::string> idents = {
+    "ctx", "func",   "kstack", "ustack", "reg",      "signal", "pid",
+    "tid", "uid",    "gid",    "comm",   "username", "cgroup", "override",
+  };
+  return idents.contains(ident);
+}
+
 std::string get_literal_string(Expression &expr)
 {
   String &str = static_cast<String &>(expr);
@@ -47,6 +66,23 @@ std::optional<RequiredResources> ResourceAnalyser::analyse()
 {
   visit(ctx_.root);
 
+  for (auto *decl : ctx_.root->map_decls) {
+    // Declarations of unused maps have already been warned about
+    auto map_info = resources_.maps_info.find(decl->ident);
+    if (map_info == resources_.maps_info.end())
+      continue;
+    map_info->second.decl_args = MapDeclArgs{
+      .bpf_type = *declarable_map_type(decl->bpf_type),
+      .max_entries = static_cast<uint32_t>(decl->max_entries),
+      .flags = decl->flag == "no_prealloc" ? BPF_F_NO_PREALLOC : 0U,
+    };
+  }
+
+  assign_scalar_agg_slots();
+  check_quantiles_map_sizes();
+  for (auto *probe : ctx_.root->probes)
+    assign_timer_slots(*probe);
+
   if (!err_.str().empty()) {
     out_ << err_.str();
     return std::nullopt;
@@ -105,23 +141,40 @@ std::optional<RequiredResources> ResourceAnalyser::analyse()
         bpftrace::globalvars::GlobalVar::MAX_CPU_ID);
   }
 
+  if (resources_.scalar_agg_slots > 0) {
+    resources_.needed_global_vars.insert(
+        bpftrace::globalvars::GlobalVar::SCALAR_AGG_BUFFER);
+    resources_.needed_global_vars.insert(
+        bpftrace::globalvars::GlobalVar::MAX_CPU_ID);
+  }
+
   return std::optional{ std::move(resources_) };
 }
 
 void ResourceAnalyser::visit(Probe &probe)
 {
   probe_ = &probe;
+  auto &loss_probes = resources_.event_loss_probes;
+  if (std::find(loss_probes.begin(), loss_probes.end(), probe.name()) ==
+      loss_probes.end())
+    loss_probes.push_back(probe.name());
+  ctx_use_ = &probe_ctx_use_[&probe];
   Visitor<ResourceAnalyser>::visit(probe);
+  ctx_use_ = nullptr;
 }
 
 void ResourceAnalyser::visit(Subprog &subprog)
 {
   probe_ = nullptr;
+  ctx_use_ = &subprog_ctx_use_[subprog.name()];
   Visitor<ResourceAnalyser>::visit(subprog);
+  ctx_use_ = nullptr;
 }
 
 void ResourceAnalyser::visit(Builtin &builtin)
 {
+  if (ctx_use_ && needs_probe_ctx(builtin.ident))
+    ctx_use_->uses_ctx = true;
   if (uses_usym_table(builtin.ident)) {
     // mark probe as using usym, so that the symbol table can be pre-loaded
     // and symbols resolved even when unavailable at resolution time
@@ -131,7 +184,20 @@ void ResourceAnalyser::visit(Builtin &builtin)
 
 void ResourceAnalyser::visit(Call &call)
 {
+  if (ctx_use_) {
+    if (needs_probe_ctx(call.func))
+      ctx_use_->uses_ctx = true;
+    // Only the calls to subprograms are followed, see uses_probe_ctx()
+    ctx_use_->calls.insert(call.func);
+  }
+  // print(), clear() and zero() of a whole map are handled in userspace and
+  // don't read the map in BPF
+  if ((call.func == "print" || call.func == "clear" || call.func == "zero") &&
+      !call.vargs.empty() && call.vargs.at(0)->is_map) {
+    async_map_arg_ = static_cast<Map *>(call.vargs.at(0));
+  }
   Visitor<ResourceAnalyser>::visit(call);
+  async_map_arg_ = nullptr;
 
   if (call.func == "printf" || call.func == "system" || call.func == "cat" ||
       call.func == "debugf") {
@@ -160,6 +226,43 @@ void ResourceAnalyser::visit(Call &call)
     // Thus, we are good to reuse the padding logic present in tuple
     // creation to generate offsets for each argument in the args "tuple".
     auto tuple = Struct::CreateTuple(args);
+    auto tuple_size = static_cast<uint64_t>(tuple->size);
+
+    // Strings and buffers are usually much shorter than their maximum size.
+    // If the args need a scratch buffer anyway, only their location is kept
+    // in the "tuple" and the data is appended after it, at its actual length.
+    // The location is encoded like a tracepoint __data_loc (see Field).
+    // Small strings are not worth the indirection and stay inline.
+    auto is_var_length = [](const SizedType &ty) {
+      return (ty.IsStringTy() || ty.IsBufferTy()) &&
+             ty.GetSize() > MIN_VAR_LENGTH_ARG_SIZE;
+    };
+    if (exceeds_stack_limit(tuple_size)) {
+      std::vector<SizedType> fixed_args;
+      uint64_t var_size = 0;
+      for (const auto &arg : args) {
+        if (is_var_length(arg)) {
+          fixed_args.push_back(CreateUInt32());
+          var_size += arg.GetSize();
+        } else {
+          fixed_args.push_back(arg);
+        }
+      }
+
+      auto fixed = Struct::CreateTuple(fixed_args);
+      uint64_t compact_size = fixed->size + var_size;
+      if (var_size > 0 && compact_size <= UINT16_MAX &&
+          exceeds_stack_limit(compact_size)) {
+        for (size_t i = 0; i < args.size(); i++) {
+          if (is_var_length(args[i])) {
+            fixed->fields[i].type = args[i];
+            fixed->fields[i].is_data_loc = true;
+          }
+        }
+        tuple = std::move(fixed);
+        tuple_size = compact_size;
+      }
+    }
 
     // Remove implicit printf ID field. Downstream consumers do not
     // expect it nor do they care about it.
@@ -168,7 +271,6 @@ void ResourceAnalyser::visit(Call &call)
     // Keep track of max "tuple" size needed for fmt string args. Codegen
     // will use this information to create a percpu array map of large
     // enough size for all fmt string calls to use.
-    const auto tuple_size = static_cast<uint64_t>(tuple->size);
     if (exceeds_stack_limit(tuple_size)) {
       resources_.max_fmtstring_args_size = std::max(
           resources_.max_fmtstring_args_size,
@@ -198,7 +300,7 @@ void ResourceAnalyser::visit(Call &call)
              call.func == "max" || call.func == "avg") {
     resources_.needed_global_vars.insert(
         bpftrace::globalvars::GlobalVar::NUM_CPUS);
-  } else if (call.func == "hist") {
+  } else if (call.func == "hist" || call.func == "quantiles") {
     auto &map_info = resources_.maps_info[call.map->ident];
     int bits = static_cast<Integer *>(call.vargs.at(1))->n;
 
@@ -208,6 +310,8 @@ void ResourceAnalyser::visit(Call &call)
     } else {
       map_info.hist_bits_arg = bits;
     }
+    if (call.func == "quantiles")
+      quantiles_locs_.emplace(call.map->ident, call.loc);
   } else if (call.func == "lhist") {
     Expression &min_arg = *call.vargs.at(1);
     Expression &max_arg = *call.vargs.at(2);
@@ -275,6 +379,25 @@ void ResourceAnalyser::visit(Call &call)
 
     resources_.skboutput_args_.emplace_back(file.str, offset.n);
     resources_.needs_perf_event_map = true;
+  } else if (call.func == "topk") {
+    auto &map_info = resources_.maps_info[call.map->ident];
+    uint32_t k = static_cast<Integer *>(call.vargs.at(0))->n;
+
+    if (map_info.topk_args.has_value() && map_info.topk_args->k != k) {
+      LOG(ERROR, call.loc, err_) << "Different k in a single topk, had "
+                                 << map_info.topk_args->k << " now " << k;
+    } else if (!map_info.topk_args.has_value()) {
+      map_info.topk_args = TopkArgs{
+        .k = k,
+        .sketch_idx = resources_.topk_sketches++,
+      };
+    }
+  } else if (call.func == "count_distinct") {
+    // New keys are initialized with an empty set of registers
+    if (exceeds_stack_limit(call.map->type.GetSize())) {
+      resources_.max_write_map_value_size = std::max(
+          resources_.max_write_map_value_size, call.map->type.GetSize());
+    }
   } else if (call.func == "delete") {
     auto &arg0 = *call.vargs.at(0);
     auto &map = static_cast<Map &>(arg0);
@@ -314,7 +437,8 @@ void ResourceAnalyser::visit(Call &call)
   //      delete(@, 2)
   //    requires a map key buffer to hold arg1 = 2 but map.key_expr is null
   //    so the map key buffer check in visit(Map &map) doesn't work as is.
-  if (call.func == "lhist" || call.func == "hist") {
+  if (call.func == "lhist" || call.func == "hist" ||
+      call.func == "quantiles") {
     Map &map = *call.map;
     // Allocation is always needed for lhist/hist. But we need to allocate
     // space for both map key and the bucket ID from a call to linear/log2
@@ -366,6 +490,8 @@ void ResourceAnalyser::visit(Map &map)
   Visitor<ResourceAnalyser>::visit(map);
 
   update_map_info(map);
+  if (&map != async_map_arg_)
+    maps_read_in_kernel_.insert(map.ident);
 
   if (exceeds_stack_limit(map.type.GetSize())) {
     resources_.read_map_value_buffers++;
@@ -449,6 +575,92 @@ void ResourceAnalyser::visit(Ternary &ternary)
   }
 }
 
+// Keyless count(), sum(), min() and max() maps which BPF programs only ever
+// update don't need a map at all: each CPU accumulates into its own slot of a
+// global buffer and userspace combines the slots when printing. This saves
+// the map lookup and update helper calls on every update.
+void ResourceAnalyser::check_quantiles_map_sizes()
+{
+  // quantiles() stores one map entry per (key, bucket) and a key can fill up
+  // to 65 << k buckets (2080 with the default k = 5). A map that can't hold
+  // all the buckets of a single key can silently drop updates.
+  for (const auto &[name, loc] : quantiles_locs_) {
+    const auto &map_info = resources_.maps_info.at(name);
+    uint64_t buckets_per_key = 65ULL << map_info.hist_bits_arg.value_or(5);
+    uint64_t max_entries = map_info.decl_args
+                               ? map_info.decl_args->max_entries
+                               : bpftrace_.config_.get(
+                                     ConfigKeyInt::max_map_keys);
+    if (max_entries >= buckets_per_key)
+      continue;
+
+    LOG(WARNING, loc, out_)
+        << "quantiles() map " << name << " can hold " << max_entries
+        << " entries but each key uses up to " << buckets_per_key
+        << " buckets, percentiles may be wrong once it is full. Raise "
+        << (map_info.decl_args ? "the declared map size" : "max_map_keys")
+        << " or lower k.";
+  }
+}
+
+void ResourceAnalyser::assign_scalar_agg_slots()
+{
+  for (auto &[ident, map_info] : resources_.maps_info) {
+    const auto &value_type = map_info.value_type;
+    if (!map_info.key_type.IsNoneTy() || map_info.decl_args ||
+        maps_read_in_kernel_.contains(ident))
+      continue;
+    if (!value_type.IsCountTy() && !value_type.IsSumTy() &&
+        !value_type.IsMinTy() && !value_type.IsMaxTy())
+      continue;
+    map_info.scalar_agg_slot = resources_.scalar_agg_slots++;
+  }
+}
+
+// Interval and profile probes are driven by BPF timers instead of perf events
+// where the kernel supports it. The body then runs in a timer callback,
+// which saves the perf event overhead on every tick. Each timer lives in its
+// own slot of the timers map: one per interval probe and one per CPU for
+// profile probes, which need the timer pinned to the CPU it samples.
+void ResourceAnalyser::assign_timer_slots(Probe &probe)
+{
+  std::unordered_set<std::string> visited;
+  if (uses_probe_ctx(probe_ctx_use_[&probe], visited) ||
+      !bpftrace_.feature_->has_timer())
+    return;
+
+  for (auto *ap : probe.attach_points) {
+    if (ap->freq == 0)
+      continue;
+
+    auto type = probetype(ap->provider);
+    if (type == ProbeType::interval) {
+      ap->timer_slot = resources_.timer_slots++;
+    } else if (type == ProbeType::profile &&
+               bpftrace_.feature_->has_timer_cpu_pin()) {
+      ap->timer_slot = resources_.timer_slots;
+      resources_.timer_slots += get_max_cpu_id() + 1;
+    }
+  }
+}
+
+// Whether a probe or subprogram needs the probe context, either itself or
+// through any of the subprograms it calls
+bool ResourceAnalyser::uses_probe_ctx(const CtxUse &ctx_use,
+                                      std::unordered_set<std::string> &visited)
+{
+  if (ctx_use.uses_ctx)
+    return true;
+  for (const auto &callee : ctx_use.calls) {
+    auto subprog = subprog_ctx_use_.find(callee);
+    if (subprog == subprog_ctx_use_.end() || !visited.insert(callee).second)
+      continue;
+    if (uses_probe_ctx(subprog->second, visited))
+      return true;
+  }
+  return false;
+}
+
 void ResourceAnalyser::update_variable_info(Variable &var)
 {
   // Note we don't check if a variable has been declared/assigned before.
@@ -2,6 +2,8 @@
 
 #include <iostream>
 #include <sstream>
+#include <unordered_map>
+#include <unordered_set>
 
 #include "ast/pass_manager.h"
 #include "ast/visitor.h"
@@ -51,6 +53,18 @@ private:
 
   void update_map_info(Map &map);
   void update_variable_info(Variable &var);
+  void assign_scalar_agg_slots();
+  void check_quantiles_map_sizes();
+  void assign_timer_slots(Probe &probe);
+
+  struct CtxUse {
+    // Uses builtins or functions which need the probe context
+    bool uses_ctx = false;
+    // Names of the functions and subprograms called
+    std::unordered_set<std::string> calls;
+  };
+  bool uses_probe_ctx(const CtxUse &ctx_use,
+                      std::unordered_set<std::string> &visited);
 
   RequiredResources resources_;
   BPFtrace &bpftrace_;
@@ -60,6 +74,17 @@ private:
   Probe *probe_;
 
   int next_map_id_ = 0;
+
+  // Maps which BPF programs read, as opposed to only updating them or
+  // handing them to userspace with print(), clear() or zero()
+  std::unordered_set<std::string> maps_read_in_kernel_;
+  const Map *async_map_arg_ = nullptr;
+  // Where each quantiles() map is first updated, to warn about its size
+  std::unordered_map<std::string, location> quantiles_locs_;
+  // What each probe and subprogram uses that needs the probe context
+  std::unordered_map<const Probe *, CtxUse> probe_ctx_use_;
+  std::unordered_map<std::string, CtxUse> subprog_ctx_use_;
+  CtxUse *ctx_use_ = nullptr;
 };
 
 Pass CreateResourcePass();
@@ -3,6 +3,7 @@
 
 #include <algorithm>
 #include <cstring>
+#include <limits>
 #include <regex>
 #include <string>
 #include <sys/stat.h>
@@ -90,8 +91,11 @@ static bool IsValidVarDeclType(const SizedType &ty)
   switch (ty.GetTy()) {
     case Type::avg_t:
     case Type::count_t:
+    case Type::count_distinct_t:
+    case Type::topk_t:
     case Type::hist_t:
     case Type::lhist_t:
+    case Type::quantiles_t:
     case Type::max_t:
     case Type::min_t:
     case Type::stats_t:
@@ -544,13 +548,13 @@ void SemanticAnalyser::visit(Builtin &builtin)
     if (probe == nullptr)
       return;
     size_t str_size = 0;
+    // No need to preserve these nodes, as we are just expanding to see the
+    // size of the name. This could be refactored into a separate pass.
+    ASTContext dummyctx;
     for (AttachPoint *attach_point : probe->attach_points) {
       auto matches = bpftrace_.probe_matcher_->get_matches_for_ap(
           *attach_point);
       for (const auto &match : matches) {
-        // No need to preserve this node, as we are just expanding to see the
-        // size of the name. This could be refactored into a separate pass.
-        ASTContext dummyctx;
         str_size = std::max(str_size,
                             attach_point->create_expansion_copy(dummyctx, match)
                                 .name()
@@ -691,13 +695,16 @@ void SemanticAnalyser::visit(Call &call)
     }
   }
 
-  if (call.func == "hist") {
+  if (call.func == "hist" || call.func == "quantiles") {
     check_assignment(call, true, false, false);
     if (!check_varargs(call, 1, 2))
       return;
     if (call.vargs.size() == 1) {
-      call.vargs.push_back(ctx_.make_node<Integer>(0, call.loc)); // default
-                                                                  // bits is 0
+      // hist() defaults to power of 2 buckets. quantiles() is a log2
+      // histogram too but defaults to the finest buckets, which bounds the
+      // relative error of its estimates to ~1.5%.
+      int64_t default_bits = call.func == "hist" ? 0 : 5;
+      call.vargs.push_back(ctx_.make_node<Integer>(default_bits, call.loc));
     } else {
       if (!check_arg(call, Type::integer, 1, true))
         return;
@@ -713,7 +720,7 @@ void SemanticAnalyser::visit(Call &call)
     }
     check_arg(call, Type::integer, 0);
 
-    call.type = CreateHist();
+    call.type = call.func == "hist" ? CreateHist() : CreateQuantiles();
   } else if (call.func == "lhist") {
     check_assignment(call, true, false, false);
     if (check_nargs(call, 4)) {
@@ -812,6 +819,69 @@ void SemanticAnalyser::visit(Call &call)
       check_arg(call, Type::integer, 0);
     }
     call.type = CreateStats(true);
+  } else if (call.func == "count_distinct") {
+    check_assignment(call, true, false, false);
+    if (!check_varargs(call, 1, 2))
+      return;
+    if (call.vargs.size() == 1) {
+      call.vargs.push_back(ctx_.make_node<Integer>(
+          COUNT_DISTINCT_DEFAULT_PRECISION, call.loc));
+    } else if (!check_arg(call, Type::integer, 1, true)) {
+      return;
+    }
+    const auto precision = bpftrace_.get_int_literal(call.vargs.at(1));
+    if (!precision.has_value()) {
+      LOG(BUG) << call.func << ": invalid precision value";
+    } else if (*precision < COUNT_DISTINCT_MIN_PRECISION ||
+               *precision > COUNT_DISTINCT_MAX_PRECISION) {
+      LOG(ERROR, call.loc, err_)
+          << call.func << ": precision " << *precision << " must be "
+          << COUNT_DISTINCT_MIN_PRECISION << ".."
+          << COUNT_DISTINCT_MAX_PRECISION;
+      return;
+    }
+
+    // The value is hashed 8 bytes at a time, see createMurmurHash2Func()
+    auto &arg = *call.vargs.at(0);
+    if (!arg.type.IsIntTy() && !arg.type.IsStringTy() &&
+        !arg.type.IsTupleTy()) {
+      if (is_final_pass())
+        LOG(ERROR, call.loc, err_)
+            << call.func << "() only supports int, string and tuple values ("
+            << arg.type << " provided)";
+    } else if (arg.type.GetSize() > COUNT_DISTINCT_MAX_VALUE_SIZE) {
+      LOG(ERROR, call.loc, err_)
+          << call.func << "() value is too large (" << arg.type.GetSize()
+          << " bytes, maximum is " << COUNT_DISTINCT_MAX_VALUE_SIZE << ")";
+    }
+
+    call.type = CreateCountDistinct(1ul << *precision);
+  } else if (call.func == "topk") {
+    check_assignment(call, true, false, false);
+    if (!check_nargs(call, 1) || !check_arg(call, Type::integer, 0, true))
+      return;
+    const auto k = bpftrace_.get_int_literal(call.vargs.at(0));
+    if (!k.has_value()) {
+      LOG(BUG) << call.func << ": invalid k value";
+    } else if (*k < 1 || *k > TOPK_MAX_K) {
+      LOG(ERROR, call.loc, err_)
+          << call.func << ": k " << *k << " must be 1.." << TOPK_MAX_K;
+    }
+    // Keyless maps hold a single value, there is nothing to rank
+    if (call.map && !call.map->key_expr) {
+      LOG(ERROR, call.loc, err_)
+          << call.func << "() must be assigned to a map with a key, e.g. `"
+          << call.map->ident << "[comm] = topk(" << k.value_or(100) << ");`";
+    } else if (call.map) {
+      // The key is hashed 8 bytes at a time, see createMurmurHash2Func()
+      auto *key_type = get_map_key_type(*call.map);
+      if (key_type && key_type->GetSize() > TOPK_MAX_KEY_SIZE) {
+        LOG(ERROR, call.loc, err_)
+            << call.func << "() map key is too large (" << key_type->GetSize()
+            << " bytes, maximum is " << TOPK_MAX_KEY_SIZE << ")";
+      }
+    }
+    call.type = CreateTopk();
   } else if (call.func == "delete") {
     check_assignment(call, false, false, false);
     if (check_varargs(call, 1, 2)) {
@@ -839,7 +909,9 @@ void SemanticAnalyser::visit(Call &call)
           auto *map_key_type = get_map_key_type(map);
           if (map_key_type) {
             auto &arg1 = *call.vargs.at(1);
-            SizedType new_key_type = create_key_type(arg1.type, arg1.loc);
+            SizedType new_key_type = create_map_key_type(map,
+                                                         arg1.type,
+                                                         arg1.loc);
             update_current_key(*map_key_type, new_key_type);
             validate_new_key(*map_key_type, new_key_type, map.ident, arg1.loc);
           }
@@ -868,7 +940,9 @@ void SemanticAnalyser::visit(Call &call)
                    "e.g. `@a = 1;`";
           } else {
             auto &arg1 = *call.vargs.at(1);
-            SizedType new_key_type = create_key_type(arg1.type, arg1.loc);
+            SizedType new_key_type = create_map_key_type(map,
+                                                         arg1.type,
+                                                         arg1.loc);
             update_current_key(*mapkey, new_key_type);
             validate_new_key(*mapkey, new_key_type, map.ident, arg1.loc);
           }
@@ -1740,7 +1814,8 @@ void SemanticAnalyser::validate_map_key(const SizedType &key,
     LOG(ERROR, loc, err_) << "context cannot be used as a map key";
   }
 
-  if (key.IsHistTy() || key.IsLhistTy() || key.IsStatsTy()) {
+  if (key.IsHistTy() || key.IsLhistTy() || key.IsQuantilesTy() ||
+      key.IsCountDistinctTy() || key.IsTopkTy() || key.IsStatsTy()) {
     LOG(ERROR, loc, err_) << key << " cannot be used as a map key";
   }
 
@@ -1751,12 +1826,15 @@ void SemanticAnalyser::validate_map_key(const SizedType &key,
 
 void SemanticAnalyser::visit(Map &map)
 {
+  use_map(map.ident);
   SizedType new_key_type = CreateNone();
   bool key_is_map = false;
   if (map.key_expr) {
     map.key_expr = dereference_if_needed(map.key_expr);
     key_is_map = map.key_expr->is_map;
-    new_key_type = create_key_type(map.key_expr->type, map.key_expr->loc);
+    new_key_type = create_map_key_type(map,
+                                       map.key_expr->type,
+                                       map.key_expr->loc);
   }
 
   if (!map.skip_key_validation) {
@@ -2563,7 +2641,7 @@ void SemanticAnalyser::visit(For &f)
 
   f.decl->type = CreateTuple(bpftrace_.structs.AddTuple({ *mapkey, *mapval }));
 
-  scope_stack_.push_back(&f);
+  push_scope(&f);
 
   variables_[scope_stack_.back()][decl_name] = { .type = f.decl->type,
                                                  .can_resize = true,
@@ -2903,6 +2981,9 @@ static const std::unordered_map<Type, std::string_view> AGGREGATE_HINTS{
   { Type::avg_t, "avg(retval)" },
   { Type::hist_t, "hist(retval)" },
   { Type::lhist_t, "lhist(rand %10, 0, 10, 1)" },
+  { Type::quantiles_t, "quantiles(retval)" },
+  { Type::count_distinct_t, "count_distinct(pid)" },
+  { Type::topk_t, "topk(100)" },
   { Type::stats_t, "stats(arg2)" },
 };
 
@@ -3523,7 +3604,7 @@ void SemanticAnalyser::visit(AttachPoint &ap)
 
 void SemanticAnalyser::visit(Block &block)
 {
-  scope_stack_.push_back(&block);
+  push_scope(&block);
   accept_statements(block.stmts);
   scope_stack_.pop_back();
 }
@@ -3551,8 +3632,8 @@ void SemanticAnalyser::visit(Config &config)
 
 void SemanticAnalyser::visit(Subprog &subprog)
 {
-  scope_stack_.push_back(&subprog);
   top_level_node_ = &subprog;
+  push_scope(&subprog);
   for (SubprogArg *arg : subprog.args) {
     variables_[scope_stack_.back()].insert(
         { arg->name(),
@@ -3562,6 +3643,106 @@ void SemanticAnalyser::visit(Subprog &subprog)
   scope_stack_.pop_back();
 }
 
+void SemanticAnalyser::visit(MapDecl &decl)
+{
+  if (!is_first_pass())
+    return;
+
+  if (map_decls_.contains(decl.ident)) {
+    LOG(ERROR, decl.loc, err_)
+        << "Map " << decl.ident << " is already declared";
+    return;
+  }
+  map_decls_[decl.ident] = &decl;
+
+  auto bpf_type = declarable_map_type(decl.bpf_type);
+  if (!bpf_type) {
+    LOG(ERROR, decl.loc, err_) << "Invalid map type: " << decl.bpf_type;
+    LOG(HINT, err_) << "Valid map types: " << declarable_map_types_str();
+    return;
+  }
+
+  if (decl.max_entries <= 0 ||
+      decl.max_entries > std::numeric_limits<uint32_t>::max()) {
+    LOG(ERROR, decl.loc, err_)
+        << "Invalid size for " << decl.ident << ": " << decl.max_entries
+        << ". Map size must be between 1 and "
+        << std::numeric_limits<uint32_t>::max();
+  }
+
+  if (!decl.flag.empty()) {
+    if (decl.flag != "no_prealloc") {
+      LOG(ERROR, decl.loc, err_) << "Invalid map flag: " << decl.flag;
+      LOG(HINT, err_) << "Valid map flags: no_prealloc";
+    } else if (*bpf_type != libbpf::BPF_MAP_TYPE_HASH &&
+               *bpf_type != libbpf::BPF_MAP_TYPE_PERCPU_HASH) {
+      LOG(ERROR, decl.loc, err_)
+          << "no_prealloc is only supported by the hash and percpu_hash map "
+             "types";
+    }
+  }
+}
+
+void SemanticAnalyser::visit(Program &program)
+{
+  visit(program.map_decls);
+  for (auto *subprog : program.functions)
+    visit_top_level(*subprog);
+  for (auto *probe : program.probes)
+    visit_top_level(*probe);
+  visit(program.config);
+
+  if (is_final_pass()) {
+    for (auto *decl : program.map_decls)
+      validate_map_decl(*decl);
+  }
+}
+
+// Check that a declared map type can hold the values the map is used with
+void SemanticAnalyser::validate_map_decl(const MapDecl &decl)
+{
+  auto bpf_type = declarable_map_type(decl.bpf_type);
+  if (!bpf_type)
+    return;
+
+  auto val = map_val_.find(decl.ident);
+  if (val == map_val_.end()) {
+    LOG(WARNING, decl.loc, out_)
+        << "Map " << decl.ident << " is declared but never used";
+    return;
+  }
+  const auto &value_type = val->second;
+
+  if (value_type.IsTopkTy()) {
+    LOG(ERROR, decl.loc, err_)
+        << "Map " << decl.ident
+        << " holds topk() results and can not be declared, topk() maps are "
+           "always lru_percpu_hash maps";
+    return;
+  }
+
+  if (is_array_map_type(*bpf_type) &&
+      (value_type.IsHistTy() || value_type.IsLhistTy() ||
+       value_type.IsQuantilesTy())) {
+    LOG(ERROR, decl.loc, err_)
+        << "Map " << decl.ident << " holds '" << value_type
+        << "' values which need a hash map type";
+    return;
+  }
+
+  if (value_type.NeedsPercpuMap() && !is_per_cpu_map_type(*bpf_type)) {
+    LOG(ERROR, decl.loc, err_)
+        << "Map " << decl.ident << " holds '" << value_type
+        << "' values which need a per-CPU map type (percpu_hash, "
+           "lru_percpu_hash or percpu_array)";
+  } else if (!value_type.NeedsPercpuMap() && is_per_cpu_map_type(*bpf_type)) {
+    LOG(ERROR, decl.loc, err_)
+        << "Map " << decl.ident << " holds '" << value_type
+        << "' values which need a map type without per-CPU values (hash, "
+           "lru_hash or array)";
+  }
+}
+
 int SemanticAnalyser::analyse()
 {
   std::string errors;
@@ -3583,6 +3764,7 @@ int SemanticAnalyser::analyse()
       return 0;
     }
 
+    update_worklist();
     int num_unresolved = pass_tracker_.get_num_unresolved();
 
     if (num_unresolved > 0 &&
@@ -3597,6 +3779,90 @@ int SemanticAnalyser::analyse()
   }
 }
 
+// Visits a probe or subprog, unless nothing it depends on has changed since
+// it was last visited. The first and final passes always visit everything.
+template <typename T>
+void SemanticAnalyser::visit_top_level(T &node)
+{
+  if (!is_first_pass() && !is_final_pass() && !worklist_.contains(&node))
+    return;
+
+  auto &state = top_level_state_[&node];
+  auto vars_before = variables_snapshot(state);
+  int num_unresolved = pass_tracker_.get_num_unresolved();
+  state.visited_at = ++clock_;
+
+  visit(node);
+
+  state.unstable = pass_tracker_.get_num_unresolved() > num_unresolved ||
+                   variables_snapshot(state) != vars_before;
+
+  for (const auto &ident : state.maps) {
+    auto val = map_val_.find(ident);
+    auto key = map_key_.find(ident);
+    const auto &val_type = val != map_val_.end() ? val->second : CreateNone();
+    const auto &key_type = key != map_key_.end() ? key->second : CreateNone();
+
+    auto &map_state = map_state_[ident];
+    if (map_state.val == val_type && map_state.key == key_type &&
+        map_state.val.is_internal == val_type.is_internal)
+      continue;
+    map_state.val = val_type;
+    map_state.key = key_type;
+    map_state.changed_at = ++clock_;
+    map_state.changed_by = &node;
+  }
+}
+
+// Collects the probes and subprogs to visit in the next pass: those which
+// are still unresolved or use a map whose type was changed by someone else
+// after they were visited
+void SemanticAnalyser::update_worklist()
+{
+  worklist_.clear();
+  for (const auto &[node, state] : top_level_state_) {
+    if (state.unstable) {
+      worklist_.insert(node);
+      continue;
+    }
+    for (const auto &ident : state.maps) {
+      const auto &map_state = map_state_[ident];
+      if (map_state.changed_at > state.visited_at &&
+          map_state.changed_by != node) {
+        worklist_.insert(node);
+        break;
+      }
+    }
+  }
+}
+
+void SemanticAnalyser::push_scope(Node *scope)
+{
+  scope_stack_.push_back(scope);
+  if (top_level_node_)
+    top_level_state_[top_level_node_].scopes.insert(scope);
+}
+
+void SemanticAnalyser::use_map(const std::string &ident)
+{
+  if (top_level_node_)
+    top_level_state_[top_level_node_].maps.insert(ident);
+}
+
+std::vector<std::pair<SizedType, bool>> SemanticAnalyser::variables_snapshot(
+    const TopLevelState &state)
+{
+  std::vector<std::pair<SizedType, bool>> snapshot;
+  for (auto *scope : state.scopes) {
+    auto vars = variables_.find(scope);
+    if (vars == variables_.end())
+      continue;
+    for (const auto &[ident, var] : vars->second)
+      snapshot.emplace_back(var.type, var.was_assigned);
+  }
+  return snapshot;
+}
+
 inline bool SemanticAnalyser::is_final_pass() const
 {
   return pass_tracker_.is_final_pass();
@@ -3957,6 +4223,28 @@ SizedType SemanticAnalyser::create_key_type(const SizedType &expr_type,
   return new_key_type;
 }
 
+SizedType SemanticAnalyser::create_map_key_type(const Map &map,
+                                                const SizedType &expr_type,
+                                                const location &loc)
+{
+  SizedType new_key_type = create_key_type(expr_type, loc);
+
+  // Array maps are indexed by 32-bit integers
+  if (auto decl = map_decls_.find(map.ident); decl != map_decls_.end()) {
+    auto bpf_type = declarable_map_type(decl->second->bpf_type);
+    if (bpf_type && is_array_map_type(*bpf_type)) {
+      if (new_key_type.IsIntegerTy()) {
+        new_key_type = CreateUInt32();
+      } else {
+        LOG(ERROR, loc, err_)
+            << map.ident << " is declared as " << decl->second->bpf_type
+            << " and can only be indexed by integers, not " << new_key_type;
+      }
+    }
+  }
+  return new_key_type;
+}
+
 void SemanticAnalyser::update_current_key(SizedType &current_key_type,
                                           const SizedType &new_key_type)
 {
@@ -1,7 +1,9 @@
 #pragma once
 
 #include <iostream>
+#include <set>
 #include <sstream>
+#include <unordered_map>
 #include <unordered_set>
 
 #include "ast/pass_manager.h"
@@ -121,6 +123,8 @@ public:
   void visit(Config &config);
   void visit(Block &block);
   void visit(Subprog &subprog);
+  void visit(MapDecl &decl);
+  void visit(Program &program);
 
   int analyse();
 
@@ -134,6 +138,40 @@ private:
   bool is_final_pass() const;
   bool is_first_pass() const;
 
+  // Incremental analysis
+  //
+  // Passes between the first and the final one only visit the probes and
+  // subprogs whose analysis may still change, see update_worklist()
+  struct TopLevelState {
+    // Value of clock_ when last visited
+    uint64_t visited_at = 0;
+    // Had unresolved types or changed the types of its variables when last
+    // visited
+    bool unstable = false;
+    std::unordered_set<std::string> maps;
+    std::set<Node *> scopes;
+  };
+  struct MapState {
+    SizedType val;
+    SizedType key;
+    // Value of clock_ and the probe or subprog of the last type change
+    uint64_t changed_at = 0;
+    Node *changed_by = nullptr;
+  };
+
+  template <typename T>
+  void visit_top_level(T &node);
+  void update_worklist();
+  void push_scope(Node *scope);
+  void use_map(const std::string &ident);
+  std::vector<std::pair<SizedType, bool>> variables_snapshot(
+      const TopLevelState &state);
+
+  std::unordered_map<Node *, TopLevelState> top_level_state_;
+  std::map<std::string, MapState> map_state_;
+  std::unordered_set<Node *> worklist_;
+  uint64_t clock_ = 0;
+
   bool check_assignment(const Call &call,
                         bool want_map,
                         bool want_var,
@@ -159,6 +197,10 @@ private:
   SizedType *get_map_key_type(const Map &map);
   void assign_map_type(const Map &map, const SizedType &type);
   SizedType create_key_type(const SizedType &expr_type, const location &loc);
+  SizedType create_map_key_type(const Map &map,
+                                const SizedType &expr_type,
+                                const location &loc);
+  void validate_map_decl(const MapDecl &decl);
   void update_current_key(SizedType &current_key_type,
                           const SizedType &new_key_type);
   void validate_new_key(const SizedType &current_key_type,
@@ -206,6 +248,7 @@ private:
   std::map<Node *, CollectNodes<Variable>> for_vars_referenced_;
   std::map<std::string, SizedType> map_val_;
   std::map<std::string, SizedType> map_key_;
+  std::map<std::string, MapDecl *> map_decls_;
 
   uint32_t loop_depth_ = 0;
   bool has_begin_probe_ = false;
@@ -206,8 +206,13 @@ public:
     visitImpl(subprog.stmts);
     return default_value();
   }
+  R visit(MapDecl &decl __attribute__((__unused__)))
+  {
+    return default_value();
+  }
   R visit(Program &program)
   {
+    visitImpl(program.map_decls);
     visitImpl(program.functions);
     visitImpl(program.probes);
     visitAndReplace(&program.config);
@@ -11,6 +11,7 @@
 #include <linux/hw_breakpoint.h>
 #include <linux/limits.h>
 #include <linux/perf_event.h>
+#include <sched.h>
 #include <sys/ioctl.h>
 #include <sys/syscall.h>
 #include <sys/utsname.h>
@@ -218,6 +219,8 @@ AttachedProbe::AttachedProbe(Probe &probe,
 
 AttachedProbe::~AttachedProbe()
 {
+  detach_timer();
+
   int err = 0;
   for (int perf_event_fd : perf_event_fds_) {
     err = bpf_close_perf_event_fd(perf_event_fd);
@@ -1002,6 +1005,11 @@ void AttachedProbe::attach_tracepoint()
 
 void AttachedProbe::attach_profile()
 {
+  if (probe_.timer_slot) {
+    attach_timer();
+    return;
+  }
+
   int pid = -1;
   int group_fd = -1;
 
@@ -1041,8 +1049,69 @@ void AttachedProbe::attach_profile()
   }
 }
 
+// Timer driven probes are started by running their program, which arms a
+// BPF timer on the CPU it runs on. Profile probes need a timer on every CPU,
+// so their program is run once on each of them.
+void AttachedProbe::attach_timer()
+{
+  auto run_prog = [this](uint32_t key) {
+    BPFTRACE_LIBBPF_OPTS(bpf_test_run_opts, opts);
+    if (::bpf_prog_test_run_opts(progfd_, &opts) != 0 || opts.retval != 0)
+      throw FatalUserException("Error starting timer for probe: " +
+                               probe_.name);
+    timer_keys_.push_back(key);
+  };
+
+  if (probe_.type == ProbeType::interval) {
+    run_prog(*probe_.timer_slot);
+    return;
+  }
+
+  cpu_set_t saved_cpus;
+  if (sched_getaffinity(0, sizeof(saved_cpus), &saved_cpus) != 0)
+    throw FatalUserException("Error attaching probe: " + probe_.name +
+                             ": failed to get CPU affinity");
+
+  try {
+    for (int cpu : get_online_cpus()) {
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(cpu, &cpus);
+      if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0)
+        throw FatalUserException("Error attaching probe: " + probe_.name +
+                                 ": failed to run on CPU " +
+                                 std::to_string(cpu));
+      run_prog(*probe_.timer_slot + cpu);
+    }
+  } catch (const FatalUserException &) {
+    sched_setaffinity(0, sizeof(saved_cpus), &saved_cpus);
+    throw;
+  }
+  sched_setaffinity(0, sizeof(saved_cpus), &saved_cpus);
+}
+
+// Deleting an element of an array map isn't possible but overwriting it
+// cancels and frees the timer in it
+void AttachedProbe::detach_timer()
+{
+  if (timer_keys_.empty())
+    return;
+
+  int map_fd = bpftrace_.bytecode_.getMap(MapType::Timers).fd();
+  uint8_t zero[16] = {};
+  for (uint32_t key : timer_keys_) {
+    if (bpf_map_update_elem(map_fd, &key, zero, BPF_ANY) != 0)
+      LOG(WARNING) << "failed to stop timer for probe: " << probe_.name;
+  }
+}
+
 void AttachedProbe::attach_interval()
 {
+  if (probe_.timer_slot) {
+    attach_timer();
+    return;
+  }
+
   int pid = -1;
   int group_fd = -1;
   int cpu = 0;
@@ -63,6 +63,8 @@ private:
   void attach_tracepoint();
   void attach_profile();
   void attach_interval();
+  void attach_timer();
+  void detach_timer();
   void attach_software();
   void attach_hardware();
   void attach_watchpoint(int pid, const std::string &mode);
@@ -79,6 +81,8 @@ private:
 
   Probe &probe_;
   std::vector<int> perf_event_fds_;
+  // Slots of the timers map started by attach_timer()
+  std::vector<uint32_t> timer_keys_;
   bool close_progfd_ = true;
   int progfd_ = -1;
   uint64_t offset_ = 0;
@@ -3,6 +3,7 @@
 #include "bpftrace.h"
 #include "globalvars.h"
 #include "log.h"
+#include "timing_trace.h"
 #include "utils.h"
 
 #include <bpf/bpf.h>
@@ -81,12 +82,20 @@ const BpfProgram &BpfBytecode::getProgramForProbe(const Probe &probe) const
                                      probe.usdt_location_idx)
                                : std::nullopt;
 
-  auto prog = programs_.find(
+  // Identical programs were merged during codegen, follow the alias to the
+  // program which was kept.
+  auto find_program = [this](const std::string &name) {
+    auto alias = program_aliases_.find(name);
+    return programs_.find(alias != program_aliases_.end() ? alias->second
+                                                          : name);
+  };
+
+  auto prog = find_program(
       get_function_name_for_probe(probe.name, probe.index, usdt_location_idx));
   if (prog == programs_.end()) {
-    prog = programs_.find(get_function_name_for_probe(probe.orig_name,
-                                                      probe.index,
-                                                      usdt_location_idx));
+    prog = find_program(get_function_name_for_probe(probe.orig_name,
+                                                    probe.index,
+                                                    usdt_location_idx));
   }
 
   if (prog == programs_.end()) {
@@ -108,6 +117,12 @@ BpfProgram &BpfBytecode::getProgramForProbe(const Probe &probe)
       const_cast<const BpfBytecode *>(this)->getProgramForProbe(probe));
 }
 
+void BpfBytecode::set_program_aliases(
+    const std::map<std::string, std::string> &aliases)
+{
+  program_aliases_ = aliases;
+}
+
 void BpfBytecode::update_global_vars(BPFtrace &bpftrace)
 {
   globalvars::update_global_vars(bpf_object_.get(),
@@ -191,7 +206,15 @@ void BpfBytecode::load_progs(const RequiredResources &resources,
   prepare_progs(resources.probes, btf, feature, config);
   prepare_progs(resources.watchpoint_probes, btf, feature, config);
 
-  int res = bpf_object__load(bpf_object_.get());
+  // libbpf loads all programs in one go, so the time spent in the verifier
+  // can't be attributed to individual programs
+  int res;
+  {
+    timing::Phase phase("load " + std::to_string(programs_.size()) +
+                            " programs",
+                        "load");
+    res = bpf_object__load(bpf_object_.get());
+  }
 
   // If requested, print the entire verifier logs, even if loading succeeded.
   for (const auto &[name, prog] : programs_) {
@@ -202,8 +225,11 @@ void BpfBytecode::load_progs(const RequiredResources &resources,
     }
   }
 
-  if (res == 0)
+  if (res == 0) {
+    if (bt_verbose)
+      log_insn_counts();
     return;
+  }
 
   // If loading of bpf_object failed, we try to give user some hints of what
   // could've gone wrong.
@@ -276,6 +302,27 @@ void BpfBytecode::prepare_progs(const std::vector<Probe> &probes,
   }
 }
 
+void BpfBytecode::log_insn_counts() const
+{
+  size_t loaded = 0;
+  uint64_t insns = 0;
+  uint64_t verified_insns = 0;
+  for (const auto &[name, prog] : programs_) {
+    // Programs which are not autoloaded have no fd
+    struct bpf_prog_info info = {};
+    uint32_t info_len = sizeof(info);
+    if (prog.fd() < 0 ||
+        bpf_obj_get_info_by_fd(prog.fd(), &info, &info_len) != 0)
+      continue;
+    loaded++;
+    insns += info.xlated_prog_len / sizeof(struct bpf_insn);
+    verified_insns += info.verified_insns;
+  }
+  LOG(V1) << "Loaded " << loaded << " BPF programs with " << insns
+          << " instructions, " << verified_insns
+          << " instructions processed by the verifier";
+}
+
 bool BpfBytecode::all_progs_loaded()
 {
   for (const auto &prog : programs_) {
@@ -335,6 +382,25 @@ int BpfBytecode::countStackMaps() const
 
 void BpfBytecode::set_map_ids(RequiredResources &resources)
 {
+  // Maps kept in the scalar aggregation buffer have no BPF map but are
+  // printed, cleared and zeroed like a single element per-CPU array map
+  for (const auto &[name, info] : resources.maps_info) {
+    if (!info.scalar_agg_slot.has_value() || maps_.contains(name))
+      continue;
+    const auto &bpf_name = scalar_agg_map_names_.emplace_back(
+        bpf_map_name(name));
+    uint32_t value_size = info.value_type.IsMinTy() ||
+                                  info.value_type.IsMaxTy()
+                              ? globalvars::SCALAR_AGG_SLOT_SIZE
+                              : info.value_type.GetSize();
+    maps_.emplace(name,
+                  BpfMap(libbpf::BPF_MAP_TYPE_PERCPU_ARRAY,
+                         bpf_name,
+                         sizeof(uint32_t),
+                         value_size,
+                         1));
+  }
+
   for (auto &map : maps_) {
     auto map_info = resources.maps_info.find(map.first);
     if (map_info != resources.maps_info.end() && map_info->second.id != -1)
@@ -342,4 +408,21 @@ void BpfBytecode::set_map_ids(RequiredResources &resources)
   }
 }
 
+std::span<uint8_t> BpfBytecode::scalar_agg_buffer() const
+{
+  auto section = section_names_to_global_vars_map_.find(
+      std::string(globalvars::SCALAR_AGG_BUFFER_SECTION_NAME));
+  if (section == section_names_to_global_vars_map_.end())
+    return {};
+
+  // libbpf mmaps global variable sections on load, after which the initial
+  // value is the memory shared with the programs
+  size_t size = 0;
+  auto *data = static_cast<uint8_t *>(
+      bpf_map__initial_value(section->second, &size));
+  if (!data)
+    return {};
+  return { data, size };
+}
+
 } // namespace bpftrace
@@ -9,6 +9,7 @@
 
 #include <bpf/libbpf.h>
 #include <cereal/access.hpp>
+#include <list>
 #include <map>
 #include <span>
 #include <string>
@@ -33,6 +34,7 @@ public:
   BpfBytecode(BpfBytecode &&) = default;
   BpfBytecode &operator=(BpfBytecode &&) = default;
 
+  void set_program_aliases(const std::map<std::string, std::string> &aliases);
   void update_global_vars(BPFtrace &bpftrace);
   void load_progs(const RequiredResources &resources,
                   const BTF &btf,
@@ -52,12 +54,18 @@ public:
   const std::map<std::string, BpfMap> &maps() const;
   int countStackMaps() const;
 
+  // Per-CPU rows of the scalar aggregation buffer. Once the programs are
+  // loaded, this is the memory the BPF programs update.
+  std::span<uint8_t> scalar_agg_buffer() const;
+
 private:
   void prepare_progs(const std::vector<Probe> &probes,
                      const BTF &btf,
                      BPFfeature &feature,
                      const Config &config);
   bool all_progs_loaded();
+  // Reports the size of the loaded programs, see --opt
+  void log_insn_counts() const;
 
   // We need a custom deleter for bpf_object which will call bpf_object__close.
   // Note that it is not possible to run bpf_object__close in ~BpfBytecode
@@ -71,8 +79,12 @@ private:
   std::unique_ptr<struct bpf_object, bpf_object_deleter> bpf_object_;
 
   std::map<std::string, BpfMap> maps_;
+  // BPF names of the maps standing in for scalar aggregation buffer slots
+  std::list<std::string> scalar_agg_map_names_;
   std::map<int, BpfMap *> maps_by_id_;
   std::map<std::string, BpfProgram> programs_;
+  // Name of a program removed as a duplicate -> name of the program it shares
+  std::map<std::string, std::string> program_aliases_;
   std::unordered_map<std::string, struct bpf_map *>
       section_names_to_global_vars_map_;
 };
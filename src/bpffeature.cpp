@@ -6,8 +6,12 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <fcntl.h>
 #include <fstream>
+#include <iomanip>
+#include <linux/version.h>
+#include <sstream>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -15,9 +19,11 @@
 #include "btf.h"
 #include "debugfs.h"
 #include "dwarf_parser.h"
+#include "log.h"
 #include "probe_matcher.h"
 #include "tracefs.h"
 #include "utils.h"
+#include "version.h"
 
 namespace bpftrace {
 
@@ -28,6 +34,8 @@ int BPFnofeature::parse(const char* str)
       kprobe_multi_ = true;
     } else if (feat == "uprobe_multi") {
       uprobe_multi_ = true;
+    } else if (feat == "timer") {
+      timer_ = true;
     } else {
       return -1;
     }
@@ -35,6 +43,217 @@ int BPFnofeature::parse(const char* str)
   return 0;
 }
 
+// Returns the GNU build id of the running kernel, read from the ELF notes
+// exported in /sys/kernel/notes
+static std::optional<std::string> kernel_build_id()
+{
+  std::ifstream file("/sys/kernel/notes", std::ios::binary);
+  if (file.fail())
+    return std::nullopt;
+  std::string notes((std::istreambuf_iterator<char>(file)),
+                    std::istreambuf_iterator<char>());
+
+  constexpr uint32_t NT_GNU_BUILD_ID = 3;
+  auto align4 = [](size_t n) { return (n + 3) & ~size_t(3); };
+  size_t pos = 0;
+  while (pos + 3 * sizeof(uint32_t) <= notes.size()) {
+    uint32_t hdr[3];
+    memcpy(hdr, notes.data() + pos, sizeof(hdr));
+    auto [namesz, descsz, type] = hdr;
+    size_t name_pos = pos + sizeof(hdr);
+    size_t desc_pos = name_pos + align4(namesz);
+    if (desc_pos + descsz > notes.size())
+      break;
+
+    if (type == NT_GNU_BUILD_ID && namesz == 4 &&
+        notes.compare(name_pos, 4, std::string_view("GNU\0", 4)) == 0) {
+      std::ostringstream id;
+      for (size_t i = 0; i < descsz; i++)
+        id << std::hex << std::setw(2) << std::setfill('0')
+           << static_cast<unsigned>(
+                  static_cast<unsigned char>(notes[desc_pos + i]));
+      return id.str();
+    }
+    pos = desc_pos + align4(descsz);
+  }
+  return std::nullopt;
+}
+
+static std::optional<std::string> boot_id()
+{
+  std::ifstream file("/proc/sys/kernel/random/boot_id");
+  std::string id;
+  if (file.fail() || !std::getline(file, id) || id.empty())
+    return std::nullopt;
+  return id;
+}
+
+BPFfeature::~BPFfeature()
+{
+  save_cache();
+}
+
+// Calls visitor(name, result) for every feature probe result which can be
+// cached. Results depending on things other than the kernel (e.g. the BTF
+// or the debuginfo available to bpftrace) are not included.
+template <typename F>
+void BPFfeature::visit_results(F&& visitor)
+{
+#define VISIT(name, member) visitor(std::string_view(name), member)
+  VISIT("insns_limit", insns_limit_);
+  VISIT("btf_func_global", has_btf_func_global_);
+  VISIT("map_batch", has_map_batch_);
+  VISIT("d_path", has_d_path_);
+  VISIT("uprobe_refcnt", has_uprobe_refcnt_);
+  VISIT("kprobe_multi", has_kprobe_multi_);
+  VISIT("uprobe_multi", has_uprobe_multi_);
+  VISIT("skb_output", has_skb_output_);
+  VISIT("prog_fentry", has_prog_fentry_);
+  VISIT("module_btf", has_module_btf_);
+  VISIT("timer_cpu_pin", has_timer_cpu_pin_);
+
+  VISIT("map_array", map_array_);
+  VISIT("map_hash", map_hash_);
+  VISIT("map_percpu_array", map_percpu_array_);
+  VISIT("map_stack_trace", map_stack_trace_);
+  VISIT("map_perf_event_array", map_perf_event_array_);
+  VISIT("map_ringbuf", map_ringbuf_);
+
+  VISIT("helper_send_signal", has_send_signal_);
+  VISIT("helper_override_return", has_override_return_);
+  VISIT("helper_get_current_cgroup_id", has_get_current_cgroup_id_);
+  VISIT("helper_probe_read", has_probe_read_);
+  VISIT("helper_probe_read_str", has_probe_read_str_);
+  VISIT("helper_probe_read_user", has_probe_read_user_);
+  VISIT("helper_probe_read_kernel", has_probe_read_kernel_);
+  VISIT("helper_probe_read_user_str", has_probe_read_user_str_);
+  VISIT("helper_probe_read_kernel_str", has_probe_read_kernel_str_);
+  VISIT("helper_ktime_get_boot_ns", has_ktime_get_boot_ns_);
+  VISIT("helper_ktime_get_tai_ns", has_ktime_get_tai_ns_);
+  VISIT("helper_get_func_ip", has_get_func_ip_);
+  VISIT("helper_jiffies64", has_jiffies64_);
+  VISIT("helper_for_each_map_elem", has_for_each_map_elem_);
+  VISIT("helper_get_ns_current_pid_tgid", has_get_ns_current_pid_tgid_);
+  VISIT("helper_map_lookup_percpu_elem", has_map_lookup_percpu_elem_);
+  VISIT("helper_timer_start", has_timer_start_);
+
+  VISIT("prog_kprobe", prog_kprobe_);
+  VISIT("prog_tracepoint", prog_tracepoint_);
+  VISIT("prog_perf_event", prog_perf_event_);
+#undef VISIT
+}
+
+// Results forced by --no-feature must neither be loaded from nor stored in
+// the cache. Only kprobe_multi and uprobe_multi store the override in their
+// result, the other --no-feature options (timer) are checked before the
+// cached results are consulted, which stay true to the kernel.
+bool BPFfeature::is_overridden(std::string_view result) const
+{
+  return (result == "kprobe_multi" && no_feature_.kprobe_multi_) ||
+         (result == "uprobe_multi" && no_feature_.uprobe_multi_);
+}
+
+std::string BPFfeature::serialize_results()
+{
+  std::ostringstream results;
+  visit_results([&](std::string_view name, const auto& result) {
+    if (result.has_value() && !is_overridden(name))
+      results << name << " " << static_cast<int>(*result) << "\n";
+  });
+  return results.str();
+}
+
+void BPFfeature::enable_cache(bool reprobe)
+{
+  // Unprivileged runs fail most of the probes, don't let them poison the cache
+  if (geteuid() != 0)
+    return;
+
+  auto kernel_id = kernel_build_id();
+  if (!kernel_id) {
+    kernel_id = boot_id();
+    if (!kernel_id)
+      return;
+    kernel_id = "boot-" + *kernel_id;
+  }
+
+  auto dir = get_cache_dir();
+  if (!dir)
+    return;
+
+  enable_cache(*dir / "features", *kernel_id, reprobe);
+}
+
+void BPFfeature::enable_cache(const std::filesystem::path& path,
+                              const std::string& kernel_id,
+                              bool reprobe)
+{
+  cache_path_ = path;
+  cache_header_ = std::string("bpftrace ") + BPFTRACE_VERSION + " kernel " +
+                  kernel_id;
+  cache_state_ = reprobe ? CacheState::reprobed : CacheState::miss;
+  if (reprobe)
+    return;
+
+  auto content = read_cache_file(cache_path_);
+  if (!content)
+    return;
+  std::istringstream file(std::move(*content));
+  std::string header;
+  if (!std::getline(file, header) || header != cache_header_)
+    return;
+
+  std::unordered_map<std::string, int> cached;
+  std::string name;
+  int value;
+  while (file >> name >> value)
+    cached[name] = value;
+
+  visit_results([&](std::string_view name, auto& result) {
+    if (is_overridden(name))
+      return;
+    auto it = cached.find(std::string(name));
+    if (it != cached.end())
+      result = it->second;
+  });
+  cached_results_ = serialize_results();
+  cache_state_ = CacheState::hit;
+  LOG(V1) << "Loaded kernel feature probe results from " << cache_path_;
+}
+
+void BPFfeature::save_cache()
+{
+  if (cache_state_ == CacheState::disabled)
+    return;
+
+  auto results = serialize_results();
+  if (results == cached_results_)
+    return;
+
+  // Write to a temporary file first so that concurrent runs never see a
+  // partially written cache
+  auto tmp_path = cache_path_;
+  tmp_path += "." + std::to_string(getpid());
+  {
+    std::ofstream file(tmp_path, std::ios::trunc);
+    if (file.fail())
+      return;
+    file << cache_header_ << "\n" << results;
+  }
+  std::error_code ec;
+  std::filesystem::permissions(tmp_path,
+                               std::filesystem::perms::owner_read |
+                                   std::filesystem::perms::owner_write,
+                               std::filesystem::perm_options::replace,
+                               ec);
+  std::filesystem::rename(tmp_path, cache_path_, ec);
+  if (ec) {
+    LOG(V1) << "Failed to write kernel feature cache " << cache_path_ << ": "
+            << ec.message();
+    std::filesystem::remove(tmp_path, ec);
+  }
+}
+
 static bool try_load_(const char* name,
                       enum libbpf::bpf_prog_type prog_type,
                       std::optional<libbpf::bpf_attach_type> attach_type,
@@ -566,6 +785,22 @@ std::string BPFfeature::report()
 
   auto to_str = [](bool f) -> std::string { return f ? "yes" : "no"; };
 
+  std::string cache_state;
+  switch (cache_state_) {
+    case CacheState::disabled:
+      cache_state = "disabled";
+      break;
+    case CacheState::miss:
+      cache_state = "miss";
+      break;
+    case CacheState::hit:
+      cache_state = "hit";
+      break;
+    case CacheState::reprobed:
+      cache_state = "reprobed";
+      break;
+  }
+
   std::vector<std::pair<std::string, std::string>> helpers = {
     { "probe_read", to_str(has_helper_probe_read()) },
     { "probe_read_str", to_str(has_helper_probe_read_str()) },
@@ -585,6 +820,7 @@ std::string BPFfeature::report()
     { "for_each_map_elem", to_str(has_helper_for_each_map_elem()) },
     { "get_ns_current_pid_tgid", to_str(has_helper_get_ns_current_pid_tgid()) },
     { "lookup_percpu_elem", to_str(has_helper_map_lookup_percpu_elem()) },
+    { "timer_start", to_str(has_helper_timer_start()) },
   };
 
   std::vector<std::pair<std::string, std::string>> features = {
@@ -594,7 +830,10 @@ std::string BPFfeature::report()
     { "Kernel DWARF", to_str(has_kernel_dwarf()) },
     { "map batch", to_str(has_map_batch()) },
     // Depends on BCC's bpf_attach_uprobe refcount feature
-    { "uprobe refcount", to_str(has_uprobe_refcnt()) }
+    { "uprobe refcount", to_str(has_uprobe_refcnt()) },
+    { "timer", to_str(has_timer()) },
+    { "timer cpu pin", to_str(has_timer_cpu_pin()) },
+    { "feature cache", cache_state }
   };
 
   std::vector<std::pair<std::string, std::string>> map_types = {
@@ -703,12 +942,133 @@ bool BPFfeature::has_iter(std::string name)
                           libbpf::BPF_TRACE_ITER);
 }
 
+// Timer probes are generated as BPF_PROG_TYPE_SYSCALL programs which start a
+// timer whose callback runs the probe body. Syscall programs predate BPF
+// timers, so checking for the helpers is enough.
+bool BPFfeature::has_timer()
+{
+  if (no_feature_.timer_)
+    return false;
+  return has_helper_timer_start() && has_map_ringbuf();
+}
+
+// BPF_F_TIMER_CPU_PIN is only validated when a timer is started, not when the
+// program is loaded. Start a timer with it from a syscall program, which is
+// how timer probes are started too, and check the result.
+bool BPFfeature::has_timer_cpu_pin()
+{
+  if (!has_timer())
+    return false;
+
+  if (has_timer_cpu_pin_.has_value())
+    return *has_timer_cpu_pin_;
+
+  has_timer_cpu_pin_ = false;
+
+  // The map value has to be described by BTF for the kernel to find the
+  // struct bpf_timer in it
+  struct btf* btf = btf__new_empty();
+  if (!btf)
+    return false;
+  int int_id = btf__add_int(btf, "int", sizeof(int), BTF_INT_SIGNED);
+  int u64_id = btf__add_int(btf, "unsigned long long", sizeof(uint64_t), 0);
+  int opaque_id = btf__add_array(btf, int_id, u64_id, 2);
+  int timer_id = btf__add_struct(btf, "bpf_timer", 2 * sizeof(uint64_t));
+  bool btf_ok = timer_id > 0 &&
+                btf__add_field(btf, "__opaque", opaque_id, 0, 0) == 0;
+  int value_id = btf__add_struct(btf, "timer_value", 2 * sizeof(uint64_t));
+  btf_ok = btf_ok && value_id > 0 &&
+           btf__add_field(btf, "timer", timer_id, 0, 0) == 0;
+  if (!btf_ok || int_id < 0 || u64_id < 0 || opaque_id < 0 ||
+      btf__load_into_kernel(btf)) {
+    btf__free(btf);
+    return false;
+  }
+
+  BPFTRACE_LIBBPF_OPTS(bpf_map_create_opts, map_opts);
+  map_opts.btf_fd = btf__fd(btf);
+  map_opts.btf_key_type_id = int_id;
+  map_opts.btf_value_type_id = value_id;
+  int map_fd = bpf_map_create(static_cast<enum ::bpf_map_type>(
+                                  libbpf::BPF_MAP_TYPE_ARRAY),
+                              "timer_cpu_pin",
+                              sizeof(int),
+                              2 * sizeof(uint64_t),
+                              1,
+                              &map_opts);
+  // The map keeps its own reference to the BTF
+  btf__free(btf);
+  if (map_fd < 0)
+    return false;
+
+  constexpr int TIMER_CPU_PIN_FLAG = 1 << 1;
+  struct bpf_insn insns[] = {
+    // timer = bpf_map_lookup_elem(map, &(int){ 0 })
+    BPF_ST_MEM(BPF_W, BPF_REG_10, -4, 0),
+    BPF_MOV64_REG(BPF_REG_2, BPF_REG_10),
+    BPF_ALU64_IMM(BPF_ADD, BPF_REG_2, -4),
+    BPF_LD_MAP_FD(BPF_REG_1, map_fd),
+    BPF_RAW_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, libbpf::BPF_FUNC_map_lookup_elem),
+    BPF_JMP_IMM(BPF_JNE, BPF_REG_0, 0, 2),
+    BPF_MOV64_IMM(BPF_REG_0, -1),
+    BPF_EXIT_INSN(),
+    BPF_MOV64_REG(BPF_REG_6, BPF_REG_0),
+    // bpf_timer_init(timer, map, CLOCK_MONOTONIC)
+    BPF_MOV64_REG(BPF_REG_1, BPF_REG_6),
+    BPF_LD_MAP_FD(BPF_REG_2, map_fd),
+    BPF_MOV64_IMM(BPF_REG_3, 1),
+    BPF_RAW_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, libbpf::BPF_FUNC_timer_init),
+    // bpf_timer_set_callback(timer, callback), the callback is the
+    // subprogram after the bpf_timer_start() call
+    BPF_MOV64_REG(BPF_REG_1, BPF_REG_6),
+    BPF_LD_IMM64_RAW(BPF_REG_2, BPF_PSEUDO_FUNC, 7),
+    BPF_RAW_INSN(BPF_JMP | BPF_CALL,
+                 0,
+                 0,
+                 0,
+                 libbpf::BPF_FUNC_timer_set_callback),
+    // return bpf_timer_start(timer, 1s, BPF_F_TIMER_CPU_PIN)
+    BPF_MOV64_REG(BPF_REG_1, BPF_REG_6),
+    BPF_MOV64_IMM(BPF_REG_2, 1000000000),
+    BPF_MOV64_IMM(BPF_REG_3, TIMER_CPU_PIN_FLAG),
+    BPF_RAW_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, libbpf::BPF_FUNC_timer_start),
+    BPF_EXIT_INSN(),
+    // The timer callback
+    BPF_MOV64_IMM(BPF_REG_0, 0),
+    BPF_EXIT_INSN(),
+  };
+
+  // Syscall programs must be sleepable
+  BPFTRACE_LIBBPF_OPTS(bpf_prog_load_opts, prog_opts);
+  prog_opts.prog_flags = BPF_F_SLEEPABLE;
+  int prog_fd = bpf_prog_load(static_cast<::bpf_prog_type>(
+                                  libbpf::BPF_PROG_TYPE_SYSCALL),
+                              "timer_cpu_pin",
+                              "GPL",
+                              insns,
+                              ARRAY_SIZE(insns),
+                              &prog_opts);
+  if (prog_fd >= 0) {
+    BPFTRACE_LIBBPF_OPTS(bpf_test_run_opts, run_opts);
+    has_timer_cpu_pin_ = bpf_prog_test_run_opts(prog_fd, &run_opts) == 0 &&
+                         run_opts.retval == 0;
+    close(prog_fd);
+  }
+  // Closing the map cancels the timer
+  close(map_fd);
+  return *has_timer_cpu_pin_;
+}
+
 bool BPFfeature::has_kernel_dwarf()
 {
 #ifndef HAVE_LIBLLDB
   return false;
 #endif
 
+  if (has_kernel_dwarf_.has_value())
+    return *has_kernel_dwarf_;
+
+  has_kernel_dwarf_ = false;
   auto vmlinux = find_vmlinux();
   if (!vmlinux.has_value())
     return false;
@@ -722,7 +1082,8 @@ bool BPFfeature::has_kernel_dwarf()
   if (!dwarf)
     return false;
 
-  return dwarf->has_debug_info();
+  has_kernel_dwarf_ = dwarf->has_debug_info();
+  return *has_kernel_dwarf_;
 }
 
 bool BPFfeature::has_kernel_func(Kfunc kfunc)
@@ -2,9 +2,11 @@
 
 #include "btf.h"
 #include "kfuncs.h"
+#include <filesystem>
 #include <memory>
 #include <optional>
 #include <string>
+#include <string_view>
 
 #include <linux/bpf.h>
 
@@ -59,7 +61,7 @@ class BPFfeature;
 
 class BPFnofeature {
 public:
-  BPFnofeature() : kprobe_multi_(false), uprobe_multi_(false)
+  BPFnofeature() : kprobe_multi_(false), uprobe_multi_(false), timer_(false)
   {
   }
   int parse(const char* optarg);
@@ -67,6 +69,7 @@ public:
 protected:
   bool kprobe_multi_;
   bool uprobe_multi_;
+  bool timer_;
   friend class BPFfeature;
 };
 
@@ -76,7 +79,7 @@ public:
   {
   }
   BPFfeature() = default;
-  virtual ~BPFfeature() = default;
+  virtual ~BPFfeature();
 
   // Due to the unique_ptr usage the generated copy constructor & assignment
   // don't work. Move works but doesn't make sense as the `has_*` functions
@@ -102,11 +105,23 @@ public:
   bool has_module_btf();
   bool has_iter(std::string name);
   bool has_kernel_dwarf();
+  // BPF timers which can drive interval and profile probes
+  bool has_timer();
+  // BPF timers which can be pinned to the CPU they were started on
+  bool has_timer_cpu_pin();
 
   bool has_kernel_func(Kfunc kfunc);
 
   std::string report(void);
 
+  // Probing all the features takes a while, so the results can be cached
+  // across runs. The cache is keyed by the kernel build (or the boot, if the
+  // kernel has no build id) and the bpftrace version. This loads the cached
+  // results, unless `reprobe` is set, and makes the destructor store the
+  // results probed in the meantime. Cache files which are not owned by the
+  // effective user or which are writable by others are ignored.
+  void enable_cache(bool reprobe = false);
+
   DEFINE_MAP_TEST(array, libbpf::BPF_MAP_TYPE_ARRAY);
   DEFINE_MAP_TEST(hash, libbpf::BPF_MAP_TYPE_HASH);
   DEFINE_MAP_TEST(percpu_array, libbpf::BPF_MAP_TYPE_PERCPU_ARRAY);
@@ -129,6 +144,7 @@ public:
   DEFINE_HELPER_TEST(for_each_map_elem, libbpf::BPF_PROG_TYPE_KPROBE);
   DEFINE_HELPER_TEST(get_ns_current_pid_tgid, libbpf::BPF_PROG_TYPE_KPROBE);
   DEFINE_HELPER_TEST(map_lookup_percpu_elem, libbpf::BPF_PROG_TYPE_KPROBE);
+  DEFINE_HELPER_TEST(timer_start, libbpf::BPF_PROG_TYPE_KPROBE);
   DEFINE_PROG_TEST(kprobe, libbpf::BPF_PROG_TYPE_KPROBE);
   DEFINE_PROG_TEST(tracepoint, libbpf::BPF_PROG_TYPE_TRACEPOINT);
   DEFINE_PROG_TEST(perf_event, libbpf::BPF_PROG_TYPE_PERF_EVENT);
@@ -145,10 +161,34 @@ protected:
   std::optional<bool> has_module_btf_;
   std::optional<bool> has_btf_func_global_;
   std::optional<bool> has_kernel_dwarf_;
+  std::optional<bool> has_timer_cpu_pin_;
 
   std::unordered_map<Kfunc, bool> available_kernel_funcs_;
 
+  // Uses the cache file at `path` for the kernel identified by `kernel_id`
+  void enable_cache(const std::filesystem::path& path,
+                    const std::string& kernel_id,
+                    bool reprobe);
+
 private:
+  enum class CacheState {
+    disabled,
+    miss,
+    hit,
+    reprobed,
+  };
+
+  template <typename F>
+  void visit_results(F&& visitor);
+  bool is_overridden(std::string_view result) const;
+  std::string serialize_results();
+  void save_cache();
+
+  CacheState cache_state_ = CacheState::disabled;
+  std::filesystem::path cache_path_;
+  std::string cache_header_;
+  std::string cached_results_;
+
   bool detect_map(libbpf::bpf_map_type map_type);
   bool detect_helper(libbpf::bpf_func_id func_id,
                      libbpf::bpf_prog_type prog_type);
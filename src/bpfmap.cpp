@@ -1,5 +1,7 @@
 #include "bpfmap.h"
 
+#include <vector>
+
 namespace bpftrace {
 
 int BpfMap::fd() const
@@ -44,8 +46,7 @@ bool BpfMap::is_stack_map() const
 
 bool BpfMap::is_per_cpu_type() const
 {
-  return type() == libbpf::BPF_MAP_TYPE_PERCPU_HASH ||
-         type() == libbpf::BPF_MAP_TYPE_PERCPU_ARRAY;
+  return is_per_cpu_map_type(type());
 }
 
 bool BpfMap::is_clearable() const
@@ -74,8 +75,45 @@ std::string to_string(MapType t)
       return "event_loss_counter";
     case MapType::RecursionPrevention:
       return "recursion_prevention";
+    case MapType::TopkSketch:
+      return "topk_sketch";
+    case MapType::Timers:
+      return "timers";
+    case MapType::SampleRate:
+      return "sample_rate";
   }
   return {}; // unreached
 }
 
+static const std::vector<std::pair<std::string, libbpf::bpf_map_type>>
+    DECLARABLE_MAP_TYPES = {
+      { "hash", libbpf::BPF_MAP_TYPE_HASH },
+      { "percpu_hash", libbpf::BPF_MAP_TYPE_PERCPU_HASH },
+      { "lru_hash", libbpf::BPF_MAP_TYPE_LRU_HASH },
+      { "lru_percpu_hash", libbpf::BPF_MAP_TYPE_LRU_PERCPU_HASH },
+      { "array", libbpf::BPF_MAP_TYPE_ARRAY },
+      { "percpu_array", libbpf::BPF_MAP_TYPE_PERCPU_ARRAY },
+    };
+
+std::optional<libbpf::bpf_map_type> declarable_map_type(
+    const std::string &name)
+{
+  for (const auto &[type_name, type] : DECLARABLE_MAP_TYPES) {
+    if (type_name == name)
+      return type;
+  }
+  return std::nullopt;
+}
+
+std::string declarable_map_types_str()
+{
+  std::string res;
+  for (const auto &[type_name, _] : DECLARABLE_MAP_TYPES) {
+    if (!res.empty())
+      res += ", ";
+    res += type_name;
+  }
+  return res;
+}
+
 } // namespace bpftrace
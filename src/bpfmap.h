@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstddef>
+#include <optional>
 #include <string>
 #include <string_view>
 
@@ -32,7 +33,8 @@ public:
          uint32_t key_size,
          uint32_t value_size,
          uint32_t max_entries)
-      : type_(type),
+      : bpf_map_(nullptr),
+        type_(type),
         name_(name),
         key_size_(key_size),
         value_size_(value_size),
@@ -71,6 +73,9 @@ enum class MapType {
   Ringbuf,
   EventLossCounter,
   RecursionPrevention,
+  TopkSketch,
+  Timers,
+  SampleRate,
 };
 
 std::string to_string(MapType t);
@@ -93,10 +98,28 @@ inline std::string bpftrace_map_name(std::string_view bpf_map_name)
   return name;
 }
 
+inline bool is_array_map_type(libbpf::bpf_map_type map_type)
+{
+  return map_type == libbpf::BPF_MAP_TYPE_ARRAY ||
+         map_type == libbpf::BPF_MAP_TYPE_PERCPU_ARRAY;
+}
+
 inline bool is_bpf_map_clearable(libbpf::bpf_map_type map_type)
 {
-  return map_type != libbpf::BPF_MAP_TYPE_ARRAY &&
-         map_type != libbpf::BPF_MAP_TYPE_PERCPU_ARRAY;
+  return !is_array_map_type(map_type);
 }
 
+inline bool is_per_cpu_map_type(libbpf::bpf_map_type map_type)
+{
+  return map_type == libbpf::BPF_MAP_TYPE_PERCPU_HASH ||
+         map_type == libbpf::BPF_MAP_TYPE_LRU_PERCPU_HASH ||
+         map_type == libbpf::BPF_MAP_TYPE_PERCPU_ARRAY;
+}
+
+// Map types that scripts can select for a map with a map declaration, e.g.
+// `let @x = lru_hash(1024);`. Returns std::nullopt for unknown names.
+std::optional<libbpf::bpf_map_type> declarable_map_type(
+    const std::string &name);
+std::string declarable_map_types_str();
+
 } // namespace bpftrace
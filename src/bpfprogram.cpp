@@ -24,6 +24,14 @@ int BpfProgram::fd() const
 void BpfProgram::set_prog_type(const Probe &probe)
 {
   auto prog_type = progtype(probe.type);
+  if (probe.timer_slot) {
+    // Timer driven probes only start a BPF timer and are run from userspace.
+    // Tracing programs may not use timers, syscall programs can and must be
+    // sleepable.
+    prog_type = libbpf::BPF_PROG_TYPE_SYSCALL;
+    bpf_program__set_flags(bpf_prog_,
+                           bpf_program__flags(bpf_prog_) | BPF_F_SLEEPABLE);
+  }
   bpf_program__set_type(bpf_prog_, static_cast<::bpf_prog_type>(prog_type));
 }
 
@@ -4,6 +4,7 @@
 #include <cassert>
 #include <cerrno>
 #include <cinttypes>
+#include <cmath>
 #include <cstdio>
 #include <cstring>
 #include <ctime>
@@ -39,10 +40,12 @@
 #include "bpfmap.h"
 #include "bpfprogram.h"
 #include "bpftrace.h"
+#include "globalvars.h"
 #include "log.h"
 #include "printf.h"
 #include "resolve_cgroupid.h"
 #include "scopeguard.h"
+#include "timing_trace.h"
 #include "utils.h"
 
 namespace bpftrace {
@@ -97,6 +100,7 @@ Probe BPFtrace::generate_probe(const ast::AttachPoint &ap,
   probe.mode = ap.mode;
   probe.async = ap.async;
   probe.pin = ap.pin;
+  probe.timer_slot = ap.timer_slot;
   return probe;
 }
 
@@ -557,18 +561,31 @@ std::vector<std::unique_ptr<IPrintable>> BPFtrace::get_arg_values(
         break;
       case Type::string: {
         auto p = reinterpret_cast<char *>(arg_data + arg.offset);
+        size_t size = arg.type.GetSize();
+        if (arg.is_data_loc) {
+          // (length << 16) | offset of the data from the start of the event
+          auto data_loc = *reinterpret_cast<uint32_t *>(arg_data + arg.offset);
+          p = reinterpret_cast<char *>(arg_data + (data_loc & 0xffff));
+          size = data_loc >> 16;
+        }
         arg_values.push_back(std::make_unique<PrintableString>(
-            std::string(p, strnlen(p, arg.type.GetSize())),
+            std::string(p, strnlen(p, size)),
             config_.get(ConfigKeyInt::max_strlen),
             config_.get(ConfigKeyString::str_trunc_trailer).c_str()));
         break;
       }
       case Type::buffer: {
-        auto length =
-            reinterpret_cast<AsyncEvent::Buf *>(arg_data + arg.offset)->length;
-        arg_values.push_back(std::make_unique<PrintableBuffer>(
-            reinterpret_cast<AsyncEvent::Buf *>(arg_data + arg.offset)->content,
-            length));
+        auto buf = reinterpret_cast<AsyncEvent::Buf *>(arg_data + arg.offset);
+        auto length = buf->length;
+        if (arg.is_data_loc) {
+          auto data_loc = *reinterpret_cast<uint32_t *>(arg_data + arg.offset);
+          buf = reinterpret_cast<AsyncEvent::Buf *>(arg_data +
+                                                    (data_loc & 0xffff));
+          size_t max_length = (data_loc >> 16) - sizeof(AsyncEvent::Buf);
+          length = std::min<size_t>(buf->length, max_length);
+        }
+        arg_values.push_back(
+            std::make_unique<PrintableBuffer>(buf->content, length));
         break;
       }
       case Type::ksym_t:
@@ -672,7 +689,7 @@ size_t BPFtrace::num_params() const
 void perf_event_lost(void *cb_cookie, uint64_t lost)
 {
   auto bpftrace = static_cast<BPFtrace *>(cb_cookie);
-  bpftrace->out_->lost_events(lost);
+  bpftrace->out_->lost_events(lost, {});
 }
 
 std::vector<std::unique_ptr<AttachedProbe>> BPFtrace::attach_usdt_probe(
@@ -755,6 +772,7 @@ std::vector<std::unique_ptr<AttachedProbe>> BPFtrace::attach_probe(
     Probe &probe,
     const BpfBytecode &bytecode)
 {
+  timing::Phase phase("attach " + probetypeName(probe.type), "attach");
   std::vector<std::unique_ptr<AttachedProbe>> ret;
 
   try {
@@ -903,6 +921,7 @@ int BPFtrace::run(BpfBytecode bytecode)
 
   bytecode_ = std::move(bytecode);
   bytecode_.set_map_ids(resources);
+  bytecode_.set_program_aliases(resources.program_aliases);
   bytecode_.update_global_vars(*this);
 
   try {
@@ -946,6 +965,13 @@ int BPFtrace::run(BpfBytecode bytecode)
     }
   }
 
+  int stats_fd = probe_stats_ ? enable_probe_stats() : -1;
+  SCOPE_EXIT
+  {
+    if (stats_fd >= 0)
+      close(stats_fd);
+  };
+
   auto begin_probe = resources.special_probes.find("BEGIN");
   if (begin_probe != resources.special_probes.end()) {
     auto &begin_prog = bytecode_.getProgramForProbe((*begin_probe).second);
@@ -1065,17 +1091,75 @@ int BPFtrace::run(BpfBytecode bytecode)
 
   poll_output(/* drain */ true);
 
+  if (probe_stats_)
+    print_probe_stats();
+
   return 0;
 }
 
+// Run time statistics of BPF programs are only collected while enabled, as
+// collecting them costs two clock reads per run. They stay enabled until the
+// returned fd is closed.
+int BPFtrace::enable_probe_stats()
+{
+  int fd = bpf_enable_stats(BPF_STATS_RUN_TIME);
+  if (fd < 0)
+    LOG(WARNING) << "Failed to enable BPF run time statistics, probe run "
+                    "times will only be reported if "
+                    "kernel.bpf_stats_enabled is set: "
+                 << strerror(-fd);
+  last_probe_stats_ = std::chrono::steady_clock::now();
+  return fd;
+}
+
+void BPFtrace::print_probe_stats()
+{
+  last_probe_stats_ = std::chrono::steady_clock::now();
+
+  // Attach points sharing a program, e.g. wildcard matches, are reported
+  // together
+  std::vector<ProbeStats> stats;
+  std::map<int, size_t> stats_by_fd;
+  auto add_probe = [&](const Probe &probe) {
+    int fd = bytecode_.getProgramForProbe(probe).fd();
+    auto existing = stats_by_fd.find(fd);
+    if (existing != stats_by_fd.end()) {
+      stats[existing->second].attach_points.push_back(probe.name);
+      return;
+    }
+
+    struct bpf_prog_info info = {};
+    uint32_t info_len = sizeof(info);
+    if (bpf_obj_get_info_by_fd(fd, &info, &info_len) != 0) {
+      LOG(WARNING) << "Failed to get statistics of probe: " << probe.name;
+      return;
+    }
+    stats_by_fd.emplace(fd, stats.size());
+    stats.push_back(ProbeStats{
+        .probe = probe.orig_name,
+        .attach_points = { probe.name },
+        .run_cnt = info.run_cnt,
+        .run_time_ns = info.run_time_ns,
+        .insns = static_cast<uint32_t>(info.xlated_prog_len /
+                                       sizeof(struct bpf_insn)),
+        .verified_insns = info.verified_insns,
+        .has_run_stats = !probe.timer_slot.has_value(),
+    });
+  };
+
+  for (const auto &[_, probe] : resources.special_probes)
+    add_probe(probe);
+  for (const auto &probe : resources.probes)
+    add_probe(probe);
+
+  out_->probe_stats(stats);
+}
+
 int BPFtrace::setup_output()
 {
   if (is_ringbuf_enabled()) {
     setup_ringbuf();
   }
-  int err = setup_event_loss();
-  if (err)
-    return err;
   if (is_perf_event_enabled()) {
     return setup_perf_events();
   }
@@ -1130,18 +1214,6 @@ void BPFtrace::setup_ringbuf()
       bytecode_.getMap(MapType::Ringbuf).fd(), ringbuf_printer, this, nullptr));
 }
 
-int BPFtrace::setup_event_loss()
-{
-  if (bpf_update_elem(bytecode_.getMap(MapType::EventLossCounter).fd(),
-                      const_cast<uint32_t *>(&event_loss_cnt_key_),
-                      const_cast<uint64_t *>(&event_loss_cnt_val_),
-                      0)) {
-    LOG(ERROR) << "fail to init event loss counter";
-    return -1;
-  }
-  return 0;
-}
-
 void BPFtrace::teardown_output()
 {
   if (is_ringbuf_enabled())
@@ -1194,6 +1266,11 @@ void BPFtrace::poll_output(bool drain)
     // print loss events
     handle_event_loss();
 
+    if (probe_stats_ && probe_stats_interval_ > 0 &&
+        std::chrono::steady_clock::now() - last_probe_stats_ >=
+            std::chrono::seconds(probe_stats_interval_))
+      print_probe_stats();
+
     if (do_poll_ringbuf) {
       ready = ring_buffer__poll(ringbuf_, timeout_ms);
       if (should_retry(ready)) {
@@ -1243,21 +1320,95 @@ int BPFtrace::poll_perf_events()
 
 void BPFtrace::handle_event_loss()
 {
-  uint64_t current_value = 0;
-  if (bpf_lookup_elem(bytecode_.getMap(MapType::EventLossCounter).fd(),
-                      const_cast<uint32_t *>(&event_loss_cnt_key_),
-                      &current_value)) {
-    LOG(ERROR) << "fail to get event loss counter";
-  }
-  if (current_value) {
-    if (current_value > event_loss_count_) {
-      out_->lost_events(current_value - event_loss_count_);
-      event_loss_count_ = current_value;
-    } else if (current_value < event_loss_count_) {
-      LOG(ERROR) << "Invalid event loss count value: " << current_value
-                 << ", last seen: " << event_loss_count_;
+  const auto &map = bytecode_.getMap(MapType::EventLossCounter);
+  const auto &probes = resources.event_loss_probes;
+  event_loss_counts_.resize((1 + probes.size()) * ncpus_, 0);
+
+  // The counters are per-CPU, sum up what was lost since the last call per
+  // probe and per CPU
+  uint64_t lost = 0;
+  std::map<std::string, uint64_t> lost_by_probe;
+  auto lost_by_cpu = std::vector<uint64_t>(ncpus_, 0);
+  auto values = std::vector<uint64_t>(ncpus_);
+  for (uint32_t key = 0; key <= probes.size(); key++) {
+    if (bpf_lookup_elem(map.fd(), &key, values.data())) {
+      LOG(ERROR) << "fail to get event loss counter";
+      return;
+    }
+
+    uint64_t *last_values = &event_loss_counts_[key * ncpus_];
+    for (int cpu = 0; cpu < ncpus_; cpu++) {
+      if (values[cpu] < last_values[cpu]) {
+        LOG(ERROR) << "Invalid event loss count value: " << values[cpu]
+                   << ", last seen: " << last_values[cpu];
+        continue;
+      }
+      uint64_t delta = values[cpu] - last_values[cpu];
+      last_values[cpu] = values[cpu];
+      if (!delta)
+        continue;
+
+      LOG(V1) << "CPU " << cpu << " has lost " << delta << " events in "
+              << (key ? probes[key - 1] : "bpftrace");
+      lost += delta;
+      lost_by_cpu[cpu] += delta;
+      if (key > 0)
+        lost_by_probe[probes[key - 1]] += delta;
+    }
+  }
+
+  if (lost)
+    out_->lost_events(lost, lost_by_probe);
+
+  if (bytecode_.hasMap(MapType::SampleRate))
+    update_sample_rates(lost_by_cpu);
+}
+
+// Adaptive sampling: a CPU which lost events since the last poll keeps half
+// as many events as before, down to one in 2^MAX_SAMPLE_SHIFT. Once it hasn't
+// lost any for SAMPLE_RATE_DECAY, it keeps twice as many again. Every change
+// is reported so that aggregates can be scaled by the rate in effect.
+void BPFtrace::update_sample_rates(const std::vector<uint64_t> &lost_by_cpu)
+{
+  constexpr uint8_t MAX_SAMPLE_SHIFT = 16;
+  constexpr auto SAMPLE_RATE_DECAY = std::chrono::seconds(1);
+
+  auto now = std::chrono::steady_clock::now();
+  sample_shifts_.resize(ncpus_, 0);
+  sample_quiet_since_.resize(ncpus_, now);
+
+  bool changed = false;
+  for (int cpu = 0; cpu < ncpus_; cpu++) {
+    uint8_t &shift = sample_shifts_[cpu];
+    if (lost_by_cpu[cpu] > 0) {
+      sample_quiet_since_[cpu] = now;
+      if (shift == MAX_SAMPLE_SHIFT)
+        continue;
+      shift++;
+    } else if (shift > 0 &&
+               now - sample_quiet_since_[cpu] >= SAMPLE_RATE_DECAY) {
+      sample_quiet_since_[cpu] = now;
+      shift--;
+    } else {
+      continue;
     }
+    changed = true;
+    out_->sample_rate(cpu, 1ULL << shift);
   }
+  if (!changed)
+    return;
+
+  // The map holds a { mask, count } pair per CPU, see
+  // IRBuilderBPF::CreateCheckSampled. Updating a per-CPU map sets the values
+  // of all CPUs, which also resets the counts. That only shifts which events
+  // are kept.
+  const auto &map = bytecode_.getMap(MapType::SampleRate);
+  auto values = std::vector<uint64_t>(2 * ncpus_, 0);
+  for (int cpu = 0; cpu < ncpus_; cpu++)
+    values[2 * cpu] = (1ULL << sample_shifts_[cpu]) - 1;
+  uint32_t key = 0;
+  if (bpf_update_elem(map.fd(), &key, values.data(), BPF_ANY))
+    LOG(WARNING) << "failed to update sample rates";
 }
 
 int BPFtrace::print_maps()
@@ -1280,6 +1431,12 @@ int BPFtrace::print_maps()
 // clear a map
 int BPFtrace::clear_map(const BpfMap &map)
 {
+  const auto &map_info = resources.maps_info.at(map.name());
+  if (map_info.scalar_agg_slot.has_value()) {
+    reset_scalar_agg(*map_info.scalar_agg_slot, false);
+    return 0;
+  }
+
   if (!map.is_clearable())
     return zero_map(map);
 
@@ -1301,12 +1458,22 @@ int BPFtrace::clear_map(const BpfMap &map)
     }
   }
 
-  return 0;
+  return reset_topk_sketch(map);
 }
 
 // zero a map
 int BPFtrace::zero_map(const BpfMap &map)
 {
+  const auto &map_info = resources.maps_info.at(map.name());
+  if (map_info.scalar_agg_slot.has_value()) {
+    // Zeroing min() and max() also unsets them, like the zeroed value of a
+    // map element would
+    reset_scalar_agg(*map_info.scalar_agg_slot,
+                     !map_info.value_type.IsMinTy() &&
+                         !map_info.value_type.IsMaxTy());
+    return 0;
+  }
+
   uint64_t nvalues = map.is_per_cpu_type() ? ncpus_ : 1;
 
   uint8_t *old_key = nullptr;
@@ -1330,14 +1497,15 @@ int BPFtrace::zero_map(const BpfMap &map)
     }
   }
 
-  return 0;
+  return reset_topk_sketch(map);
 }
 
 int BPFtrace::print_map(const BpfMap &map, uint32_t top, uint32_t div)
 {
   const auto &map_info = resources.maps_info.at(map.name());
   const auto &value_type = map_info.value_type;
-  if (value_type.IsHistTy() || value_type.IsLhistTy())
+  if (value_type.IsHistTy() || value_type.IsLhistTy() ||
+      value_type.IsQuantilesTy())
     return print_map_hist(map, top, div);
 
   uint64_t nvalues = map.is_per_cpu_type() ? ncpus_ : 1;
@@ -1348,7 +1516,13 @@ int BPFtrace::print_map(const BpfMap &map, uint32_t top, uint32_t div)
   std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>>
       values_by_key;
 
-  while (bpf_get_next_key(map.fd(), old_key, key.data()) == 0) {
+  if (map_info.scalar_agg_slot.has_value()) {
+    if (auto value = read_scalar_agg(map, *map_info.scalar_agg_slot))
+      values_by_key.push_back({ key, std::move(*value) });
+  }
+
+  while (!map_info.scalar_agg_slot.has_value() &&
+         bpf_get_next_key(map.fd(), old_key, key.data()) == 0) {
     auto value = std::vector<uint8_t>(map.value_size() * nvalues);
     int err = bpf_lookup_elem(map.fd(), key.data(), value.data());
     if (err == -ENOENT) {
@@ -1360,12 +1534,37 @@ int BPFtrace::print_map(const BpfMap &map, uint32_t top, uint32_t div)
       return -1;
     }
 
-    values_by_key.push_back({ key, value });
-
     old_key = key.data();
+
+    // Array maps always contain all of their elements, only print the ones
+    // that have been written to
+    if (!map.is_clearable() && !map_info.key_type.IsNoneTy() &&
+        std::all_of(value.begin(), value.end(), [](uint8_t b) {
+          return b == 0;
+        }))
+      continue;
+
+    values_by_key.push_back({ key, value });
   }
 
-  if (value_type.IsCountTy() || value_type.IsSumTy() || value_type.IsIntTy()) {
+  if (value_type.IsCountDistinctTy()) {
+    // Estimating merges the registers of all CPUs, so only do it once per key
+    std::vector<std::pair<uint64_t, size_t>> estimates;
+    estimates.reserve(values_by_key.size());
+    for (size_t i = 0; i < values_by_key.size(); i++)
+      estimates.emplace_back(count_distinct_value(values_by_key[i].second,
+                                                  nvalues,
+                                                  value_type.GetSize()),
+                             i);
+    std::sort(estimates.begin(), estimates.end());
+
+    decltype(values_by_key) sorted;
+    sorted.reserve(values_by_key.size());
+    for (const auto &[estimate, i] : estimates)
+      sorted.push_back(std::move(values_by_key[i]));
+    values_by_key = std::move(sorted);
+  } else if (value_type.IsCountTy() || value_type.IsSumTy() ||
+             value_type.IsTopkTy() || value_type.IsIntTy()) {
     bool is_signed = value_type.IsSigned();
     std::sort(values_by_key.begin(),
               values_by_key.end(),
@@ -1410,6 +1609,9 @@ int BPFtrace::print_map(const BpfMap &map, uint32_t top, uint32_t div)
   if (div == 0)
     div = 1;
 
+  if (value_type.IsTopkTy())
+    return print_map_topk(map, top, div, values_by_key);
+
   if (value_type.IsAvgTy() || value_type.IsStatsTy()) {
     out_->map_stats(*this, map, top, div, values_by_key);
     return 0;
@@ -1419,6 +1621,95 @@ int BPFtrace::print_map(const BpfMap &map, uint32_t top, uint32_t div)
   return 0;
 }
 
+int BPFtrace::print_map_topk(
+    const BpfMap &map,
+    uint32_t top,
+    uint32_t div,
+    const std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>>
+        &values_by_key)
+{
+  const auto &topk_args = resources.maps_info.at(map.name()).topk_args;
+  if (!topk_args.has_value())
+    LOG(BUG) << "topk map " << map.name() << " has no arguments";
+
+  // Each count is overestimated by at most e * total / width (with
+  // probability 1 - e^-depth), where total is the number of events counted
+  // in the sketch.
+  const auto &sketch_map = bytecode_.getMap(MapType::TopkSketch);
+  uint32_t sketch_idx = topk_args->sketch_idx;
+  auto sketch = std::vector<uint8_t>(sketch_map.value_size() * ncpus_);
+  int err = bpf_lookup_elem(sketch_map.fd(), &sketch_idx, sketch.data());
+  if (err) {
+    LOG(ERROR) << "failed to look up topk sketch: " << err;
+    return -1;
+  }
+  uint64_t total = 0;
+  for (uint64_t cpu = 0; cpu < ncpus_; cpu++) {
+    total += read_data<uint64_t>(sketch.data() +
+                                 cpu * sketch_map.value_size() +
+                                 (TOPK_SKETCH_SIZE - 1) * sizeof(uint64_t));
+  }
+  auto error = static_cast<uint64_t>(
+      std::ceil(M_E * total / TOPK_SKETCH_WIDTH));
+
+  // Output the (count, error) pairs like stats() values
+  std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>>
+      counts_by_key;
+  for (const auto &[key, value] : values_by_key) {
+    auto count_error = std::vector<uint8_t>(2 * sizeof(uint64_t));
+    uint64_t count = reduce_value<uint64_t>(value, ncpus_);
+    std::memcpy(count_error.data(), &count, sizeof(count));
+    std::memcpy(count_error.data() + sizeof(count), &error, sizeof(error));
+    counts_by_key.emplace_back(key, std::move(count_error));
+  }
+
+  if (top == 0 || top > topk_args->k)
+    top = topk_args->k;
+
+  out_->map_stats(*this, map, top, div, counts_by_key);
+  return 0;
+}
+
+int BPFtrace::reset_topk_sketch(const BpfMap &map)
+{
+  auto map_info = resources.maps_info.find(map.name());
+  if (map_info == resources.maps_info.end() ||
+      !map_info->second.topk_args.has_value())
+    return 0;
+
+  const auto &sketch_map = bytecode_.getMap(MapType::TopkSketch);
+  uint32_t sketch_idx = map_info->second.topk_args->sketch_idx;
+  auto zero = std::vector<uint8_t>(sketch_map.value_size() * ncpus_, 0);
+  int err = bpf_update_elem(sketch_map.fd(), &sketch_idx, zero.data(), BPF_ANY);
+  if (err) {
+    LOG(ERROR) << "failed to reset topk sketch: " << err;
+    return -1;
+  }
+  return 0;
+}
+
+// Collects the per-CPU values of a map kept in the scalar aggregation buffer
+// in the same layout as a per-CPU map lookup returns them. Returns
+// std::nullopt if no CPU has updated the map yet.
+std::optional<std::vector<uint8_t>> BPFtrace::read_scalar_agg(
+    const BpfMap &map,
+    uint32_t slot)
+{
+  return globalvars::read_scalar_agg(bytecode_.scalar_agg_buffer(),
+                                     resources.scalar_agg_slots,
+                                     slot,
+                                     map.value_size(),
+                                     get_possible_cpus());
+}
+
+void BPFtrace::reset_scalar_agg(uint32_t slot, bool keep_is_set)
+{
+  globalvars::reset_scalar_agg(bytecode_.scalar_agg_buffer(),
+                               resources.scalar_agg_slots,
+                               slot,
+                               keep_is_set);
+}
+
 int BPFtrace::print_map_hist(const BpfMap &map, uint32_t top, uint32_t div)
 {
   // A hist-map adds an extra 8 bytes onto the end of its key for storing
@@ -1455,7 +1746,8 @@ int BPFtrace::print_map_hist(const BpfMap &map, uint32_t top, uint32_t div)
 
     if (values_by_key.find(key_prefix) == values_by_key.end()) {
       // New key - create a list of buckets for it
-      if (map_info.value_type.IsHistTy())
+      if (map_info.value_type.IsHistTy() ||
+          map_info.value_type.IsQuantilesTy())
         values_by_key[key_prefix] = std::vector<uint64_t>(65 * 32);
       else
         values_by_key[key_prefix] = std::vector<uint64_t>(1002);
@@ -2045,6 +2337,7 @@ bool BPFtrace::write_pcaps(uint64_t id,
 
 void BPFtrace::parse_btf(const std::set<std::string> &modules)
 {
+  timing::Phase phase("BTF load", "compile");
   btf_ = std::make_unique<BTF>(this, modules);
 }
 
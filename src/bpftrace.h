@@ -2,6 +2,7 @@
 
 #include <time.h>
 
+#include <chrono>
 #include <cstdint>
 #include <iostream>
 #include <map>
@@ -75,6 +76,21 @@ const std::unordered_map<std::string_view, DebugStage> debug_stages = {
   { "verifier", DebugStage::Verifier },
 };
 
+// How much effort LLVM spends on optimizing the generated code
+enum class OptProfile {
+  // Compile quickly, e.g. for one-liners
+  fast,
+  default_,
+  // Fewest BPF instructions
+  size,
+};
+
+const std::unordered_map<std::string_view, OptProfile> opt_profiles = {
+  { "fast", OptProfile::fast },
+  { "default", OptProfile::default_ },
+  { "size", OptProfile::size },
+};
+
 class WildcardException : public std::exception {
 public:
   WildcardException(const std::string &msg) : msg_(msg)
@@ -212,10 +228,13 @@ public:
   int helper_check_level_ = 1;
   uint64_t max_ast_nodes_ = std::numeric_limits<uint64_t>::max();
   bool debug_output_ = false;
+  // --probe-stats: report the kernel statistics of each probe at exit and,
+  // if non-zero, every probe_stats_interval_ seconds
+  bool probe_stats_ = false;
+  uint64_t probe_stats_interval_ = 0;
+  OptProfile opt_profile_ = OptProfile::default_;
   std::optional<struct timespec> boottime_;
   std::optional<struct timespec> delta_taitime_;
-  static constexpr uint32_t event_loss_cnt_key_ = 0;
-  static constexpr uint64_t event_loss_cnt_val_ = 0;
   bool need_recursion_check_ = false;
 
   static void sort_by_key(
@@ -256,7 +275,6 @@ private:
   int setup_output();
   int setup_perf_events();
   void setup_ringbuf();
-  int setup_event_loss();
   // when the ringbuf feature is available, enable ringbuf for built-ins like
   // printf, cat.
   bool is_ringbuf_enabled(void) const
@@ -273,7 +291,20 @@ private:
   void poll_output(bool drain = false);
   int poll_perf_events();
   void handle_event_loss();
+  void update_sample_rates(const std::vector<uint64_t> &lost_by_cpu);
+  int enable_probe_stats();
+  void print_probe_stats();
   int print_map_hist(const BpfMap &map, uint32_t top, uint32_t div);
+  int print_map_topk(
+      const BpfMap &map,
+      uint32_t top,
+      uint32_t div,
+      const std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>>
+          &values_by_key);
+  int reset_topk_sketch(const BpfMap &map);
+  std::optional<std::vector<uint8_t>> read_scalar_agg(const BpfMap &map,
+                                                      uint32_t slot);
+  void reset_scalar_agg(uint32_t slot, bool keep_is_set);
   static uint64_t read_address_from_output(std::string output);
   struct bcc_symbol_option &get_symbol_opts();
   Probe generate_probe(const ast::AttachPoint &ap,
@@ -282,7 +313,13 @@ private:
   bool has_iter_ = false;
   int epollfd_ = -1;
   struct ring_buffer *ringbuf_ = nullptr;
-  uint64_t event_loss_count_ = 0;
+  // Last seen per-CPU event loss counts, indexed by the event loss counter
+  // map key times the number of CPUs plus the CPU
+  std::vector<uint64_t> event_loss_counts_;
+  // Adaptive sampling state per CPU: one in 2^shift events is kept
+  std::vector<uint8_t> sample_shifts_;
+  std::vector<std::chrono::steady_clock::time_point> sample_quiet_since_;
+  std::chrono::steady_clock::time_point last_probe_stats_;
 
   // Mapping traceable functions to modules (or "vmlinux") they appear in.
   // Needs to be mutable to allow lazy loading of the mapping from const lookup
@@ -84,8 +84,21 @@ void BTF::load_kernel_btfs(const std::set<std::string> &modules)
   btf_objects.push_back(
       BTFObj{ .btf = vmlinux_btf, .id = 0, .name = "vmlinux" });
 
-  if (bpftrace_ && !bpftrace_->feature_->has_module_btf())
-    return;
+  // Module BTFs are only loaded once they are actually needed.
+  pending_modules_ = modules;
+  pending_modules_.erase("vmlinux");
+}
+
+const std::map<std::string, __u32> &BTF::kernel_btf_ids() const
+{
+  if (!kernel_btf_ids_)
+    kernel_btf_ids_ = read_kernel_btf_ids();
+  return *kernel_btf_ids_;
+}
+
+std::map<std::string, __u32> BTF::read_kernel_btf_ids() const
+{
+  std::map<std::string, __u32> ids;
 
   // Note that we cannot parse BTFs from /sys/kernel/btf/ as we need BTF object
   // IDs, so the only way is to iterate through all loaded BTF objects
@@ -120,19 +133,100 @@ void BTF::load_kernel_btfs(const std::set<std::string> &modules)
       continue;
     }
 
-    auto mod_name = std::string(name);
     if (!info.kernel_btf)
       continue;
 
-    if (mod_name == "vmlinux") {
+    auto mod_name = std::string(name);
+    if (mod_name == "vmlinux")
       btf_objects.front().id = id;
-    } else if (modules.find(mod_name) != modules.end()) {
-      btf_objects.push_back(
-          BTFObj{ .btf = btf__load_from_kernel_by_id_split(id, vmlinux_btf),
-                  .id = id,
-                  .name = mod_name });
-    }
+    else
+      ids.emplace(std::move(mod_name), id);
+  }
+
+  return ids;
+}
+
+struct btf *BTF::load_split_btf(__u32 id) const
+{
+  return btf__load_from_kernel_by_id_split(id, vmlinux_btf);
+}
+
+size_t BTF::objects_cnt() const
+{
+  size_t cnt = btf_objects.size();
+  if (pending_modules_.empty() ||
+      (bpftrace_ && !bpftrace_->feature_->has_module_btf()))
+    return cnt;
+
+  // Enumerating the kernel's BTF objects is cheap compared to loading them
+  const auto &ids = kernel_btf_ids();
+  for (const auto &mod : pending_modules_)
+    cnt += ids.contains(mod);
+  return cnt;
+}
+
+struct btf *BTF::load_module_btf(const std::string &name) const
+{
+  for (auto &btf_obj : btf_objects) {
+    if (btf_obj.name == name)
+      return btf_obj.btf;
   }
+
+  if (pending_modules_.erase(name) == 0)
+    return nullptr;
+
+  if (bpftrace_ && !bpftrace_->feature_->has_module_btf())
+    return nullptr;
+
+  auto id = kernel_btf_ids().find(name);
+  if (id == kernel_btf_ids().end())
+    return nullptr;
+
+  auto *btf = load_split_btf(id->second);
+  if (!btf) {
+    LOG(V1) << "BTF: failed to load BTF for module " << name << ": "
+            << strerror(errno);
+    return nullptr;
+  }
+
+  btf_objects.push_back(BTFObj{ .btf = btf, .id = id->second, .name = name });
+  return btf;
+}
+
+void BTF::load_module_btfs() const
+{
+  while (!pending_modules_.empty())
+    load_module_btf(std::string(*pending_modules_.begin()));
+}
+
+const BTF::BTFObj *BTF::get_btf_obj(size_t idx) const
+{
+  while (idx >= btf_objects.size() && !pending_modules_.empty())
+    load_module_btf(std::string(*pending_modules_.begin()));
+
+  return idx < btf_objects.size() ? &btf_objects[idx] : nullptr;
+}
+
+const std::unordered_multimap<std::string_view, __u32> &BTF::name_index(
+    const struct btf *btf) const
+{
+  auto index = name_indexes_.find(btf);
+  if (index != name_indexes_.end())
+    return index->second;
+
+  auto &new_index = name_indexes_[btf];
+  for (__s32 id = start_id(btf), max = static_cast<__s32>(type_cnt(btf));
+       id <= max;
+       ++id) {
+    const struct btf_type *t = btf__type_by_id(btf, id);
+    if (!t || !t->name_off)
+      continue;
+
+    const char *name = btf__name_by_offset(btf, t->name_off);
+    if (name && *name)
+      new_index.emplace(name, static_cast<__u32>(id));
+  }
+  return new_index;
 }
 
 static void dump_printf(void *ctx, const char *fmt, va_list args)
@@ -201,39 +295,64 @@ std::string BTF::dump_defs_from_btf(
     return std::string("");
   }
 
-  __s32 id, max = static_cast<__s32>(type_cnt(btf));
+  // Look the requested types up in the name index first. Split BTF shares
+  // type ids with vmlinux, so vmlinux types are valid ids in module BTFs, too.
+  std::set<__s32> ids;
+  for (auto it = types.begin(); it != types.end();) {
+    std::string_view name = *it;
+    for (std::string_view prefix : { "struct ", "union ", "enum " }) {
+      if (name.starts_with(prefix)) {
+        name.remove_prefix(prefix.size());
+        break;
+      }
+    }
 
-  // note that we're always iterating from 1 here as we need to go through the
-  // vmlinux BTF entries, too (even for kernel module BTFs)
+    std::optional<__s32> found;
+    auto find_in = [&](const struct btf *index_btf) {
+      auto [begin, end] = name_index(index_btf).equal_range(name);
+      for (auto cand = begin; cand != end; ++cand) {
+        const struct btf_type *t = btf__type_by_id(btf, cand->second);
+        if (t && full_type_str(btf, t) == *it &&
+            (!found || static_cast<__s32>(cand->second) < *found))
+          found = cand->second;
+      }
+    };
+    find_in(vmlinux_btf);
+    if (!found && btf != vmlinux_btf)
+      find_in(btf);
+
+    if (found) {
+      ids.insert(*found);
+      it = types.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  // Allow users to reference enum values by name to pull in entire enum defs.
+  // Enum values are not part of the name index so we need to scan for those.
+  __s32 id, max = static_cast<__s32>(type_cnt(btf));
   for (id = 1; id <= max && !types.empty(); id++) {
     const struct btf_type *t = btf__type_by_id(btf, id);
-    if (!t)
+    if (!t || !btf_is_enum(t))
       continue;
 
-    // Allow users to reference enum values by name to pull in entire enum defs
-    if (btf_is_enum(t)) {
-      const struct btf_enum *p = btf_enum(t);
-      uint16_t vlen = btf_vlen(t);
-      for (int e = 0; e < vlen; ++e, ++p) {
-        std::string str = btf_str(btf, p->name_off);
-        auto it = types.find(str);
-        if (it != types.end()) {
-          btf_dump__dump_type(dump, id);
-          types.erase(it);
-          break;
-        }
+    const struct btf_enum *p = btf_enum(t);
+    uint16_t vlen = btf_vlen(t);
+    for (int e = 0; e < vlen; ++e, ++p) {
+      std::string str = btf_str(btf, p->name_off);
+      auto it = types.find(str);
+      if (it != types.end()) {
+        ids.insert(id);
+        types.erase(it);
+        break;
       }
     }
-
-    std::string str = full_type_str(btf, t);
-
-    auto it = types.find(str);
-    if (it != types.end()) {
-      btf_dump__dump_type(dump, id);
-      types.erase(it);
-    }
   }
 
+  for (auto type_id : ids)
+    btf_dump__dump_type(dump, type_id);
+
   btf_dump__free(dump);
   return ret;
 }
@@ -246,6 +365,7 @@ std::string BTF::c_def(const std::unordered_set<std::string> &set) const
   // Definition dumping from multiple modules would require to resolve type
   // conflicts, so we allow dumping from a single module or from vmlinux only.
   std::unordered_set<std::string> to_dump(set);
+  load_module_btfs();
   if (btf_objects.size() == 2) {
     auto *mod_btf = btf_objects[0].btf == vmlinux_btf ? btf_objects[1].btf
                                                       : btf_objects[0].btf;
@@ -376,7 +496,16 @@ SizedType BTF::get_stype(const BTFId &btf_id, bool resolve_structs)
   if (!t)
     return CreateNone();
 
-  t = btf_type_skip_modifiers(t, btf_id.btf);
+  // Anonymous records are named by their typedef, the same way clang spells
+  // them (e.g. atomic_t)
+  std::string typedef_name;
+  while (t && btf_type_is_modifier(t)) {
+    if (btf_is_typedef(t))
+      typedef_name = btf_str(btf_id.btf, t->name_off);
+    t = btf__type_by_id(btf_id.btf, t->type);
+  }
+  if (!t)
+    return CreateNone();
 
   auto stype = CreateNone();
 
@@ -387,10 +516,13 @@ SizedType BTF::get_stype(const BTFId &btf_id, bool resolve_structs)
     stype = CreateInteger(t->size * 8, false);
   } else if (btf_is_composite(t)) {
     std::string cast = btf_str(btf_id.btf, t->name_off);
-    if (cast.empty() || cast == "(anon)")
+    std::string name;
+    if (!cast.empty() && cast != "(anon)")
+      name = std::string(btf_is_struct(t) ? "struct " : "union ") + cast;
+    else if (!typedef_name.empty())
+      name = typedef_name;
+    else
       return CreateNone();
-    std::string comp = btf_is_struct(t) ? "struct" : "union";
-    std::string name = comp + " " + cast;
 
     stype = CreateRecord(name, bpftrace_->structs.LookupOrAdd(name, t->size));
     if (resolve_structs)
@@ -530,11 +662,25 @@ std::string BTF::get_all_funcs_from_btf(const BTFObj &btf_obj) const
 std::unique_ptr<std::istream> BTF::get_all_funcs() const
 {
   auto funcs = std::make_unique<std::stringstream>();
+  load_module_btfs();
   for (auto &btf_obj : btf_objects)
     *funcs << get_all_funcs_from_btf(btf_obj);
   return funcs;
 }
 
+std::unique_ptr<std::istream> BTF::get_all_funcs(
+    const std::string &module) const
+{
+  auto funcs = std::make_unique<std::stringstream>();
+  if (load_module_btf(module)) {
+    for (auto &btf_obj : btf_objects) {
+      if (btf_obj.name == module)
+        *funcs << get_all_funcs_from_btf(btf_obj);
+    }
+  }
+  return funcs;
+}
+
 std::map<std::string, std::vector<std::string>> BTF::get_params_from_btf(
     const BTFObj &btf_obj,
     const std::set<std::string> &funcs) const
@@ -625,11 +771,11 @@ std::map<std::string, std::vector<std::string>> BTF::get_params(
     return params.find(f) != params.end();
   };
 
-  for (auto &btf_obj : btf_objects) {
+  for (size_t i = 0; const auto *btf_obj = get_btf_obj(i); i++) {
     if (std::all_of(funcs.begin(), funcs.end(), all_resolved))
       break;
 
-    auto mod_params = get_params_from_btf(btf_obj, funcs);
+    auto mod_params = get_params_from_btf(*btf_obj, funcs);
     params.insert(mod_params.begin(), mod_params.end());
   }
 
@@ -704,6 +850,7 @@ std::set<std::string> BTF::get_all_structs_from_btf(const struct btf *btf) const
 std::set<std::string> BTF::get_all_structs() const
 {
   std::set<std::string> structs;
+  load_module_btfs();
   for (auto &btf_obj : btf_objects) {
     auto mod_structs = get_all_structs_from_btf(btf_obj.btf);
     structs.insert(mod_structs.begin(), mod_structs.end());
@@ -711,6 +858,35 @@ std::set<std::string> BTF::get_all_structs() const
   return structs;
 }
 
+std::set<std::string> BTF::get_structs(const std::string &name) const
+{
+  std::string_view type_name = name;
+  for (std::string_view prefix : { "struct ", "union ", "enum " }) {
+    if (type_name.starts_with(prefix)) {
+      type_name.remove_prefix(prefix.size());
+      break;
+    }
+  }
+
+  std::set<std::string> structs;
+  for (size_t i = 0; const auto *btf_obj = get_btf_obj(i); i++) {
+    auto [begin, end] = name_index(btf_obj->btf).equal_range(type_name);
+    for (auto it = begin; it != end; ++it) {
+      const struct btf_type *t = btf__type_by_id(btf_obj->btf, it->second);
+      if (!t || !(btf_is_struct(t) || btf_is_union(t) || btf_is_enum(t)))
+        continue;
+
+      auto full_name = full_type_str(btf_obj->btf, t);
+      if (full_name == name)
+        structs.insert(std::move(full_name));
+    }
+    // Types are deduplicated against vmlinux, the first match is enough
+    if (!structs.empty())
+      break;
+  }
+  return structs;
+}
+
 std::unordered_set<std::string> BTF::get_all_iters_from_btf(
     const struct btf *btf) const
 {
@@ -744,6 +920,7 @@ std::unordered_set<std::string> BTF::get_all_iters_from_btf(
 std::unordered_set<std::string> BTF::get_all_iters() const
 {
   std::unordered_set<std::string> iters;
+  load_module_btfs();
   for (auto &btf_obj : btf_objects) {
     auto mod_iters = get_all_iters_from_btf(btf_obj.btf);
     iters.insert(mod_iters.begin(), mod_iters.end());
@@ -753,11 +930,14 @@ std::unordered_set<std::string> BTF::get_all_iters() const
 
 int BTF::get_btf_id(std::string_view func, std::string_view mod) const
 {
-  for (auto &btf_obj : btf_objects) {
-    if (!mod.empty() && mod != btf_obj.name)
-      continue;
+  if (!mod.empty()) {
+    auto *btf = mod == "vmlinux" ? vmlinux_btf
+                                 : load_module_btf(std::string(mod));
+    return btf ? find_id_in_btf(btf, func, BTF_KIND_FUNC) : -1;
+  }
 
-    auto id = find_id_in_btf(btf_obj.btf, func, BTF_KIND_FUNC);
+  for (size_t i = 0; const auto *btf_obj = get_btf_obj(i); i++) {
+    auto id = find_id_in_btf(btf_obj->btf, func, BTF_KIND_FUNC);
     if (id >= 0)
       return id;
   }
@@ -768,11 +948,10 @@ int BTF::get_btf_id(std::string_view func, std::string_view mod) const
 BTF::BTFId BTF::find_id(const std::string &name,
                         std::optional<__u32> kind) const
 {
-  for (auto &btf_obj : btf_objects) {
-    __s32 id = kind ? btf__find_by_name_kind(btf_obj.btf, name.c_str(), *kind)
-                    : btf__find_by_name(btf_obj.btf, name.c_str());
+  for (size_t i = 0; const auto *btf_obj = get_btf_obj(i); i++) {
+    __s32 id = find_id_in_btf(btf_obj->btf, name, kind);
     if (id >= 0)
-      return { btf_obj.btf, static_cast<__u32>(id) };
+      return { btf_obj->btf, static_cast<__u32>(id) };
   }
 
   return { nullptr, 0 };
@@ -782,20 +961,21 @@ __s32 BTF::find_id_in_btf(struct btf *btf,
                           std::string_view name,
                           std::optional<__u32> kind) const
 {
-  for (__s32 id = start_id(btf), max = static_cast<__s32>(type_cnt(btf));
-       id <= max;
-       ++id) {
-    const struct btf_type *t = btf__type_by_id(btf, id);
+  __s32 found = -1;
+  auto [begin, end] = name_index(btf).equal_range(name);
+  for (auto it = begin; it != end; ++it) {
+    const struct btf_type *t = btf__type_by_id(btf, it->second);
     if (!t)
       continue;
     if (kind && btf_kind(t) != *kind)
       continue;
 
-    std::string type_name = btf__name_by_offset(btf, t->name_off);
-    if (type_name == name)
-      return id;
+    // Prefer the first matching type, like a linear scan would
+    __s32 id = static_cast<__s32>(it->second);
+    if (found < 0 || id < found)
+      found = id;
   }
-  return -1;
+  return found;
 }
 
 void BTF::resolve_fields(SizedType &type)
@@ -811,12 +991,176 @@ void BTF::resolve_fields(SizedType &type)
   auto type_id = find_id(type_name, BTF_KIND_STRUCT);
   if (!type_id.btf)
     type_id = find_id(type_name, BTF_KIND_UNION);
-  if (!type_id.btf)
-    return;
+  if (!type_id.btf) {
+    // Anonymous record named by its typedef
+    type_id = find_id(type_name, BTF_KIND_TYPEDEF);
+    const struct btf_type *t = type_id.btf
+                                   ? btf__type_by_id(type_id.btf, type_id.id)
+                                   : nullptr;
+    while (t && btf_type_is_modifier(t)) {
+      type_id.id = t->type;
+      t = btf__type_by_id(type_id.btf, type_id.id);
+    }
+    if (!t || !btf_is_composite(t))
+      return;
+  }
 
   resolve_fields(type_id, record.get(), 0);
 }
 
+// Returns the record type which is referenced (directly or via pointers and
+// arrays) by the given type, if any.
+static const SizedType *inner_record_type(const SizedType &type)
+{
+  const SizedType *inner = &type;
+  while (inner->IsPtrTy() || inner->IsArrayTy())
+    inner = inner->IsPtrTy() ? inner->GetPointeeTy() : inner->GetElementTy();
+  return inner->IsRecordTy() ? inner : nullptr;
+}
+
+void BTF::resolve_types(const std::unordered_set<std::string> &types,
+                        unsigned max_depth)
+{
+  if (!has_data() || !bpftrace_)
+    return;
+
+  std::vector<SizedType> records;
+  std::unordered_set<std::string> identifiers;
+  for (const auto &name : types) {
+    if (name.starts_with("struct ") || name.starts_with("union ")) {
+      auto type_id = find_id(btf_type_str(name),
+                             name.starts_with("union ") ? BTF_KIND_UNION
+                                                        : BTF_KIND_STRUCT);
+      if (type_id.btf)
+        records.push_back(get_stype(type_id));
+    } else if (auto type_id = find_id(name, BTF_KIND_TYPEDEF); type_id.btf) {
+      // Typedefs (e.g. of field or argument types) are followed to the
+      // records they name, which is what clang would see in their definitions
+      auto stype = get_stype(type_id, false);
+      if (const auto *inner = inner_record_type(stype))
+        records.push_back(*inner);
+    } else if (!name.empty()) {
+      // Bare identifiers may reference enum values
+      identifiers.insert(name);
+    }
+  }
+
+  // Resolve the requested records, then the records they point to, one level
+  // of indirection at a time. This mirrors what ClangParser does with
+  // incomplete types.
+  for (unsigned depth = 0; depth <= max_depth && !records.empty(); depth++) {
+    std::vector<SizedType> next;
+    for (auto &record : records) {
+      resolve_fields(record);
+      auto str = bpftrace_->structs.Lookup(record.GetName()).lock();
+      if (!str)
+        continue;
+      for (auto &field : str->fields) {
+        const auto *inner = inner_record_type(field.type);
+        if (!inner)
+          continue;
+        auto inner_str = bpftrace_->structs.Lookup(inner->GetName()).lock();
+        if (inner_str && !inner_str->HasFields())
+          next.push_back(*inner);
+      }
+    }
+    records = std::move(next);
+  }
+
+  if (identifiers.empty())
+    return;
+
+  for (size_t i = 0; const auto *btf_obj = get_btf_obj(i); i++) {
+    auto *btf = btf_obj->btf;
+    for (__s32 id = start_id(btf), max = static_cast<__s32>(type_cnt(btf));
+         id <= max && !identifiers.empty();
+         ++id) {
+      const struct btf_type *t = btf__type_by_id(btf, id);
+      if (!t || !btf_is_enum(t))
+        continue;
+
+      const struct btf_enum *p = btf_enum(t);
+      bool used = false;
+      for (int e = 0; e < btf_vlen(t); ++e, ++p)
+        used |= identifiers.erase(btf_str(btf, p->name_off)) > 0;
+
+      if (used)
+        add_enum(BTFId{ .btf = btf, .id = static_cast<__u32>(id) });
+    }
+  }
+}
+
+std::optional<Struct> BTF::resolve_raw_tracepoint_args(
+    const std::string &event)
+{
+  if (!has_data() || !bpftrace_ || !vmlinux_btf)
+    return std::nullopt;
+
+  auto id = find_id_in_btf(vmlinux_btf,
+                           "trace_event_raw_" + event,
+                           BTF_KIND_STRUCT);
+  if (id < 0)
+    return std::nullopt;
+
+  const struct btf_type *t = btf__type_by_id(vmlinux_btf, id);
+  Struct raw(t->size, false);
+  resolve_fields(BTFId{ .btf = vmlinux_btf, .id = static_cast<__u32>(id) },
+                 &raw,
+                 0);
+  if (!raw.HasFields())
+    return std::nullopt;
+
+  static constexpr std::string_view data_loc_prefix = "__data_loc_";
+  Struct args(raw.size, false);
+  for (const auto &field : raw.fields) {
+    if (field.name == "ent" && field.type.IsRecordTy()) {
+      // struct trace_entry holds the common_* fields
+      auto entry = bpftrace_->structs.Lookup(field.type.GetName()).lock();
+      if (!entry || !entry->HasFields())
+        return std::nullopt;
+      for (const auto &common : entry->fields)
+        args.AddField(common.name,
+                      common.type,
+                      field.offset + common.offset,
+                      common.bitfield);
+    } else if (field.name.starts_with(data_loc_prefix)) {
+      args.AddField(field.name.substr(data_loc_prefix.size()),
+                    CreateInt64(),
+                    field.offset,
+                    std::nullopt,
+                    true);
+    } else if (field.name.starts_with("__rel_loc_")) {
+      // Not supported, let the caller fall back to the format file
+      return std::nullopt;
+    } else if (field.name != "__data") {
+      // __data is the flexible array holding the __data_loc contents
+      args.fields.push_back(field);
+    }
+  }
+  return args;
+}
+
+void BTF::add_enum(const BTFId &enum_id)
+{
+  const struct btf_type *t = btf__type_by_id(enum_id.btf, enum_id.id);
+  std::string enum_name = t->name_off
+                              ? btf_str(enum_id.btf, t->name_off)
+                              : "enum <anon_" + std::to_string(enum_id.id) +
+                                    ">";
+
+  const struct btf_enum *p = btf_enum(t);
+  for (int e = 0; e < btf_vlen(t); ++e, ++p) {
+    std::string variant_name = btf_str(enum_id.btf, p->name_off);
+    uint64_t variant_value = btf_kflag(t)
+                                 ? static_cast<uint64_t>(
+                                       static_cast<__u32>(p->val))
+                                 : static_cast<uint64_t>(
+                                       static_cast<int64_t>(p->val));
+    bpftrace_->enums_[variant_name] = std::make_pair(variant_value, enum_name);
+    bpftrace_->enum_defs_[enum_name][variant_value] = variant_name;
+  }
+}
+
 static std::optional<Bitfield> resolve_bitfield(
     const struct btf_type *record_type,
     __u32 member_idx)
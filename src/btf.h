@@ -8,7 +8,9 @@
 #include <regex>
 #include <set>
 #include <string>
+#include <string_view>
 #include <unistd.h>
+#include <unordered_map>
 #include <unordered_set>
 
 // Taken from libbpf
@@ -56,13 +58,12 @@ public:
   {
     bpftrace_ = bpftrace;
   };
-  ~BTF();
+  virtual ~BTF();
 
   bool has_data(void) const;
-  size_t objects_cnt() const
-  {
-    return btf_objects.size();
-  }
+  // Number of BTF objects available for the requested modules, including
+  // those which have not been loaded, yet
+  size_t objects_cnt() const;
   std::string c_def(const std::unordered_set<std::string>& set) const;
   std::string type_of(const std::string& name, const std::string& field);
   std::string type_of(const BTFId& type_id, const std::string& field);
@@ -71,6 +72,10 @@ public:
 
   std::set<std::string> get_all_structs() const;
   std::unique_ptr<std::istream> get_all_funcs() const;
+  // Only loads the BTF of `module` (which may be "vmlinux")
+  std::unique_ptr<std::istream> get_all_funcs(const std::string& module) const;
+  // Looks `name` up in the type name indexes instead of walking all types
+  std::set<std::string> get_structs(const std::string& name) const;
   std::unordered_set<std::string> get_all_iters() const;
   std::map<std::string, std::vector<std::string>> get_params(
       const std::set<std::string>& funcs) const;
@@ -79,13 +84,45 @@ public:
                                      bool ret,
                                      std::string& err);
   void resolve_fields(SizedType& type);
+  // Populate StructManager and the enum tables of BPFtrace with the given
+  // types directly from BTF, following pointers to records up to max_depth
+  // levels. This yields the same information as running ClangParser over the
+  // BTF-generated header, so it can be used instead when the program has no
+  // C definitions of its own.
+  void resolve_types(const std::unordered_set<std::string>& types,
+                     unsigned max_depth);
+  // Build the args record of a tracepoint from the kernel's
+  // `struct trace_event_raw_<event>`, in the layout of the tracepoint format
+  // file: the common fields are inlined and __data_loc fields are unwrapped.
+  // Only vmlinux BTF is searched.
+  std::optional<Struct> resolve_raw_tracepoint_args(const std::string& event);
 
   int get_btf_id(std::string_view func, std::string_view mod) const;
 
+protected:
+  // Kernel module name -> kernel BTF object id of all loaded modules. Also
+  // records the object id of vmlinux.
+  virtual std::map<std::string, __u32> read_kernel_btf_ids() const;
+  virtual struct btf* load_split_btf(__u32 id) const;
+
+  // Modules requested by the script whose BTF has not been loaded, yet
+  mutable std::set<std::string> pending_modules_;
+
 private:
   void load_kernel_btfs(const std::set<std::string>& modules);
+  // Module BTFs are loaded lazily, only once a lookup cannot be satisfied
+  // from the BTF objects loaded so far (usually just vmlinux).
+  const std::map<std::string, __u32>& kernel_btf_ids() const;
+  struct btf* load_module_btf(const std::string& name) const;
+  void load_module_btfs() const;
+  // Returns the idx-th BTF object, loading the next pending module BTF if
+  // necessary. Returns nullptr once all objects have been visited.
+  const BTFObj* get_btf_obj(size_t idx) const;
+  const std::unordered_multimap<std::string_view, __u32>& name_index(
+      const struct btf* btf) const;
   SizedType get_stype(const BTFId& btf_id, bool resolve_structs = true);
   void resolve_fields(const BTFId& type_id, Struct* record, __u32 start_offset);
+  void add_enum(const BTFId& enum_id);
   const struct btf_type* btf_type_skip_modifiers(const struct btf_type* t,
                                                  const struct btf* btf);
   BTF::BTFId find_id(const std::string& name,
@@ -113,8 +150,14 @@ private:
 
   struct btf* vmlinux_btf = nullptr;
   __s32 vmlinux_btf_size;
-  // BTF objects for vmlinux and modules
-  std::vector<BTFObj> btf_objects;
+  // BTF objects for vmlinux and modules loaded so far
+  mutable std::vector<BTFObj> btf_objects;
+  // Kernel module name -> kernel BTF object id
+  mutable std::optional<std::map<std::string, __u32>> kernel_btf_ids_;
+  // Per-object type name -> type ids index, built on first lookup
+  mutable std::unordered_map<const struct btf*,
+                             std::unordered_multimap<std::string_view, __u32>>
+      name_indexes_;
   enum state state = NODATA;
   BPFtrace* bpftrace_ = nullptr;
 };
@@ -5,12 +5,14 @@
 #include "config.h"
 #include "log.h"
 #include "types.h"
+#include "utils.h"
 
 namespace bpftrace {
 
 Config::Config(bool has_cmd)
 {
   config_map_ = {
+    { ConfigKeyBool::adaptive_sampling, { .value = false } },
     { ConfigKeyBool::cpp_demangle, { .value = true } },
     { ConfigKeyBool::lazy_symbolication, { .value = false } },
     { ConfigKeyBool::probe_inline, { .value = false } },
@@ -20,17 +22,21 @@ Config::Config(bool has_cmd)
 #else
     { ConfigKeyBool::use_blazesym, { .value = true } },
 #endif
+    { ConfigKeyInt::codegen_threads, { .value = static_cast<uint64_t>(1) } },
     { ConfigKeyInt::log_size, { .value = static_cast<uint64_t>(1000000) } },
     { ConfigKeyInt::max_bpf_progs, { .value = static_cast<uint64_t>(1024) } },
     { ConfigKeyInt::max_cat_bytes, { .value = static_cast<uint64_t>(10240) } },
     { ConfigKeyInt::max_map_keys, { .value = static_cast<uint64_t>(4096) } },
     { ConfigKeyInt::max_probes, { .value = static_cast<uint64_t>(1024) } },
+    { ConfigKeyInt::max_stack_ids,
+      { .value = static_cast<uint64_t>(128 << 10) } },
     { ConfigKeyInt::max_strlen, { .value = static_cast<uint64_t>(1024) } },
     { ConfigKeyInt::max_type_res_iterations,
       { .value = static_cast<uint64_t>(0) } },
     { ConfigKeyInt::on_stack_limit, { .value = static_cast<uint64_t>(32) } },
     { ConfigKeyInt::perf_rb_pages, { .value = static_cast<uint64_t>(64) } },
     { ConfigKeyStackMode::default_, { .value = StackMode::bpftrace } },
+    { ConfigKeyString::quantiles, { .value = std::string("50,90,99,99.9") } },
     { ConfigKeyString::str_trunc_trailer, { .value = std::string("..") } },
     { ConfigKeySymbolSource::default_,
       { .value =
@@ -42,6 +48,8 @@ Config::Config(bool has_cmd)
       } },
     { ConfigKeyMissingProbes::default_,
       { .value = ConfigMissingProbes::warn } },
+    { ConfigKeyStackMapType::default_,
+      { .value = ConfigStackMapType::lru_hash } },
     // by default, cache user symbols per program if ASLR is disabled on system
     // or `-c` option is given
     { ConfigKeyUserSymbolCacheType::default_,
@@ -100,6 +108,27 @@ std::optional<StackMode> Config::get_stack_mode(const std::string &s)
   return std::nullopt;
 }
 
+std::optional<std::vector<double>> Config::parse_quantiles(
+    const std::string &s)
+{
+  std::vector<double> quantiles;
+  for (const auto &token : split_string(s, ',', /* remove_empty */ true)) {
+    size_t idx = 0;
+    double q;
+    try {
+      q = std::stod(token, &idx);
+    } catch (const std::exception &) {
+      return std::nullopt;
+    }
+    if (idx != token.size() || !(q > 0 && q <= 100))
+      return std::nullopt;
+    quantiles.push_back(q);
+  }
+  if (quantiles.empty())
+    return std::nullopt;
+  return quantiles;
+}
+
 std::optional<ConfigKey> Config::get_config_key(const std::string &str,
                                                 std::string &err)
 {
@@ -193,4 +222,29 @@ bool ConfigSetter::set_missing_probes_config(const std::string &s)
   return config_.set(ConfigKeyMissingProbes::default_, mp, source_);
 }
 
+bool ConfigSetter::set_stack_map_type_config(const std::string &s)
+{
+  ConfigStackMapType type;
+  if (s == "lru_hash") {
+    type = ConfigStackMapType::lru_hash;
+  } else if (s == "hash") {
+    type = ConfigStackMapType::hash;
+  } else {
+    LOG(ERROR) << "Invalid value for stack_map_type: valid values are "
+                  "\"lru_hash\" and \"hash\".";
+    return false;
+  }
+  return config_.set(ConfigKeyStackMapType::default_, type, source_);
+}
+
+bool ConfigSetter::set_quantiles(const std::string &s)
+{
+  if (!Config::parse_quantiles(s).has_value()) {
+    LOG(ERROR) << "Invalid value for quantiles: expected a comma separated "
+                  "list of percentiles in (0, 100], e.g. \"50,99,99.9\".";
+    return false;
+  }
+  return config_.set(ConfigKeyString::quantiles, s, source_);
+}
+
 } // namespace bpftrace
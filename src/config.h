@@ -6,6 +6,7 @@
 #include <optional>
 #include <set>
 #include <variant>
+#include <vector>
 
 #include "types.h"
 
@@ -23,6 +24,7 @@ enum class ConfigSource {
 };
 
 enum class ConfigKeyBool {
+  adaptive_sampling,
   cpp_demangle,
   lazy_symbolication,
   probe_inline,
@@ -31,11 +33,13 @@ enum class ConfigKeyBool {
 };
 
 enum class ConfigKeyInt {
+  codegen_threads,
   log_size,
   max_bpf_progs,
   max_cat_bytes,
   max_map_keys,
   max_probes,
+  max_stack_ids,
   max_strlen,
   max_type_res_iterations,
   on_stack_limit,
@@ -43,6 +47,7 @@ enum class ConfigKeyInt {
 };
 
 enum class ConfigKeyString {
+  quantiles,
   str_trunc_trailer,
 };
 
@@ -73,19 +78,31 @@ enum class ConfigKeyMissingProbes {
   default_,
 };
 
+enum class ConfigStackMapType {
+  lru_hash,
+  hash,
+};
+
+enum class ConfigKeyStackMapType {
+  default_,
+};
+
 typedef std::variant<ConfigKeyBool,
                      ConfigKeyInt,
                      ConfigKeyString,
                      ConfigKeyStackMode,
                      ConfigKeyUserSymbolCacheType,
                      ConfigKeySymbolSource,
-                     ConfigKeyMissingProbes>
+                     ConfigKeyMissingProbes,
+                     ConfigKeyStackMapType>
     ConfigKey;
 
 // The strings in CONFIG_KEY_MAP AND ENV_ONLY match the env variables (minus the
 // 'BPFTRACE_' prefix)
 const std::map<std::string, ConfigKey> CONFIG_KEY_MAP = {
+  { "adaptive_sampling", ConfigKeyBool::adaptive_sampling },
   { "cache_user_symbols", ConfigKeyUserSymbolCacheType::default_ },
+  { "codegen_threads", ConfigKeyInt::codegen_threads },
   { "cpp_demangle", ConfigKeyBool::cpp_demangle },
   { "lazy_symbolication", ConfigKeyBool::lazy_symbolication },
   { "log_size", ConfigKeyInt::log_size },
@@ -93,11 +110,14 @@ const std::map<std::string, ConfigKey> CONFIG_KEY_MAP = {
   { "max_cat_bytes", ConfigKeyInt::max_cat_bytes },
   { "max_map_keys", ConfigKeyInt::max_map_keys },
   { "max_probes", ConfigKeyInt::max_probes },
+  { "max_stack_ids", ConfigKeyInt::max_stack_ids },
   { "max_strlen", ConfigKeyInt::max_strlen },
   { "max_type_res_iterations", ConfigKeyInt::max_type_res_iterations },
   { "on_stack_limit", ConfigKeyInt::on_stack_limit },
   { "perf_rb_pages", ConfigKeyInt::perf_rb_pages },
   { "probe_inline", ConfigKeyBool::probe_inline },
+  { "quantiles", ConfigKeyString::quantiles },
+  { "stack_map_type", ConfigKeyStackMapType::default_ },
   { "stack_mode", ConfigKeyStackMode::default_ },
   { "str_trunc_trailer", ConfigKeyString::str_trunc_trailer },
   { "symbol_source", ConfigKeySymbolSource::default_ },
@@ -120,7 +140,8 @@ struct ConfigValue {
                StackMode,
                UserSymbolCacheType,
                ConfigSymbolSource,
-               ConfigMissingProbes>
+               ConfigMissingProbes,
+               ConfigStackMapType>
       value;
 };
 
@@ -163,7 +184,15 @@ public:
     return get<ConfigMissingProbes>(key);
   }
 
+  ConfigStackMapType get(ConfigKeyStackMapType key) const
+  {
+    return get<ConfigStackMapType>(key);
+  }
+
   static std::optional<StackMode> get_stack_mode(const std::string &s);
+  // Parses a comma separated list of percentiles, e.g. "50,99,99.9"
+  static std::optional<std::vector<double>> parse_quantiles(
+      const std::string &s);
   std::optional<ConfigKey> get_config_key(const std::string &str,
                                           std::string &err);
 
@@ -243,10 +272,17 @@ public:
     return config_.set(ConfigKeyMissingProbes::default_, val, source_);
   }
 
+  bool set(ConfigStackMapType val)
+  {
+    return config_.set(ConfigKeyStackMapType::default_, val, source_);
+  }
+
   bool set_stack_mode(const std::string &s);
   bool set_user_symbol_cache_type(const std::string &s);
   bool set_symbol_source_config(const std::string &s);
   bool set_missing_probes_config(const std::string &s);
+  bool set_stack_map_type_config(const std::string &s);
+  bool set_quantiles(const std::string &s);
 
   Config &config_;
 
@@ -7,6 +7,7 @@
 
 #include <bpf/bpf.h>
 #include <bpf/btf.h>
+#include <cstring>
 #include <elf.h>
 #include <map>
 #include <stdexcept>
@@ -149,6 +150,7 @@ static void update_global_vars_rodata(
       case GlobalVar::WRITE_MAP_VALUE_BUFFER:
       case GlobalVar::VARIABLE_BUFFER:
       case GlobalVar::MAP_KEY_BUFFER:
+      case GlobalVar::SCALAR_AGG_BUFFER:
         break;
     }
   }
@@ -196,7 +198,9 @@ static void update_global_vars_custom_rw_section(
         std::to_string(desired_size) + " for section " + section_name);
   }
 
-  // No need to memset to zero as we memset on each usage
+  // No need to memset to zero: scratch buffers are memset on each usage and
+  // the resized section starts out zeroed, which is what the scalar
+  // aggregation buffer relies on
 
   // Verify we can still find variable name via BTF and it hasn't been cleared
   // after size changes
@@ -305,6 +309,11 @@ SizedType get_type(bpftrace::globalvars::GlobalVar global_var,
       return make_rw_type(resources.map_key_buffers,
                           CreateArray(resources.max_map_key_size,
                                       CreateInt8()));
+    case GlobalVar::SCALAR_AGG_BUFFER:
+      assert(resources.scalar_agg_slots > 0);
+      return make_rw_type(scalar_agg_row_slots(resources.scalar_agg_slots),
+                          CreateArray(SCALAR_AGG_SLOT_SIZE / 8,
+                                      CreateUInt64()));
   }
   return {}; // unreachable
 }
@@ -318,4 +327,55 @@ std::unordered_set<std::string> get_section_names()
   return ret;
 }
 
+size_t scalar_agg_row_slots(size_t num_slots)
+{
+  constexpr size_t slots_per_line = SCALAR_AGG_ROW_ALIGN /
+                                    SCALAR_AGG_SLOT_SIZE;
+  return (num_slots + slots_per_line - 1) / slots_per_line * slots_per_line;
+}
+
+std::optional<std::vector<uint8_t>> read_scalar_agg(
+    std::span<const uint8_t> buffer,
+    size_t num_slots,
+    uint32_t slot,
+    size_t value_size,
+    const std::vector<int> &cpus)
+{
+  const size_t row_size = scalar_agg_row_slots(num_slots) *
+                          SCALAR_AGG_SLOT_SIZE;
+  const size_t offset = slot * SCALAR_AGG_SLOT_SIZE;
+
+  std::vector<uint8_t> value;
+  bool is_set = false;
+  for (int cpu : cpus) {
+    size_t start = cpu * row_size + offset;
+    if (start + SCALAR_AGG_SLOT_SIZE > buffer.size())
+      return std::nullopt;
+    const uint8_t *slot_data = buffer.data() + start;
+    uint64_t cpu_is_set;
+    std::memcpy(&cpu_is_set, slot_data + sizeof(uint64_t), sizeof(uint64_t));
+    is_set |= cpu_is_set != 0;
+    value.insert(value.end(), slot_data, slot_data + value_size);
+  }
+
+  if (!is_set)
+    return std::nullopt;
+  return value;
+}
+
+void reset_scalar_agg(std::span<uint8_t> buffer,
+                      size_t num_slots,
+                      uint32_t slot,
+                      bool keep_is_set)
+{
+  const size_t row_size = scalar_agg_row_slots(num_slots) *
+                          SCALAR_AGG_SLOT_SIZE;
+  const size_t len = keep_is_set ? sizeof(uint64_t) : SCALAR_AGG_SLOT_SIZE;
+
+  for (size_t start = slot * SCALAR_AGG_SLOT_SIZE;
+       start + SCALAR_AGG_SLOT_SIZE <= buffer.size();
+       start += row_size)
+    std::memset(buffer.data() + start, 0, len);
+}
+
 } // namespace bpftrace::globalvars
@@ -2,6 +2,7 @@
 
 #include <optional>
 #include <set>
+#include <span>
 #include <string>
 
 #include "bpftrace.h"
@@ -27,6 +28,16 @@ constexpr std::string_view WRITE_MAP_VALUE_BUFFER_SECTION_NAME =
     ".data.write_map_val_buf";
 constexpr std::string_view VARIABLE_BUFFER_SECTION_NAME = ".data.var_buf";
 constexpr std::string_view MAP_KEY_BUFFER_SECTION_NAME = ".data.map_key_buf";
+constexpr std::string_view SCALAR_AGG_BUFFER_SECTION_NAME =
+    ".data.scalar_agg_buf";
+
+// Each keyless aggregation gets a slot of two u64s in the scalar aggregation
+// buffer: the value and, for min() and max(), whether it has been set. This
+// matches the value layout of the equivalent per-CPU map.
+constexpr size_t SCALAR_AGG_SLOT_SIZE = 16;
+// Each CPU's row of slots is rounded up to whole cache lines, so CPUs never
+// write to the same cache line
+constexpr size_t SCALAR_AGG_ROW_ALIGN = 64;
 
 struct GlobalVarConfig {
   std::string name;
@@ -56,6 +67,10 @@ const std::unordered_map<GlobalVar, GlobalVarConfig> GLOBAL_VAR_CONFIGS = {
     { "var_buf", std::string(VARIABLE_BUFFER_SECTION_NAME), false } },
   { GlobalVar::MAP_KEY_BUFFER,
     { "map_key_buf", std::string(MAP_KEY_BUFFER_SECTION_NAME), false } },
+  { GlobalVar::SCALAR_AGG_BUFFER,
+    { "scalar_agg_buf",
+      std::string(SCALAR_AGG_BUFFER_SECTION_NAME),
+      false } },
 };
 
 void update_global_vars(
@@ -69,5 +84,23 @@ SizedType get_type(GlobalVar global_var,
                    const Config &bpftrace_config);
 std::unordered_set<std::string> get_section_names();
 
+// Number of slots in a CPU's row of the scalar aggregation buffer, including
+// the padding up to SCALAR_AGG_ROW_ALIGN
+size_t scalar_agg_row_slots(size_t num_slots);
+// Collects the per-CPU values of a slot of the scalar aggregation buffer, see
+// BPFtrace::read_scalar_agg
+std::optional<std::vector<uint8_t>> read_scalar_agg(
+    std::span<const uint8_t> buffer,
+    size_t num_slots,
+    uint32_t slot,
+    size_t value_size,
+    const std::vector<int> &cpus);
+// Zeroes a slot of the scalar aggregation buffer on every CPU. With
+// keep_is_set, only the value is zeroed.
+void reset_scalar_agg(std::span<uint8_t> buffer,
+                      size_t num_slots,
+                      uint32_t slot,
+                      bool keep_is_set);
+
 } // namespace globalvars
 } // namespace bpftrace
@@ -8,6 +8,10 @@
 #define BPF_PSEUDO_MAP_VALUE 2
 #endif
 
+#ifndef BPF_PSEUDO_FUNC
+#define BPF_PSEUDO_FUNC 4
+#endif
+
 #ifndef BPF_F_KPROBE_MULTI_RETURN
 #define BPF_F_KPROBE_MULTI_RETURN (1U << 0)
 #endif
@@ -37,6 +37,7 @@
 #include "probe_matcher.h"
 #include "procmon.h"
 #include "run_bpftrace.h"
+#include "timing_trace.h"
 #include "tracepoint_format_parser.h"
 #include "utils.h"
 #include "version.h"
@@ -79,6 +80,10 @@ enum Options {
   NO_FEATURE,
   DEBUG,
   DRY_RUN,
+  REPROBE_FEATURES,
+  PROBE_STATS,
+  TIMING_TRACE,
+  OPT,
 };
 } // namespace
 
@@ -107,9 +112,14 @@ void usage(std::ostream& out)
   out << "    --unsafe       allow unsafe/destructive functionality" << std::endl;
   out << "    -q             keep messages quiet" << std::endl;
   out << "    --info         Print information about kernel BPF support" << std::endl;
+  out << "    --reprobe-features" << std::endl;
+  out << "                   ignore cached kernel feature probe results" << std::endl;
   out << "    -k             emit a warning when probe read helpers return an error" << std::endl;
+  out << "    --probe-stats[=SECONDS]" << std::endl;
+  out << "                   report run count and time of each probe at exit (and every SECONDS)" << std::endl;
   out << "    -V, --version  bpftrace version" << std::endl;
   out << "    --no-warnings  disable all warning messages" << std::endl;
+  out << "    --opt PROFILE  optimization profile ('fast', 'default', 'size')" << std::endl;
   out << std::endl;
   out << "TROUBLESHOOTING OPTIONS:" << std::endl;
   out << "    -v                      verbose messages" << std::endl;
@@ -117,11 +127,14 @@ void usage(std::ostream& out)
   out << "    -d STAGE                debug info for various stages of bpftrace execution" << std::endl;
   out << "                            ('all', 'ast', 'codegen', 'codegen-opt', 'dis', 'libbpf', 'verifier')" << std::endl;
   out << "    --emit-elf FILE         (dry run) generate ELF file with bpf programs and write to FILE" << std::endl;
+  out << "    --timing-trace FILE     write the time spent in each phase of bpftrace to FILE (Chrome trace format)" << std::endl;
   out << "    --emit-llvm FILE        write LLVM IR to FILE.original.ll and FILE.optimized.ll" << std::endl;
   out << std::endl;
   out << "ENVIRONMENT:" << std::endl;
+  out << "    BPFTRACE_ADAPTIVE_SAMPLING        [default: 0] sample events instead of losing them when output is saturated" << std::endl;
   out << "    BPFTRACE_BTF                      [default: none] BTF file" << std::endl;
   out << "    BPFTRACE_CACHE_USER_SYMBOLS       [default: auto] enable user symbol cache" << std::endl;
+  out << "    BPFTRACE_CODEGEN_THREADS          [default: 1] number of threads optimizing BPF programs (0 = one per CPU)" << std::endl;
   out << "    BPFTRACE_COLOR                    [default: auto] enable log output colorization" << std::endl;
   out << "    BPFTRACE_CPP_DEMANGLE             [default: 1] enable C++ symbol demangling" << std::endl;
   out << "    BPFTRACE_DEBUG_OUTPUT             [default: 0] enable bpftrace's internal debugging outputs" << std::endl;
@@ -133,9 +146,11 @@ void usage(std::ostream& out)
   out << "    BPFTRACE_MAX_CAT_BYTES            [default: 10k] maximum bytes read by cat builtin" << std::endl;
   out << "    BPFTRACE_MAX_MAP_KEYS             [default: 4096] max keys in a map" << std::endl;
   out << "    BPFTRACE_MAX_PROBES               [default: 1024] max number of probes" << std::endl;
+  out << "    BPFTRACE_MAX_STACK_IDS            [default: 131072] max distinct stacks stored for kstack/ustack" << std::endl;
   out << "    BPFTRACE_MAX_STRLEN               [default: 1024] bytes on BPF stack per str()" << std::endl;
   out << "    BPFTRACE_MAX_TYPE_RES_ITERATIONS  [default: 0] number of levels of nested field accesses for tracepoint args" << std::endl;
   out << "    BPFTRACE_PERF_RB_PAGES            [default: 64] pages per CPU to allocate for ring buffer" << std::endl;
+  out << "    BPFTRACE_STACK_MAP_TYPE           [default: lru_hash] map type storing kstack/ustack traces" << std::endl;
   out << "    BPFTRACE_STACK_MODE               [default: bpftrace] Output format for ustack and kstack builtins" << std::endl;
   out << "    BPFTRACE_STR_TRUNC_TRAILER        [default: '..'] string truncation trailer" << std::endl;
   out << "    BPFTRACE_VMLINUX                  [default: none] vmlinux path used for kernel symbol resolution" << std::endl;
@@ -164,7 +179,7 @@ static void enforce_infinite_rlimit()
                  << "\"ulimit -l 8192\" to fix the problem";
 }
 
-static void info(BPFnofeature no_feature)
+static void info(BPFnofeature no_feature, bool reprobe_features)
 {
   struct utsname utsname;
   uname(&utsname);
@@ -178,7 +193,9 @@ static void info(BPFnofeature no_feature)
   std::cout << BuildInfo::report();
 
   std::cout << std::endl;
-  std::cout << BPFfeature(no_feature).report();
+  BPFfeature feature(no_feature);
+  feature.enable_cache(reprobe_features);
+  std::cout << feature.report();
 }
 
 static std::optional<struct timespec> get_delta_with_boottime(int clock_type)
@@ -266,6 +283,15 @@ static void parse_env(BPFtrace& bpftrace)
   if (const char* env_p = std::getenv("BPFTRACE_STR_TRUNC_TRAILER"))
     config_setter.set(ConfigKeyString::str_trunc_trailer, std::string(env_p));
 
+  if (const char* env_p = std::getenv("BPFTRACE_QUANTILES")) {
+    if (!config_setter.set_quantiles(env_p))
+      exit(1);
+  }
+
+  get_bool_env_var("BPFTRACE_ADAPTIVE_SAMPLING", [&](bool x) {
+    config_setter.set(ConfigKeyBool::adaptive_sampling, x);
+  });
+
   get_bool_env_var("BPFTRACE_CPP_DEMANGLE", [&](bool x) {
     config_setter.set(ConfigKeyBool::cpp_demangle, x);
   });
@@ -289,6 +315,10 @@ static void parse_env(BPFtrace& bpftrace)
     config_setter.set(ConfigKeyInt::max_bpf_progs, x);
   });
 
+  get_uint64_env_var("BPFTRACE_CODEGEN_THREADS", [&](uint64_t x) {
+    config_setter.set(ConfigKeyInt::codegen_threads, x);
+  });
+
   get_uint64_env_var("BPFTRACE_LOG_SIZE", [&](uint64_t x) {
     config_setter.set(ConfigKeyInt::log_size, x);
   });
@@ -319,6 +349,15 @@ static void parse_env(BPFtrace& bpftrace)
       exit(1);
   }
 
+  get_uint64_env_var("BPFTRACE_MAX_STACK_IDS", [&](uint64_t x) {
+    config_setter.set(ConfigKeyInt::max_stack_ids, x);
+  });
+
+  if (const char* env_p = std::getenv("BPFTRACE_STACK_MAP_TYPE")) {
+    if (!config_setter.set_stack_map_type_config(env_p))
+      exit(1);
+  }
+
   get_bool_env_var("BPFTRACE_NO_CPP_DEMANGLE", [&](bool x) {
     LOG(WARNING) << "BPFTRACE_NO_CPP_DEMANGLE is deprecated. Use "
                     "BPFTRACE_CPP_DEMANGLE=0 instead.";
@@ -360,19 +399,28 @@ static void parse_env(BPFtrace& bpftrace)
   driver.source(name, program);
   int err;
 
-  err = driver.parse();
+  {
+    timing::Phase phase("parse", "compile");
+    err = driver.parse();
+  }
   if (err)
     return std::nullopt;
 
   bpftrace.parse_btf(driver.list_modules());
 
-  ast::FieldAnalyser fields(driver.ctx, bpftrace);
-  err = fields.analyse();
+  {
+    timing::Phase phase("FieldAnalyser", "compile");
+    ast::FieldAnalyser fields(driver.ctx, bpftrace);
+    err = fields.analyse();
+  }
   if (err)
     return std::nullopt;
 
-  if (TracepointFormatParser::parse(driver.ctx, bpftrace) == false)
-    return std::nullopt;
+  {
+    timing::Phase phase("tracepoint formats", "compile");
+    if (TracepointFormatParser::parse(driver.ctx, bpftrace) == false)
+      return std::nullopt;
+  }
 
   // NOTE(mmarchini): if there are no C definitions, clang parser won't run to
   // avoid issues in some versions. Since we're including files in the command
@@ -384,7 +432,25 @@ static void parse_env(BPFtrace& bpftrace)
   bool should_clang_parse = !(driver.ctx.root->c_definitions.empty() &&
                               bpftrace.btf_set_.empty());
 
+  // If the program has no C definitions of its own, all the types clang would
+  // see come from BTF, so take them from there directly and skip clang.
+  if (should_clang_parse && driver.ctx.root->c_definitions.empty() &&
+      bpftrace.has_btf_data()) {
+    uint64_t field_lvl = 1;
+    for (auto* probe : driver.ctx.root->probes)
+      if (probe->tp_args_structs_level > static_cast<int>(field_lvl))
+        field_lvl = probe->tp_args_structs_level;
+    auto max_depth = std::max(
+        bpftrace.config_.get(ConfigKeyInt::max_type_res_iterations),
+        field_lvl);
+
+    bpftrace.btf_->resolve_types(bpftrace.btf_set_, max_depth);
+    LOG(V1) << "Resolved types from BTF, skipping clang parser";
+    should_clang_parse = false;
+  }
+
   if (should_clang_parse) {
+    timing::Phase phase("clang parse", "compile");
     ClangParser clang;
     std::string ksrc, kobj;
     struct utsname utsname;
@@ -421,7 +487,10 @@ static void parse_env(BPFtrace& bpftrace)
     }
   }
 
-  err = driver.parse();
+  {
+    timing::Phase phase("reparse", "compile");
+    err = driver.parse();
+  }
   if (err)
     return {};
 
@@ -458,6 +527,11 @@ struct Args {
   bool usdt_file_activation = false;
   int helper_check_level = 1;
   bool no_warnings = false;
+  bool info = false;
+  bool reprobe_features = false;
+  bool probe_stats = false;
+  uint64_t probe_stats_interval = 0;
+  OptProfile opt_profile = OptProfile::default_;
   TestMode test_mode = TestMode::UNSET;
   std::string script;
   std::string search;
@@ -517,6 +591,13 @@ Args parse_args(int argc, char* argv[])
     option{ "no-feature", required_argument, nullptr, Options::NO_FEATURE },
     option{ "debug", required_argument, nullptr, Options::DEBUG },
     option{ "dry-run", no_argument, nullptr, Options::DRY_RUN },
+    option{ "reprobe-features",
+            no_argument,
+            nullptr,
+            Options::REPROBE_FEATURES },
+    option{ "probe-stats", optional_argument, nullptr, Options::PROBE_STATS },
+    option{ "timing-trace", required_argument, nullptr, Options::TIMING_TRACE },
+    option{ "opt", required_argument, nullptr, Options::OPT },
     option{ nullptr, 0, nullptr, 0 }, // Must be last
   };
 
@@ -526,9 +607,7 @@ Args parse_args(int argc, char* argv[])
          -1) {
     switch (c) {
       case Options::INFO: // --info
-        check_is_root();
-        info(args.no_feature);
-        exit(0);
+        args.info = true;
         break;
       case Options::EMIT_ELF: // --emit-elf
         args.output_elf = optarg;
@@ -556,13 +635,40 @@ Args parse_args(int argc, char* argv[])
       case Options::NO_FEATURE: // --no-feature
         if (args.no_feature.parse(optarg)) {
           LOG(ERROR) << "USAGE: --no-feature can only have values "
-                        "'kprobe_multi,uprobe_multi'.";
+                        "'kprobe_multi,uprobe_multi,timer'.";
           exit(1);
         }
         break;
       case Options::DRY_RUN:
         dry_run = true;
         break;
+      case Options::REPROBE_FEATURES: // --reprobe-features
+        args.reprobe_features = true;
+        break;
+      case Options::PROBE_STATS: // --probe-stats
+        args.probe_stats = true;
+        if (optarg) {
+          try {
+            args.probe_stats_interval = std::stoull(optarg);
+          } catch (const std::exception&) {
+            LOG(ERROR) << "USAGE: --probe-stats interval must be a number of "
+                          "seconds.";
+            exit(1);
+          }
+        }
+        break;
+      case Options::TIMING_TRACE: // --timing-trace
+        timing::enable(optarg);
+        break;
+      case Options::OPT: { // --opt
+        auto profile = opt_profiles.find(optarg);
+        if (profile == opt_profiles.end()) {
+          LOG(ERROR) << "USAGE: --opt must be 'fast', 'default' or 'size'.";
+          exit(1);
+        }
+        args.opt_profile = profile->second;
+        break;
+      }
       case 'o':
         args.output_file = optarg;
         break;
@@ -646,6 +752,12 @@ Args parse_args(int argc, char* argv[])
     }
   }
 
+  if (args.info) {
+    check_is_root();
+    info(args.no_feature, args.reprobe_features);
+    exit(0);
+  }
+
   if (argc == 1) {
     usage(std::cerr);
     exit(1);
@@ -664,6 +776,11 @@ Args parse_args(int argc, char* argv[])
     exit(1);
   }
 
+  // Whether BPF timers are supported, and how many CPUs profile probes need
+  // timers for, is only known on the host running the AOT binary
+  if (args.build_mode == BuildMode::AHEAD_OF_TIME)
+    args.no_feature.parse("timer");
+
   if (args.listing) {
     // Expect zero or one positional arguments
     if (optind == argc) {
@@ -774,11 +891,15 @@ int main(int argc, char* argv[])
 
   Config config = Config(!args.cmd_str.empty());
   BPFtrace bpftrace(std::move(output), args.no_feature, config);
+  bpftrace.feature_->enable_cache(args.reprobe_features);
 
   parse_env(bpftrace);
 
   bpftrace.usdt_file_activation_ = args.usdt_file_activation;
   bpftrace.safe_mode_ = args.safe_mode;
+  bpftrace.probe_stats_ = args.probe_stats;
+  bpftrace.probe_stats_interval_ = args.probe_stats_interval;
+  bpftrace.opt_profile_ = args.opt_profile;
   bpftrace.helper_check_level_ = args.helper_check_level;
   bpftrace.boottime_ = get_boottime();
   bpftrace.delta_taitime_ = get_delta_taitime();
@@ -935,7 +1056,10 @@ int main(int argc, char* argv[])
   ast::CodegenLLVM llvm(ctx.ast_ctx, bpftrace);
   BpfBytecode bytecode;
   try {
-    llvm.generate_ir();
+    {
+      timing::Phase phase("generate_ir", "codegen");
+      llvm.generate_ir();
+    }
     if (bt_debug.find(DebugStage::Codegen) != bt_debug.end()) {
       std::cout << "LLVM IR before optimization\n";
       std::cout << "---------------------------\n\n";
@@ -948,12 +1072,18 @@ int main(int argc, char* argv[])
     bool verify_llvm_ir = false;
     get_bool_env_var("BPFTRACE_VERIFY_LLVM_IR",
                      [&](bool x) { verify_llvm_ir = x; });
-    if (verify_llvm_ir && !llvm.verify()) {
-      LOG(ERROR) << "Verification of generated LLVM IR failed";
-      exit(1);
+    if (verify_llvm_ir) {
+      timing::Phase phase("verify", "codegen");
+      if (!llvm.verify()) {
+        LOG(ERROR) << "Verification of generated LLVM IR failed";
+        exit(1);
+      }
     }
 
-    llvm.optimize();
+    {
+      timing::Phase phase("optimize", "codegen");
+      llvm.optimize();
+    }
     if (bt_debug.find(DebugStage::CodegenOpt) != bt_debug.end()) {
       std::cout << "\nLLVM IR after optimization\n";
       std::cout << "----------------------------\n\n";
@@ -976,6 +1106,7 @@ int main(int argc, char* argv[])
     }
 
     bool disassemble = bt_debug.find(DebugStage::Disassemble) != bt_debug.end();
+    timing::Phase phase("emit", "codegen");
     bytecode = llvm.emit(disassemble);
   } catch (const std::system_error& ex) {
     LOG(ERROR) << "failed to write elf: " << ex.what();
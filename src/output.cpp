@@ -6,6 +6,7 @@
 #include "utils.h"
 
 #include <bpf/libbpf.h>
+#include <cmath>
 
 namespace libbpf {
 #define __BPF_NAME_FN(x) #x
@@ -35,9 +36,12 @@ bool is_quoted_type(const SizedType &ty)
     case Type::array:
     case Type::avg_t:
     case Type::count_t:
+    case Type::count_distinct_t:
+    case Type::topk_t:
     case Type::hist_t:
     case Type::integer:
     case Type::lhist_t:
+    case Type::quantiles_t:
     case Type::mac_address:
     case Type::max_t:
     case Type::min_t:
@@ -68,9 +72,15 @@ std::ostream &operator<<(std::ostream &out, MessageType type)
     case MessageType::hist:
       out << "hist";
       break;
+    case MessageType::quantiles:
+      out << "quantiles";
+      break;
     case MessageType::stats:
       out << "stats";
       break;
+    case MessageType::topk:
+      out << "topk";
+      break;
     case MessageType::printf:
       out << "printf";
       break;
@@ -92,6 +102,12 @@ std::ostream &operator<<(std::ostream &out, MessageType type)
     case MessageType::lost_events:
       out << "lost_events";
       break;
+    case MessageType::sample_rate:
+      out << "sample_rate";
+      break;
+    case MessageType::probe_stats:
+      out << "probe_stats";
+      break;
     default:
       out << "?";
   }
@@ -171,6 +187,61 @@ void Output::hist_prepare(const std::vector<uint64_t> &values,
   }
 }
 
+// Returns the lower bound of log2 histogram bucket `index`, for indexes past
+// the exact buckets. See TextOutput::hist_index_label().
+static uint64_t hist_index_lower_bound(uint32_t index, uint32_t k)
+{
+  const uint64_t n = 1ULL << k, interval = index & (n - 1);
+  const uint64_t power = (index >> k) - 1;
+  return (1ULL << power) * (n + interval);
+}
+
+std::string Output::quantiles_to_str(const std::vector<uint64_t> &values,
+                                     uint32_t div,
+                                     uint32_t k,
+                                     const std::vector<double> &quantiles) const
+{
+  if (div == 0)
+    div = 1;
+  uint64_t total = 0;
+  for (auto v : values)
+    total += v;
+
+  std::vector<std::pair<std::string, std::string>> keyvals = {
+    { "count", std::to_string(total) }
+  };
+  for (double q : quantiles) {
+    // Rank of the value below which q percent of the values fall
+    uint64_t rank = std::max<uint64_t>(
+        1, static_cast<uint64_t>(std::ceil(q / 100 * total)));
+    uint64_t estimate = 0;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < values.size() && total > 0; i++) {
+      seen += values[i];
+      if (seen < rank)
+        continue;
+      // Index 0 holds negative values, which we report as 0. The indexes up
+      // to 2^(k+1) hold a single value each. Values in the other buckets are
+      // estimated by the middle of the bucket.
+      if (i == 0)
+        estimate = 0;
+      else if (i <= (2U << k))
+        estimate = i - 1;
+      else {
+        uint64_t lower = hist_index_lower_bound(i - 1, k);
+        uint64_t upper = hist_index_lower_bound(i, k);
+        estimate = lower + (upper - lower) / 2;
+      }
+      break;
+    }
+
+    std::ostringstream label;
+    label << "p" << q;
+    keyvals.emplace_back(label.str(), std::to_string(estimate / div));
+  }
+  return key_value_pairs_to_str(keyvals);
+}
+
 void Output::lhist_prepare(const std::vector<uint64_t> &values,
                            int min,
                            int max,
@@ -373,6 +444,10 @@ std::string Output::value_to_str(BPFtrace &bpftrace,
 
       return std::to_string(reduce_value<uint64_t>(value, nvalues) / div);
     }
+    case Type::count_distinct_t: {
+      return std::to_string(
+          count_distinct_value(value, nvalues, type.GetSize()) / div);
+    }
     case Type::max_t:
     case Type::min_t: {
       if (is_per_cpu) {
@@ -414,6 +489,8 @@ std::string Output::value_to_str(BPFtrace &bpftrace,
     case Type::voidtype:
     case Type::hist_t:
     case Type::lhist_t:
+    case Type::quantiles_t:
+    case Type::topk_t:
     case Type::stack_mode:
     case Type::pointer:
     case Type::reference:
@@ -466,6 +543,9 @@ std::string Output::map_key_str(BPFtrace &bpftrace,
     case Type::strerror_t:
     case Type::hist_t:
     case Type::lhist_t:
+    case Type::quantiles_t:
+    case Type::count_distinct_t:
+    case Type::topk_t:
     case Type::none:
     case Type::reference:
     case Type::stack_mode:
@@ -552,6 +632,15 @@ void Output::map_hist_contents(
       if (!map_info.hist_bits_arg.has_value())
         LOG(BUG) << "call to hist with missing \"bits\" argument";
       val_str = hist_to_str(value, div, *map_info.hist_bits_arg);
+    } else if (map_type.IsQuantilesTy()) {
+      if (!map_info.hist_bits_arg.has_value())
+        LOG(BUG) << "call to quantiles with missing \"bits\" argument";
+      auto quantiles = Config::parse_quantiles(
+          bpftrace.config_.get(ConfigKeyString::quantiles));
+      if (!quantiles.has_value())
+        LOG(BUG) << "invalid quantiles config";
+      val_str = quantiles_to_str(
+          value, div, *map_info.hist_bits_arg, *quantiles);
     } else {
       auto &args = map_info.lhist_args;
       if (!args.has_value())
@@ -576,7 +665,7 @@ void Output::map_stats_contents(
   bool first = true;
 
   for (auto &[key, value] : values_by_key) {
-    if (top && map_type.IsAvgTy()) {
+    if (top && (map_type.IsAvgTy() || map_type.IsTopkTy())) {
       if (total > top && i++ < (total - top))
         continue;
     }
@@ -588,6 +677,17 @@ void Output::map_stats_contents(
 
     auto key_str = map_key_to_str(bpftrace, map, key);
 
+    // topk() values are already reduced into (count, error) pairs
+    if (map_type.IsTopkTy()) {
+      std::vector<std::pair<std::string, std::string>> topk = {
+        { "count", std::to_string(read_data<uint64_t>(value.data()) / div) },
+        { "error",
+          std::to_string(read_data<uint64_t>(value.data() + 8) / div) }
+      };
+      map_key_val(map_type, key_str, key_value_pairs_to_str(topk));
+      continue;
+    }
+
     std::string total_str;
     std::string count_str;
     std::string avg_str;
@@ -732,6 +832,8 @@ void TextOutput::map_hist(
   map_hist_contents(
       bpftrace, map, top, div, values_by_key, total_counts_by_key);
   out_ << std::endl;
+  if (bpftrace.resources.maps_info.at(map.name()).value_type.IsQuantilesTy())
+    out_ << std::endl;
 }
 
 void TextOutput::map_stats(
@@ -820,11 +922,46 @@ void TextOutput::message(MessageType type __attribute__((unused)),
     out_ << std::endl;
 }
 
-void TextOutput::lost_events(uint64_t lost) const
+void TextOutput::lost_events(
+    uint64_t lost,
+    const std::map<std::string, uint64_t> &probes
+    __attribute__((unused))) const
 {
   out_ << "Lost " << lost << " events" << std::endl;
 }
 
+void TextOutput::sample_rate(int cpu, uint64_t rate) const
+{
+  out_ << "Sampling 1 in " << rate << " events on CPU " << cpu << std::endl;
+}
+
+void TextOutput::probe_stats(const std::vector<ProbeStats> &stats) const
+{
+  out_ << "Probe statistics:" << std::endl;
+  for (const auto &probe : stats) {
+    out_ << "  " << probe.probe;
+    // Wildcard matches may be loaded as separate programs
+    if (probe.attach_points.size() != 1 ||
+        probe.attach_points.front() != probe.probe) {
+      out_ << " (";
+      for (size_t i = 0; i < probe.attach_points.size(); i++)
+        out_ << (i > 0 ? ", " : "") << probe.attach_points[i];
+      out_ << ")";
+    }
+    out_ << ": ";
+    if (probe.has_run_stats) {
+      out_ << probe.run_cnt << " runs, " << probe.run_time_ns << " ns";
+      if (probe.run_cnt > 0)
+        out_ << " (" << probe.run_time_ns / probe.run_cnt << " ns/run)";
+    } else {
+      out_ << "runs not counted (BPF timer)";
+    }
+    out_ << ", " << probe.insns << " insns (" << probe.verified_insns
+         << " verified)";
+    out_ << std::endl;
+  }
+}
+
 void TextOutput::attached_probes(uint64_t num_probes) const
 {
   if (num_probes == 1)
@@ -1056,9 +1193,12 @@ void JsonOutput::map_hist(
   if (total_counts_by_key.empty())
     return;
 
-  const auto &map_key = bpftrace.resources.maps_info.at(map.name()).key_type;
+  const auto &map_info = bpftrace.resources.maps_info.at(map.name());
+  const auto &map_key = map_info.key_type;
+  auto type = map_info.value_type.IsQuantilesTy() ? MessageType::quantiles
+                                                  : MessageType::hist;
 
-  out_ << R"({"type": ")" << MessageType::hist << R"(", "data": {)";
+  out_ << R"({"type": ")" << type << R"(", "data": {)";
   out_ << "\"" << json_escape(map.name()) << "\": ";
   if (!map_key.IsNoneTy()) // check if this map has keys
     out_ << "{";
@@ -1082,9 +1222,12 @@ void JsonOutput::map_stats(
   if (values_by_key.empty())
     return;
 
-  const auto &map_key = bpftrace.resources.maps_info.at(map.name()).key_type;
+  const auto &map_info = bpftrace.resources.maps_info.at(map.name());
+  const auto &map_key = map_info.key_type;
 
-  out_ << R"({"type": ")" << MessageType::stats << R"(", "data": {)";
+  auto type = map_info.value_type.IsTopkTy() ? MessageType::topk
+                                              : MessageType::stats;
+  out_ << R"({"type": ")" << type << R"(", "data": {)";
   out_ << "\"" << json_escape(map.name()) << "\": ";
   if (!map_key.IsNoneTy()) // check if this map has keys
     out_ << "{";
@@ -1122,9 +1265,56 @@ void JsonOutput::message(MessageType type,
        << "}" << std::endl;
 }
 
-void JsonOutput::lost_events(uint64_t lost) const
+void JsonOutput::lost_events(
+    uint64_t lost,
+    const std::map<std::string, uint64_t> &probes) const
 {
-  message(MessageType::lost_events, "events", lost);
+  if (probes.empty()) {
+    message(MessageType::lost_events, "events", lost);
+    return;
+  }
+
+  out_ << R"({"type": ")" << MessageType::lost_events << R"(", "data": )"
+       << R"({"events": )" << lost << R"(, "probes": {)";
+  bool first = true;
+  for (const auto &[probe, count] : probes) {
+    if (!first)
+      out_ << ", ";
+    first = false;
+    out_ << "\"" << json_escape(probe) << "\": " << count;
+  }
+  out_ << "}}}" << std::endl;
+}
+
+void JsonOutput::sample_rate(int cpu, uint64_t rate) const
+{
+  out_ << R"({"type": ")" << MessageType::sample_rate << R"(", "data": )"
+       << R"({"cpu": )" << cpu << R"(, "rate": )" << rate << "}}" << std::endl;
+}
+
+void JsonOutput::probe_stats(const std::vector<ProbeStats> &stats) const
+{
+  out_ << R"({"type": ")" << MessageType::probe_stats << R"(", "data": [)";
+  for (size_t i = 0; i < stats.size(); i++) {
+    const auto &probe = stats[i];
+    if (i > 0)
+      out_ << ", ";
+    out_ << R"({"probe": ")" << json_escape(probe.probe)
+         << R"(", "attach_points": [)";
+    for (size_t j = 0; j < probe.attach_points.size(); j++) {
+      if (j > 0)
+        out_ << ", ";
+      out_ << "\"" << json_escape(probe.attach_points[j]) << "\"";
+    }
+    out_ << R"(], "run_cnt": )";
+    if (probe.has_run_stats)
+      out_ << probe.run_cnt << R"(, "run_time_ns": )" << probe.run_time_ns;
+    else
+      out_ << R"(null, "run_time_ns": null)";
+    out_ << R"(, "insns": )" << probe.insns << R"(, "verified_insns": )"
+         << probe.verified_insns << "}";
+  }
+  out_ << "]}" << std::endl;
 }
 
 void JsonOutput::attached_probes(uint64_t num_probes) const
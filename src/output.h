@@ -19,7 +19,9 @@ enum class MessageType {
   map,
   value,
   hist,
+  quantiles,
   stats,
+  topk,
   printf,
   time,
   cat,
@@ -27,11 +29,30 @@ enum class MessageType {
   syscall,
   attached_probes,
   lost_events,
+  sample_rate,
+  probe_stats,
   helper_error,
 };
 
 std::ostream &operator<<(std::ostream &out, MessageType type);
 
+// Kernel statistics of a loaded BPF program, see --probe-stats
+struct ProbeStats {
+  // The probe as written in the script
+  std::string probe;
+  // Attach points sharing the program
+  std::vector<std::string> attach_points;
+  uint64_t run_cnt = 0;
+  uint64_t run_time_ns = 0;
+  // Size of the program and the number of instructions the verifier
+  // processed when loading it
+  uint32_t insns = 0;
+  uint32_t verified_insns = 0;
+  // Runs of BPF timer callbacks are not counted by the kernel, so run_cnt and
+  // run_time_ns are meaningless for probes driven by timers
+  bool has_run_stats = true;
+};
+
 // Abstract class (interface) for output
 // Provides default implementation of some methods for formatting map and
 // non-map values into strings.
@@ -88,7 +109,13 @@ public:
   virtual void message(MessageType type,
                        const std::string &msg,
                        bool nl = true) const = 0;
-  virtual void lost_events(uint64_t lost) const = 0;
+  // `probes` optionally breaks down the lost events by probe
+  virtual void lost_events(
+      uint64_t lost,
+      const std::map<std::string, uint64_t> &probes) const = 0;
+  // One in `rate` events is now kept on `cpu`, see adaptive_sampling
+  virtual void sample_rate(int cpu, uint64_t rate) const = 0;
+  virtual void probe_stats(const std::vector<ProbeStats> &stats) const = 0;
   virtual void attached_probes(uint64_t num_probes) const = 0;
   virtual void helper_error(int func_id,
                             int retcode,
@@ -120,6 +147,11 @@ protected:
                                    int min,
                                    int max,
                                    int step) const = 0;
+  // Convert a log2 histogram into estimates of the given percentiles
+  std::string quantiles_to_str(const std::vector<uint64_t> &values,
+                               uint32_t div,
+                               uint32_t k,
+                               const std::vector<double> &quantiles) const;
 
   // Convert map into string
   // Default behaviour: format each (key, value) pair using output-specific
@@ -233,7 +265,11 @@ public:
   void message(MessageType type,
                const std::string &msg,
                bool nl = true) const override;
-  void lost_events(uint64_t lost) const override;
+  void lost_events(
+      uint64_t lost,
+      const std::map<std::string, uint64_t> &probes) const override;
+  void sample_rate(int cpu, uint64_t rate) const override;
+  void probe_stats(const std::vector<ProbeStats> &stats) const override;
   void attached_probes(uint64_t num_probes) const override;
   void helper_error(int func_id,
                     int retcode,
@@ -311,7 +347,11 @@ public:
   void message(MessageType type,
                const std::string &field,
                uint64_t value) const;
-  void lost_events(uint64_t lost) const override;
+  void lost_events(
+      uint64_t lost,
+      const std::map<std::string, uint64_t> &probes) const override;
+  void sample_rate(int cpu, uint64_t rate) const override;
+  void probe_stats(const std::vector<ProbeStats> &stats) const override;
   void attached_probes(uint64_t num_probes) const override;
   void helper_error(int func_id,
                     int retcode,
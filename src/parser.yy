@@ -147,6 +147,8 @@ void yyerror(bpftrace::Driver &driver, const char *s);
 %type <ast::SubprogArgList> subprog_args
 %type <ast::Integer *> int
 %type <ast::Map *> map
+%type <ast::MapDecl *> map_decl
+%type <ast::MapDeclList> map_decls
 %type <ast::PositionalParameter *> param
 %type <ast::Predicate *> pred
 %type <ast::Probe *> probe
@@ -180,8 +182,8 @@ void yyerror(bpftrace::Driver &driver, const char *s);
 %%
 
 program:
-                c_definitions config probes_and_subprogs END {
-                    driver.ctx.root = driver.ctx.make_node<ast::Program>($1, $2, std::move($3.second), std::move($3.first), @$);
+                c_definitions config map_decls probes_and_subprogs END {
+                    driver.ctx.root = driver.ctx.make_node<ast::Program>($1, $2, std::move($3), std::move($4.second), std::move($4.first), @$);
                 }
                 ;
 
@@ -292,6 +294,16 @@ config_assign_stmt:
                 IDENT ASSIGN expr   { $$ = driver.ctx.make_node<ast::AssignConfigVarStatement>($1, $3, @2); }
                 ;
 
+map_decls:
+                map_decls map_decl ";" { $$ = std::move($1); $$.push_back($2); }
+        |       %empty                 { $$ = ast::MapDeclList{}; }
+                ;
+
+map_decl:
+                LET MAP ASSIGN IDENT "(" INT ")"            { $$ = driver.ctx.make_node<ast::MapDecl>($2, $4, $6, "", @$); }
+        |       LET MAP ASSIGN IDENT "(" INT "," IDENT ")"  { $$ = driver.ctx.make_node<ast::MapDecl>($2, $4, $6, $8, @$); }
+                ;
+
 subprog:
                 SUBPROG IDENT "(" subprog_args ")" ":" type block {
                     $$ = driver.ctx.make_node<ast::Subprog>($2, $7, std::move($4), std::move($8), @$);
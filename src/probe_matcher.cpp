@@ -13,6 +13,7 @@
 #include "log.h"
 #include "probe_matcher.h"
 #include "scopeguard.h"
+#include "timing_trace.h"
 #include "tracefs.h"
 #include "utils.h"
 
@@ -148,8 +149,13 @@ std::set<std::string> ProbeMatcher::get_matches_for_probetype(
       // If BTF is not parsed, yet, read available_filter_functions instead.
       // This is useful as we will use the result to extract the list of
       // potentially used kernel modules and then only parse BTF for them.
-      if (bpftrace_->has_btf_data())
-        symbol_stream = bpftrace_->btf_->get_all_funcs();
+      if (bpftrace_->has_btf_data()) {
+        // Only load the BTF of the requested module, if there is one
+        if (!target.empty() && !has_wildcard(target))
+          symbol_stream = bpftrace_->btf_->get_all_funcs(target);
+        else
+          symbol_stream = bpftrace_->btf_->get_all_funcs();
+      }
       else {
         symbol_stream = get_symbols_from_traceable_funcs(true);
       }
@@ -492,6 +498,7 @@ void ProbeMatcher::list_probes(ast::Program* prog)
 std::set<std::string> ProbeMatcher::get_matches_for_ap(
     const ast::AttachPoint& attach_point)
 {
+  timing::Phase phase("probe matching", "compile");
   std::string search_input;
   switch (probetype(attach_point.provider)) {
     case ProbeType::kprobe:
@@ -578,6 +585,14 @@ std::set<std::string> ProbeMatcher::expand_probetype_userspace(
 
 void ProbeMatcher::list_structs(const std::string& search)
 {
+  // A plain type name can be looked up in the BTF name index, there is no
+  // need to collect all the types. Verbose listing needs the full definitions.
+  if (!search.empty() && !has_wildcard(search) && !bt_verbose) {
+    for (auto& match : bpftrace_->btf_->get_structs(search))
+      std::cout << match << std::endl;
+    return;
+  }
+
   auto structs = bpftrace_->btf_->get_all_structs();
 
   std::string search_input = search;
@@ -2,6 +2,7 @@
 
 #include <cstdint>
 #include <istream>
+#include <map>
 #include <ostream>
 #include <string>
 #include <tuple>
@@ -10,6 +11,7 @@
 
 #include <cereal/access.hpp>
 
+#include "bpfmap.h"
 #include "format_string.h"
 #include "location.hh"
 #include "struct.h"
@@ -47,11 +49,45 @@ private:
   }
 };
 
+// Map type and size selected by a map declaration
+struct MapDeclArgs {
+  libbpf::bpf_map_type bpf_type = libbpf::BPF_MAP_TYPE_HASH;
+  uint32_t max_entries = 0;
+  uint32_t flags = 0;
+
+private:
+  friend class cereal::access;
+  template <typename Archive>
+  void serialize(Archive &archive)
+  {
+    archive(bpf_type, max_entries, flags);
+  }
+};
+
+struct TopkArgs {
+  uint32_t k = 0;
+  // Index of this map's count-min sketch in the topk sketch map
+  uint32_t sketch_idx = 0;
+
+private:
+  friend class cereal::access;
+  template <typename Archive>
+  void serialize(Archive &archive)
+  {
+    archive(k, sketch_idx);
+  }
+};
+
 struct MapInfo {
   SizedType key_type;
   SizedType value_type;
   std::optional<LinearHistogramArgs> lhist_args;
   std::optional<int> hist_bits_arg;
+  std::optional<TopkArgs> topk_args;
+  std::optional<MapDeclArgs> decl_args;
+  // Set for keyless count(), sum(), min() and max() maps which are kept in
+  // the scalar aggregation global buffer instead of a per-CPU map
+  std::optional<uint32_t> scalar_agg_slot;
   int id = -1;
 
 private:
@@ -59,7 +95,14 @@ private:
   template <typename Archive>
   void serialize(Archive &archive)
   {
-    archive(key_type, value_type, lhist_args, hist_bits_arg, id);
+    archive(key_type,
+            value_type,
+            lhist_args,
+            hist_bits_arg,
+            topk_args,
+            decl_args,
+            scalar_agg_slot,
+            id);
   }
 };
 
@@ -134,6 +177,13 @@ public:
   std::map<std::string, MapInfo> maps_info;
   std::unordered_set<bpftrace::globalvars::GlobalVar> needed_global_vars;
   bool needs_perf_event_map = false;
+  // Number of topk() maps, each gets a count-min sketch, see TopkArgs
+  uint32_t topk_sketches = 0;
+  // Number of slots in the scalar aggregation buffer, see
+  // MapInfo::scalar_agg_slot
+  uint32_t scalar_agg_slots = 0;
+  // Number of entries in the timers map, see AttachPoint::timer_slot
+  uint32_t timer_slots = 0;
 
   // Probe metadata
   //
@@ -142,6 +192,14 @@ public:
   std::vector<Probe> probes;
   std::unordered_map<std::string, Probe> special_probes;
   std::vector<Probe> watchpoint_probes;
+  // Programs which were found identical to another program during codegen
+  // and removed from the object. Maps the removed program's name to the name
+  // of the program it shares.
+  std::map<std::string, std::string> program_aliases;
+
+  // Probes which count their lost events separately. Event loss counter i + 1
+  // belongs to probe i, counter 0 collects events lost outside of a probe.
+  std::vector<std::string> event_loss_probes;
 
   // List of probes using userspace symbol resolution
   std::unordered_set<const ast::Probe *> probes_using_usym;
@@ -165,8 +223,13 @@ private:
             maps_info,
             needed_global_vars,
             needs_perf_event_map,
+            topk_sketches,
+            scalar_agg_slots,
+            timer_slots,
             probes,
-            special_probes);
+            special_probes,
+            program_aliases,
+            event_loss_probes);
   }
 };
 
@@ -50,12 +50,13 @@ struct Field {
 
   std::optional<Bitfield> bitfield;
 
-  // Used for tracepoint __data_loc's
+  // Used for tracepoint __data_loc's and for variable-length format string
+  // arguments
   //
   // If true, this field is a 32 bit integer whose value encodes information on
   // where to find the actual data. The first 2 bytes is the size of the data.
   // The last 2 bytes is the offset from the start of the tracepoint struct
-  // where the data begins.
+  // (or the format string event) where the data begins.
   bool is_data_loc = false;
 
   bool operator==(const Field &rhs) const
@@ -0,0 +1,146 @@
+#include "timing_trace.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <vector>
+
+#include "log.h"
+
+namespace bpftrace::timing {
+
+namespace {
+
+struct Event {
+  std::string name;
+  std::string category;
+  int64_t start_us;
+  int64_t dur_us;
+  pid_t tid;
+  long max_rss_kb;
+};
+
+struct Trace {
+  std::mutex lock;
+  std::string path;
+  std::chrono::steady_clock::time_point epoch;
+  std::vector<Event> events;
+};
+
+Trace &trace()
+{
+  static Trace t;
+  return t;
+}
+
+bool enabled_ = false;
+
+int64_t us_since(std::chrono::steady_clock::time_point epoch,
+                 std::chrono::steady_clock::time_point t)
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(t - epoch)
+      .count();
+}
+
+std::string escape(const std::string &str)
+{
+  std::ostringstream escaped;
+  for (const char &c : str) {
+    if (c == '"' || c == '\\') {
+      escaped << '\\' << c;
+    } else if (c >= '\x00' && c <= '\x1f') {
+      escaped << "\\u" << std::hex << std::setw(4) << std::setfill('0')
+              << static_cast<int>(c) << std::dec;
+    } else {
+      escaped << c;
+    }
+  }
+  return escaped.str();
+}
+
+void write_file()
+{
+  auto &t = trace();
+  if (t.path.empty())
+    return;
+
+  std::ofstream out(t.path);
+  if (!out) {
+    LOG(WARNING) << "Failed to write timing trace to " << t.path;
+    return;
+  }
+  write(out);
+}
+
+} // namespace
+
+void enable(const std::string &path)
+{
+  auto &t = trace();
+  t.path = path;
+  t.epoch = std::chrono::steady_clock::now();
+  if (!enabled_)
+    std::atexit(write_file);
+  enabled_ = true;
+}
+
+bool enabled()
+{
+  return enabled_;
+}
+
+void write(std::ostream &out)
+{
+  auto &t = trace();
+  std::lock_guard<std::mutex> guard(t.lock);
+
+  pid_t pid = getpid();
+  out << "{\"traceEvents\": [";
+  for (size_t i = 0; i < t.events.size(); i++) {
+    const auto &e = t.events[i];
+    out << (i ? ",\n" : "\n") << "  {\"name\": \"" << escape(e.name)
+        << "\", \"cat\": \"" << escape(e.category)
+        << "\", \"ph\": \"X\", \"ts\": " << e.start_us
+        << ", \"dur\": " << e.dur_us << ", \"pid\": " << pid
+        << ", \"tid\": " << e.tid << ", \"args\": {\"max_rss_kb\": "
+        << e.max_rss_kb << "}}";
+  }
+  out << "\n], \"displayTimeUnit\": \"ms\"}" << std::endl;
+}
+
+Phase::Phase(std::string name, std::string category)
+    : name_(std::move(name)),
+      category_(std::move(category)),
+      enabled_(enabled())
+{
+  if (enabled_)
+    start_ = std::chrono::steady_clock::now();
+}
+
+Phase::~Phase()
+{
+  if (!enabled_)
+    return;
+
+  auto end = std::chrono::steady_clock::now();
+  struct rusage usage = {};
+  getrusage(RUSAGE_SELF, &usage);
+
+  auto &t = trace();
+  std::lock_guard<std::mutex> guard(t.lock);
+  int64_t start_us = us_since(t.epoch, start_);
+  t.events.push_back(Event{
+      .name = std::move(name_),
+      .category = std::move(category_),
+      .start_us = start_us,
+      .dur_us = us_since(t.epoch, end) - start_us,
+      .tid = gettid(),
+      .max_rss_kb = usage.ru_maxrss,
+  });
+}
+
+} // namespace bpftrace::timing
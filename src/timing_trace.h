@@ -0,0 +1,41 @@
+#pragma once
+
+#include <chrono>
+#include <ostream>
+#include <string>
+
+namespace bpftrace::timing {
+
+// Tracing of where the time of a bpftrace run goes, see --timing-trace
+//
+// Phases are recorded as complete events in the Chrome trace event format,
+// which can be opened in chrome://tracing or https://ui.perfetto.dev. Each
+// event also records the peak resident set size of bpftrace when the phase
+// ended. Phases may nest and may be recorded from any thread.
+
+// Start recording. The trace is written to `path` when bpftrace exits, unless
+// `path` is empty.
+void enable(const std::string &path);
+bool enabled();
+
+// Writes the phases recorded so far as a Chrome trace
+void write(std::ostream &out);
+
+// Records the time from construction to destruction as a phase. Does nothing
+// unless tracing is enabled.
+class Phase {
+public:
+  Phase(std::string name, std::string category);
+  ~Phase();
+
+  Phase(const Phase &) = delete;
+  Phase &operator=(const Phase &) = delete;
+
+private:
+  std::string name_;
+  std::string category_;
+  std::chrono::steady_clock::time_point start_;
+  bool enabled_;
+};
+
+} // namespace bpftrace::timing
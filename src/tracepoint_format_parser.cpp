@@ -1,7 +1,23 @@
+#include <algorithm>
+#include <atomic>
+#include <cctype>
 #include <cstring>
+#include <filesystem>
 #include <fstream>
 #include <glob.h>
 #include <iostream>
+#include <set>
+#include <sstream>
+#include <sys/utsname.h>
+#include <thread>
+#include <tuple>
+#include <unistd.h>
+#include <unordered_map>
+
+#include <cereal/archives/binary.hpp>
+#include <cereal/types/string.hpp>
+#include <cereal/types/unordered_map.hpp>
+#include <cereal/types/vector.hpp>
 
 #include "ast/ast.h"
 #include "bpftrace.h"
@@ -14,6 +30,251 @@ namespace bpftrace {
 
 std::set<std::string> TracepointFormatParser::struct_list;
 
+namespace {
+
+// Parsed format files are cached across runs, one cache file per kernel
+// release. The kernel build string and the set of loaded modules are stored in
+// the cache to detect rebuilt kernels with the same release and modules which
+// were loaded, unloaded or replaced since the cache was written.
+class FormatCache {
+public:
+  const TracepointFormat *find(const std::string &probe_id)
+  {
+    load();
+    auto it = formats_.find(probe_id);
+    return it != formats_.end() ? &it->second : nullptr;
+  }
+
+  void insert(const std::string &probe_id, TracepointFormat format)
+  {
+    load();
+    if (path_.empty() || format.empty())
+      return;
+    formats_[probe_id] = std::move(format);
+    dirty_ = true;
+  }
+
+  void save() const
+  {
+    if (!dirty_)
+      return;
+    // Write to a temporary file first so that concurrent runs never see a
+    // partially written cache
+    auto tmp_path = path_;
+    tmp_path += "." + std::to_string(getpid());
+    try {
+      {
+        std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+        if (file.fail())
+          return;
+        cereal::BinaryOutputArchive archive(file);
+        archive(VERSION, kernel_version_, modules_, formats_);
+      }
+      std::filesystem::rename(tmp_path, path_);
+    } catch (const std::exception &e) {
+      LOG(V1) << "Failed to write tracepoint format cache " << path_ << ": "
+              << e.what();
+      std::error_code ec;
+      std::filesystem::remove(tmp_path, ec);
+    }
+  }
+
+private:
+  static constexpr uint32_t VERSION = 2;
+
+  // Names and sizes of the loaded modules, in a stable order
+  static std::string loaded_modules()
+  {
+    std::ifstream file("/proc/modules");
+    std::set<std::string> modules;
+    std::string name, size;
+    for (std::string line; std::getline(file, line);) {
+      std::istringstream fields(line);
+      if (fields >> name >> size)
+        modules.insert(name + " " + size);
+    }
+
+    std::string result;
+    for (const auto &module : modules)
+      result += module + "\n";
+    return result;
+  }
+
+  void load()
+  {
+    if (loaded_)
+      return;
+    loaded_ = true;
+
+    struct utsname utsname;
+    if (uname(&utsname) != 0)
+      return;
+    auto dir = get_cache_dir();
+    if (!dir)
+      return;
+    path_ = *dir / ("tracepoint_formats-" + std::string(utsname.release));
+    kernel_version_ = utsname.version;
+    modules_ = loaded_modules();
+
+    auto content = read_cache_file(path_);
+    if (!content)
+      return;
+    try {
+      std::istringstream file(std::move(*content));
+      cereal::BinaryInputArchive archive(file);
+      uint32_t version;
+      std::string kernel_version, modules;
+      archive(version);
+      if (version != VERSION)
+        return;
+      archive(kernel_version, modules);
+      if (kernel_version != kernel_version_ || modules != modules_)
+        return;
+      archive(formats_);
+    } catch (const std::exception &e) {
+      LOG(V1) << "Ignoring invalid tracepoint format cache " << path_ << ": "
+              << e.what();
+      formats_.clear();
+    }
+  }
+
+  std::filesystem::path path_;
+  std::string kernel_version_;
+  std::string modules_;
+  std::unordered_map<std::string, TracepointFormat> formats_;
+  bool loaded_ = false;
+  bool dirty_ = false;
+};
+
+// Reads and parses the given format files using a pool of threads. Reading
+// format files is slow as the kernel generates them on every read.
+template <typename Parser>
+std::vector<TracepointFormat> read_formats(
+    const std::vector<std::string> &paths,
+    Parser parse_format)
+{
+  std::vector<TracepointFormat> formats(paths.size());
+  std::atomic<size_t> next = 0;
+  auto worker = [&]() {
+    for (size_t i = next++; i < paths.size(); i = next++) {
+      std::ifstream file(paths[i]);
+      if (!file.fail())
+        formats[i] = parse_format(file);
+    }
+  };
+
+  size_t n_threads = std::min<size_t>(
+      std::max(1u, std::thread::hardware_concurrency()), paths.size());
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < n_threads; i++)
+    threads.emplace_back(worker);
+  worker();
+  for (auto &thread : threads)
+    thread.join();
+  return formats;
+}
+
+// Strips cv-qualifiers and surrounding whitespace from a type name
+std::string strip_qualifiers(std::string type)
+{
+  auto is_ident = [](char c) { return std::isalnum(c) || c == '_'; };
+  for (std::string_view qual : { "const", "volatile" }) {
+    size_t pos = 0;
+    while ((pos = type.find(qual, pos)) != std::string::npos) {
+      size_t end = pos + qual.size();
+      if ((pos == 0 || !is_ident(type[pos - 1])) &&
+          (end == type.size() || !is_ident(type[end])))
+        type.erase(pos, qual.size());
+      else
+        pos = end;
+    }
+  }
+  auto first = type.find_first_not_of(" \t");
+  auto last = type.find_last_not_of(" \t");
+  return first == std::string::npos ? ""
+                                    : type.substr(first, last - first + 1);
+}
+
+// Resolves a type name used in a format file (e.g. "unsigned int", "pid_t",
+// "char *" or "struct task_struct"). Typedefs and records are looked up in
+// BTF.
+std::optional<SizedType> resolve_type_name(const std::string &type_name,
+                                           BPFtrace &bpftrace)
+{
+  static const std::unordered_map<std::string, SizedType> builtin_types = {
+    { "char", CreateInt8() },
+    { "signed char", CreateInt8() },
+    { "unsigned char", CreateUInt8() },
+    { "short", CreateInt16() },
+    { "short int", CreateInt16() },
+    { "unsigned short", CreateUInt16() },
+    { "unsigned short int", CreateUInt16() },
+    { "int", CreateInt32() },
+    { "signed int", CreateInt32() },
+    { "unsigned", CreateUInt32() },
+    { "unsigned int", CreateUInt32() },
+    { "long", CreateInt64() },
+    { "long int", CreateInt64() },
+    { "unsigned long", CreateUInt64() },
+    { "unsigned long int", CreateUInt64() },
+    { "long long", CreateInt64() },
+    { "unsigned long long", CreateUInt64() },
+    { "bool", CreateUInt8() },
+    { "_Bool", CreateUInt8() },
+    { "u8", CreateUInt8() },
+    { "s8", CreateInt8() },
+    { "u16", CreateUInt16() },
+    { "s16", CreateInt16() },
+    { "u32", CreateUInt32() },
+    { "s32", CreateInt32() },
+    { "u64", CreateUInt64() },
+    { "s64", CreateInt64() },
+    { "__u8", CreateUInt8() },
+    { "__s8", CreateInt8() },
+    { "__u16", CreateUInt16() },
+    { "__s16", CreateInt16() },
+    { "__u32", CreateUInt32() },
+    { "__s32", CreateInt32() },
+    { "__u64", CreateUInt64() },
+    { "__s64", CreateInt64() },
+  };
+
+  auto type = strip_qualifiers(type_name);
+  if (type.ends_with('*')) {
+    auto pointee = resolve_type_name(type.substr(0, type.size() - 1),
+                                     bpftrace);
+    if (!pointee)
+      return std::nullopt;
+    return CreatePointer(*pointee);
+  }
+
+  if (type == "void")
+    return CreateNone();
+  if (auto it = builtin_types.find(type); it != builtin_types.end())
+    return it->second;
+  if (!bpftrace.has_btf_data() || type.starts_with("enum "))
+    return std::nullopt;
+
+  auto stype = bpftrace.btf_->get_stype(type);
+  if (stype.IsNoneTy())
+    return std::nullopt;
+  return stype;
+}
+
+// Checks that the args record has the fields of the format at the same
+// offsets
+bool matches_format(const Struct &args, const TracepointFormat &format)
+{
+  if (format.empty() || args.fields.size() != format.size())
+    return false;
+  return std::ranges::all_of(format, [&](const TracepointFormatField &field) {
+    return args.HasField(field.name) &&
+           args.GetField(field.name).offset == field.offset;
+  });
+}
+
+} // namespace
+
 bool TracepointFormatParser::parse(ast::ASTContext &ctx, BPFtrace &bpftrace)
 {
   ast::Program *program = ctx.root;
@@ -28,8 +289,9 @@ bool TracepointFormatParser::parse(ast::ASTContext &ctx, BPFtrace &bpftrace)
     return true;
 
   ast::TracepointArgsVisitor n(ctx);
-  if (!bpftrace.has_btf_data())
-    program->c_definitions += "#include <linux/types.h>\n";
+  // Tracepoints whose args records are needed: category, event and the path
+  // to the format file
+  std::vector<std::tuple<std::string, std::string, std::string>> events;
   for (ast::Probe *probe : probes_with_tracepoint) {
     n.visit(*probe);
 
@@ -69,7 +331,6 @@ bool TracepointFormatParser::parse(ast::ASTContext &ctx, BPFtrace &bpftrace)
 
           for (size_t i = 0; i < glob_result.gl_pathc; ++i) {
             std::string filename(glob_result.gl_pathv[i]);
-            std::ifstream format_file(filename);
             const std::string prefix = tracefs::events() + "/";
             size_t pos = prefix.length();
             std::string real_category = filename.substr(
@@ -82,11 +343,8 @@ bool TracepointFormatParser::parse(ast::ASTContext &ctx, BPFtrace &bpftrace)
             // definitions
             std::string struct_name = get_struct_name(real_category,
                                                       real_event);
-            if (!TracepointFormatParser::struct_list.count(struct_name)) {
-              program->c_definitions += get_tracepoint_struct(
-                  format_file, real_category, real_event, bpftrace);
-              TracepointFormatParser::struct_list.insert(struct_name);
-            }
+            if (TracepointFormatParser::struct_list.insert(struct_name).second)
+              events.emplace_back(real_category, real_event, filename);
           }
           globfree(&glob_result);
         } else {
@@ -127,12 +385,69 @@ bool TracepointFormatParser::parse(ast::ASTContext &ctx, BPFtrace &bpftrace)
           // Check to avoid adding the same struct more than once to definitions
           std::string struct_name = get_struct_name(category, event_name);
           if (TracepointFormatParser::struct_list.insert(struct_name).second)
-            program->c_definitions += get_tracepoint_struct(
-                format_file, category, event_name, bpftrace);
+            events.emplace_back(category, event_name, format_file_path);
         }
       }
     }
   }
+
+  // Get the formats from the cache or from the format files themselves
+  FormatCache cache;
+  std::vector<TracepointFormat> formats(events.size());
+  std::vector<size_t> unresolved;
+  std::vector<std::string> unresolved_paths;
+  for (size_t i = 0; i < events.size(); i++) {
+    const auto &[category, event_name, path] = events[i];
+    if (const auto *format = cache.find(category + ":" + event_name)) {
+      formats[i] = *format;
+    } else {
+      unresolved.push_back(i);
+      unresolved_paths.push_back(path);
+    }
+  }
+
+  auto read = read_formats(unresolved_paths, [](std::istream &format_file) {
+    return parse_format(format_file);
+  });
+  for (size_t i = 0; i < unresolved.size(); i++) {
+    const auto &[category, event_name, path] = events[unresolved[i]];
+    cache.insert(category + ":" + event_name, read[i]);
+    formats[unresolved[i]] = std::move(read[i]);
+  }
+  cache.save();
+
+  bool added_includes = false;
+  for (size_t i = 0; i < events.size(); i++) {
+    const auto &[category, event_name, path] = events[i];
+    std::string struct_name = get_struct_name(category, event_name);
+    if (bpftrace.structs.Has(struct_name))
+      continue;
+
+    // BTF has the better types (e.g. records instead of void pointers), but
+    // the record is named after the event class, which may be shared by
+    // several events. Only take it if it has the layout of the format file.
+    if (bpftrace.has_btf_data()) {
+      auto args = bpftrace.btf_->resolve_raw_tracepoint_args(event_name);
+      if (args && matches_format(*args, formats[i])) {
+        add_padding(*args);
+        bpftrace.structs.Add(struct_name, std::move(*args));
+        continue;
+      }
+    }
+
+    if (auto args = build_struct(formats[i], bpftrace)) {
+      bpftrace.structs.Add(struct_name, std::move(*args));
+      continue;
+    }
+
+    // Let clang resolve the types we don't know about
+    if (!bpftrace.has_btf_data() && !added_includes) {
+      program->c_definitions += "#include <linux/types.h>\n";
+      added_includes = true;
+    }
+    program->c_definitions += get_tracepoint_struct(
+        formats[i], category, event_name, bpftrace);
+  }
   return true;
 }
 
@@ -151,59 +466,97 @@ std::string TracepointFormatParser::get_struct_name(const std::string &probe_id)
   return get_struct_name(category, event_name);
 }
 
-std::string TracepointFormatParser::parse_field(const std::string &line,
-                                                int *last_offset,
-                                                BPFtrace &bpftrace)
+std::optional<TracepointFormatField> TracepointFormatParser::parse_field(
+    const std::string &line)
 {
-  std::string extra = "";
-
   auto field_pos = line.find("field:");
   if (field_pos == std::string::npos)
-    return "";
+    return std::nullopt;
 
   auto field_semi_pos = line.find(';', field_pos);
   if (field_semi_pos == std::string::npos)
-    return "";
+    return std::nullopt;
 
   auto offset_pos = line.find("offset:", field_semi_pos);
   if (offset_pos == std::string::npos)
-    return "";
+    return std::nullopt;
 
   auto offset_semi_pos = line.find(';', offset_pos);
   if (offset_semi_pos == std::string::npos)
-    return "";
+    return std::nullopt;
 
   auto size_pos = line.find("size:", offset_semi_pos);
   if (size_pos == std::string::npos)
-    return "";
+    return std::nullopt;
 
   auto size_semi_pos = line.find(';', size_pos);
   if (size_semi_pos == std::string::npos)
-    return "";
+    return std::nullopt;
+
+  TracepointFormatField field;
+  try {
+    field.size = std::stoi(
+        line.substr(size_pos + 5, size_semi_pos - size_pos - 5));
+    field.offset = std::stoi(
+        line.substr(offset_pos + 7, offset_semi_pos - offset_pos - 7));
+  } catch (const std::exception &) {
+    return std::nullopt;
+  }
 
-  int size = std::stoi(line.substr(size_pos + 5, size_semi_pos - size_pos - 5));
-  int offset = std::stoi(
-      line.substr(offset_pos + 7, offset_semi_pos - offset_pos - 7));
+  auto signed_pos = line.find("signed:", size_semi_pos);
+  if (signed_pos != std::string::npos)
+    field.is_signed = line.compare(signed_pos + 7, 1, "1") == 0;
+
+  std::string decl = line.substr(field_pos + 6,
+                                 field_semi_pos - field_pos - 6);
+  auto field_type_end_pos = decl.find_last_of("\t ");
+  if (field_type_end_pos == std::string::npos)
+    return std::nullopt;
+  field.type = decl.substr(0, field_type_end_pos);
+  field.name = decl.substr(field_type_end_pos + 1);
+
+  // Move array dimensions to the type
+  auto arr_size_pos = field.name.find('[');
+  if (arr_size_pos != std::string::npos) {
+    field.type += field.name.substr(arr_size_pos);
+    field.name.erase(arr_size_pos);
+  }
+
+  return field;
+}
+
+TracepointFormat TracepointFormatParser::parse_format(std::istream &format_file)
+{
+  TracepointFormat format;
+  for (std::string line; getline(format_file, line);) {
+    if (auto field = parse_field(line))
+      format.push_back(std::move(*field));
+  }
+  return format;
+}
+
+std::string TracepointFormatParser::format_field(
+    const TracepointFormatField &field,
+    int *last_offset,
+    BPFtrace &bpftrace)
+{
+  std::string extra = "";
 
   // If there'a gap between last field and this one,
   // generate padding fields
-  if (offset && *last_offset) {
-    int i, gap = offset - *last_offset;
+  if (field.offset && *last_offset) {
+    int i, gap = field.offset - *last_offset;
 
     for (i = 0; i < gap; i++) {
-      extra += "  char __pad_" + std::to_string(offset - gap + i) + ";\n";
+      extra += "  char __pad_" + std::to_string(field.offset - gap + i) +
+               ";\n";
     }
   }
 
-  *last_offset = offset + size;
+  *last_offset = field.offset + field.size;
 
-  std::string field = line.substr(field_pos + 6,
-                                  field_semi_pos - field_pos - 6);
-  auto field_type_end_pos = field.find_last_of("\t ");
-  if (field_type_end_pos == std::string::npos)
-    return "";
-  std::string field_type = field.substr(0, field_type_end_pos);
-  std::string field_name = field.substr(field_type_end_pos + 1);
+  std::string field_type = field.type;
+  std::string field_name = field.name;
 
   if (field_type.find("__data_loc") != std::string::npos) {
     // Note that the type here (ie `int`) does not matter. Later during parse
@@ -212,21 +565,25 @@ std::string TracepointFormatParser::parse_field(const std::string &line,
     field_type = R"_(__attribute__((annotate("tp_data_loc"))) int)_";
   }
 
-  auto arr_size_pos = field_name.find('[');
-  auto arr_size_end_pos = field_name.find(']');
+  auto arr_size_pos = field_type.find('[');
+  auto arr_size_end_pos = field_type.find(']');
   // Only adjust field types for non-arrays
   if (arr_size_pos == std::string::npos)
-    field_type = adjust_integer_types(field_type, size);
-
-  // If BTF is available, we try not to use any header files, including
-  // <linux/types.h> and request all the types we need from BTF.
-  bpftrace.btf_set_.emplace(field_type);
+    field_type = adjust_integer_types(field_type, field.size);
 
   if (arr_size_pos != std::string::npos) {
-    auto arr_size = field_name.substr(arr_size_pos + 1,
+    field_name += field_type.substr(arr_size_pos);
+    auto arr_size = field_type.substr(arr_size_pos + 1,
                                       arr_size_end_pos - arr_size_pos - 1);
+    field_type.erase(arr_size_pos);
+
+    // If BTF is available, we try not to use any header files, including
+    // <linux/types.h> and request all the types we need from BTF.
+    bpftrace.btf_set_.emplace(field_type);
     if (arr_size.find_first_not_of("0123456789") != std::string::npos)
       bpftrace.btf_set_.emplace(arr_size);
+  } else {
+    bpftrace.btf_set_.emplace(field_type);
   }
 
   return extra + "  " + field_type + " " + field_name + ";\n";
@@ -255,16 +612,123 @@ std::string TracepointFormatParser::get_tracepoint_struct(
     const std::string &category,
     const std::string &event_name,
     BPFtrace &bpftrace)
+{
+  return get_tracepoint_struct(parse_format(format_file),
+                               category,
+                               event_name,
+                               bpftrace);
+}
+
+std::string TracepointFormatParser::get_tracepoint_struct(
+    const TracepointFormat &format,
+    const std::string &category,
+    const std::string &event_name,
+    BPFtrace &bpftrace)
 {
   std::string format_struct = get_struct_name(category, event_name) + "\n{\n";
   int last_offset = 0;
 
-  for (std::string line; getline(format_file, line);) {
-    format_struct += parse_field(line, &last_offset, bpftrace);
+  for (const auto &field : format) {
+    format_struct += format_field(field, &last_offset, bpftrace);
   }
 
   format_struct += "};\n";
   return format_struct;
 }
 
+std::optional<SizedType> TracepointFormatParser::resolve_field_type(
+    const TracepointFormatField &field,
+    BPFtrace &bpftrace)
+{
+  const std::string &type = field.type;
+  if (type.find("__rel_loc") != std::string::npos)
+    return std::nullopt;
+
+  auto arr_size_pos = type.find('[');
+  if (arr_size_pos != std::string::npos) {
+    // Multi-dimensional arrays are left to clang
+    if (type.find('[', arr_size_pos + 1) != std::string::npos)
+      return std::nullopt;
+
+    auto elem_name = strip_qualifiers(type.substr(0, arr_size_pos));
+    if (elem_name == "char")
+      return CreateString(field.size);
+
+    auto elem_type = resolve_type_name(elem_name, bpftrace);
+    if (!elem_type || elem_type->GetSize() == 0 ||
+        field.size % elem_type->GetSize() != 0)
+      return std::nullopt;
+    return CreateArray(field.size / elem_type->GetSize(), *elem_type);
+  }
+
+  if (strip_qualifiers(type).starts_with("enum "))
+    return CreateInteger(field.size * 8, field.is_signed);
+
+  auto stype = resolve_type_name(type, bpftrace);
+  if (!stype || stype->IsNoneTy())
+    return std::nullopt;
+  // The format file knows the actual size and signedness of integers
+  if (stype->IsIntTy())
+    return CreateInteger(field.size * 8, field.is_signed);
+  return stype;
+}
+
+std::optional<Struct> TracepointFormatParser::build_struct(
+    const TracepointFormat &format,
+    BPFtrace &bpftrace)
+{
+  if (format.empty())
+    return std::nullopt;
+
+  int size = 0;
+  Struct args(0, false);
+  for (const auto &field : format) {
+    size = std::max(size, field.offset + field.size);
+    if (field.type.find("__data_loc") != std::string::npos) {
+      args.AddField(field.name, CreateInt64(), field.offset, std::nullopt, true);
+      continue;
+    }
+
+    auto type = resolve_field_type(field, bpftrace);
+    if (!type)
+      return std::nullopt;
+    args.AddField(field.name, *type, field.offset);
+  }
+  args.size = size;
+  add_padding(args);
+
+  // Records referenced by the fields are resolved later, together with the
+  // other types requested from BTF
+  for (const auto &field : args.fields) {
+    const SizedType *inner = &field.type;
+    while (inner->IsPtrTy() || inner->IsArrayTy())
+      inner = inner->IsPtrTy() ? inner->GetPointeeTy() : inner->GetElementTy();
+    if (inner->IsRecordTy())
+      bpftrace.btf_set_.insert(inner->GetName());
+  }
+
+  return args;
+}
+
+void TracepointFormatParser::add_padding(Struct &record)
+{
+  // Mirror the __pad_N fields which are generated for the C definitions so
+  // that the records look the same whichever way they were created
+  Fields fields;
+  ssize_t last_offset = 0;
+  for (auto &field : record.fields) {
+    if (field.offset && last_offset) {
+      for (ssize_t i = last_offset; i < field.offset; i++)
+        fields.push_back(Field{ .name = "__pad_" + std::to_string(i),
+                                .type = CreateInt8(),
+                                .offset = i });
+    }
+    // __data_loc fields are 32 bits wide, even though they are read as u64
+    last_offset = field.offset +
+                  (field.is_data_loc ? 4 : field.type.GetSize());
+    fields.push_back(std::move(field));
+  }
+  record.fields = std::move(fields);
+}
+
 } // namespace bpftrace
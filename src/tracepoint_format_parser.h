@@ -1,7 +1,12 @@
 #pragma once
 
 #include <istream>
+#include <optional>
 #include <set>
+#include <string>
+#include <vector>
+
+#include <cereal/access.hpp>
 
 #include "ast/visitor.h"
 #include "bpftrace.h"
@@ -43,6 +48,32 @@ private:
 };
 } // namespace ast
 
+// A field of a tracepoint, as described by its format file. Array dimensions
+// are part of the type (e.g. "char[16]"), not of the name.
+struct TracepointFormatField {
+  std::string name;
+  std::string type;
+  int offset = 0;
+  int size = 0;
+  bool is_signed = false;
+
+private:
+  friend class cereal::access;
+  template <typename Archive>
+  void serialize(Archive &archive)
+  {
+    archive(name, type, offset, size, is_signed);
+  }
+};
+
+using TracepointFormat = std::vector<TracepointFormatField>;
+
+// Provides the record types of tracepoint args. The layouts are described by
+// the tracepoint format files, which are read in parallel and cached across
+// runs. The types are taken from BTF (`struct trace_event_raw_<event>`) if it
+// has the same layout, otherwise they are resolved from the format.
+// Records are added to BPFtrace::structs directly, C definitions for clang are
+// only generated for layouts which cannot be resolved that way.
 class TracepointFormatParser {
 public:
   static bool parse(ast::ASTContext &ctx, BPFtrace &bpftrace);
@@ -55,18 +86,33 @@ public:
   }
 
 private:
-  static std::string parse_field(const std::string &line,
-                                 int *last_offset,
-                                 BPFtrace &bpftrace);
+  static std::optional<TracepointFormatField> parse_field(
+      const std::string &line);
+  static std::string format_field(const TracepointFormatField &field,
+                                  int *last_offset,
+                                  BPFtrace &bpftrace);
   static std::string adjust_integer_types(const std::string &field_type,
                                           int size);
+  static std::optional<SizedType> resolve_field_type(
+      const TracepointFormatField &field,
+      BPFtrace &bpftrace);
+  static void add_padding(Struct &record);
   static std::set<std::string> struct_list;
 
 protected:
+  static TracepointFormat parse_format(std::istream &format_file);
   static std::string get_tracepoint_struct(std::istream &format_file,
                                            const std::string &category,
                                            const std::string &event_name,
                                            BPFtrace &bpftrace);
+  static std::string get_tracepoint_struct(const TracepointFormat &format,
+                                           const std::string &category,
+                                           const std::string &event_name,
+                                           BPFtrace &bpftrace);
+  // Builds the args record from the format without going through clang.
+  // Returns std::nullopt if some of the field types cannot be resolved.
+  static std::optional<Struct> build_struct(const TracepointFormat &format,
+                                            BPFtrace &bpftrace);
 };
 
 } // namespace bpftrace
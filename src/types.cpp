@@ -93,6 +93,9 @@ std::string typestr(const SizedType &type)
     case Type::strerror_t:
     case Type::hist_t:
     case Type::lhist_t:
+    case Type::quantiles_t:
+    case Type::count_distinct_t:
+    case Type::topk_t:
     case Type::none:
     case Type::voidtype:
       return typestr(type.GetTy());
@@ -215,7 +218,10 @@ std::string typestr(Type t)
     case Type::record:   return "record";   break;
     case Type::hist_t:     return "hist_t";     break;
     case Type::lhist_t:    return "lhist_t";    break;
+    case Type::quantiles_t: return "quantiles_t"; break;
     case Type::count_t:    return "count_t";    break;
+    case Type::count_distinct_t: return "count_distinct_t"; break;
+    case Type::topk_t:     return "topk_t";     break;
     case Type::sum_t:      return "sum_t";      break;
     case Type::min_t:      return "min_t";      break;
     case Type::max_t:      return "max_t";      break;
@@ -498,6 +504,22 @@ SizedType CreateHist()
   return SizedType(Type::hist_t, 8);
 }
 
+SizedType CreateQuantiles()
+{
+  return SizedType(Type::quantiles_t, 8);
+}
+
+// The map value holds one byte per HyperLogLog register
+SizedType CreateCountDistinct(size_t registers)
+{
+  return SizedType(Type::count_distinct_t, registers);
+}
+
+SizedType CreateTopk()
+{
+  return SizedType(Type::topk_t, 8);
+}
+
 SizedType CreateUSym()
 {
   return SizedType(Type::usym_t, 16);
@@ -674,7 +696,8 @@ bool SizedType::FitsInto(const SizedType &t) const
 
 bool SizedType::NeedsPercpuMap() const
 {
-  return IsHistTy() || IsLhistTy() || IsCountTy() || IsSumTy() || IsMinTy() ||
+  return IsHistTy() || IsLhistTy() || IsQuantilesTy() || IsCountTy() ||
+         IsCountDistinctTy() || IsTopkTy() || IsSumTy() || IsMinTy() ||
          IsMaxTy() || IsAvgTy() || IsStatsTy();
 }
 } // namespace bpftrace
@@ -716,7 +739,10 @@ size_t hash<bpftrace::SizedType>::operator()(
     case bpftrace::Type::voidtype:
     case bpftrace::Type::hist_t:
     case bpftrace::Type::lhist_t:
+    case bpftrace::Type::quantiles_t:
     case bpftrace::Type::count_t:
+    case bpftrace::Type::count_distinct_t:
+    case bpftrace::Type::topk_t:
     case bpftrace::Type::sum_t:
     case bpftrace::Type::min_t:
     case bpftrace::Type::max_t:
@@ -20,6 +20,23 @@ const int MAX_STACK_SIZE = 1024;
 const int DEFAULT_STACK_SIZE = 127;
 const int COMM_SIZE = 16;
 
+// count_distinct() keeps 2^precision one byte HyperLogLog registers per key
+const int COUNT_DISTINCT_MIN_PRECISION = 4;
+const int COUNT_DISTINCT_MAX_PRECISION = 14;
+const int COUNT_DISTINCT_DEFAULT_PRECISION = 10;
+// Values are hashed in at most 255 8-byte words
+const size_t COUNT_DISTINCT_MAX_VALUE_SIZE = 255 * 8;
+
+// topk() maps keep up to 2 * k keys, ranked by a count-min sketch of
+// TOPK_SKETCH_DEPTH rows of TOPK_SKETCH_WIDTH counters. The sketch is
+// followed by the number of events counted in it.
+const int TOPK_MAX_K = 65536;
+const int TOPK_SKETCH_DEPTH = 4;
+const int TOPK_SKETCH_WIDTH = 512;
+const int TOPK_SKETCH_SIZE = TOPK_SKETCH_DEPTH * TOPK_SKETCH_WIDTH + 1;
+// Keys are hashed in at most 255 8-byte words
+const size_t TOPK_MAX_KEY_SIZE = 255 * 8;
+
 enum class Type : uint8_t {
   // clang-format off
   none,
@@ -52,6 +69,9 @@ enum class Type : uint8_t {
   cgroup_path_t,
   strerror_t,
   timestamp_mode,
+  quantiles_t,
+  count_distinct_t,
+  topk_t,
   // clang-format on
 };
 
@@ -367,11 +387,23 @@ public:
   bool IsLhistTy(void) const
   {
     return type_ == Type::lhist_t;
+  }
+  bool IsQuantilesTy(void) const
+  {
+    return type_ == Type::quantiles_t;
   };
   bool IsCountTy(void) const
   {
     return type_ == Type::count_t;
   };
+  bool IsCountDistinctTy(void) const
+  {
+    return type_ == Type::count_distinct_t;
+  };
+  bool IsTopkTy(void) const
+  {
+    return type_ == Type::topk_t;
+  };
   bool IsSumTy(void) const
   {
     return type_ == Type::sum_t;
@@ -475,7 +507,8 @@ public:
   bool IsMultiOutputMapTy() const
   {
     return type_ == Type::hist_t || type_ == Type::lhist_t ||
-           type_ == Type::stats_t;
+           type_ == Type::quantiles_t || type_ == Type::count_distinct_t ||
+           type_ == Type::topk_t || type_ == Type::stats_t;
   }
 
   bool NeedsPercpuMap() const;
@@ -542,6 +575,9 @@ SizedType CreateUsername();
 SizedType CreateInet(size_t size);
 SizedType CreateLhist();
 SizedType CreateHist();
+SizedType CreateQuantiles();
+SizedType CreateCountDistinct(size_t registers);
+SizedType CreateTopk();
 SizedType CreateUSym();
 SizedType CreateKSym();
 SizedType CreateBuffer(size_t size);
@@ -667,6 +703,9 @@ struct Probe {
   uint64_t address = 0;
   uint64_t func_offset = 0;
   std::vector<std::string> funcs;
+  // for interval and profile probes driven by a BPF timer, the first slot of
+  // the timers map used by the probe
+  std::optional<uint32_t> timer_slot;
 
 private:
   friend class cereal::access;
@@ -690,7 +729,8 @@ private:
             async,
             address,
             func_offset,
-            funcs);
+            funcs,
+            timer_slot);
   }
 };
 
@@ -737,6 +777,9 @@ enum class GlobalVar {
   WRITE_MAP_VALUE_BUFFER,
   VARIABLE_BUFFER,
   MAP_KEY_BUFFER,
+  // Per-CPU values of keyless count(), sum(), min() and max() maps which are
+  // only updated in BPF, see MapInfo::scalar_agg_slot
+  SCALAR_AGG_BUFFER,
 };
 
 } // namespace globalvars
@@ -337,6 +337,73 @@ std::optional<std::filesystem::path> find_in_path(std::string_view name)
   return std::nullopt;
 }
 
+std::optional<std::filesystem::path> get_cache_dir()
+{
+  std::filesystem::path dir;
+  if (const char *cache_env = std::getenv("BPFTRACE_CACHE_DIR")) {
+    if (*cache_env == '\0')
+      return std::nullopt;
+    dir = cache_env;
+  } else if (const char *xdg_env = std::getenv("XDG_CACHE_HOME");
+             xdg_env && *xdg_env) {
+    dir = std::filesystem::path(xdg_env) / "bpftrace";
+  } else if (const char *home_env = std::getenv("HOME");
+             home_env && *home_env) {
+    dir = std::filesystem::path(home_env) / ".cache" / "bpftrace";
+  } else {
+    return std::nullopt;
+  }
+
+  std::error_code ec;
+  bool created = std::filesystem::create_directories(dir, ec);
+  if (ec) {
+    LOG(V1) << "Failed to create cache directory " << dir << ": "
+            << ec.message();
+    return std::nullopt;
+  }
+  if (created)
+    std::filesystem::permissions(dir,
+                                 std::filesystem::perms::owner_all,
+                                 std::filesystem::perm_options::replace,
+                                 ec);
+  return dir;
+}
+
+std::optional<std::string> read_cache_file(const std::filesystem::path &path)
+{
+  int fd = open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0)
+    return std::nullopt;
+  SCOPE_EXIT
+  {
+    close(fd);
+  };
+
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+    return std::nullopt;
+  if (!S_ISREG(st.st_mode) || st.st_uid != geteuid() ||
+      (st.st_mode & (S_IWGRP | S_IWOTH))) {
+    LOG(V1) << "Ignoring cache file " << path
+            << " which is not owned by the current user or is writable by "
+               "others";
+    return std::nullopt;
+  }
+
+  std::string content(st.st_size, '\0');
+  size_t done = 0;
+  while (done < content.size()) {
+    ssize_t ret = read(fd, content.data() + done, content.size() - done);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      break;
+    done += ret;
+  }
+  content.resize(done);
+  return content;
+}
+
 std::optional<std::filesystem::path> find_near_self(std::string_view filename)
 {
   std::error_code ec;
@@ -1626,6 +1693,45 @@ std::string sanitise_bpf_program_name(const std::string &name)
   return sanitised_name;
 }
 
+uint64_t count_distinct_value(const std::vector<uint8_t> &value,
+                              int nvalues,
+                              size_t nregisters)
+{
+  // The union of the per-CPU sets is the register-wise maximum
+  std::vector<uint8_t> registers(nregisters, 0);
+  for (int i = 0; i < nvalues; i++) {
+    for (size_t j = 0; j < nregisters; j++)
+      registers[j] = std::max(registers[j], value.at(i * nregisters + j));
+  }
+
+  double m = nregisters;
+  double alpha;
+  if (nregisters <= 16)
+    alpha = 0.673;
+  else if (nregisters <= 32)
+    alpha = 0.697;
+  else if (nregisters <= 64)
+    alpha = 0.709;
+  else
+    alpha = 0.7213 / (1 + 1.079 / m);
+
+  double sum = 0;
+  size_t zeros = 0;
+  for (uint8_t reg : registers) {
+    sum += std::ldexp(1.0, -reg);
+    if (reg == 0)
+      zeros++;
+  }
+
+  double estimate = alpha * m * m / sum;
+  // Small cardinalities: fall back to linear counting while some registers
+  // are still unused. With 64-bit hashes no large range correction is needed.
+  if (estimate <= 2.5 * m && zeros != 0)
+    estimate = m * std::log(m / zeros);
+
+  return std::llround(estimate);
+}
+
 uint32_t round_up_to_next_power_of_two(uint32_t n)
 {
   // http://graphics.stanford.edu/~seander/bithacks.html#RoundUpPowerOf2
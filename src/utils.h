@@ -175,6 +175,12 @@ void get_bool_env_var(const ::std::string &str,
 std::optional<std::filesystem::path> find_in_path(std::string_view name);
 // Finds a file in the same directory as running binary
 std::optional<std::filesystem::path> find_near_self(std::string_view name);
+// Directory for data cached across bpftrace runs (created if necessary).
+// Can be overridden with BPFTRACE_CACHE_DIR, an empty value disables caching.
+std::optional<std::filesystem::path> get_cache_dir();
+// Reads a file from the cache directory. Files which are not regular files
+// owned by the effective user, or which are writable by others, are refused.
+std::optional<std::string> read_cache_file(const std::filesystem::path &path);
 std::string get_pid_exe(pid_t pid);
 std::string get_pid_exe(const std::string &pid);
 std::string get_proc_maps(const std::string &pid);
@@ -388,6 +394,12 @@ T avg_value(const std::vector<uint8_t> &value, int nvalues)
   return stats_value<T>(value, nvalues).avg;
 }
 
+// Merges the per-CPU HyperLogLog registers of a count_distinct() value and
+// returns the estimated number of distinct values
+uint64_t count_distinct_value(const std::vector<uint8_t> &value,
+                              int nvalues,
+                              size_t nregisters);
+
 // Combination of 2 hashes
 // The algorithm is taken from boost::hash_combine
 template <class T>
@@ -1,11 +1,17 @@
-#include "ast/ast.h"
+#include <sstream>
 
+#include "ast/ast.h"
+#include "ast/passes/semantic_analyser.h"
+#include "driver.h"
+#include "mocks.h"
 #include "gtest/gtest.h"
 
 namespace bpftrace::test::ast {
 
+using bpftrace::ast::ASTContext;
 using bpftrace::ast::AttachPoint;
 using bpftrace::ast::AttachPointList;
+using bpftrace::ast::Integer;
 using bpftrace::ast::Probe;
 
 TEST(ast, probe_name_special)
@@ -133,4 +139,80 @@ TEST(ast, attach_point_name)
   EXPECT_EQ(ap3.name(), "uprobe:/bin/sh:readline");
 }
 
+TEST(ast, context_many_nodes)
+{
+  ASTContext ctx;
+  std::vector<Integer *> ints;
+  // Enough nodes to span multiple chunks
+  for (int i = 0; i < 100000; i++)
+    ints.push_back(ctx.make_node<Integer>(i, location()));
+
+  EXPECT_EQ(ctx.node_count(), 100000U);
+  for (int i = 0; i < 100000; i++) {
+    EXPECT_EQ(ints[i]->n, i);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(ints[i]) % alignof(Integer), 0U);
+  }
+
+  // Nodes bigger than a chunk
+  auto *ap = ctx.make_node<AttachPoint>(std::string(10000, 'a'),
+                                        false,
+                                        location());
+  EXPECT_EQ(ap->raw_input.size(), 10000U);
+}
+
+TEST(ast, context_move)
+{
+  ASTContext ctx;
+  auto *integer = ctx.make_node<Integer>(42, location());
+  auto *ap = ctx.make_node<AttachPoint>("kprobe:f", false, location());
+
+  ASTContext moved(std::move(ctx));
+  EXPECT_EQ(moved.node_count(), 2U);
+  EXPECT_EQ(integer->n, 42);
+  EXPECT_EQ(ap->raw_input, "kprobe:f");
+
+  moved = ASTContext();
+  EXPECT_EQ(moved.node_count(), 0U);
+  moved.make_node<Integer>(1, location());
+  EXPECT_EQ(moved.node_count(), 1U);
+}
+
+static std::string generate_program(int num_probes)
+{
+  std::ostringstream prog;
+  for (int i = 0; i < num_probes; i++) {
+    prog << "kprobe:f { $x = arg0 + " << i << "; @m" << i % 10
+         << "[pid, comm] = count(); if ($x > 10) { printf(\"%d\\n\", $x); } "
+         << "@s[" << i << "] = sum($x * 2 - arg1); }\n";
+  }
+  return prog.str();
+}
+
+static void parse_and_analyse(int num_probes)
+{
+  auto mock_bpftrace = get_mock_bpftrace();
+  Driver driver(*mock_bpftrace);
+  std::stringstream out;
+
+  ASSERT_EQ(driver.parse_str(generate_program(num_probes)), 0);
+  bpftrace::ast::SemanticAnalyser semantics(driver.ctx, *mock_bpftrace, out);
+  ASSERT_EQ(semantics.analyse(), 0) << out.str();
+  EXPECT_GT(driver.ctx.node_count(), num_probes * 20U);
+}
+
+// A parsed and analysed program spanning several growing arena chunks, small
+// enough to run on every test run
+TEST(ast, program_arena_growth)
+{
+  parse_and_analyse(100);
+}
+
+// Parsing and analysing a large generated program. This is a benchmark of
+// allocating and walking many AST nodes rather than a unit test, run it with
+// --gtest_also_run_disabled_tests --gtest_filter=ast.DISABLED_large_program
+TEST(ast, DISABLED_large_program)
+{
+  parse_and_analyse(2000);
+}
+
 } // namespace bpftrace::test::ast
@@ -1,4 +1,7 @@
 #include "bpfbytecode.h"
+
+#include <algorithm>
+
 #include "ast/passes/codegen_llvm.h"
 #include "ast/passes/semantic_analyser.h"
 #include "driver.h"
@@ -8,20 +11,24 @@
 
 namespace bpftrace::test::bpfbytecode {
 
-BpfBytecode codegen(std::string_view input)
+BpfBytecode codegen(BPFtrace &bpftrace, std::string_view input)
 {
-  auto bpftrace = get_mock_bpftrace();
-
-  Driver driver(*bpftrace);
+  Driver driver(bpftrace);
   EXPECT_EQ(driver.parse_str(input), 0);
 
-  ast::SemanticAnalyser semantics(driver.ctx, *bpftrace);
+  ast::SemanticAnalyser semantics(driver.ctx, bpftrace);
   EXPECT_EQ(semantics.analyse(), 0);
 
-  ast::CodegenLLVM codegen(driver.ctx, *bpftrace);
+  ast::CodegenLLVM codegen(driver.ctx, bpftrace);
   return codegen.compile();
 }
 
+BpfBytecode codegen(std::string_view input)
+{
+  auto bpftrace = get_mock_bpftrace();
+  return codegen(*bpftrace, input);
+}
+
 TEST(bpfbytecode, create_programs)
 {
   auto bytecode = codegen("kprobe:foo { 1 }");
@@ -39,4 +46,113 @@ TEST(bpfbytecode, create_programs)
             "s_kprobe_foo_1");
 }
 
+TEST(bpfbytecode, dedupe_identical_programs)
+{
+  auto bpftrace = get_mock_bpftrace();
+  auto bytecode = codegen(*bpftrace, "kprobe:foo,kprobe:bar { 1 }");
+
+  std::map<std::string, std::string> expected_aliases = {
+    { "kprobe_bar_1", "kprobe_foo_1" }
+  };
+  EXPECT_EQ(bpftrace->resources.program_aliases, expected_aliases);
+
+  Probe foo;
+  foo.type = ProbeType::kprobe;
+  foo.name = "kprobe:foo";
+  foo.index = 1;
+
+  Probe bar = foo;
+  bar.name = "kprobe:bar";
+
+  bytecode.set_program_aliases(bpftrace->resources.program_aliases);
+  EXPECT_EQ(bytecode.getProgramForProbe(foo).bpf_prog(),
+            bytecode.getProgramForProbe(bar).bpf_prog());
+}
+
+TEST(bpfbytecode, parallel_codegen)
+{
+  const std::string prog = "kprobe:foo { @a = hist(arg0); } "
+                           "kprobe:bar { @b[comm] = count(); } "
+                           "kprobe:baz { @a = hist(arg1); "
+                           "             @c = lhist(arg0, 0, 100, 10); } "
+                           "kprobe:qux { @d = @b[comm]; }";
+  const std::vector<std::string> names = { "foo", "bar", "baz", "qux" };
+
+  struct Result {
+    std::vector<std::string> sections;
+    std::vector<std::string> maps;
+    std::vector<size_t> insn_counts;
+  };
+  auto build = [&](uint64_t threads) {
+    auto bpftrace = get_mock_bpftrace();
+    ConfigSetter configs{ bpftrace->config_, ConfigSource::script };
+    configs.set(ConfigKeyInt::codegen_threads, threads);
+    auto bytecode = codegen(*bpftrace, prog);
+
+    Result result;
+    for (size_t i = 0; i < names.size(); i++) {
+      Probe probe;
+      probe.type = ProbeType::kprobe;
+      probe.name = "kprobe:" + names[i];
+      probe.index = i + 1;
+
+      auto &program = bytecode.getProgramForProbe(probe);
+      result.sections.emplace_back(
+          bpf_program__section_name(program.bpf_prog()));
+      result.insn_counts.push_back(
+          bpf_program__insn_cnt(program.bpf_prog()));
+    }
+    for (const auto &[name, map] : bytecode.maps())
+      result.maps.push_back(name);
+    return result;
+  };
+
+  auto serial = build(1);
+  for (size_t i = 0; i < names.size(); i++)
+    EXPECT_EQ(serial.sections[i],
+              "s_kprobe_" + names[i] + "_" + std::to_string(i + 1));
+  EXPECT_NE(std::find(serial.maps.begin(), serial.maps.end(), "@a"),
+            serial.maps.end());
+
+  // Programs optimized on different threads must end up in one object with
+  // the same programs, and maps used by programs of different parts (e.g. @a
+  // in foo and baz) must not be duplicated
+  for (uint64_t threads : { 2, 3 }) {
+    auto parallel = build(threads);
+    EXPECT_EQ(parallel.sections, serial.sections) << threads << " threads";
+    EXPECT_EQ(parallel.maps, serial.maps) << threads << " threads";
+    for (auto count : parallel.insn_counts)
+      EXPECT_GT(count, 0U) << threads << " threads";
+  }
+
+  // The output only depends on the number of threads
+  EXPECT_EQ(build(3).insn_counts, build(3).insn_counts);
+}
+
+TEST(bpfbytecode, opt_profiles)
+{
+  auto insn_count = [](OptProfile profile) {
+    auto bpftrace = get_mock_bpftrace();
+    bpftrace->opt_profile_ = profile;
+    auto bytecode = codegen(*bpftrace,
+                            "kprobe:foo { @a = hist(arg0); "
+                            "             @b[comm, pid] = count(); "
+                            "             @c = lhist(arg1, 0, 1000, 10); }");
+
+    Probe probe;
+    probe.type = ProbeType::kprobe;
+    probe.name = "kprobe:foo";
+    probe.index = 1;
+    return bpf_program__insn_cnt(
+        bytecode.getProgramForProbe(probe).bpf_prog());
+  };
+
+  auto fast = insn_count(OptProfile::fast);
+  auto default_ = insn_count(OptProfile::default_);
+  auto size = insn_count(OptProfile::size);
+  EXPECT_GT(fast, 0U);
+  EXPECT_GT(default_, 0U);
+  EXPECT_LE(size, default_);
+}
+
 } // namespace bpftrace::test::bpfbytecode
@@ -0,0 +1,163 @@
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+#include "bpffeature.h"
+#include "gtest/gtest.h"
+
+namespace bpftrace::test::bpffeature {
+
+class CachedBPFfeature : public BPFfeature {
+public:
+  CachedBPFfeature(BPFnofeature &no_feature = default_no_feature)
+      : BPFfeature(no_feature)
+  {
+  }
+
+  using BPFfeature::enable_cache;
+
+  std::optional<bool> &d_path()
+  {
+    return has_d_path_;
+  }
+  std::optional<bool> &kprobe_multi()
+  {
+    return has_kprobe_multi_;
+  }
+
+  static inline BPFnofeature default_no_feature;
+};
+
+class bpffeature_cache : public ::testing::Test {
+protected:
+  void SetUp() override
+  {
+    std::string tmpdir = "/tmp/bpftrace-test-features-XXXXXX";
+    ASSERT_TRUE(::mkdtemp(&tmpdir[0]));
+    dir_ = tmpdir;
+    path_ = dir_ / "features";
+  }
+
+  void TearDown() override
+  {
+    std::filesystem::remove_all(dir_);
+  }
+
+  std::string read_cache()
+  {
+    std::ifstream file(path_);
+    std::stringstream content;
+    content << file.rdbuf();
+    return content.str();
+  }
+
+  // Stores d_path and kprobe_multi results for kernel "k1"
+  void populate(BPFnofeature &no_feature = CachedBPFfeature::default_no_feature)
+  {
+    CachedBPFfeature feature(no_feature);
+    feature.enable_cache(path_, "k1", false);
+    feature.d_path() = true;
+    feature.kprobe_multi() = false;
+  }
+
+  std::filesystem::path dir_;
+  std::filesystem::path path_;
+};
+
+TEST_F(bpffeature_cache, save)
+{
+  populate();
+  auto content = read_cache();
+  EXPECT_TRUE(content.starts_with("bpftrace ")) << content;
+  EXPECT_NE(content.find(" kernel k1\n"), std::string::npos) << content;
+  EXPECT_NE(content.find("\nd_path 1\n"), std::string::npos) << content;
+  EXPECT_NE(content.find("\nkprobe_multi 0\n"), std::string::npos) << content;
+  // Results which were not probed are not stored
+  EXPECT_EQ(content.find("map_batch"), std::string::npos) << content;
+
+  auto perms = std::filesystem::status(path_).permissions();
+  EXPECT_EQ(perms & (std::filesystem::perms::group_all |
+                     std::filesystem::perms::others_all),
+            std::filesystem::perms::none);
+}
+
+TEST_F(bpffeature_cache, load)
+{
+  populate();
+
+  CachedBPFfeature feature;
+  feature.enable_cache(path_, "k1", false);
+  ASSERT_TRUE(feature.d_path().has_value());
+  EXPECT_TRUE(*feature.d_path());
+  ASSERT_TRUE(feature.kprobe_multi().has_value());
+  EXPECT_FALSE(*feature.kprobe_multi());
+}
+
+TEST_F(bpffeature_cache, invalidate_other_kernel)
+{
+  populate();
+
+  {
+    CachedBPFfeature feature;
+    feature.enable_cache(path_, "k2", false);
+    EXPECT_FALSE(feature.d_path().has_value());
+    feature.d_path() = false;
+  }
+
+  // The cache now belongs to the other kernel
+  auto content = read_cache();
+  EXPECT_NE(content.find(" kernel k2\n"), std::string::npos) << content;
+  EXPECT_NE(content.find("\nd_path 0\n"), std::string::npos) << content;
+}
+
+TEST_F(bpffeature_cache, reprobe)
+{
+  populate();
+
+  {
+    CachedBPFfeature feature;
+    feature.enable_cache(path_, "k1", true);
+    EXPECT_FALSE(feature.d_path().has_value());
+    feature.d_path() = false;
+  }
+
+  auto content = read_cache();
+  EXPECT_NE(content.find("\nd_path 0\n"), std::string::npos) << content;
+  EXPECT_EQ(content.find("kprobe_multi"), std::string::npos) << content;
+}
+
+TEST_F(bpffeature_cache, no_feature)
+{
+  populate();
+
+  // Overridden results are neither loaded nor stored
+  BPFnofeature no_feature;
+  ASSERT_EQ(no_feature.parse("kprobe_multi"), 0);
+  {
+    CachedBPFfeature feature(no_feature);
+    feature.enable_cache(path_, "k1", false);
+    ASSERT_TRUE(feature.d_path().has_value());
+    EXPECT_TRUE(*feature.d_path());
+    EXPECT_FALSE(feature.kprobe_multi().has_value());
+    feature.d_path() = false;
+    feature.kprobe_multi() = false;
+  }
+
+  auto content = read_cache();
+  EXPECT_NE(content.find("\nd_path 0\n"), std::string::npos) << content;
+  EXPECT_EQ(content.find("kprobe_multi"), std::string::npos) << content;
+}
+
+TEST_F(bpffeature_cache, writable_by_others)
+{
+  populate();
+  std::filesystem::permissions(path_,
+                               std::filesystem::perms::others_write,
+                               std::filesystem::perm_options::add);
+
+  CachedBPFfeature feature;
+  feature.enable_cache(path_, "k1", false);
+  EXPECT_FALSE(feature.d_path().has_value());
+}
+
+} // namespace bpftrace::test::bpffeature
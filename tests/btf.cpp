@@ -0,0 +1,75 @@
+#include "btf.h"
+#include "gtest/gtest.h"
+
+namespace bpftrace::test::btf {
+
+#include "btf_common.h"
+
+// Pretends that the kernel has a module with BTF. Loading the module BTF
+// always fails, we only count how many times it is attempted.
+class MockBTF : public BTF {
+public:
+  MockBTF() : BTF({})
+  {
+    pending_modules_ = { "mod" };
+  }
+
+  int loads = 0;
+
+protected:
+  std::map<std::string, __u32> read_kernel_btf_ids() const override
+  {
+    return { { "mod", 42 } };
+  }
+
+  struct btf *load_split_btf(__u32 id) const override
+  {
+    EXPECT_EQ(id, 42U);
+    const_cast<MockBTF *>(this)->loads++;
+    return nullptr;
+  }
+};
+
+class btf_lazy : public test_btf {};
+
+TEST_F(btf_lazy, objects_cnt)
+{
+  MockBTF btf;
+  ASSERT_TRUE(btf.has_data());
+  EXPECT_EQ(btf.objects_cnt(), 2);
+  EXPECT_EQ(btf.loads, 0);
+}
+
+TEST_F(btf_lazy, lookup_in_vmlinux)
+{
+  MockBTF btf;
+  EXPECT_TRUE(btf.get_stype("struct Foo1").IsRecordTy());
+  EXPECT_EQ(btf.get_structs("struct Foo1"),
+            std::set<std::string>{ "struct Foo1" });
+  EXPECT_EQ(btf.loads, 0);
+}
+
+TEST_F(btf_lazy, lookup_in_module)
+{
+  MockBTF btf;
+  EXPECT_TRUE(btf.get_stype("struct NotThere").IsNoneTy());
+  EXPECT_EQ(btf.loads, 1);
+
+  // The module is only tried once
+  EXPECT_TRUE(btf.get_stype("struct NotThere").IsNoneTy());
+  EXPECT_EQ(btf.loads, 1);
+}
+
+TEST_F(btf_lazy, funcs_of_module)
+{
+  MockBTF btf;
+  std::string funcs{ std::istreambuf_iterator<char>(*btf.get_all_funcs("")),
+                     std::istreambuf_iterator<char>() };
+  EXPECT_NE(funcs.find(":func_1\n"), std::string::npos);
+  EXPECT_EQ(btf.loads, 0);
+
+  EXPECT_EQ(btf.get_all_funcs("mod")->peek(), EOF);
+  EXPECT_EQ(btf.loads, 1);
+}
+
+} // namespace bpftrace::test::btf
@@ -703,6 +703,86 @@ TEST_F(clang_parser_btf, btf)
   EXPECT_EQ(foo2_field.offset, 8);
 }
 
+TEST_F(clang_parser_btf, btf_resolve_types)
+{
+  // Types resolved directly from BTF must match what clang gets from the
+  // BTF-generated header.
+  BPFtrace clang_bpftrace;
+  clang_bpftrace.parse_btf({});
+  parse("", clang_bpftrace, true, "kprobe:sys_read { (struct Foo3 *)curtask }");
+
+  BPFtrace btf_bpftrace;
+  btf_bpftrace.parse_btf({});
+  btf_bpftrace.btf_->resolve_types({ "struct Foo3" }, 1);
+
+  for (const auto &name : { "struct Foo1", "struct Foo2", "struct Foo3" }) {
+    ASSERT_TRUE(btf_bpftrace.structs.Has(name)) << name;
+    ASSERT_TRUE(clang_bpftrace.structs.Has(name)) << name;
+    auto btf_struct = btf_bpftrace.structs.Lookup(name).lock();
+    auto clang_struct = clang_bpftrace.structs.Lookup(name).lock();
+    EXPECT_EQ(btf_struct->size, clang_struct->size) << name;
+    ASSERT_EQ(btf_struct->fields.size(), clang_struct->fields.size()) << name;
+    for (const auto &field : clang_struct->fields) {
+      ASSERT_TRUE(btf_struct->HasField(field.name)) << name << "." << field.name;
+      EXPECT_EQ(btf_struct->GetField(field.name).offset, field.offset)
+          << name << "." << field.name;
+    }
+  }
+}
+
+TEST_F(clang_parser_btf, btf_resolve_typedefs)
+{
+  BPFtrace clang_bpftrace;
+  clang_bpftrace.parse_btf({});
+  parse("",
+        clang_bpftrace,
+        true,
+        "kprobe:sys_read { (struct FooTypedefs *)curtask }");
+
+  BPFtrace btf_bpftrace;
+  btf_bpftrace.parse_btf({});
+  btf_bpftrace.btf_->resolve_types({ "struct FooTypedefs" }, 1);
+
+  // Anonymous records are named by their typedef, named records by their tag
+  for (const auto &name : { "struct FooTypedefs", "atomic_t", "struct Foo1" }) {
+    ASSERT_TRUE(btf_bpftrace.structs.Has(name)) << name;
+    ASSERT_TRUE(clang_bpftrace.structs.Has(name)) << name;
+    auto btf_struct = btf_bpftrace.structs.Lookup(name).lock();
+    auto clang_struct = clang_bpftrace.structs.Lookup(name).lock();
+    EXPECT_EQ(btf_struct->size, clang_struct->size) << name;
+    ASSERT_EQ(btf_struct->fields.size(), clang_struct->fields.size()) << name;
+    for (const auto &field : clang_struct->fields) {
+      ASSERT_TRUE(btf_struct->HasField(field.name)) << name << "." << field.name;
+      EXPECT_EQ(btf_struct->GetField(field.name).type, field.type)
+          << name << "." << field.name;
+      EXPECT_EQ(btf_struct->GetField(field.name).offset, field.offset)
+          << name << "." << field.name;
+    }
+  }
+}
+
+TEST_F(clang_parser_btf, btf_resolve_typedef_arg)
+{
+  BPFtrace bpftrace;
+  bpftrace.parse_btf({});
+
+  // The type of the argument is a typedef of a record
+  std::string err;
+  auto args = bpftrace.btf_->resolve_args("func_typedefs", false, err);
+  ASSERT_TRUE(args.has_value()) << err;
+  auto foo1 = args->GetField("foo1").type;
+  ASSERT_TRUE(foo1.IsPtrTy());
+  EXPECT_EQ(foo1.GetPointeeTy()->GetName(), "struct Foo1");
+
+  // FieldAnalyser asks for typedef names of dereferenced fields
+  bpftrace.btf_->resolve_types({ "foo1_t" }, 0);
+  auto foo1_struct = bpftrace.structs.Lookup("struct Foo1").lock();
+  ASSERT_TRUE(foo1_struct);
+  EXPECT_TRUE(foo1_struct->HasField("a"));
+  EXPECT_TRUE(foo1_struct->HasField("b"));
+  EXPECT_TRUE(foo1_struct->HasField("c"));
+}
+
 TEST_F(clang_parser_btf, btf_arrays_multi_dim)
 {
   GTEST_SKIP() << "BTF flattens multi-dimensional arrays #3082";
@@ -0,0 +1,43 @@
+#include "common.h"
+
+namespace bpftrace {
+namespace test {
+namespace codegen {
+
+using ::testing::ContainsRegex;
+using ::testing::HasSubstr;
+using ::testing::Not;
+
+TEST(codegen, call_printf_var_length_args)
+{
+  auto ir = generate_ir(R"(kprobe:f { printf("%s %d\n", str(arg0), 1); })");
+
+  // Only the location of the string is kept in the fixed part of the event,
+  // its data follows at the end
+  EXPECT_THAT(ir, HasSubstr("%printf_t = type { i64, i32, i64 }"));
+  EXPECT_THAT(ir,
+              HasSubstr("%printf_buf_t = type { %printf_t, [1024 x i8] }"));
+  // The location is (length << 16) | offset
+  EXPECT_THAT(ir, ContainsRegex("shl i64 %[^,]+, 16"));
+  // The event is sent at its actual length
+  EXPECT_THAT(ir,
+              ContainsRegex("call i64 inttoptr \\(i64 130 to ptr\\)\\(ptr "
+                            "@ringbuf, ptr %[^,]+, i64 %"));
+}
+
+TEST(codegen, call_printf_short_args_inline)
+{
+  // Strings up to 64 bytes are not worth the indirection
+  auto bpftrace = get_mock_bpftrace();
+  auto configs = ConfigSetter(bpftrace->config_, ConfigSource::script);
+  configs.set(ConfigKeyInt::max_strlen, 64);
+  std::string ir;
+  generate_ir(*bpftrace, R"(kprobe:f { printf("%s\n", str(arg0)); })", ir);
+
+  EXPECT_THAT(ir, HasSubstr("%printf_t = type { i64, [64 x i8] }"));
+  EXPECT_THAT(ir, Not(HasSubstr("%printf_buf_t")));
+}
+
+} // namespace codegen
+} // namespace test
+} // namespace bpftrace
@@ -0,0 +1,30 @@
+#include "common.h"
+
+namespace bpftrace {
+namespace test {
+namespace codegen {
+
+using ::testing::ContainsRegex;
+using ::testing::HasSubstr;
+
+TEST(codegen, call_topk)
+{
+  auto ir = generate_ir("kprobe:f { @[comm] = topk(3); }");
+
+  // Every event is counted in the sketch and its total
+  EXPECT_THAT(ir, HasSubstr("[2049 x i64]"));
+  // Keys already in the map are updated in place
+  EXPECT_THAT(ir,
+              HasSubstr("%lookup_elem = call ptr inttoptr (i64 1 to ptr)(ptr "
+                        "@AT_, ptr"));
+  // New keys are only admitted if estimate * 2k >= total
+  EXPECT_THAT(ir, ContainsRegex("mul i64 %[^,]+, 6"));
+  EXPECT_THAT(ir, HasSubstr("topk_admit:"));
+  EXPECT_THAT(ir,
+              HasSubstr("%update_elem = call i64 inttoptr (i64 2 to ptr)(ptr "
+                        "@AT_, ptr"));
+}
+
+} // namespace codegen
+} // namespace test
+} // namespace bpftrace
@@ -41,14 +41,10 @@ static std::string get_expected(const std::string &name)
   throw std::runtime_error("Could not find codegen result for test: " + name);
 }
 
-// This is the lower level codegen test entrypoint.
-//
-// The contract is that the `bpftrace` must be completely initialized and ready
-// to go (eg. members replaced with mocks as necessary) before calling into
-// here.
-static void test(BPFtrace &bpftrace,
-                 const std::string &input,
-                 const std::string &name)
+// Generates the IR of `input` into `ir` and checks that it compiles.
+static void generate_ir(BPFtrace &bpftrace,
+                        const std::string &input,
+                        std::string &ir)
 {
   Driver driver(bpftrace);
   ASSERT_EQ(driver.parse_str(input), 0);
@@ -77,19 +73,36 @@ static void test(BPFtrace &bpftrace,
   codegen.optimize();
   codegen.emit(false);
 
+  ir = out.str();
+}
+
+// This is the lower level codegen test entrypoint.
+//
+// The contract is that the `bpftrace` must be completely initialized and ready
+// to go (eg. members replaced with mocks as necessary) before calling into
+// here.
+static void test(BPFtrace &bpftrace,
+                 const std::string &input,
+                 const std::string &name)
+{
+  std::string ir;
+  generate_ir(bpftrace, input, ir);
+  if (::testing::Test::HasFatalFailure())
+    return;
+
   uint64_t update_tests = 0;
   get_uint64_env_var("BPFTRACE_UPDATE_TESTS",
                      [&](uint64_t x) { update_tests = x; });
   if (update_tests >= 1) {
     std::cerr << "Running in update mode, test is skipped" << std::endl;
     std::ofstream file(TEST_CODEGEN_LOCATION + name + ".ll");
-    file << out.str();
+    file << ir;
     return;
   }
 
   std::string expected_output = get_expected(name);
 
-  EXPECT_EQ(expected_output, out.str())
+  EXPECT_EQ(expected_output, ir)
       << "the following program failed: '" << input << "'";
 }
 
@@ -106,6 +119,16 @@ static void test(const std::string &input,
   test(*bpftrace, input, name);
 }
 
+// Entrypoint for tests which pin down particular properties of the IR instead
+// of comparing all of it against a file in tests/codegen/llvm.
+static std::string generate_ir(const std::string &input)
+{
+  auto bpftrace = get_mock_bpftrace();
+  std::string ir;
+  generate_ir(*bpftrace, input, ir);
+  return ir;
+}
+
 } // namespace codegen
 } // namespace test
 } // namespace bpftrace
@@ -0,0 +1,42 @@
+#include "common.h"
+
+namespace bpftrace {
+namespace test {
+namespace codegen {
+
+static int count_occurrences(const std::string &ir, const std::string &needle)
+{
+  int count = 0;
+  for (size_t pos = ir.find(needle); pos != std::string::npos;
+       pos = ir.find(needle, pos + 1))
+    count++;
+  return count;
+}
+
+TEST(codegen, cse_builtin)
+{
+  auto ir = generate_ir("kprobe:f { @x[pid] = pid; @y = pid; }");
+
+  // bpf_get_current_pid_tgid is called once for the whole probe
+  EXPECT_EQ(count_occurrences(ir, "inttoptr (i64 14 to ptr)"), 1);
+}
+
+TEST(codegen, cse_map_read)
+{
+  auto ir = generate_ir("kprobe:f { @x = 1; } kprobe:g { @y = @x + @x; }");
+
+  EXPECT_EQ(count_occurrences(ir, "inttoptr (i64 1 to ptr)(ptr @AT_x"), 1);
+}
+
+TEST(codegen, cse_map_read_after_write)
+{
+  auto ir = generate_ir(
+      "kprobe:f { @x = 1; } kprobe:g { @y = @x; @x = 2; @z = @x; }");
+
+  // The write invalidates the cached read
+  EXPECT_EQ(count_occurrences(ir, "inttoptr (i64 1 to ptr)(ptr @AT_x"), 2);
+}
+
+} // namespace codegen
+} // namespace test
+} // namespace bpftrace
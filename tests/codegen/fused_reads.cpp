@@ -0,0 +1,63 @@
+#include "common.h"
+
+namespace bpftrace {
+namespace test {
+namespace codegen {
+
+using ::testing::HasSubstr;
+using ::testing::Not;
+
+static int count_probe_reads(const std::string &ir)
+{
+  int count = 0;
+  for (size_t pos = ir.find("inttoptr (i64 113 to ptr)");
+       pos != std::string::npos;
+       pos = ir.find("inttoptr (i64 113 to ptr)", pos + 1))
+    count++;
+  return count;
+}
+
+TEST(codegen, fused_reads)
+{
+  auto ir = generate_ir("struct Foo { int x; int y; }"
+                        "kprobe:f {"
+                        "  $foo = (struct Foo*)arg0;"
+                        "  @ = $foo->x + $foo->y;"
+                        "}");
+
+  // Both fields are read with a single helper call
+  EXPECT_THAT(ir, HasSubstr("%fused_read = alloca [8 x i8]"));
+  EXPECT_THAT(ir,
+              HasSubstr("call i64 inttoptr (i64 113 to ptr)(ptr %fused_read, "
+                        "i32 8, ptr"));
+  EXPECT_EQ(count_probe_reads(ir), 1);
+}
+
+TEST(codegen, fused_reads_separate_statements)
+{
+  auto ir = generate_ir("struct Foo { int x; int y; }"
+                        "kprobe:f {"
+                        "  $foo = (struct Foo*)arg0;"
+                        "  @x = $foo->x;"
+                        "  @y = $foo->y;"
+                        "}");
+
+  EXPECT_THAT(ir, Not(HasSubstr("%fused_read")));
+  EXPECT_EQ(count_probe_reads(ir), 2);
+}
+
+TEST(codegen, fused_reads_conditional)
+{
+  auto ir = generate_ir("struct Foo { int x; int y; }"
+                        "kprobe:f {"
+                        "  $foo = (struct Foo*)arg0;"
+                        "  @ = $foo->x > 0 ? $foo->y : 0;"
+                        "}");
+
+  EXPECT_THAT(ir, Not(HasSubstr("%fused_read")));
+  EXPECT_EQ(count_probe_reads(ir), 2);
+}
+
+} // namespace codegen
+} // namespace test
+} // namespace bpftrace
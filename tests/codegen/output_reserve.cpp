@@ -0,0 +1,65 @@
+#include "common.h"
+
+namespace bpftrace {
+namespace test {
+namespace codegen {
+
+using ::testing::HasSubstr;
+using ::testing::Not;
+
+TEST(codegen, output_reserve_printf)
+{
+  auto ir = generate_ir(R"(kprobe:f { printf("%d\n", pid); })");
+
+  // The event is built in place in the ring buffer and submitted
+  EXPECT_THAT(ir,
+              HasSubstr("%ringbuf_reserve = call ptr inttoptr (i64 131 to "
+                        "ptr)(ptr @ringbuf, i64 16, i64 0)"));
+  EXPECT_THAT(ir,
+              HasSubstr("br i1 %ringbuf_reserve_ok, label %ringbuf_reserved, "
+                        "label %event_loss_counter"));
+  EXPECT_THAT(ir,
+              HasSubstr("call void inttoptr (i64 132 to ptr)(ptr "
+                        "%ringbuf_reserve, i64 0)"));
+  // No copy through bpf_ringbuf_output
+  EXPECT_THAT(ir, Not(HasSubstr("inttoptr (i64 130 to ptr)")));
+}
+
+TEST(codegen, output_reserve_print_non_map)
+{
+  auto ir = generate_ir("kprobe:f { print(pid); }");
+
+  EXPECT_THAT(ir, HasSubstr("inttoptr (i64 131 to ptr)"));
+  EXPECT_THAT(ir, HasSubstr("inttoptr (i64 132 to ptr)"));
+  EXPECT_THAT(ir, Not(HasSubstr("inttoptr (i64 130 to ptr)")));
+}
+
+TEST(codegen, output_reserve_args_before_reserve)
+{
+  auto ir = generate_ir(
+      R"(kprobe:f { @x[1] = 1; printf("%d\n", @x[1]); })");
+
+  // Args which need helper calls are evaluated before the reservation, so
+  // that the reservation is held for as short as possible
+  auto lookup = ir.find("inttoptr (i64 1 to ptr)(ptr @AT_x");
+  auto reserve = ir.find("inttoptr (i64 131 to ptr)");
+  ASSERT_NE(lookup, std::string::npos);
+  ASSERT_NE(reserve, std::string::npos);
+  EXPECT_LT(lookup, reserve);
+}
+
+TEST(codegen, output_reserve_perf_event)
+{
+  // Without a ring buffer, events are output from the scratch buffer
+  auto bpftrace = get_mock_bpftrace();
+  bpftrace->feature_ = std::make_unique<MockBPFfeature>(false);
+  std::string ir;
+  generate_ir(*bpftrace, R"(kprobe:f { printf("%d\n", pid); })", ir);
+
+  EXPECT_THAT(ir, Not(HasSubstr("inttoptr (i64 131 to ptr)")));
+  EXPECT_THAT(ir, HasSubstr("%perf_event_output = call i64 inttoptr (i64 25"));
+}
+
+} // namespace codegen
+} // namespace test
+} // namespace bpftrace
@@ -0,0 +1,38 @@
+#include "common.h"
+
+namespace bpftrace {
+namespace test {
+namespace codegen {
+
+using ::testing::HasSubstr;
+using ::testing::Not;
+
+TEST(codegen, scalar_agg_buffer)
+{
+  auto ir = generate_ir("kprobe:f { @a = count(); @b = sum(arg0); }");
+
+  // Two slots, padded to a 64 byte row per CPU
+  EXPECT_THAT(ir,
+              HasSubstr("@scalar_agg_buf = dso_local externally_initialized "
+                        "global [1 x [4 x [2 x i64]]] zeroinitializer, "
+                        "section \".data.scalar_agg_buf\""));
+  EXPECT_THAT(ir,
+              HasSubstr("getelementptr [1 x [4 x [2 x i64]]], ptr "
+                        "@scalar_agg_buf, i64 0, i64 %cpu.id.bounded, i64 1, "
+                        "i64 0"));
+  // No map helpers for the aggregations
+  EXPECT_THAT(ir, Not(HasSubstr("inttoptr (i64 1 to ptr)(ptr @AT_a")));
+  EXPECT_THAT(ir, Not(HasSubstr("inttoptr (i64 2 to ptr)(ptr @AT_b")));
+}
+
+TEST(codegen, scalar_agg_buffer_read_in_probe)
+{
+  // Maps read by a probe stay in BPF maps
+  auto ir = generate_ir("kprobe:f { @a = count(); if (@a > 1) { exit(); } }");
+
+  EXPECT_THAT(ir, Not(HasSubstr("@scalar_agg_buf")));
+}
+
+} // namespace codegen
+} // namespace test
+} // namespace bpftrace
@@ -0,0 +1,38 @@
+#include "common.h"
+
+namespace bpftrace {
+namespace test {
+namespace codegen {
+
+using ::testing::HasSubstr;
+using ::testing::Not;
+
+TEST(codegen, stack_lookup_before_update)
+{
+  auto ir = generate_ir("kprobe:f { @x = kstack; }");
+
+  // The stack map is looked up first and only updated if the stack is
+  // missing or a different stack collided with it
+  EXPECT_THAT(ir,
+              HasSubstr("%stack_lookup = call ptr inttoptr (i64 1 to ptr)(ptr "
+                        "@stack_bpftrace_127, ptr %stack_key)"));
+  EXPECT_THAT(ir, HasSubstr("br i1 %stack_missing_cond, label %stack_missing, "
+                            "label %stack_found"));
+  EXPECT_THAT(ir,
+              HasSubstr("%stack_collision_cond = icmp ne i64 %stored_leaf, "
+                        "%leaf"));
+  EXPECT_THAT(ir,
+              HasSubstr("br i1 %stack_collision_cond, label %stack_missing, "
+                        "label %merge_block"));
+  EXPECT_THAT(ir,
+              HasSubstr("call i64 inttoptr (i64 2 to ptr)(ptr "
+                        "@stack_bpftrace_127, ptr %stack_key, ptr "
+                        "%lookup_stack_scratch_map, i64 0)"));
+  // The scratch buffer is not zeroed before bpf_get_stack()
+  EXPECT_THAT(ir, Not(HasSubstr("call void @llvm.memset.p0.i64(ptr align 1 "
+                                "%lookup_stack_scratch_map")));
+}
+
+} // namespace codegen
+} // namespace test
+} // namespace bpftrace
@@ -12,12 +12,18 @@ TEST(Config, get_and_set)
   auto config_setter = ConfigSetter(config, ConfigSource::env_var);
 
   // check all the keys
+  EXPECT_TRUE(config_setter.set(ConfigKeyBool::adaptive_sampling, true));
+  EXPECT_EQ(config.get(ConfigKeyBool::adaptive_sampling), true);
+
   EXPECT_TRUE(config_setter.set(ConfigKeyBool::cpp_demangle, true));
   EXPECT_EQ(config.get(ConfigKeyBool::cpp_demangle), true);
 
   EXPECT_TRUE(config_setter.set(ConfigKeyBool::lazy_symbolication, true));
   EXPECT_EQ(config.get(ConfigKeyBool::lazy_symbolication), true);
 
+  EXPECT_TRUE(config_setter.set(ConfigKeyInt::codegen_threads, 10));
+  EXPECT_EQ(config.get(ConfigKeyInt::codegen_threads), 10);
+
   EXPECT_TRUE(config_setter.set(ConfigKeyInt::log_size, 10));
   EXPECT_EQ(config.get(ConfigKeyInt::log_size), 10);
 
@@ -33,6 +39,9 @@ TEST(Config, get_and_set)
   EXPECT_TRUE(config_setter.set(ConfigKeyInt::max_bpf_progs, 10));
   EXPECT_EQ(config.get(ConfigKeyInt::max_bpf_progs), 10);
 
+  EXPECT_TRUE(config_setter.set(ConfigKeyInt::max_stack_ids, 10));
+  EXPECT_EQ(config.get(ConfigKeyInt::max_stack_ids), 10);
+
   EXPECT_TRUE(config_setter.set(ConfigKeyInt::max_strlen, 10));
   EXPECT_EQ(config.get(ConfigKeyInt::max_strlen), 10);
 
@@ -60,6 +69,10 @@ TEST(Config, get_and_set)
   EXPECT_TRUE(config_setter.set(ConfigMissingProbes::ignore));
   EXPECT_EQ(config.get(ConfigKeyMissingProbes::default_),
             ConfigMissingProbes::ignore);
+
+  EXPECT_TRUE(config_setter.set(ConfigStackMapType::hash));
+  EXPECT_EQ(config.get(ConfigKeyStackMapType::default_),
+            ConfigStackMapType::hash);
 }
 
 TEST(Config, get_config_key)
@@ -114,6 +127,19 @@ TEST(ConfigSetter, set_missing_probes)
             ConfigMissingProbes::error);
 }
 
+TEST(ConfigSetter, set_stack_map_type)
+{
+  auto config = Config();
+  auto config_setter = ConfigSetter(config, ConfigSource::script);
+
+  EXPECT_EQ(config.get(ConfigKeyStackMapType::default_),
+            ConfigStackMapType::lru_hash);
+  EXPECT_FALSE(config_setter.set_stack_map_type_config("percpu_hash"));
+  EXPECT_TRUE(config_setter.set_stack_map_type_config("hash"));
+  EXPECT_EQ(config.get(ConfigKeyStackMapType::default_),
+            ConfigStackMapType::hash);
+}
+
 TEST(ConfigSetter, source_precedence)
 {
   auto config = Config();
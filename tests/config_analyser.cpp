@@ -126,6 +126,15 @@ TEST(config_analyser, config_setting)
             UserSymbolCacheType::per_program);
   EXPECT_EQ(bpftrace->config_.get(ConfigKeyInt::log_size), 150);
 
+  EXPECT_EQ(bpftrace->config_.get(ConfigKeyStackMapType::default_),
+            ConfigStackMapType::lru_hash);
+  test(*bpftrace,
+       "config = { stack_map_type = \"hash\"; max_stack_ids = 1024 } "
+       "BEGIN { }");
+  EXPECT_EQ(bpftrace->config_.get(ConfigKeyStackMapType::default_),
+            ConfigStackMapType::hash);
+  EXPECT_EQ(bpftrace->config_.get(ConfigKeyInt::max_stack_ids), 1024);
+
   // When liblldb is present, the default config for symbol_source is "dwarf",
   // otherwise the default is "symbol_table".
 #ifdef HAVE_LIBLLDB
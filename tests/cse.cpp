@@ -0,0 +1,95 @@
+#include <algorithm>
+
+#include "ast/passes/cse.h"
+#include "driver.h"
+#include "mocks.h"
+#include "gtest/gtest.h"
+
+namespace bpftrace::test::cse {
+
+using ast::CSEInfo;
+
+CSEInfo test(Driver &driver, const std::string &input)
+{
+  EXPECT_EQ(driver.parse_str(input), 0);
+  ast::CSEAnalyser cse(driver.ctx);
+  return cse.analyse();
+}
+
+std::vector<std::string> idents(const std::vector<ast::Builtin *> &builtins)
+{
+  std::vector<std::string> result;
+  for (auto *builtin : builtins)
+    result.push_back(builtin->ident);
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+TEST(cse, builtins)
+{
+  auto bpftrace = get_mock_bpftrace();
+  Driver driver(*bpftrace);
+  auto info = test(driver, R"(kprobe:f /pid > 1 && comm != "x"/ {
+      @[pid, tid] = count(); @t[tid] = sum(cpu); $c = comm; @n = nsecs;
+      @n2 = nsecs; })");
+
+  auto *probe = driver.ctx.root->probes.at(0);
+  auto &cse = info.builtins.at(probe);
+  EXPECT_EQ(idents(cse.before_pred),
+            std::vector<std::string>({ "comm", "pid" }));
+  EXPECT_EQ(idents(cse.before_body), std::vector<std::string>({ "tid" }));
+}
+
+TEST(cse, builtins_in_loop_body)
+{
+  auto bpftrace = get_mock_bpftrace();
+  Driver driver(*bpftrace);
+  auto info = test(driver, R"(kprobe:f { @m[1] = 1;
+      for ($kv : @m) { @x[pid] = 1; @y[pid] = 1; } })");
+
+  auto *probe = driver.ctx.root->probes.at(0);
+  EXPECT_TRUE(info.builtins.at(probe).before_body.empty());
+}
+
+TEST(cse, statement_effects)
+{
+  auto bpftrace = get_mock_bpftrace();
+  Driver driver(*bpftrace);
+  auto info = test(driver, R"(fn f(): void { }
+      kprobe:f { $x = @a; if ($x) { @b = count(); delete(@c, 1); }
+      @d++; f(); print(@a); })");
+
+  auto &stmts = driver.ctx.root->probes.at(0)->block->stmts;
+  const auto &assign = info.effects.at(stmts.at(0));
+  EXPECT_TRUE(assign.assigns_vars);
+  EXPECT_TRUE(assign.maps_written.empty());
+
+  const auto &if_stmt = info.effects.at(stmts.at(1));
+  EXPECT_FALSE(if_stmt.assigns_vars);
+  EXPECT_TRUE(if_stmt.writes_map("@b"));
+  EXPECT_TRUE(if_stmt.writes_map("@c"));
+  EXPECT_FALSE(if_stmt.writes_map("@a"));
+
+  EXPECT_TRUE(info.effects.at(stmts.at(2)).writes_map("@d"));
+  EXPECT_TRUE(info.effects.at(stmts.at(3)).writes_any_map);
+  EXPECT_FALSE(info.effects.at(stmts.at(4)).writes_map("@a"));
+}
+
+TEST(cse, map_key_str)
+{
+  auto bpftrace = get_mock_bpftrace();
+  Driver driver(*bpftrace);
+  test(driver, R"(kprobe:f { @[1, "a", pid, $x] = 1; @[nsecs] = 1; })");
+
+  auto &stmts = driver.ctx.root->probes.at(0)->block->stmts;
+  auto *first = static_cast<ast::AssignMapStatement *>(stmts.at(0));
+  auto *second = static_cast<ast::AssignMapStatement *>(stmts.at(1));
+
+  bool uses_vars = false;
+  EXPECT_EQ(ast::map_key_cse_str(first->map->key_expr, uses_vars),
+            R"((1,"a",pid,$x,))");
+  EXPECT_TRUE(uses_vars);
+  EXPECT_FALSE(ast::map_key_cse_str(second->map->key_expr, uses_vars));
+}
+
+} // namespace bpftrace::test::cse
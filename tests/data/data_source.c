@@ -40,6 +40,22 @@ struct Foo3 *__attribute__((noinline)) func_3(int a, int *b, struct Foo1 *foo1)
   return 0;
 }
 
+typedef struct {
+  int counter;
+} atomic_t;
+
+typedef struct Foo1 foo1_t;
+
+struct FooTypedefs {
+  atomic_t refs;
+  foo1_t *foo1;
+};
+
+struct Foo3 *func_typedefs(foo1_t *foo1, struct FooTypedefs *foo)
+{
+  return 0;
+}
+
 struct FirstFieldsAreAnonUnion {
   union {
     int a;
@@ -0,0 +1,82 @@
+#include "ast/passes/fused_reads.h"
+#include "ast/passes/field_analyser.h"
+#include "ast/passes/semantic_analyser.h"
+#include "clang_parser.h"
+#include "driver.h"
+#include "mocks.h"
+#include "gtest/gtest.h"
+
+namespace bpftrace::test::fused_reads {
+
+ast::FusedReads test(const std::string &input)
+{
+  auto bpftrace = get_mock_bpftrace();
+  Driver driver(*bpftrace);
+  std::stringstream out;
+
+  EXPECT_EQ(driver.parse_str(input), 0);
+
+  ast::FieldAnalyser fields(driver.ctx, *bpftrace, out);
+  EXPECT_EQ(fields.analyse(), 0) << out.str();
+
+  ClangParser clang;
+  EXPECT_TRUE(clang.parse(driver.ctx.root, *bpftrace));
+
+  EXPECT_EQ(driver.parse_str(input), 0);
+  ast::SemanticAnalyser semantics(driver.ctx, *bpftrace, out, false);
+  EXPECT_EQ(semantics.analyse(), 0) << out.str();
+
+  ast::FusedReadAnalyser fused(driver.ctx, *bpftrace);
+  return fused.analyse();
+}
+
+const std::string FOO = "struct Foo { int a; int b; char c[100]; long d; "
+                        "long e; } ";
+
+TEST(fused_reads, nearby_fields)
+{
+  auto fused = test(FOO + R"(kprobe:f { $f = (struct Foo *)arg0;
+      printf("%d %d %d %d\n", $f->a, $f->b, $f->d, $f->e); })");
+
+  ASSERT_EQ(fused.reads.size(), 2);
+  EXPECT_EQ(fused.reads[0].offset, 0);
+  EXPECT_EQ(fused.reads[0].size, 8);
+  EXPECT_EQ(fused.reads[1].offset, 112);
+  EXPECT_EQ(fused.reads[1].size, 16);
+  EXPECT_EQ(fused.read_idx.size(), 4);
+}
+
+TEST(fused_reads, cast_builtin)
+{
+  auto fused = test(FOO + R"(kprobe:f {
+      @[((struct Foo *)arg0)->a] = sum(((struct Foo *)arg0)->b); })");
+
+  ASSERT_EQ(fused.reads.size(), 1);
+  EXPECT_EQ(fused.reads[0].offset, 0);
+  EXPECT_EQ(fused.reads[0].size, 8);
+}
+
+TEST(fused_reads, not_fused)
+{
+  // Different statements
+  auto fused = test(FOO + R"(kprobe:f { $f = (struct Foo *)arg0;
+      @a = $f->a; @b = $f->b; })");
+  EXPECT_TRUE(fused.reads.empty());
+
+  // Different pointers
+  fused = test(FOO + R"(kprobe:f { $f = (struct Foo *)arg0;
+      $g = (struct Foo *)arg1; @ = $f->a + $g->b; })");
+  EXPECT_TRUE(fused.reads.empty());
+
+  // Conditionally evaluated
+  fused = test(FOO + R"(kprobe:f { $f = (struct Foo *)arg0;
+      @ = $f->a > 0 ? $f->b : 0; @b = $f->a && $f->b; })");
+  EXPECT_TRUE(fused.reads.empty());
+
+  // Too far apart
+  fused = test(FOO + R"(kprobe:f { $f = (struct Foo *)arg0;
+      @ = $f->a + $f->d; })");
+  EXPECT_TRUE(fused.reads.empty());
+}
+
+} // namespace bpftrace::test::fused_reads
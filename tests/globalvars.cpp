@@ -0,0 +1,71 @@
+#include "globalvars.h"
+#include "gtest/gtest.h"
+
+#include <cstring>
+
+namespace bpftrace::test::globalvars {
+
+using namespace bpftrace::globalvars;
+
+static void write_slot(std::vector<uint8_t> &buffer,
+                       size_t offset,
+                       uint64_t value,
+                       uint64_t is_set)
+{
+  std::memcpy(buffer.data() + offset, &value, sizeof(value));
+  std::memcpy(buffer.data() + offset + sizeof(value), &is_set, sizeof(is_set));
+}
+
+TEST(globalvars, scalar_agg_row_slots)
+{
+  EXPECT_EQ(scalar_agg_row_slots(1), 4U);
+  EXPECT_EQ(scalar_agg_row_slots(4), 4U);
+  EXPECT_EQ(scalar_agg_row_slots(5), 8U);
+  EXPECT_EQ(scalar_agg_row_slots(5) * SCALAR_AGG_SLOT_SIZE %
+                SCALAR_AGG_ROW_ALIGN,
+            0U);
+}
+
+TEST(globalvars, scalar_agg_read_and_reset)
+{
+  // 5 slots, padded to a row of 128 bytes per CPU
+  const size_t num_slots = 5;
+  const size_t row_size = 128;
+  std::vector<uint8_t> buffer(2 * row_size, 0);
+  write_slot(buffer, 4 * SCALAR_AGG_SLOT_SIZE, 3, 1);
+  write_slot(buffer, row_size + 4 * SCALAR_AGG_SLOT_SIZE, 5, 1);
+  // Neighbouring slots are left alone
+  write_slot(buffer, 3 * SCALAR_AGG_SLOT_SIZE, 7, 1);
+
+  auto value = read_scalar_agg(buffer, num_slots, 4, 8, { 0, 1 });
+  ASSERT_TRUE(value.has_value());
+  ASSERT_EQ(value->size(), 16U);
+  uint64_t cpu0, cpu1;
+  std::memcpy(&cpu0, value->data(), sizeof(cpu0));
+  std::memcpy(&cpu1, value->data() + 8, sizeof(cpu1));
+  EXPECT_EQ(cpu0, 3U);
+  EXPECT_EQ(cpu1, 5U);
+
+  // Zeroing the value keeps the slot set
+  reset_scalar_agg(buffer, num_slots, 4, true);
+  value = read_scalar_agg(buffer, num_slots, 4, 8, { 0, 1 });
+  ASSERT_TRUE(value.has_value());
+  EXPECT_EQ(*value, std::vector<uint8_t>(16, 0));
+
+  reset_scalar_agg(buffer, num_slots, 4, false);
+  EXPECT_FALSE(read_scalar_agg(buffer, num_slots, 4, 8, { 0, 1 }).has_value());
+
+  value = read_scalar_agg(buffer, num_slots, 3, 8, { 0 });
+  ASSERT_TRUE(value.has_value());
+  std::memcpy(&cpu0, value->data(), sizeof(cpu0));
+  EXPECT_EQ(cpu0, 7U);
+}
+
+TEST(globalvars, scalar_agg_read_short_buffer)
+{
+  std::vector<uint8_t> buffer(64, 0);
+  write_slot(buffer, 0, 1, 1);
+  EXPECT_FALSE(read_scalar_agg(buffer, 1, 0, 8, { 0, 1 }).has_value());
+}
+
+} // namespace bpftrace::test::globalvars
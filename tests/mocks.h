@@ -128,8 +128,18 @@ public:
     has_for_each_map_elem_ = std::make_optional<bool>(has_features);
     has_get_ns_current_pid_tgid_ = std::make_optional<bool>(has_features);
     has_map_lookup_percpu_elem_ = std::make_optional<bool>(has_features);
+    // Timers change the code of every interval and profile probe, tests opt
+    // in with mock_timer_support()
+    has_timer_start_ = std::make_optional<bool>(false);
+    has_timer_cpu_pin_ = std::make_optional<bool>(false);
   };
 
+  void mock_timer_support()
+  {
+    has_timer_start_ = std::make_optional<bool>(true);
+    has_timer_cpu_pin_ = std::make_optional<bool>(true);
+  }
+
   void mock_missing_kernel_func(Kfunc kfunc)
   {
     available_kernel_funcs_.emplace(kfunc, false);
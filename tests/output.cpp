@@ -1,5 +1,6 @@
 #include "output.h"
 
+#include <cstring>
 #include <gtest/gtest.h>
 #include <sstream>
 
@@ -96,4 +97,174 @@ TEST(TextOutput, lhist_suffix)
   EXPECT_TRUE(err.str().empty());
 }
 
+TEST(TextOutput, quantiles)
+{
+  std::stringstream out;
+  std::stringstream err;
+  TextOutput output{ out, err };
+
+  MockBPFtrace bpftrace;
+  bpftrace.resources.maps_info["@mymap"] = MapInfo{
+    CreateNone(), CreateQuantiles(), {}, 5, {}
+  };
+  BpfMap map{ libbpf::BPF_MAP_TYPE_HASH, "@mymap", 8, 8, 1000 };
+
+  // 50 x 10, 49 x 20 and 1 x 1000, which lands in the [992, 1008) bucket
+  std::vector<uint64_t> buckets(65 * 32);
+  buckets[11] = 50;
+  buckets[21] = 49;
+  buckets[191] = 1;
+  std::map<std::vector<uint8_t>, std::vector<uint64_t>> values_by_key = {
+    { { 0 }, buckets },
+  };
+
+  std::vector<std::pair<std::vector<uint8_t>, uint64_t>> total_counts_by_key = {
+    { { 0 }, 100 }
+  };
+
+  output.map_hist(bpftrace, map, 0, 0, values_by_key, total_counts_by_key);
+
+  EXPECT_EQ("@mymap: count 100, p50 10, p90 20, p99 20, p99.9 1000\n\n",
+            out.str());
+  EXPECT_TRUE(err.str().empty());
+}
+
+TEST(TextOutput, topk)
+{
+  std::stringstream out;
+  std::stringstream err;
+  TextOutput output{ out, err };
+
+  MockBPFtrace bpftrace;
+  bpftrace.resources.maps_info["@mymap"] = MapInfo{
+    CreateUInt64(), CreateTopk(), {}, {}, TopkArgs{ 2, 0 }
+  };
+  BpfMap map{ libbpf::BPF_MAP_TYPE_LRU_PERCPU_HASH, "@mymap", 8, 8, 4 };
+
+  auto entry = [](uint64_t key, uint64_t count, uint64_t error) {
+    std::vector<uint8_t> key_data(8);
+    std::vector<uint8_t> value(16);
+    std::memcpy(key_data.data(), &key, 8);
+    std::memcpy(value.data(), &count, 8);
+    std::memcpy(value.data() + 8, &error, 8);
+    return std::make_pair(key_data, value);
+  };
+  std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>>
+      values_by_key = { entry(1, 1, 3), entry(2, 10, 3), entry(3, 20, 3) };
+
+  output.map_stats(bpftrace, map, 2, 1, values_by_key);
+
+  EXPECT_EQ(R"(@mymap[2]: count 10, error 3
+@mymap[3]: count 20, error 3
+
+)",
+            out.str());
+  EXPECT_TRUE(err.str().empty());
+}
+
+TEST(JsonOutput, lost_events)
+{
+  std::stringstream out;
+  std::stringstream err;
+  JsonOutput output{ out, err };
+
+  output.lost_events(3, {});
+  output.lost_events(5, { { "kprobe:f", 4 }, { "kprobe:\"g\"", 1 } });
+
+  EXPECT_EQ(R"({"type": "lost_events", "data": {"events": 3}}
+{"type": "lost_events", "data": {"events": 5, "probes": {"kprobe:\"g\"": 1, "kprobe:f": 4}}}
+)",
+            out.str());
+  EXPECT_TRUE(err.str().empty());
+}
+
+TEST(JsonOutput, sample_rate)
+{
+  std::stringstream out;
+  std::stringstream err;
+  JsonOutput output{ out, err };
+
+  output.sample_rate(2, 4);
+
+  EXPECT_EQ(R"({"type": "sample_rate", "data": {"cpu": 2, "rate": 4}}
+)",
+            out.str());
+  EXPECT_TRUE(err.str().empty());
+}
+
+TEST(TextOutput, probe_stats)
+{
+  std::stringstream out;
+  std::stringstream err;
+  TextOutput output{ out, err };
+
+  output.probe_stats({
+      ProbeStats{ .probe = "BEGIN",
+                  .attach_points = { "BEGIN" },
+                  .run_cnt = 1,
+                  .run_time_ns = 100,
+                  .insns = 8,
+                  .verified_insns = 10 },
+      ProbeStats{ .probe = "kprobe:f*",
+                  .attach_points = { "kprobe:f1" },
+                  .run_cnt = 4,
+                  .run_time_ns = 200,
+                  .insns = 16,
+                  .verified_insns = 20 },
+      ProbeStats{ .probe = "kprobe:f*",
+                  .attach_points = { "kprobe:f2", "kprobe:f3" },
+                  .run_cnt = 0,
+                  .run_time_ns = 0,
+                  .insns = 16,
+                  .verified_insns = 20 },
+      ProbeStats{ .probe = "interval:s:1",
+                  .attach_points = { "interval:s:1" },
+                  .insns = 4,
+                  .verified_insns = 4,
+                  .has_run_stats = false },
+  });
+
+  EXPECT_EQ(R"(Probe statistics:
+  BEGIN: 1 runs, 100 ns (100 ns/run), 8 insns (10 verified)
+  kprobe:f* (kprobe:f1): 4 runs, 200 ns (50 ns/run), 16 insns (20 verified)
+  kprobe:f* (kprobe:f2, kprobe:f3): 0 runs, 0 ns, 16 insns (20 verified)
+  interval:s:1: runs not counted (BPF timer), 4 insns (4 verified)
+)",
+            out.str());
+  EXPECT_TRUE(err.str().empty());
+}
+
+TEST(JsonOutput, probe_stats)
+{
+  std::stringstream out;
+  std::stringstream err;
+  JsonOutput output{ out, err };
+
+  output.probe_stats({
+      ProbeStats{ .probe = "BEGIN",
+                  .attach_points = { "BEGIN" },
+                  .run_cnt = 1,
+                  .run_time_ns = 100,
+                  .insns = 8,
+                  .verified_insns = 10 },
+      ProbeStats{ .probe = "kprobe:f*",
+                  .attach_points = { "kprobe:f1", "kprobe:f2" },
+                  .run_cnt = 4,
+                  .run_time_ns = 200,
+                  .insns = 16,
+                  .verified_insns = 20 },
+      ProbeStats{ .probe = "interval:s:1",
+                  .attach_points = { "interval:s:1" },
+                  .insns = 4,
+                  .verified_insns = 4,
+                  .has_run_stats = false },
+  });
+
+  EXPECT_EQ(
+      R"({"type": "probe_stats", "data": [{"probe": "BEGIN", "attach_points": ["BEGIN"], "run_cnt": 1, "run_time_ns": 100, "insns": 8, "verified_insns": 10}, {"probe": "kprobe:f*", "attach_points": ["kprobe:f1", "kprobe:f2"], "run_cnt": 4, "run_time_ns": 200, "insns": 16, "verified_insns": 20}, {"probe": "interval:s:1", "attach_points": ["interval:s:1"], "run_cnt": null, "run_time_ns": null, "insns": 4, "verified_insns": 4}]}
+)",
+      out.str());
+  EXPECT_TRUE(err.str().empty());
+}
+
 } // namespace bpftrace::test::output
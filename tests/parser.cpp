@@ -2594,6 +2594,32 @@ Program
 )");
 }
 
+TEST(Parser, map_decl)
+{
+  test("let @x = lru_hash(1024); BEGIN { @x[1] = 1; }", R"(
+Program
+ map decl: @x = lru_hash(1024)
+ BEGIN
+  =
+   map: @x
+    int: 1
+   int: 1
+)");
+
+  test("config = { blah = 5 } let @x = hash(10, no_prealloc); let @y = "
+       "percpu_array(8); BEGIN {}",
+       R"(
+Program
+ config
+  =
+   config var: blah
+   int: 5
+ map decl: @x = hash(10, no_prealloc)
+ map decl: @y = percpu_array(8)
+ BEGIN
+)");
+}
+
 TEST(Parser, config_error)
 {
   test_parse_failure("i:s:1 { exit(); } config = { BPFTRACE_STACK_MODE=perf }",
@@ -7,15 +7,19 @@
 #include "clang_parser.h"
 #include "driver.h"
 #include "mocks.h"
+#include "utils.h"
 
 namespace bpftrace::test::resource_analyser {
 
 using ::testing::_;
+using ::testing::HasSubstr;
+using ::testing::Not;
 
 void test(BPFtrace &bpftrace,
           const std::string &input,
           bool expected_result = true,
-          RequiredResources *out_p = nullptr)
+          RequiredResources *out_p = nullptr,
+          std::string *output = nullptr)
 {
   Driver driver(bpftrace);
   std::stringstream out;
@@ -42,6 +46,8 @@ void test(BPFtrace &bpftrace,
 
   if (out_p && resources_optional)
     *out_p = *resources_optional;
+  if (output)
+    *output = out.str();
 }
 
 void test(const std::string &input,
@@ -106,6 +112,32 @@ TEST(resource_analyser, fmt_string_args_size_strings)
   EXPECT_EQ(resources.max_fmtstring_args_size, 72);
 }
 
+TEST(resource_analyser, fmt_string_args_variable_length_strings)
+{
+  auto bpftrace = get_mock_bpftrace();
+  auto configs = ConfigSetter(bpftrace->config_, ConfigSource::script);
+  configs.set(ConfigKeyInt::on_stack_limit, 0);
+  configs.set(ConfigKeyInt::max_strlen, 1024);
+
+  RequiredResources resources;
+  test(*bpftrace,
+       R"(kprobe:f { printf("%d %s %s\n", 1, str(arg0), str(arg1)) })",
+       true,
+       &resources);
+  // id + int + two 32 bit data_locs, followed by the string data
+  EXPECT_EQ(resources.max_fmtstring_args_size, 24 + 2 * 1024);
+
+  ASSERT_EQ(resources.printf_args.size(), 1U);
+  auto &args = std::get<1>(resources.printf_args[0]);
+  ASSERT_EQ(args.size(), 3U);
+  EXPECT_FALSE(args[0].is_data_loc);
+  EXPECT_TRUE(args[1].is_data_loc);
+  EXPECT_TRUE(args[1].type.IsStringTy());
+  EXPECT_EQ(args[1].offset, 16);
+  EXPECT_TRUE(args[2].is_data_loc);
+  EXPECT_EQ(args[2].offset, 20);
+}
+
 TEST(resource_analyser, fmt_string_args_non_map_print_int)
 {
   RequiredResources resources;
@@ -123,4 +155,87 @@ TEST(resource_analyser, fmt_string_args_non_map_print_arr)
   EXPECT_EQ(resources.max_fmtstring_args_size, 40);
 }
 
+TEST(resource_analyser, scalar_agg_slots)
+{
+  RequiredResources resources;
+  test(R"(BEGIN { @a = count(); @b = max(5); @c[1] = sum(3); @d = sum(2);
+              @e = min(1); print(@a); clear(@b); zero(@e);
+              if (@d > 1) { exit() } })",
+       true,
+       &resources);
+  EXPECT_EQ(resources.scalar_agg_slots, 3);
+  EXPECT_EQ(resources.maps_info.at("@a").scalar_agg_slot, 0);
+  EXPECT_EQ(resources.maps_info.at("@b").scalar_agg_slot, 1);
+  EXPECT_EQ(resources.maps_info.at("@e").scalar_agg_slot, 2);
+  // Keyed and read in BPF
+  EXPECT_FALSE(resources.maps_info.at("@c").scalar_agg_slot.has_value());
+  EXPECT_FALSE(resources.maps_info.at("@d").scalar_agg_slot.has_value());
+  EXPECT_TRUE(resources.needed_global_vars.contains(
+      bpftrace::globalvars::GlobalVar::SCALAR_AGG_BUFFER));
+}
+
+TEST(resource_analyser, timer_slots)
+{
+  auto bpftrace = get_mock_bpftrace();
+  RequiredResources resources;
+  test(*bpftrace, "interval:s:1 { @ = count(); }", true, &resources);
+  EXPECT_EQ(resources.timer_slots, 0);
+
+  static_cast<MockBPFfeature &>(*bpftrace->feature_).mock_timer_support();
+  resources = RequiredResources{};
+  test(*bpftrace,
+       R"(interval:s:1 { @a = count(); }
+          interval:ms:10 { @b = count(); }
+          interval:us:100 { @c[kstack] = count(); }
+          interval:hz:1 { @d[pid] = count(); })",
+       true,
+       &resources);
+  // Probes which need the probe context stay on perf events
+  EXPECT_EQ(resources.timer_slots, 2);
+
+  // A subprogram needing the probe context only matters to the probes
+  // calling it
+  resources = RequiredResources{};
+  test(*bpftrace,
+       R"(fn get_pid(): uint64 { return pid; }
+          interval:s:1 { @a = count(); })",
+       true,
+       &resources);
+  EXPECT_EQ(resources.timer_slots, 1);
+
+  resources = RequiredResources{};
+  test(*bpftrace, "profile:hz:99 { @ = count(); }", true, &resources);
+  EXPECT_EQ(resources.timer_slots,
+            static_cast<uint32_t>(get_max_cpu_id() + 1));
+}
+
+TEST(resource_analyser, quantiles_map_size)
+{
+  auto bpftrace = get_mock_bpftrace();
+  std::string output;
+
+  // 65 << 5 = 2080 buckets fit in the default 4096 entries
+  test(*bpftrace, "k:f { @ = quantiles(1); }", true, nullptr, &output);
+  EXPECT_THAT(output, Not(HasSubstr("quantiles() map")));
+
+  test(*bpftrace, "k:f { @ = quantiles(1, 2); }", true, nullptr, &output);
+  EXPECT_THAT(output, Not(HasSubstr("quantiles() map")));
+
+  ConfigSetter(bpftrace->config_, ConfigSource::script)
+      .set(ConfigKeyInt::max_map_keys, 1024);
+  test(*bpftrace, "k:f { @ = quantiles(1); }", true, nullptr, &output);
+  EXPECT_THAT(output, HasSubstr("quantiles() map @ can hold 1024 entries"));
+  EXPECT_THAT(output, HasSubstr("max_map_keys"));
+
+  test(*bpftrace, "k:f { @ = quantiles(1, 2); }", true, nullptr, &output);
+  EXPECT_THAT(output, Not(HasSubstr("quantiles() map")));
+
+  test(*bpftrace,
+       "let @a = percpu_hash(100); k:f { @a[pid] = quantiles(1); }",
+       true,
+       nullptr,
+       &output);
+  EXPECT_THAT(output, HasSubstr("the declared map size"));
+}
+
 } // namespace bpftrace::test::resource_analyser
@@ -769,6 +769,99 @@ kprobe:f { hist() ? 0 : 1; }
 )");
 }
 
+TEST(semantic_analyser, call_quantiles)
+{
+  test("kprobe:f { @x = quantiles(1); }");
+  test("kprobe:f { @x = quantiles(arg0, 3); }");
+  test("kprobe:f { @x[comm] = quantiles(nsecs); }");
+  test_error("kprobe:f { @x = quantiles(1, 6); }", R"(
+stdin:1:17-32: ERROR: quantiles: bits 6 must be 0..5
+kprobe:f { @x = quantiles(1, 6); }
+                ~~~~~~~~~~~~~~~
+)");
+  test_error("kprobe:f { quantiles(1); }", R"(
+stdin:1:12-24: ERROR: quantiles() should be directly assigned to a map
+kprobe:f { quantiles(1); }
+           ~~~~~~~~~~~~
+)");
+}
+
+TEST(semantic_analyser, call_count_distinct)
+{
+  test("kprobe:f { @x = count_distinct(pid); }");
+  test("kprobe:f { @x = count_distinct(comm, 14); }");
+  test("kprobe:f { @x[cpu] = count_distinct((pid, arg0)); }");
+  test_error("kprobe:f { @x = count_distinct(1, 3); }", R"(
+stdin:1:17-37: ERROR: count_distinct: precision 3 must be 4..14
+kprobe:f { @x = count_distinct(1, 3); }
+                ~~~~~~~~~~~~~~~~~~~~
+)");
+  test_error("kprobe:f { count_distinct(1); }", R"(
+stdin:1:12-29: ERROR: count_distinct() should be directly assigned to a map
+kprobe:f { count_distinct(1); }
+           ~~~~~~~~~~~~~~~~~
+)");
+}
+
+TEST(semantic_analyser, call_topk)
+{
+  test("kprobe:f { @x[comm] = topk(10); }");
+  test("kprobe:f { @x[kstack, comm] = topk(1000); }");
+  test_error("kprobe:f { @x[comm] = topk(0); }", R"(
+stdin:1:23-30: ERROR: topk: k 0 must be 1..65536
+kprobe:f { @x[comm] = topk(0); }
+                      ~~~~~~~
+)");
+  test_error("kprobe:f { @x = topk(10); }", R"(
+stdin:1:17-25: ERROR: topk() must be assigned to a map with a key, e.g. `@x[comm] = topk(10);`
+kprobe:f { @x = topk(10); }
+                ~~~~~~~~
+)");
+
+  auto bpftrace = get_mock_bpftrace();
+  ConfigSetter configs{ bpftrace->config_, ConfigSource::script };
+  configs.set(ConfigKeyInt::max_strlen, 2048);
+  test(*bpftrace, "kprobe:f { @x[str(arg0)] = topk(10); }", 1);
+}
+
+TEST(semantic_analyser, map_decl)
+{
+  test("let @x = lru_hash(1024); kprobe:f { @x[pid] = 1; }");
+  test("let @x = lru_percpu_hash(1024); kprobe:f { @x[pid] = count(); }");
+  test("let @x = hash(1024, no_prealloc); kprobe:f { @x[comm] = 1; }");
+  test("let @x = array(16); kprobe:f { @x[cpu] = 1; }");
+  test("let @x = percpu_array(16); kprobe:f { @x[cpu] = sum(arg0); }");
+  test_for_warning("let @x = hash(10); BEGIN { @y = 1; }",
+                   "Map @x is declared but never used");
+
+  test_error("let @x = foo(10); kprobe:f { @x[1] = 1; }", R"(
+stdin:1:1-17: ERROR: Invalid map type: foo
+let @x = foo(10); kprobe:f { @x[1] = 1; }
+~~~~~~~~~~~~~~~~
+HINT: Valid map types: hash, percpu_hash, lru_hash, lru_percpu_hash, array, percpu_array
+)");
+  test_error("let @x = hash(0); kprobe:f { @x[1] = 1; }", R"(
+stdin:1:1-17: ERROR: Invalid size for @x: 0. Map size must be between 1 and 4294967295
+let @x = hash(0); kprobe:f { @x[1] = 1; }
+~~~~~~~~~~~~~~~~
+)");
+  test_error("let @x = lru_hash(10, no_prealloc); kprobe:f { @x[1] = 1; }", R"(
+stdin:1:1-35: ERROR: no_prealloc is only supported by the hash and percpu_hash map types
+let @x = lru_hash(10, no_prealloc); kprobe:f { @x[1] = 1; }
+~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+)");
+  test_error("let @x = hash(10); kprobe:f { @x[1] = count(); }", R"(
+stdin:1:1-18: ERROR: Map @x holds 'count_t' values which need a per-CPU map type (percpu_hash, lru_percpu_hash or percpu_array)
+let @x = hash(10); kprobe:f { @x[1] = count(); }
+~~~~~~~~~~~~~~~~~
+)");
+  test_error("let @x = array(10); kprobe:f { @x[comm] = 1; }", R"(
+stdin:1:35-39: ERROR: @x is declared as array and can only be indexed by integers, not string[16]
+let @x = array(10); kprobe:f { @x[comm] = 1; }
+                                  ~~~~
+)");
+}
+
 TEST(semantic_analyser, call_lhist)
 {
   test("kprobe:f { @ = lhist(5, 0, 10, 1); }");
@@ -1710,6 +1803,23 @@ TEST(semantic_analyser, map_use_before_assign)
   test("kprobe:f { @x = @y; @y = 2; }");
 }
 
+TEST(semantic_analyser, map_use_before_assign_across_probes)
+{
+  // Each probe can only be resolved after the one following it
+  BPFtrace bpftrace;
+  Driver driver(bpftrace);
+  test(driver,
+       "kprobe:f { @a = @b; $x = @a; } kprobe:g { @b = @c; } "
+       "kprobe:h { @c = @d; } kprobe:i { @d = 1; } kprobe:j { @e = 1; }");
+
+  auto a = static_cast<ast::AssignMapStatement *>(
+      driver.ctx.root->probes.at(0)->block->stmts.at(0));
+  EXPECT_EQ(CreateInt64(), a->map->type);
+  auto x = static_cast<ast::AssignVarStatement *>(
+      driver.ctx.root->probes.at(0)->block->stmts.at(1));
+  EXPECT_EQ(CreateInt64(), x->var->type);
+}
+
 TEST(semantic_analyser, variable_use_before_assign)
 {
   test("kprobe:f { @x = $y; $y = 2; }", 1);
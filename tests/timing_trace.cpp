@@ -0,0 +1,79 @@
+#include "timing_trace.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include <map>
+#include <regex>
+#include <sstream>
+#include <thread>
+
+namespace bpftrace::test::timing_trace {
+
+using ::testing::HasSubstr;
+
+struct TraceEvent {
+  int64_t ts;
+  int64_t dur;
+  long tid;
+};
+
+static std::map<std::string, TraceEvent> parse_events(const std::string &json)
+{
+  static const std::regex event_re(
+      R"re(\{"name": "([^"]*)", "cat": "test", "ph": "X", "ts": (\d+), "dur": (\d+), "pid": \d+, "tid": (\d+), "args": \{"max_rss_kb": \d+\}\})re");
+  std::map<std::string, TraceEvent> events;
+  for (std::sregex_iterator it(json.begin(), json.end(), event_re), end;
+       it != end;
+       ++it) {
+    events[(*it)[1]] = TraceEvent{ .ts = std::stoll((*it)[2]),
+                                   .dur = std::stoll((*it)[3]),
+                                   .tid = std::stol((*it)[4]) };
+  }
+  return events;
+}
+
+TEST(timing_trace, phases)
+{
+  // Nothing is recorded until tracing is enabled
+  {
+    timing::Phase phase("disabled", "test");
+  }
+
+  // Only record, don't write a file at exit
+  timing::enable("");
+  ASSERT_TRUE(timing::enabled());
+  {
+    timing::Phase outer("outer", "test");
+    {
+      timing::Phase inner("inner", "test");
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    std::thread([] { timing::Phase thread("thread", "test"); }).join();
+  }
+
+  std::ostringstream out;
+  timing::write(out);
+  std::string json = out.str();
+  EXPECT_THAT(json, HasSubstr("{\"traceEvents\": ["));
+  EXPECT_THAT(json, HasSubstr("], \"displayTimeUnit\": \"ms\"}"));
+
+  auto events = parse_events(json);
+  ASSERT_EQ(events.size(), 3U) << json;
+  EXPECT_FALSE(events.contains("disabled"));
+  const auto &outer = events.at("outer");
+  const auto &inner = events.at("inner");
+  const auto &thread = events.at("thread");
+
+  // Nested phases lie within their parent
+  EXPECT_GE(inner.ts, outer.ts);
+  EXPECT_LE(inner.ts + inner.dur, outer.ts + outer.dur);
+  EXPECT_GE(inner.dur, 1000);
+  EXPECT_EQ(inner.tid, outer.tid);
+
+  // Phases of other threads are recorded with their thread id
+  EXPECT_NE(thread.tid, outer.tid);
+  EXPECT_GE(thread.ts, inner.ts + inner.dur);
+  EXPECT_LE(thread.ts + thread.dur, outer.ts + outer.dur);
+}
+
+} // namespace bpftrace::test::timing_trace
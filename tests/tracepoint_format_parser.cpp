@@ -16,6 +16,18 @@ public:
   {
     return get_tracepoint_struct(format_file, category, event_name, bpftrace);
   }
+
+  static TracepointFormat parse_format_public(std::istream &format_file)
+  {
+    return parse_format(format_file);
+  }
+
+  static std::optional<Struct> build_struct_public(
+      const TracepointFormat &format,
+      BPFtrace &bpftrace)
+  {
+    return build_struct(format, bpftrace);
+  }
 };
 
 TEST(tracepoint_format_parser, tracepoint_struct)
@@ -256,6 +268,78 @@ TEST(tracepoint_format_parser, tracepoint_struct_btf)
   EXPECT_THAT(bpftrace.btf_set_, Contains("TASK_COMM_LEN"));
 }
 
+TEST(tracepoint_format_parser, build_struct)
+{
+  std::string input =
+      "name: sched_process_exec\n"
+      "ID: 310\n"
+      "format:\n"
+      "	field:unsigned short common_type;	offset:0;	size:2;	"
+      "signed:0;\n"
+      "	field:unsigned char common_flags;	offset:2;	size:1;	"
+      "signed:0;\n"
+      "	field:unsigned char common_preempt_count;	offset:3;	"
+      "size:1;	signed:0;\n"
+      "	field:int common_pid;	offset:4;	size:4;	signed:1;\n"
+      "\n"
+      "	field:__data_loc char[] filename;	offset:8;	size:4;	"
+      "signed:1;\n"
+      "	field:unsigned int pid;	offset:16;	size:8;	signed:0;\n"
+      "	field:const char * buf;	offset:24;	size:8;	signed:0;\n"
+      "	field:char comm[16];	offset:32;	size:16;	signed:1;\n"
+      "	field:u32 ids[2];	offset:48;	size:8;	signed:0;\n"
+      "\n"
+      "print fmt: \"filename=%s pid=%d\", __get_str(filename), REC->pid\n";
+
+  std::istringstream format_file(input);
+  auto format = MockTracepointFormatParser::parse_format_public(format_file);
+  ASSERT_EQ(format.size(), 9);
+  EXPECT_EQ(format[6].name, "buf");
+  EXPECT_EQ(format[6].type, "const char *");
+  EXPECT_EQ(format[7].name, "comm");
+  EXPECT_EQ(format[7].type, "char[16]");
+  EXPECT_TRUE(format[7].is_signed);
+
+  MockBPFtrace bpftrace;
+  auto args = MockTracepointFormatParser::build_struct_public(format,
+                                                              bpftrace);
+  ASSERT_TRUE(args.has_value());
+  EXPECT_EQ(args->size, 56);
+
+  EXPECT_EQ(args->GetField("common_type").type, CreateUInt16());
+  EXPECT_EQ(args->GetField("common_pid").type, CreateInt32());
+
+  auto &filename = args->GetField("filename");
+  EXPECT_TRUE(filename.is_data_loc);
+  EXPECT_EQ(filename.type, CreateInt64());
+  EXPECT_EQ(filename.offset, 8);
+
+  // Gaps are padded the same way as in the C definitions
+  for (int i = 12; i < 16; i++)
+    EXPECT_TRUE(args->HasField("__pad_" + std::to_string(i)));
+
+  EXPECT_EQ(args->GetField("pid").type, CreateUInt64());
+  EXPECT_EQ(args->GetField("buf").type, CreatePointer(CreateInt8()));
+  EXPECT_EQ(args->GetField("comm").type, CreateString(16));
+  EXPECT_EQ(args->GetField("ids").type, CreateArray(2, CreateUInt32()));
+  EXPECT_EQ(args->GetField("ids").offset, 48);
+}
+
+TEST(tracepoint_format_parser, build_struct_unknown_type)
+{
+  // Without BTF, typedefs can only be resolved by clang
+  std::string input =
+      "	field:int common_pid;	offset:4;	size:4;	signed:1;\n"
+      "	field:size_t count;	offset:8;	size:8;	signed:0;\n";
+
+  std::istringstream format_file(input);
+  auto format = MockTracepointFormatParser::parse_format_public(format_file);
+
+  MockBPFtrace bpftrace;
+  EXPECT_FALSE(
+      MockTracepointFormatParser::build_struct_public(format, bpftrace));
+}
+
 TEST(tracepoint_format_parser, args_field_access)
 {
   // Test computing the level of nested structs accessed from tracepoint args
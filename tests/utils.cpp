@@ -427,4 +427,55 @@ TEST(utils, round_up_to_next_power_of_two)
   ASSERT_EQ(round_up_to_next_power_of_two(max_power_of_two), max_power_of_two);
 }
 
+TEST(utils, count_distinct_value)
+{
+  // 2 CPUs with 16 registers each
+  std::vector<uint8_t> value(2 * 16, 0);
+  EXPECT_EQ(count_distinct_value(value, 2, 16), 0);
+
+  // Linear counting while most registers are empty: 16 * ln(16 / 14)
+  value[0] = 1;
+  value[16 + 1] = 2;
+  value[16 + 0] = 1;
+  EXPECT_EQ(count_distinct_value(value, 2, 16), 2);
+
+  // Registers are merged by taking the maximum across CPUs:
+  // 0.673 * 16 * 2^10
+  std::fill(value.begin(), value.begin() + 16, 10);
+  EXPECT_EQ(count_distinct_value(value, 2, 16), 11026);
+}
+
+TEST(utils, read_cache_file)
+{
+  std::string tmpdir = "/tmp/bpftrace-test-utils-XXXXXX";
+  ASSERT_TRUE(::mkdtemp(&tmpdir[0]));
+  const std::filesystem::path path(tmpdir);
+  const auto cache_file = path / "cache";
+  std::ofstream(cache_file) << "cached";
+
+  std::filesystem::permissions(cache_file,
+                               std::filesystem::perms::owner_read |
+                                   std::filesystem::perms::owner_write,
+                               std::filesystem::perm_options::replace);
+  EXPECT_EQ(read_cache_file(cache_file), "cached");
+
+  // Writable by others
+  std::filesystem::permissions(cache_file,
+                               std::filesystem::perms::others_write,
+                               std::filesystem::perm_options::add);
+  EXPECT_FALSE(read_cache_file(cache_file).has_value());
+
+  // Symlinks are not followed
+  std::filesystem::permissions(cache_file,
+                               std::filesystem::perms::others_write,
+                               std::filesystem::perm_options::remove);
+  std::filesystem::create_symlink(cache_file, path / "link");
+  EXPECT_FALSE(read_cache_file(path / "link").has_value());
+
+  EXPECT_FALSE(read_cache_file(path / "missing").has_value());
+
+  // Cleanup
+  EXPECT_TRUE(std::filesystem::remove_all(path));
+}
+
 } // namespace bpftrace::test::utils